@@ -0,0 +1,105 @@
+/*
+ * arena.c: Bump allocation for things that all die together.
+ *
+ * (C) Copyright Simon Frankau 1999-2014
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+#define ARENA_DEFAULT_BLOCK (1 << 20)
+
+#define ALIGN_UP(x) (((x) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+static arena_block *new_block(size_t size)
+{
+  void *mem;
+  if (posix_memalign(&mem, ARENA_ALIGN, sizeof(arena_block) + size) != 0) {
+    printf("Out of memory allocating %zu bytes.\n", size);
+    exit(1);
+  }
+  arena_block *b = (arena_block *)mem;
+  b->next = NULL;
+  b->size = size;
+  b->used = 0;
+  return b;
+}
+
+arena *arena_create(size_t block_size)
+{
+  arena *a = (arena *)malloc(sizeof(arena));
+  a->block_size = block_size > 0 ? ALIGN_UP(block_size) : ARENA_DEFAULT_BLOCK;
+  a->first = a->current = new_block(a->block_size);
+  a->used = 0;
+  a->peak = 0;
+  return a;
+}
+
+void arena_destroy(arena *a)
+{
+  arena_block *b = a->first;
+  while (b != NULL) {
+    arena_block *next = b->next;
+    free(b);
+    b = next;
+  }
+  free(a);
+}
+
+void *arena_alloc(arena *a, size_t size)
+{
+  size = ALIGN_UP(size);
+  arena_block *b = a->current;
+
+  /* Move on through blocks kept from before the last reset, and only
+   * then make a new one.
+   */
+  while (b->used + size > b->size) {
+    if (b->next == NULL) {
+      b->next = new_block(size > a->block_size ? size : a->block_size);
+    }
+    b = b->next;
+    b->used = 0;
+  }
+  a->current = b;
+
+  void *p = b->data + b->used;
+  b->used += size;
+  a->used += size;
+  if (a->used > a->peak) {
+    a->peak = a->used;
+  }
+  return p;
+}
+
+void *arena_calloc(arena *a, size_t count, size_t size)
+{
+  void *p = arena_alloc(a, count * size);
+  memset(p, 0, count * size);
+  return p;
+}
+
+void arena_reset(arena *a)
+{
+  a->current = a->first;
+  a->first->used = 0;
+  a->used = 0;
+}
+
+size_t arena_peak(arena const *a)
+{
+  return a->peak;
+}
+
+size_t arena_reserved(arena const *a)
+{
+  size_t total = 0;
+  arena_block const *b;
+  for (b = a->first; b != NULL; b = b->next) {
+    total += b->size;
+  }
+  return total;
+}
@@ -0,0 +1,72 @@
+/*
+ * arena.h: Bump allocation for things that all die together.
+ *
+ * (C) Copyright Simon Frankau 1999-2014
+ */
+
+#ifndef ARENA_H_INCLUDED
+#define ARENA_H_INCLUDED
+
+#include <stddef.h>
+
+/* ------------------------------------------------------------------
+ * Macros
+ */
+
+/* All allocations are aligned for SIMD loads of geometry arrays. */
+#define ARENA_ALIGN 64
+
+/* ------------------------------------------------------------------
+ * Data types
+ */
+
+typedef struct arena_block_t {
+  struct arena_block_t *next;
+  size_t size;
+  size_t used;
+  /* Padding so that the data starts aligned. */
+  char pad[ARENA_ALIGN - sizeof(struct arena_block_t *) - 2 * sizeof(size_t)];
+  char data[];
+} arena_block;
+
+/* A chain of blocks, allocated from in order. Blocks are kept on
+ * reset, so an arena reused for similar frames stops calling malloc
+ * after the first.
+ */
+typedef struct arena_t {
+  arena_block *first;
+  arena_block *current;
+  size_t block_size;
+  /* Bytes handed out since the last reset, and the most ever. */
+  size_t used;
+  size_t peak;
+} arena;
+
+/* ------------------------------------------------------------------
+ * Exported functions
+ */
+
+/* Make an arena which grabs memory 'block_size' bytes at a time (0 for
+ * a default). Bigger allocations get a block to themselves.
+ */
+arena *arena_create(size_t block_size);
+
+/* Free everything. */
+void arena_destroy(arena *a);
+
+/* Get some ARENA_ALIGN-aligned memory. Exits if out of memory. */
+void *arena_alloc(arena *a, size_t size);
+
+/* As arena_alloc, but zeroed. */
+void *arena_calloc(arena *a, size_t count, size_t size);
+
+/* Forget everything allocated, in constant time, keeping the memory
+ * for reuse.
+ */
+void arena_reset(arena *a);
+
+/* Peak bytes in use, and bytes reserved from the system. */
+size_t arena_peak(arena const *a);
+size_t arena_reserved(arena const *a);
+
+#endif // ARENA_H_INCLUDED
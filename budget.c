@@ -0,0 +1,315 @@
+/*
+ * budget.c: Rendering to a deadline.
+ *
+ * Samples go alternately into two half-framebuffers. Where the halves
+ * disagree, the image is noisy, and the size of the disagreement gives
+ * each tile's noise without keeping any per-sample data. Each round
+ * spends about half the remaining time, split between tiles so that
+ * their sample counts end up in proportion to their noise, which is
+ * what minimises the total variance. The halves are added together at
+ * the end.
+ *
+ * (C) Copyright Simon Frankau 1999-2014
+ */
+
+#include <math.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "arena.h"
+#include "budget.h"
+
+/* ------------------------------------------------------------------
+ * Macros
+ */
+
+/* Tile size if the options don't give one. */
+#define BUDGET_TILE 32
+
+/* Plan on only using this much of the time that seems to be left, in
+ * case the speed estimate is optimistic.
+ */
+#define BUDGET_SAFETY 0.9
+
+/* Tiles get sampled as if at least this fraction of the average
+ * noise, so that one lucky estimate doesn't starve a tile.
+ */
+#define BUDGET_NOISE_FLOOR 0.05
+
+/* ------------------------------------------------------------------
+ * Data types
+ */
+
+typedef struct {
+  scene const *sc;
+  int width;
+  int height;
+  render_opts opts;
+  /* Region size, and the tiles over it. */
+  int region_width;
+  int region_height;
+  int tiles_across;
+  int num_tiles;
+  /* Per tile: pixels, samples per pixel so far and to do next, the
+   * estimated standard deviation of a single sample, and how far
+   * short of its share of samples it is.
+   */
+  int *pixels;
+  int *total;
+  int *spp;
+  int *half_spp;
+  double *sigma;
+  double *shortfall;
+  framebuffer *half[2];
+  int passes;
+} budget;
+
+/* ------------------------------------------------------------------
+ * Functions
+ */
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Render each tile's 'spp', split between the halves. Returns the
+ * number of samples traced.
+ */
+static double budget_round(budget *b)
+{
+  double samples = 0.0;
+  int h, t;
+  for (h = 0; h < 2; h++) {
+    int any = 0;
+    for (t = 0; t < b->num_tiles; t++) {
+      /* The odd sample goes in the first half. */
+      b->half_spp[t] = (b->spp[t] + 1 - h) / 2;
+      b->total[t] += b->half_spp[t];
+      samples += (double)b->half_spp[t] * b->pixels[t];
+      any |= b->half_spp[t];
+    }
+    if (!any) {
+      continue;
+    }
+    b->opts.tile_samples = b->half_spp;
+    render_fb(b->sc, b->width, b->height, b->half[h], &b->opts);
+    b->opts.pass++;
+    b->opts.features = NULL;
+    b->passes++;
+  }
+  return samples;
+}
+
+/* Estimate each tile's noise from the difference between the halves.
+ * Returns the variance of the combined image, summed over pixels and
+ * averaged over colour channels.
+ */
+static double budget_measure(budget *b)
+{
+  int tile_width = b->opts.tile_width;
+  int tile_height = b->opts.tile_height;
+  double total_var = 0.0;
+  int t;
+  for (t = 0; t < b->num_tiles; t++) {
+    int x0 = (t % b->tiles_across) * tile_width;
+    int y0 = (t / b->tiles_across) * tile_height;
+    int x1 = x0 + tile_width;
+    int y1 = y0 + tile_height;
+    if (x1 > b->region_width) x1 = b->region_width;
+    if (y1 > b->region_height) y1 = b->region_height;
+
+    double sum_sigma2 = 0.0;
+    int x, y;
+    for (y = y0; y < y1; y++) {
+      for (x = x0; x < x1; x++) {
+        fb_pixel const *p = framebuffer_pixel(b->half[0], x, y);
+        fb_pixel const *q = framebuffer_pixel(b->half[1], x, y);
+        if (p->n == 0.0f || q->n == 0.0f) {
+          continue;
+        }
+        /* The halves' means differ with variance sigma^2 (1/n + 1/m). */
+        double dr = p->r / p->n - q->r / q->n;
+        double dg = p->g / p->n - q->g / q->n;
+        double db = p->b / p->n - q->b / q->n;
+        double sigma2 = (dr * dr + dg * dg + db * db) / 3.0 /
+          (1.0 / p->n + 1.0 / q->n);
+        sum_sigma2 += sigma2;
+        total_var += sigma2 / (p->n + q->n);
+      }
+    }
+    b->sigma[t] = sqrt(sum_sigma2 / b->pixels[t]);
+  }
+  return total_var;
+}
+
+/* Share out 'samples' samples between the tiles, aiming for each
+ * tile's total to be in proportion to its noise.
+ */
+static void budget_plan(budget *b, double samples)
+{
+  double pixels = 0.0;
+  double done = 0.0;
+  double mean_sigma = 0.0;
+  int t;
+  for (t = 0; t < b->num_tiles; t++) {
+    pixels += b->pixels[t];
+    done += (double)b->total[t] * b->pixels[t];
+    mean_sigma += b->sigma[t] * b->pixels[t];
+  }
+  mean_sigma /= pixels;
+
+  double floor_sigma = mean_sigma * BUDGET_NOISE_FLOOR;
+  double weight = 0.0;
+  for (t = 0; t < b->num_tiles; t++) {
+    double s = b->sigma[t] > floor_sigma ? b->sigma[t] : floor_sigma;
+    weight += s * b->pixels[t];
+  }
+  if (weight <= 0.0) {
+    /* Nothing looks noisy, so spread them evenly. */
+    for (t = 0; t < b->num_tiles; t++) {
+      b->spp[t] = (int)(samples / pixels + 0.5);
+    }
+    return;
+  }
+
+  /* How far short each tile is of its share, scaled to fit. */
+  double want = 0.0;
+  for (t = 0; t < b->num_tiles; t++) {
+    double s = b->sigma[t] > floor_sigma ? b->sigma[t] : floor_sigma;
+    double target = (done + samples) * s / weight;
+    double extra = target - b->total[t];
+    b->shortfall[t] = extra > 0.0 ? extra : 0.0;
+    want += b->shortfall[t] * b->pixels[t];
+  }
+  double scale = want > 0.0 ? samples / want : 0.0;
+  for (t = 0; t < b->num_tiles; t++) {
+    b->spp[t] = (int)(b->shortfall[t] * scale + 0.5);
+  }
+}
+
+void render_budget(scene const *sc, int width, int height, framebuffer *fb,
+                   double seconds, render_opts const *opts,
+                   budget_result *result)
+{
+  double start = now();
+  double deadline = start + seconds;
+
+  budget b;
+  b.sc = sc;
+  b.width = width;
+  b.height = height;
+  b.opts = *opts;
+  /* Each pass is short, and its progress says nothing about the
+   * budget's.
+   */
+  b.opts.verbose = 0;
+  b.opts.progress = NULL;
+  b.opts.progress_fd = -1;
+  b.passes = 0;
+
+  int x0, y0, x1, y1;
+  if (!render_clip_region(width, height, opts, &x0, &y0, &x1, &y1)) {
+    if (result) {
+      result->passes = 0;
+      result->spp = 0.0;
+      result->min_spp = result->max_spp = 0;
+      result->noise = 0.0;
+      result->seconds = 0.0;
+    }
+    return;
+  }
+  b.region_width = x1 - x0;
+  b.region_height = y1 - y0;
+
+  /* The same tiles as render_fb will use. */
+  int tile_width = opts->tile_width > 0 ? opts->tile_width : BUDGET_TILE;
+  int tile_height = opts->tile_height > 0 ? opts->tile_height : BUDGET_TILE;
+  b.opts.tile_width = (tile_width + FB_TILE_SIZE - 1) & ~(FB_TILE_SIZE - 1);
+  b.opts.tile_height = (tile_height + FB_TILE_SIZE - 1) & ~(FB_TILE_SIZE - 1);
+  b.tiles_across = (b.region_width - 1) / b.opts.tile_width + 1;
+  int tiles_down = (b.region_height - 1) / b.opts.tile_height + 1;
+  b.num_tiles = b.tiles_across * tiles_down;
+
+  b.pixels = (int *)malloc(b.num_tiles * sizeof(int));
+  b.total = (int *)calloc(b.num_tiles, sizeof(int));
+  b.spp = (int *)malloc(b.num_tiles * sizeof(int));
+  b.half_spp = (int *)malloc(b.num_tiles * sizeof(int));
+  b.sigma = (double *)malloc(b.num_tiles * sizeof(double));
+  b.shortfall = (double *)malloc(b.num_tiles * sizeof(double));
+  double pixels = (double)b.region_width * b.region_height;
+  int t;
+  for (t = 0; t < b.num_tiles; t++) {
+    int w = b.region_width - (t % b.tiles_across) * b.opts.tile_width;
+    int h = b.region_height - (t / b.tiles_across) * b.opts.tile_height;
+    b.pixels[t] = (w < b.opts.tile_width ? w : b.opts.tile_width) *
+      (h < b.opts.tile_height ? h : b.opts.tile_height);
+  }
+  b.half[0] = framebuffer_create(b.region_width, b.region_height);
+  b.half[1] = framebuffer_create(b.region_width, b.region_height);
+
+  /* Building the scene's trees isn't rendering, so keep it out of
+   * the speed estimate.
+   */
+  arena *own_arena;
+  b.sc = render_prepare_copy(sc, &b.opts, &own_arena);
+
+  /* A sample per pixel in each half, to time and to see the noise. */
+  for (t = 0; t < b.num_tiles; t++) {
+    b.spp[t] = 2;
+  }
+  double t0 = now();
+  double traced = budget_round(&b);
+  double rate = traced / fmax(now() - t0, 1e-6);
+
+  for (;;) {
+    budget_measure(&b);
+    double affordable = rate * (deadline - now()) * BUDGET_SAFETY;
+    /* Stop when there's not even a quarter sample per pixel left. */
+    if (affordable < pixels / 4) {
+      break;
+    }
+    /* Spend half of it, to keep the estimates fresh, unless that's
+     * getting small.
+     */
+    budget_plan(&b, affordable >= 4 * pixels ? affordable / 2 : affordable);
+    t0 = now();
+    traced = budget_round(&b);
+    if (traced <= 0.0) {
+      break;
+    }
+    rate = traced / fmax(now() - t0, 1e-6);
+  }
+
+  double var = budget_measure(&b);
+  framebuffer_merge(fb, b.half[0]);
+  framebuffer_merge(fb, b.half[1]);
+
+  if (result) {
+    double samples = 0.0;
+    result->min_spp = result->max_spp = b.total[0];
+    for (t = 0; t < b.num_tiles; t++) {
+      samples += (double)b.total[t] * b.pixels[t];
+      if (b.total[t] < result->min_spp) result->min_spp = b.total[t];
+      if (b.total[t] > result->max_spp) result->max_spp = b.total[t];
+    }
+    result->passes = b.passes;
+    result->spp = samples / pixels;
+    result->noise = sqrt(var / pixels);
+    result->seconds = now() - start;
+  }
+
+  framebuffer_destroy(b.half[0]);
+  framebuffer_destroy(b.half[1]);
+  free(b.pixels);
+  free(b.total);
+  free(b.spp);
+  free(b.half_spp);
+  free(b.sigma);
+  free(b.shortfall);
+  if (own_arena != NULL) {
+    arena_destroy(own_arena);
+  }
+}
@@ -0,0 +1,51 @@
+/*
+ * budget.h: Rendering to a deadline.
+ *
+ * Rather than a fixed number of samples, render for a given wall
+ * clock time: measure how fast a first pass goes, plan the rest to
+ * fit, and put the extra samples where the image is noisiest.
+ *
+ * (C) Copyright Simon Frankau 1999-2014
+ */
+
+#ifndef BUDGET_H_INCLUDED
+#define BUDGET_H_INCLUDED
+
+#include "framebuffer.h"
+#include "tracer.h"
+
+/* ------------------------------------------------------------------
+ * Data types
+ */
+
+/* How a budgeted render went. */
+typedef struct {
+  /* Calls to render_fb. */
+  int passes;
+  /* Samples per pixel: the mean, and the least and most any tile got. */
+  double spp;
+  int min_spp;
+  int max_spp;
+  /* Estimated standard error of the pixel values, RMS over the image
+   * and colour channels.
+   */
+  double noise;
+  double seconds;
+} budget_result;
+
+/* ------------------------------------------------------------------
+ * Exported functions
+ */
+
+/* Add samples for the region to a framebuffer covering it, as
+ * render_fb does, taking about 'seconds' in all (unless one sample
+ * per pixel takes longer). Tiles are sized from 'opts', or 32 pixels
+ * square if it doesn't say. Feature buffers, if given, come from the
+ * first pass. 'result' may be NULL. An unprepared scene is prepared
+ * in a copy of its own, so the caller's is left alone.
+ */
+void render_budget(scene const *sc, int width, int height, framebuffer *fb,
+                   double seconds, render_opts const *opts,
+                   budget_result *result);
+
+#endif // BUDGET_H_INCLUDED
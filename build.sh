@@ -1,9 +1,29 @@
 #!/bin/sh
 
-gcc spheres.c tracer.c png_render.c -lpng -O2 -Wall -std=c99 -o spheres
-gcc dof.c tracer.c png_render.c -lpng -O2 -Wall -std=c99 -o dof
-gcc soft.c tracer.c png_render.c -lpng -O2 -Wall -std=c99 -o soft
-gcc fuzzy.c tracer.c png_render.c -lpng -O2 -Wall -std=c99 -o fuzzy
-gcc moblur.c tracer.c png_render.c -lpng -O2 -Wall -std=c99 -o moblur
-gcc trans.c tracer.c png_render.c -lpng -O2 -Wall -std=c99 -o trans
-gcc dof2.c tracer.c png_render.c -lpng -O2 -Wall -std=c99 -o dof2
+CFLAGS="-O2 -Wall -std=gnu99 -pthread"
+# FAST_MATH=1 sh build.sh swaps libm for the approximations in fastmath.h.
+if [ -n "$FAST_MATH" ]; then
+  CFLAGS="$CFLAGS -DTRACER_FAST_MATH"
+fi
+LIBS="-lpng -lz -lm"
+CORE="arena.c bvh.c prims.c mesh.c numa.c photon.c gbuffer.c irradiance.c tracer.c budget.c png_render.c png_stream.c scene_file.c image_file.c preview.c denoise.c framebuffer.c daemon.c"
+
+gcc tracer_cli.c $CORE $LIBS $CFLAGS -o tracer
+
+gcc spheres.c $CORE $LIBS $CFLAGS -o spheres
+gcc dof.c $CORE $LIBS $CFLAGS -o dof
+gcc soft.c $CORE $LIBS $CFLAGS -o soft
+gcc fuzzy.c $CORE $LIBS $CFLAGS -o fuzzy
+gcc moblur.c $CORE $LIBS $CFLAGS -o moblur
+gcc trans.c $CORE $LIBS $CFLAGS -o trans
+gcc dof2.c $CORE $LIBS $CFLAGS -o dof2
+gcc instances.c $CORE $LIBS $CFLAGS -o instances
+gcc shapes.c $CORE $LIBS $CFLAGS -o shapes
+gcc torus.c $CORE $LIBS $CFLAGS -o torus
+
+gcc tracerd.c $CORE $LIBS $CFLAGS -o tracerd
+gcc tracerd_load.c $CORE $LIBS $CFLAGS -o tracerd_load
+
+gcc fastmath_bench.c -lm $CFLAGS -o fastmath_bench
+# kernel_bench includes tracer.c, to get at its static functions.
+gcc kernel_bench.c $(echo $CORE | sed 's/ tracer\.c//') $LIBS $CFLAGS -o kernel_bench
@@ -0,0 +1,129 @@
+/*
+ * bvh.c: Bounding volume hierarchies over boxes.
+ *
+ * The trees are built by splitting at the median along the longest
+ * axis, which isn't the best tree you could make, but is quick, and
+ * balanced enough that traversal never needs more than a small fixed
+ * stack.
+ *
+ * (C) Copyright Simon Frankau 1999-2014
+ */
+
+/* For qsort_r. */
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+
+#include "arena.h"
+#include "bvh.h"
+
+/* ------------------------------------------------------------------
+ * Macros
+ */
+
+/* Most items kept in a leaf. */
+#define BVH_LEAF_SIZE 4
+
+/* ------------------------------------------------------------------
+ * Data types
+ */
+
+typedef struct {
+  bbox const *boxes;
+  bvh *tree;
+  /* Axis being sorted along. */
+  int axis;
+} bvh_builder;
+
+/* ------------------------------------------------------------------
+ * Functions
+ */
+
+static double centre(bbox const *b, int axis)
+{
+  switch (axis) {
+  case 0: return b->lo.x + b->hi.x;
+  case 1: return b->lo.y + b->hi.y;
+  default: return b->lo.z + b->hi.z;
+  }
+}
+
+/* Sort items by box centre along an axis. */
+static int compare_items(void const *a, void const *b, void *arg)
+{
+  bbox const *boxes = ((bvh_builder const *)arg)->boxes;
+  int axis = ((bvh_builder const *)arg)->axis;
+  double ca = centre(boxes + *(int const *)a, axis);
+  double cb = centre(boxes + *(int const *)b, axis);
+  return ca < cb ? -1 : ca > cb ? 1 : 0;
+}
+
+static int build_node(bvh_builder *b, int start, int end)
+{
+  bvh *t = b->tree;
+  int index = t->num_nodes++;
+  bvh_node *node = t->nodes + index;
+
+  /* Bound the boxes, and their centres. */
+  bbox const *first = b->boxes + t->items[start];
+  node->box = *first;
+  bbox centres = { { first->lo.x + first->hi.x,
+                     first->lo.y + first->hi.y,
+                     first->lo.z + first->hi.z }, { 0 } };
+  centres.hi = centres.lo;
+  int i;
+  for (i = start + 1; i < end; i++) {
+    bbox const *box = b->boxes + t->items[i];
+    bbox c = { { box->lo.x + box->hi.x,
+                 box->lo.y + box->hi.y,
+                 box->lo.z + box->hi.z }, { 0 } };
+    c.hi = c.lo;
+    bbox_union(&node->box, box);
+    bbox_union(&centres, &c);
+  }
+
+  if (end - start <= BVH_LEAF_SIZE) {
+    node->first = start;
+    node->count = end - start;
+    return index;
+  }
+
+  vector extent = centres.hi;
+  SUB(extent, centres.lo);
+  b->axis = 0;
+  if (extent.y > extent.x) b->axis = 1;
+  if (extent.z > (b->axis ? extent.y : extent.x)) b->axis = 2;
+  qsort_r(t->items + start, end - start, sizeof(int), compare_items, b);
+
+  int mid = (start + end) / 2;
+  node->count = 0;
+  build_node(b, start, mid);
+  node->first = build_node(b, mid, end);
+  return index;
+}
+
+bvh *bvh_build(bbox const *boxes, int count, arena *a)
+{
+  bvh *t;
+  if (a) {
+    t = (bvh *)arena_alloc(a, sizeof(bvh));
+    t->nodes = (bvh_node *)arena_alloc(a, 2 * count * sizeof(bvh_node));
+    t->items = (int *)arena_alloc(a, count * sizeof(int));
+  } else {
+    t = (bvh *)malloc(sizeof(bvh));
+    t->nodes = (bvh_node *)malloc(2 * count * sizeof(bvh_node));
+    t->items = (int *)malloc(count * sizeof(int));
+  }
+  t->num_nodes = 0;
+  t->num_items = count;
+
+  int i;
+  for (i = 0; i < count; i++) {
+    t->items[i] = i;
+  }
+  if (count > 0) {
+    bvh_builder b = { boxes, t, 0 };
+    build_node(&b, 0, count);
+  }
+  return t;
+}
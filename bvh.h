@@ -0,0 +1,94 @@
+/*
+ * bvh.h: Bounding volume hierarchies over boxes.
+ *
+ * (C) Copyright Simon Frankau 1999-2014
+ */
+
+#ifndef BVH_H_INCLUDED
+#define BVH_H_INCLUDED
+
+#include "tracer.h"
+
+/* ------------------------------------------------------------------
+ * Macros
+ */
+
+/* Deep enough for any tree bvh_build makes from an int's worth of
+ * items.
+ */
+#define BVH_STACK_SIZE 64
+
+/* ------------------------------------------------------------------
+ * Data types
+ */
+
+typedef struct {
+  vector lo;
+  vector hi;
+} bbox;
+
+/* Nodes are stored depth-first, so an inner node's left child comes
+ * straight after it.
+ */
+typedef struct {
+  bbox box;
+  /* Leaves: the first of 'count' entries in the item list. Inner
+   * nodes: the index of the right child, with 'count' zero.
+   */
+  int first;
+  int count;
+} bvh_node;
+
+typedef struct bvh_t {
+  bvh_node *nodes;
+  int num_nodes;
+  /* Indices into the boxes the tree was built over, in leaf order. */
+  int *items;
+  int num_items;
+} bvh;
+
+/* ------------------------------------------------------------------
+ * Exported functions
+ */
+
+/* Build a tree over 'count' boxes, in the arena if non-NULL. */
+bvh *bvh_build(bbox const *boxes, int count, struct arena_t *a);
+
+/* Grow 'b' to cover 'other'. */
+static inline void bbox_union(bbox *b, bbox const *other)
+{
+  if (other->lo.x < b->lo.x) b->lo.x = other->lo.x;
+  if (other->lo.y < b->lo.y) b->lo.y = other->lo.y;
+  if (other->lo.z < b->lo.z) b->lo.z = other->lo.z;
+  if (other->hi.x > b->hi.x) b->hi.x = other->hi.x;
+  if (other->hi.y > b->hi.y) b->hi.y = other->hi.y;
+  if (other->hi.z > b->hi.z) b->hi.z = other->hi.z;
+}
+
+/* Does the ray from 'from' with reciprocal direction 'inv_dir' enter
+ * the box before 'max_dist'?
+ */
+static inline int bbox_hit(bbox const *b, vector from, vector inv_dir,
+                           double max_dist)
+{
+  double t0 = (b->lo.x - from.x) * inv_dir.x;
+  double t1 = (b->hi.x - from.x) * inv_dir.x;
+  double tmin = t0 < t1 ? t0 : t1;
+  double tmax = t0 < t1 ? t1 : t0;
+
+  t0 = (b->lo.y - from.y) * inv_dir.y;
+  t1 = (b->hi.y - from.y) * inv_dir.y;
+  if (t0 > t1) { double t = t0; t0 = t1; t1 = t; }
+  if (t0 > tmin) tmin = t0;
+  if (t1 < tmax) tmax = t1;
+
+  t0 = (b->lo.z - from.z) * inv_dir.z;
+  t1 = (b->hi.z - from.z) * inv_dir.z;
+  if (t0 > t1) { double t = t0; t0 = t1; t1 = t; }
+  if (t0 > tmin) tmin = t0;
+  if (t1 < tmax) tmax = t1;
+
+  return tmin <= tmax && tmax > 0.0 && tmin < max_dist;
+}
+
+#endif // BVH_H_INCLUDED
@@ -0,0 +1,749 @@
+/*
+ * daemon.c: A long-running render server on a Unix domain socket.
+ *
+ * Each connection gets a thread reading its requests. Jobs wait in a
+ * heap ordered by priority, then age. A couple of runner threads take
+ * the top job, render its next tile on a render context whose workers
+ * all jobs share, send the tile, and put the job back, so a more
+ * urgent job gets in between the tiles of a long one. Tiles are
+ * rendered with the job's full image size, so the pixels are the same
+ * as one render of the whole image would give (bar ambient light,
+ * whose estimates are made for each tile's region, as with "-r").
+ *
+ * (C) Copyright Simon Frankau 1999-2014
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "daemon.h"
+#include "framebuffer.h"
+#include "scene_file.h"
+
+/* ------------------------------------------------------------------
+ * Macros
+ */
+
+/* Threads taking jobs' tiles from the queue. More than one, so the
+ * render workers have a tile to go on with while a runner sends its
+ * last one.
+ */
+#define DAEMON_RUNNERS 2
+
+#define DEFAULT_TILE_SIZE 64
+
+/* Connections waiting to be accepted. */
+#define DAEMON_BACKLOG 16
+
+/* Seconds a client may leave a tile unread before it's taken as gone
+ * and its jobs cancelled, so it can't hold a runner forever.
+ */
+#define DAEMON_SEND_TIMEOUT 30
+
+/* ------------------------------------------------------------------
+ * Data types
+ */
+
+/* A loaded, prepared scene, shared by the jobs using it. */
+typedef struct {
+  uint64_t hash;
+  scene_file *sf;
+  /* Jobs using it, and when it was last asked for. Only entries
+   * nobody is using are evicted.
+   */
+  int refs;
+  uint64_t last_used;
+  /* Set once render_prepare is done. */
+  int ready;
+} scene_entry;
+
+typedef struct daemon_client_t {
+  int fd;
+  /* Tiles come from the runners, so writes take turns. */
+  pthread_mutex_t write_lock;
+  /* The reader thread and each job hold a reference. */
+  int refs;
+  /* The connection is gone, so its jobs are cancelled. Set by the
+   * reader or whoever fails to write, so accessed atomically.
+   */
+  int gone;
+} daemon_client;
+
+typedef struct daemon_job_t {
+  uint64_t id;
+  int priority;
+  daemon_client *client;
+  scene_entry *entry;
+  /* A copy of the entry's scene, with the job's settings. */
+  scene sc;
+  int width;
+  int height;
+  int tile_size;
+  int tiles_across;
+  int num_tiles;
+  int next_tile;
+  int cancelled;
+  int cached;
+  double start;
+  /* Place in the queue, or -1 while running. */
+  int heap_index;
+  /* Set up once the job is over, to send without the lock. */
+  daemon_message done;
+  /* In the daemon's list of jobs, then in a list of those to send
+   * DONE for.
+   */
+  struct daemon_job_t *next;
+} daemon_job;
+
+typedef struct {
+  render_opts opts;
+  pthread_mutex_t lock;
+  pthread_cond_t work;
+  pthread_cond_t scene_ready;
+  /* Waiting jobs, as a heap. */
+  daemon_job **heap;
+  int heap_size;
+  int heap_capacity;
+  /* Every job not yet done, for cancelling. */
+  daemon_job *jobs;
+  uint64_t next_id;
+  scene_entry *cache;
+  int cache_size;
+  int cache_capacity;
+  uint64_t cache_clock;
+} daemon_state;
+
+typedef struct {
+  daemon_state *d;
+  daemon_client *client;
+} reader_args;
+
+/* ------------------------------------------------------------------
+ * Messages
+ */
+
+static int write_all(int fd, void const *buf, size_t len)
+{
+  char const *p = (char const *)buf;
+  while (len > 0) {
+    ssize_t n = write(fd, p, len);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static int read_all(int fd, void *buf, size_t len)
+{
+  char *p = (char *)buf;
+  while (len > 0) {
+    ssize_t n = read(fd, p, len);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return -1;
+    }
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+int daemon_send(int fd, daemon_message const *m, void const *payload)
+{
+  if (write_all(fd, m, sizeof(*m)) != 0) {
+    return -1;
+  }
+  return m->payload_size > 0 ? write_all(fd, payload, m->payload_size) : 0;
+}
+
+int daemon_receive(int fd, daemon_message *m, void *payload,
+                   uint64_t max_payload)
+{
+  if (read_all(fd, m, sizeof(*m)) != 0 || m->magic != DAEMON_MAGIC ||
+      m->payload_size > max_payload) {
+    return -1;
+  }
+  return m->payload_size > 0 ? read_all(fd, payload, m->payload_size) : 0;
+}
+
+int daemon_connect(char const *path)
+{
+  struct sockaddr_un addr;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    return -1;
+  }
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static void message_init(daemon_message *m, uint32_t type, uint64_t job_id)
+{
+  memset(m, 0, sizeof(*m));
+  m->magic = DAEMON_MAGIC;
+  m->type = type;
+  m->job_id = job_id;
+}
+
+static int client_gone(daemon_client const *c)
+{
+  return __atomic_load_n(&c->gone, __ATOMIC_RELAXED);
+}
+
+/* Send to a client, noting if it's gone. Never call with the daemon's
+ * lock held: a client that stops reading would hold everyone up.
+ */
+static void client_send(daemon_client *c, daemon_message const *m,
+                        void const *payload)
+{
+  pthread_mutex_lock(&c->write_lock);
+  if (!client_gone(c) && daemon_send(c->fd, m, payload) != 0) {
+    __atomic_store_n(&c->gone, 1, __ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(&c->write_lock);
+}
+
+/* Drop a reference to a client. Call with the daemon's lock held. */
+static void client_release(daemon_client *c)
+{
+  if (--c->refs == 0) {
+    close(c->fd);
+    pthread_mutex_destroy(&c->write_lock);
+    free(c);
+  }
+}
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* ------------------------------------------------------------------
+ * The queue. Call with the lock held.
+ */
+
+/* Should job a run before job b? */
+static int job_before(daemon_job const *a, daemon_job const *b)
+{
+  return a->priority != b->priority ? a->priority > b->priority
+                                    : a->id < b->id;
+}
+
+static void heap_set(daemon_state *d, int i, daemon_job *job)
+{
+  d->heap[i] = job;
+  job->heap_index = i;
+}
+
+static void heap_up(daemon_state *d, int i)
+{
+  daemon_job *job = d->heap[i];
+  while (i > 0 && job_before(job, d->heap[(i - 1) / 2])) {
+    heap_set(d, i, d->heap[(i - 1) / 2]);
+    i = (i - 1) / 2;
+  }
+  heap_set(d, i, job);
+}
+
+static void heap_down(daemon_state *d, int i)
+{
+  daemon_job *job = d->heap[i];
+  for (;;) {
+    int child = 2 * i + 1;
+    if (child >= d->heap_size) {
+      break;
+    }
+    if (child + 1 < d->heap_size &&
+        job_before(d->heap[child + 1], d->heap[child])) {
+      child++;
+    }
+    if (!job_before(d->heap[child], job)) {
+      break;
+    }
+    heap_set(d, i, d->heap[child]);
+    i = child;
+  }
+  heap_set(d, i, job);
+}
+
+static void heap_push(daemon_state *d, daemon_job *job)
+{
+  if (d->heap_size == d->heap_capacity) {
+    d->heap_capacity = d->heap_capacity ? 2 * d->heap_capacity : 16;
+    d->heap = (daemon_job **)realloc(d->heap, d->heap_capacity *
+                                     sizeof(daemon_job *));
+  }
+  heap_set(d, d->heap_size++, job);
+  heap_up(d, d->heap_size - 1);
+}
+
+static void heap_remove(daemon_state *d, daemon_job *job)
+{
+  int i = job->heap_index;
+  daemon_job *last = d->heap[--d->heap_size];
+  job->heap_index = -1;
+  if (i == d->heap_size) {
+    return;
+  }
+  heap_set(d, i, last);
+  heap_up(d, i);
+  heap_down(d, last->heap_index);
+}
+
+/* ------------------------------------------------------------------
+ * The scene cache
+ */
+
+/* FNV-1a, a word at a time. */
+static uint64_t hash_bytes(void const *data, size_t size)
+{
+  uint64_t h = 0xcbf29ce484222325ULL ^ size;
+  uint64_t const *words = (uint64_t const *)data;
+  size_t i;
+  for (i = 0; i < size / 8; i++) {
+    h = (h ^ words[i]) * 0x100000001b3ULL;
+  }
+  unsigned char const *tail = (unsigned char const *)data + i * 8;
+  for (i = 0; i < size % 8; i++) {
+    h = (h ^ tail[i]) * 0x100000001b3ULL;
+  }
+  return h;
+}
+
+/* Find a prepared scene for a file, loading and preparing it if it's
+ * not one seen before. Returns NULL if it won't load.
+ */
+static scene_entry *scene_acquire(daemon_state *d, char const *path,
+                                  int *cached)
+{
+  /* Loading just maps the file, so is cheap enough to do to find out
+   * whether we have it already.
+   */
+  scene_file *sf = scene_file_load(path);
+  if (sf == NULL) {
+    return NULL;
+  }
+  uint64_t hash = hash_bytes(sf->map, sf->map_size);
+
+  pthread_mutex_lock(&d->lock);
+  scene_entry *e = NULL;
+  int i;
+  for (i = 0; i < d->cache_size; i++) {
+    if (d->cache[i].sf != NULL && d->cache[i].hash == hash) {
+      e = d->cache + i;
+      break;
+    }
+  }
+  *cached = e != NULL;
+  if (e != NULL) {
+    e->refs++;
+    e->last_used = ++d->cache_clock;
+    while (!e->ready) {
+      pthread_cond_wait(&d->scene_ready, &d->lock);
+    }
+    pthread_mutex_unlock(&d->lock);
+    scene_file_unload(sf);
+    return e;
+  }
+
+  /* Take an empty slot, or the least recently used one not in use. */
+  for (i = 0; i < d->cache_size; i++) {
+    scene_entry *c = d->cache + i;
+    if (c->refs == 0 && (e == NULL || c->sf == NULL ||
+                         (e->sf != NULL && c->last_used < e->last_used))) {
+      e = c;
+    }
+  }
+  if (e == NULL) {
+    if (d->cache_size == d->cache_capacity) {
+      /* Everything's in use, so go over for now. Entries are pointed
+       * at, so the array can't move: give up instead.
+       */
+      pthread_mutex_unlock(&d->lock);
+      fprintf(stderr, "Scene cache full, can't load %s\n", path);
+      scene_file_unload(sf);
+      return NULL;
+    }
+    e = d->cache + d->cache_size++;
+  }
+  scene_file *old = e->sf;
+  e->hash = hash;
+  e->sf = sf;
+  e->refs = 1;
+  e->last_used = ++d->cache_clock;
+  e->ready = 0;
+  pthread_mutex_unlock(&d->lock);
+  if (old != NULL) {
+    scene_file_unload(old);
+  }
+
+  render_prepare_ex(&sf->sc, &d->opts);
+
+  pthread_mutex_lock(&d->lock);
+  e->ready = 1;
+  pthread_cond_broadcast(&d->scene_ready);
+  pthread_mutex_unlock(&d->lock);
+  return e;
+}
+
+/* ------------------------------------------------------------------
+ * Jobs
+ */
+
+/* Take a job that's over off the daemon's list, set up its DONE
+ * message, and add it to 'finished'. Call with the lock held, then
+ * jobs_done without it.
+ */
+static void job_finish(daemon_state *d, daemon_job *job, int status,
+                       daemon_job **finished)
+{
+  daemon_job **p;
+  for (p = &d->jobs; *p != job; p = &(*p)->next) {
+  }
+  *p = job->next;
+
+  message_init(&job->done, DAEMON_DONE, job->id);
+  job->done.width = job->width;
+  job->done.height = job->height;
+  job->done.status = status;
+  job->done.cached = job->cached;
+  job->done.seconds = now() - job->start;
+  job->next = *finished;
+  *finished = job;
+}
+
+/* Tell the clients the jobs are over, and forget them. Call without
+ * the lock.
+ */
+static void jobs_done(daemon_state *d, daemon_job *finished)
+{
+  while (finished != NULL) {
+    daemon_job *job = finished;
+    finished = job->next;
+    client_send(job->client, &job->done, NULL);
+    if (d->opts.verbose) {
+      int status = job->done.status;
+      printf("Job %llu: %dx%d, %s in %.3f s%s\n",
+             (unsigned long long)job->id, job->width, job->height,
+             status == DAEMON_OK ? "done" :
+             status == DAEMON_CANCELLED ? "cancelled" : "failed",
+             job->done.seconds, job->cached ? ", scene cached" : "");
+      fflush(stdout);
+    }
+    pthread_mutex_lock(&d->lock);
+    job->entry->refs--;
+    client_release(job->client);
+    pthread_mutex_unlock(&d->lock);
+    free(job);
+  }
+}
+
+/* Cancel a job: at once if it's waiting, else when its tile is done.
+ * Call with the lock held.
+ */
+static void job_cancel(daemon_state *d, daemon_job *job,
+                       daemon_job **finished)
+{
+  job->cancelled = 1;
+  if (job->heap_index >= 0) {
+    heap_remove(d, job);
+    job_finish(d, job, DAEMON_CANCELLED, finished);
+  }
+}
+
+static daemon_job *job_find(daemon_state *d, uint64_t id)
+{
+  daemon_job *job;
+  for (job = d->jobs; job != NULL && job->id != id; job = job->next) {
+  }
+  return job;
+}
+
+static void job_start(daemon_state *d, daemon_client *client,
+                      daemon_message const *req, char const *path)
+{
+  daemon_job *job = (daemon_job *)calloc(1, sizeof(daemon_job));
+  job->start = now();
+  job->priority = req->priority;
+  job->client = client;
+  job->heap_index = -1;
+  job->entry = scene_acquire(d, path, &job->cached);
+
+  pthread_mutex_lock(&d->lock);
+  job->id = d->next_id++;
+  pthread_mutex_unlock(&d->lock);
+
+  daemon_message m;
+  message_init(&m, DAEMON_ACCEPTED, job->id);
+  if (job->entry == NULL) {
+    client_send(client, &m, NULL);
+    message_init(&m, DAEMON_DONE, job->id);
+    m.status = DAEMON_FAILED;
+    client_send(client, &m, NULL);
+    if (d->opts.verbose) {
+      printf("Job %llu: couldn't load %s\n", (unsigned long long)job->id,
+             path);
+      fflush(stdout);
+    }
+    free(job);
+    return;
+  }
+
+  scene_file const *sf = job->entry->sf;
+  job->sc = sf->sc;
+  if (req->samples > 0) {
+    job->sc.num_samples = req->samples;
+  }
+  job->width = req->width > 0 ? req->width : sf->width;
+  job->height = req->height > 0 ? req->height : sf->height;
+  job->tile_size = req->tile_size > 0 ? req->tile_size : DEFAULT_TILE_SIZE;
+  job->tiles_across = (job->width - 1) / job->tile_size + 1;
+  job->num_tiles = job->tiles_across *
+    ((job->height - 1) / job->tile_size + 1);
+  m.width = job->width;
+  m.height = job->height;
+  m.tile_size = job->tile_size;
+  m.cached = job->cached;
+  client_send(client, &m, NULL);
+
+  daemon_job *finished = NULL;
+  pthread_mutex_lock(&d->lock);
+  client->refs++;
+  job->next = d->jobs;
+  d->jobs = job;
+  if (client_gone(client)) {
+    job_finish(d, job, DAEMON_CANCELLED, &finished);
+  } else {
+    heap_push(d, job);
+    pthread_cond_signal(&d->work);
+  }
+  pthread_mutex_unlock(&d->lock);
+  jobs_done(d, finished);
+}
+
+/* Take the top job's next tile, render it and send it, until told to
+ * stop.
+ */
+static void *runner_run(void *arg)
+{
+  daemon_state *d = (daemon_state *)arg;
+  colour *pixels = NULL;
+  float *payload = NULL;
+  int capacity = 0;
+  pthread_mutex_lock(&d->lock);
+  for (;;) {
+    while (d->heap_size == 0) {
+      pthread_cond_wait(&d->work, &d->lock);
+    }
+    daemon_job *job = d->heap[0];
+    heap_remove(d, job);
+    int tile = job->next_tile++;
+    pthread_mutex_unlock(&d->lock);
+
+    int x0 = (tile % job->tiles_across) * job->tile_size;
+    int y0 = (tile / job->tiles_across) * job->tile_size;
+    int w = job->width - x0 < job->tile_size ? job->width - x0
+                                             : job->tile_size;
+    int h = job->height - y0 < job->tile_size ? job->height - y0
+                                              : job->tile_size;
+    if (w * h > capacity) {
+      capacity = w * h;
+      pixels = (colour *)realloc(pixels, capacity * sizeof(colour));
+      payload = (float *)realloc(payload, capacity * 3 * sizeof(float));
+    }
+    render_opts opts = d->opts;
+    opts.verbose = 0;
+    opts.region_x = x0;
+    opts.region_y = y0;
+    opts.region_width = w;
+    opts.region_height = h;
+    /* Small tiles within it, so every worker gets some. */
+    opts.tile_width = opts.tile_height = FB_TILE_SIZE;
+    render_crop(&job->sc, job->width, job->height, pixels, &opts);
+
+    int i;
+    for (i = 0; i < w * h; i++) {
+      payload[i * 3 + 0] = pixels[i].r;
+      payload[i * 3 + 1] = pixels[i].g;
+      payload[i * 3 + 2] = pixels[i].b;
+    }
+    daemon_message m;
+    message_init(&m, DAEMON_TILE, job->id);
+    m.x = x0;
+    m.y = y0;
+    m.width = w;
+    m.height = h;
+    m.payload_size = (uint64_t)w * h * 3 * sizeof(float);
+    client_send(job->client, &m, payload);
+
+    daemon_job *finished = NULL;
+    pthread_mutex_lock(&d->lock);
+    if (job->cancelled || client_gone(job->client)) {
+      job_finish(d, job, DAEMON_CANCELLED, &finished);
+    } else if (job->next_tile == job->num_tiles) {
+      job_finish(d, job, DAEMON_OK, &finished);
+    } else {
+      heap_push(d, job);
+    }
+    if (finished != NULL) {
+      pthread_mutex_unlock(&d->lock);
+      jobs_done(d, finished);
+      pthread_mutex_lock(&d->lock);
+    }
+  }
+  return NULL;
+}
+
+/* Read a client's requests until it goes away, then cancel its jobs. */
+static void *reader_run(void *arg)
+{
+  reader_args *args = (reader_args *)arg;
+  daemon_state *d = args->d;
+  daemon_client *client = args->client;
+  free(args);
+
+  char path[DAEMON_MAX_PATH];
+  daemon_message m;
+  while (daemon_receive(client->fd, &m, path, sizeof(path) - 1) == 0) {
+    if (m.type == DAEMON_RENDER) {
+      path[m.payload_size] = '\0';
+      job_start(d, client, &m, path);
+    } else if (m.type == DAEMON_CANCEL) {
+      daemon_job *finished = NULL;
+      pthread_mutex_lock(&d->lock);
+      daemon_job *job = job_find(d, m.job_id);
+      /* Clients can only cancel their own jobs. */
+      if (job != NULL && job->client == client) {
+        job_cancel(d, job, &finished);
+      }
+      pthread_mutex_unlock(&d->lock);
+      jobs_done(d, finished);
+    }
+  }
+
+  daemon_job *finished = NULL;
+  pthread_mutex_lock(&d->lock);
+  __atomic_store_n(&client->gone, 1, __ATOMIC_RELAXED);
+  daemon_job *job = d->jobs;
+  while (job != NULL) {
+    daemon_job *next = job->next;
+    if (job->client == client) {
+      job_cancel(d, job, &finished);
+    }
+    job = next;
+  }
+  pthread_mutex_unlock(&d->lock);
+  /* Nothing goes out now, but the jobs still need freeing. */
+  jobs_done(d, finished);
+  pthread_mutex_lock(&d->lock);
+  client_release(client);
+  pthread_mutex_unlock(&d->lock);
+  return NULL;
+}
+
+static int listen_socket(char const *path)
+{
+  struct sockaddr_un addr;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Socket path too long: %s\n", path);
+    return -1;
+  }
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  unlink(path);
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+      listen(fd, DAEMON_BACKLOG) != 0) {
+    fprintf(stderr, "Couldn't listen on %s\n", path);
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+int daemon_run(char const *path, int threads, int cache_scenes,
+               render_opts const *opts)
+{
+  /* Clients going away shouldn't kill us. */
+  signal(SIGPIPE, SIG_IGN);
+
+  int listen_fd = listen_socket(path);
+  if (listen_fd < 0) {
+    return -1;
+  }
+
+  daemon_state *d = (daemon_state *)calloc(1, sizeof(daemon_state));
+  d->opts = *opts;
+  d->opts.context = render_context_create(threads);
+  pthread_mutex_init(&d->lock, NULL);
+  pthread_cond_init(&d->work, NULL);
+  pthread_cond_init(&d->scene_ready, NULL);
+  d->next_id = 1;
+  d->cache_capacity = cache_scenes > 0 ? cache_scenes : 1;
+  d->cache = (scene_entry *)calloc(d->cache_capacity, sizeof(scene_entry));
+
+  int i;
+  for (i = 0; i < DAEMON_RUNNERS; i++) {
+    pthread_t thread;
+    pthread_create(&thread, NULL, runner_run, d);
+    pthread_detach(thread);
+  }
+
+  printf("Listening on %s\n", path);
+  fflush(stdout);
+  for (;;) {
+    int fd = accept(listen_fd, NULL, NULL);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      fprintf(stderr, "Couldn't accept: %s\n", strerror(errno));
+      return -1;
+    }
+    daemon_client *client = (daemon_client *)calloc(1,
+                                                    sizeof(daemon_client));
+    struct timeval timeout = { DAEMON_SEND_TIMEOUT, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    client->fd = fd;
+    client->refs = 1;
+    pthread_mutex_init(&client->write_lock, NULL);
+    reader_args *args = (reader_args *)malloc(sizeof(reader_args));
+    args->d = d;
+    args->client = client;
+    pthread_t thread;
+    pthread_create(&thread, NULL, reader_run, args);
+    pthread_detach(thread);
+  }
+}
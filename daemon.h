@@ -0,0 +1,94 @@
+/*
+ * daemon.h: A long-running render server on a Unix domain socket.
+ *
+ * Clients send render jobs naming a scene file, and get the image
+ * back a tile at a time as tiles finish. Loaded scenes, and the trees
+ * built for them, are kept between jobs, keyed by a hash of the
+ * file's contents, so a job for a scene already seen starts tracing
+ * straight away. Waiting jobs run highest priority first, and a job
+ * can be cancelled while waiting or between tiles.
+ *
+ * Messages are native-endian, as the socket is local: a fixed-size
+ * header, then 'payload_size' bytes.
+ *
+ * (C) Copyright Simon Frankau 1999-2014
+ */
+
+#ifndef DAEMON_H_INCLUDED
+#define DAEMON_H_INCLUDED
+
+#include <stdint.h>
+
+#include "tracer.h"
+
+/* ------------------------------------------------------------------
+ * Macros
+ */
+
+#define DAEMON_MAGIC 0x54524344  /* "TRCD" */
+
+/* Longest scene path a job may give. */
+#define DAEMON_MAX_PATH 4096
+
+/* Client to daemon. */
+#define DAEMON_RENDER 1   /* Payload: the scene file's path. */
+#define DAEMON_CANCEL 2   /* Of job 'job_id'. */
+
+/* Daemon to client. */
+#define DAEMON_ACCEPTED 16  /* The job's number, in 'job_id'. */
+#define DAEMON_TILE 17      /* Payload: w * h pixels of 3 floats. */
+#define DAEMON_DONE 18      /* The job is over; see 'status'. */
+
+/* Statuses of DAEMON_DONE. */
+#define DAEMON_OK 0
+#define DAEMON_CANCELLED 1
+#define DAEMON_FAILED 2
+
+/* ------------------------------------------------------------------
+ * Data types
+ */
+
+typedef struct {
+  uint32_t magic;
+  uint32_t type;
+  uint64_t job_id;
+  /* For DAEMON_RENDER: bigger runs sooner. */
+  int32_t priority;
+  /* For DAEMON_RENDER, the image size and samples per pixel, 0 for the
+   * scene's, and the tile size to send back, 0 for the default.
+   * For DAEMON_TILE, where the tile goes.
+   */
+  int32_t x, y;
+  int32_t width, height;
+  int32_t samples;
+  int32_t tile_size;
+  /* For DAEMON_DONE. 'cached' says the scene was already loaded. */
+  int32_t status;
+  int32_t cached;
+  double seconds;
+  uint64_t payload_size;
+} daemon_message;
+
+/* ------------------------------------------------------------------
+ * Exported functions
+ */
+
+/* Write and read whole messages, with their payloads. Return 0 on
+ * success.
+ */
+int daemon_send(int fd, daemon_message const *m, void const *payload);
+int daemon_receive(int fd, daemon_message *m, void *payload,
+                   uint64_t max_payload);
+
+/* Serve jobs on a socket at 'path', rendering with 'threads' worker
+ * threads shared by all the jobs, and keeping up to 'cache_scenes'
+ * scenes loaded. 'opts' gives the other render settings. Only
+ * returns on error.
+ */
+int daemon_run(char const *path, int threads, int cache_scenes,
+               render_opts const *opts);
+
+/* Connect to a daemon. Returns the socket, or -1. */
+int daemon_connect(char const *path);
+
+#endif // DAEMON_H_INCLUDED
@@ -0,0 +1,196 @@
+/*
+ * denoise.c: Edge-avoiding a-trous wavelet denoiser.
+ *
+ * This is the filter from Dammertz et al, "Edge-Avoiding A-Trous
+ * Wavelet Transform for fast Global Illumination Filtering". Each pass
+ * applies a 5x5 B-spline kernel whose taps are spread 2^i pixels
+ * apart, so a few cheap passes cover a wide area. Each tap is weighted
+ * down by how different its colour, normal, depth and albedo are from
+ * the centre pixel's, so edges and checkerboard squares stay sharp
+ * while the noise within them is smoothed out.
+ *
+ * (C) Copyright Simon Frankau 1999-2014
+ */
+
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "denoise.h"
+
+/* ------------------------------------------------------------------
+ * Data types
+ */
+
+/* One filter pass, shared between threads that each take some rows. */
+typedef struct {
+  int width;
+  int height;
+  colour const *in;
+  colour *out;
+  render_features const *features;
+  int step;
+  /* Precomputed 1/sigma^2, or zero to ignore. */
+  double colour_k;
+  double normal_k;
+  double depth_k;
+  double albedo_k;
+  int y0;
+  int y1;
+} denoise_pass;
+
+/* ------------------------------------------------------------------
+ * Functions
+ */
+
+void denoise_opts_init(denoise_opts *opts)
+{
+  opts->iterations = 5;
+  opts->sigma_colour = 1.0;
+  opts->sigma_normal = 0.3;
+  opts->sigma_depth = 0.1;
+  opts->sigma_albedo = 0.1;
+  opts->threads = 1;
+}
+
+static double inv_square(double sigma)
+{
+  return sigma > 0.0 ? 1.0 / (sigma * sigma) : 0.0;
+}
+
+static void *denoise_rows(void *arg)
+{
+  static double const kernel[5] = {
+    1.0 / 16.0, 1.0 / 4.0, 3.0 / 8.0, 1.0 / 4.0, 1.0 / 16.0
+  };
+
+  denoise_pass const *p = (denoise_pass const *)arg;
+  colour const *albedo = p->features->albedo;
+  vector const *normal = p->features->normal;
+  double const *depth = p->features->depth;
+  int width = p->width;
+
+  int x, y, i, j;
+  for (y = p->y0; y < p->y1; y++) {
+    for (x = 0; x < width; x++) {
+      int centre = y * width + x;
+      colour c0 = p->in[centre];
+      colour a0 = albedo[centre];
+      vector n0 = normal[centre];
+      double z0 = depth[centre];
+
+      colour sum = { 0.0, 0.0, 0.0 };
+      double total = 0.0;
+      for (j = 0; j < 5; j++) {
+        int qy = y + (j - 2) * p->step;
+        if (qy < 0 || qy >= p->height) {
+          continue;
+        }
+        for (i = 0; i < 5; i++) {
+          int qx = x + (i - 2) * p->step;
+          if (qx < 0 || qx >= width) {
+            continue;
+          }
+          int q = qy * width + qx;
+
+          colour c = p->in[q];
+          double dc = (c.r - c0.r) * (c.r - c0.r) +
+                      (c.g - c0.g) * (c.g - c0.g) +
+                      (c.b - c0.b) * (c.b - c0.b);
+          vector n = normal[q];
+          SUB(n, n0);
+          double dn = DOT(n, n);
+          double zmax = fmax(fabs(z0), fabs(depth[q]));
+          double dz = zmax > 0.0 ? (depth[q] - z0) / zmax : 0.0;
+          colour a = albedo[q];
+          double da = (a.r - a0.r) * (a.r - a0.r) +
+                      (a.g - a0.g) * (a.g - a0.g) +
+                      (a.b - a0.b) * (a.b - a0.b);
+
+          double w = kernel[i] * kernel[j] *
+            exp(-(dc * p->colour_k + dn * p->normal_k +
+                  dz * dz * p->depth_k + da * p->albedo_k));
+          sum.r += c.r * w;
+          sum.g += c.g * w;
+          sum.b += c.b * w;
+          total += w;
+        }
+      }
+      /* The centre tap always has weight, so total > 0. */
+      sum.r /= total;
+      sum.g /= total;
+      sum.b /= total;
+      p->out[centre] = sum;
+    }
+  }
+  return NULL;
+}
+
+void denoise(int width, int height, colour *image,
+             render_features const *features, denoise_opts const *opts)
+{
+  int threads = opts->threads > 0 ? opts->threads : 1;
+  if (threads > height) {
+    threads = height;
+  }
+
+  /* Make colour differences independent of exposure. */
+  double mean = 0.0;
+  int i;
+  for (i = 0; i < width * height; i++) {
+    mean += (image[i].r + image[i].g + image[i].b) / 3.0;
+  }
+  mean /= width * height;
+  if (mean <= 0.0) {
+    return;
+  }
+
+  colour *buf = (colour *)malloc(width * height * sizeof(colour));
+  denoise_pass *passes =
+    (denoise_pass *)malloc(threads * sizeof(denoise_pass));
+  pthread_t *workers = (pthread_t *)malloc(threads * sizeof(pthread_t));
+
+  colour *in = image;
+  colour *out = buf;
+  int iter;
+  for (iter = 0; iter < opts->iterations; iter++) {
+    /* As the filter widens, only smooth over smaller colour
+     * differences, since the noise has already been reduced.
+     */
+    double sigma_colour = opts->sigma_colour * mean / (1 << iter);
+    for (i = 0; i < threads; i++) {
+      denoise_pass *p = passes + i;
+      p->width = width;
+      p->height = height;
+      p->in = in;
+      p->out = out;
+      p->features = features;
+      p->step = 1 << iter;
+      p->colour_k = inv_square(sigma_colour);
+      p->normal_k = inv_square(opts->sigma_normal);
+      p->depth_k = inv_square(opts->sigma_depth);
+      p->albedo_k = inv_square(opts->sigma_albedo);
+      p->y0 = height * i / threads;
+      p->y1 = height * (i + 1) / threads;
+    }
+    for (i = 1; i < threads; i++) {
+      pthread_create(workers + i, NULL, denoise_rows, passes + i);
+    }
+    denoise_rows(passes);
+    for (i = 1; i < threads; i++) {
+      pthread_join(workers[i], NULL);
+    }
+
+    colour *tmp = in;
+    in = out;
+    out = tmp;
+  }
+
+  if (in != image) {
+    memcpy(image, in, width * height * sizeof(colour));
+  }
+  free(workers);
+  free(passes);
+  free(buf);
+}
@@ -0,0 +1,45 @@
+/*
+ * denoise.h: Edge-avoiding a-trous wavelet denoiser.
+ *
+ * (C) Copyright Simon Frankau 1999-2014
+ */
+
+#ifndef DENOISE_H_INCLUDED
+#define DENOISE_H_INCLUDED
+
+#include "tracer.h"
+
+/* ------------------------------------------------------------------
+ * Data types
+ */
+
+typedef struct {
+  /* Filter passes. Each doubles the filter's reach. */
+  int iterations;
+  /* How quickly weights fall off with differences in each feature.
+   * Colour differences are relative to the image's mean brightness,
+   * and depth differences relative to the depth. Zero ignores that
+   * feature.
+   */
+  double sigma_colour;
+  double sigma_normal;
+  double sigma_depth;
+  double sigma_albedo;
+  int threads;
+} denoise_opts;
+
+/* ------------------------------------------------------------------
+ * Exported functions
+ */
+
+/* Default settings, good for 16-64 spp. */
+void denoise_opts_init(denoise_opts *opts);
+
+/* Denoise an image in place, using the feature buffers written by
+ * render to avoid blurring across edges. All three feature buffers
+ * must be present.
+ */
+void denoise(int width, int height, colour *image,
+             render_features const *features, denoise_opts const *opts);
+
+#endif // DENOISE_H_INCLUDED
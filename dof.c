@@ -8,8 +8,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#include "arena.h"
 #include "tracer.h"
 #include "png_render.h"
+#include "scene_file.h"
 
 #define WIDTH 1024
 #define HEIGHT 512
@@ -45,7 +47,7 @@ static void set_surface(surface *s, double r, double g, double b, double shine)
   s->refractive_index = 1.0;
 }
 
-static scene *make_scene()
+static scene *make_scene(arena *a)
 {
   /* Place the checkerboard */
   checkerboards.normal.x = 0.0;
@@ -58,7 +60,7 @@ static scene *make_scene()
 
   /* Place a set of spheres. */
   int num_spheres = 5;
-  sphere *spheres = (sphere *)malloc(num_spheres * sizeof(sphere));
+  sphere *spheres = (sphere *)arena_alloc(a, num_spheres * sizeof(sphere));
 
   int i;
   vector pos = { -2.5, -0.5, 3.0 };
@@ -78,25 +80,40 @@ static scene *make_scene()
     pos.z += 2.0;
   }
 
- scene *result = (scene *)malloc(sizeof(scene));
+ scene *result = (scene *)arena_calloc(a, 1, sizeof(scene));
  result->spheres = spheres;
  result->num_spheres = num_spheres;
  result->checkerboards = &checkerboards;
  result->num_checkerboards = num_checkerboards;
  result->lights = lights;
  result->num_lights = num_lights;
+ result->light_samples = 0;
+ result->light_table = NULL;
 
  result->num_samples    = 1000;
+ result->max_depth      = DEPTH_UNSET;
+ result->rr_depth       = DEPTH_UNSET;
  result->blur_size      = 6.0;
  result->antialias_size = 0.5;
  result->focal_depth    = 5.0;
  result->callback       = NULL;
+ result->arena          = a;
 
  return result;
 }
 
-int main(void) {
-  scene *sc = make_scene();
-  png_render(sc, WIDTH, HEIGHT, "dof.png");
-  return 0;
+/* With a filename argument, save the scene there rather than
+ * rendering it.
+ */
+int main(int argc, char **argv) {
+  arena *scene_arena = arena_create(0);
+  scene *sc = make_scene(scene_arena);
+  int err = 0;
+  if (argc > 1) {
+    err = scene_file_save(sc, WIDTH, HEIGHT, argv[1]) ? 1 : 0;
+  } else {
+    png_render(sc, WIDTH, HEIGHT, "dof.png");
+  }
+  arena_destroy(scene_arena);
+  return err;
 }
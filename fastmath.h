@@ -0,0 +1,153 @@
+/*
+ * fastmath.h: Cheap versions of the maths functions shading uses.
+ *
+ * The fast_* functions are always available. The fm_* functions are
+ * what the tracer calls: the fast versions when built with
+ * -DTRACER_FAST_MATH (FAST_MATH=1 sh build.sh), and libm otherwise.
+ * Everything is inline and branch-light, so loops over them can be
+ * vectorised. fastmath_bench measures speed and error against libm.
+ *
+ * Accuracy, over the inputs the tracer gives them:
+ *   fast_exp2, fast_log2  relative error < 1e-8 (absolute for log2)
+ *   fast_pow              relative error < 1e-8 * |y log2 x| + 2e-8
+ *   fast_sincos           absolute error < 2e-9
+ *   fast_powi             exact up to rounding
+ * Inputs outside the ranges documented on each are not handled.
+ *
+ * (C) Copyright Simon Frankau 1999-2014
+ */
+
+#ifndef FASTMATH_H_INCLUDED
+#define FASTMATH_H_INCLUDED
+
+#include <math.h>
+#include <stdint.h>
+
+/* ------------------------------------------------------------------
+ * Exported functions
+ */
+
+/* x^n by repeated squaring. */
+static inline double fast_powi(double x, unsigned n)
+{
+  double result = 1.0;
+  while (n) {
+    if (n & 1) {
+      result *= x;
+    }
+    x *= x;
+    n >>= 1;
+  }
+  return result;
+}
+
+/* 2^x, for any x. Underflows to 0 below -1022. */
+static inline double fast_exp2(double x)
+{
+  if (x < -1022.0) {
+    return 0.0;
+  }
+  if (x > 1023.0) {
+    return INFINITY;
+  }
+  /* 2^x = 2^i * e^(f ln 2), with |f| <= 0.5, so the Taylor series
+   * to the 7th power is good to 5e-9. Adding and subtracting 1.5 *
+   * 2^52 rounds to an integer without a call to rint.
+   */
+  double i = (x + 0x1.8p52) - 0x1.8p52;
+  double t = (x - i) * M_LN2;
+  double p = 1.0 + t * (1.0 + t * (1.0 / 2 + t * (1.0 / 6 + t *
+             (1.0 / 24 + t * (1.0 / 120 + t * (1.0 / 720 + t *
+             (1.0 / 5040)))))));
+  union { double d; uint64_t u; } scale;
+  scale.u = (uint64_t)((int64_t)i + 1023) << 52;
+  return p * scale.d;
+}
+
+/* log2(x), for positive normal x. */
+static inline double fast_log2(double x)
+{
+  /* Split x into 2^e * m, with m in [sqrt(1/2), sqrt(2)), by
+   * measuring the exponent from sqrt(1/2) rather than 1. No branches,
+   * as the tracer's inputs are as likely to fall either side.
+   */
+  union { double d; uint64_t u; } bits;
+  bits.d = x;
+  uint64_t off = bits.u - 0x3fe6a09e667f3bcdull;
+  int e = (int)((int64_t)off >> 52);
+  bits.u -= off & 0xfff0000000000000ull;
+  double m = bits.d;
+  /* log(m) = 2 atanh(s), s = (m - 1) / (m + 1), |s| < 0.172. */
+  double s = (m - 1.0) / (m + 1.0);
+  double s2 = s * s;
+  double a = s * (1.0 + s2 * (1.0 / 3 + s2 * (1.0 / 5 + s2 *
+             (1.0 / 7 + s2 * (1.0 / 9)))));
+  return e + a * (2.0 / M_LN2);
+}
+
+/* Natural log, for positive normal x. */
+static inline double fast_log(double x)
+{
+  return fast_log2(x) * M_LN2;
+}
+
+/* x^y, for x >= 0. */
+static inline double fast_pow(double x, double y)
+{
+  if (y == 0.0) {
+    return 1.0;
+  }
+  if (x <= 0.0) {
+    return 0.0;
+  }
+  return fast_exp2(y * fast_log2(x));
+}
+
+/* sin and cos of x, for |x| < 2^20. */
+static inline void fast_sincos(double x, double *s, double *c)
+{
+  /* Reduce to |r| <= pi/4 and a quadrant. */
+  double k = (x * M_2_PI + 0x1.8p52) - 0x1.8p52;
+  double r = x - k * M_PI_2;
+  double r2 = r * r;
+  union { double d; uint64_t u; } sr, cr;
+  sr.d = r * (1.0 - r2 * (1.0 / 6 - r2 * (1.0 / 120 - r2 *
+         (1.0 / 5040 - r2 * (1.0 / 362880)))));
+  cr.d = 1.0 - r2 * (1.0 / 2 - r2 * (1.0 / 24 - r2 * (1.0 / 720 -
+         r2 * (1.0 / 40320 - r2 * (1.0 / 3628800)))));
+  /* Swap and negate by quadrant with bit masks rather than a switch,
+   * which mispredicts on random angles.
+   */
+  uint64_t q = (uint64_t)(int64_t)k;
+  uint64_t swap = -(q & 1);
+  union { double d; uint64_t u; } so, co;
+  so.u = ((sr.u & ~swap) | (cr.u & swap)) ^ ((q & 2) << 62);
+  co.u = ((cr.u & ~swap) | (sr.u & swap)) ^ (((q + 1) & 2) << 62);
+  *s = so.d;
+  *c = co.d;
+}
+
+#ifdef TRACER_FAST_MATH
+
+static inline double fm_powi(double x, unsigned n) { return fast_powi(x, n); }
+static inline double fm_pow(double x, double y) { return fast_pow(x, y); }
+static inline double fm_log(double x) { return fast_log(x); }
+static inline void fm_sincos(double x, double *s, double *c)
+{
+  fast_sincos(x, s, c);
+}
+
+#else
+
+static inline double fm_powi(double x, unsigned n) { return pow(x, n); }
+static inline double fm_pow(double x, double y) { return pow(x, y); }
+static inline double fm_log(double x) { return log(x); }
+static inline void fm_sincos(double x, double *s, double *c)
+{
+  *s = sin(x);
+  *c = cos(x);
+}
+
+#endif // TRACER_FAST_MATH
+
+#endif // FASTMATH_H_INCLUDED
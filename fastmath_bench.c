@@ -0,0 +1,135 @@
+/*
+ * fastmath_bench.c: Time fastmath.h against libm, and check its error
+ *
+ * Each function is run over an array of inputs in the range the
+ * tracer uses it for. Prints ns per call for both versions, and the
+ * largest error seen.
+ *
+ * (C) Copyright Simon Frankau 1999-2014
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "fastmath.h"
+
+#define N (1 << 20)
+#define RUNS 5
+
+static double in_a[N];
+static double in_b[N];
+static double out_libm[N];
+static double out_fast[N];
+static double out_libm2[N];
+static double out_fast2[N];
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Best of RUNS timings of 'body' over i = 0..N-1, in ns per call. */
+#define TIME(result, body) { \
+    int _run; \
+    result = INFINITY; \
+    for (_run = 0; _run < RUNS; _run++) { \
+      double _t0 = now(); \
+      int i; \
+      for (i = 0; i < N; i++) { \
+        body; \
+      } \
+      double _t = (now() - _t0) * 1e9 / N; \
+      if (_t < result) result = _t; \
+    } \
+  }
+
+static double uniform(double lo, double hi)
+{
+  return lo + (hi - lo) * ((double)rand() + 1.0) / ((double)RAND_MAX + 1.0);
+}
+
+static void fill(double lo_a, double hi_a, double lo_b, double hi_b)
+{
+  int i;
+  for (i = 0; i < N; i++) {
+    in_a[i] = uniform(lo_a, hi_a);
+    in_b[i] = uniform(lo_b, hi_b);
+  }
+}
+
+/* Largest error of out_fast against out_libm, relative if asked. */
+static double max_error(double const *fast, double const *libm, int relative)
+{
+  double worst = 0.0;
+  int i;
+  for (i = 0; i < N; i++) {
+    double err = fabs(fast[i] - libm[i]);
+    if (relative && libm[i] != 0.0) {
+      err /= fabs(libm[i]);
+    }
+    if (err > worst) {
+      worst = err;
+    }
+  }
+  return worst;
+}
+
+static void report(char const *name, double t_libm, double t_fast,
+                   double err, char const *err_kind)
+{
+  printf("%-12s libm %6.2f ns  fast %6.2f ns  x%5.2f  max %s error %.2g\n",
+         name, t_libm, t_fast, t_libm / t_fast, err_kind, err);
+}
+
+int main(void)
+{
+  double t_libm, t_fast;
+  srand(1);
+
+  /* Specular highlights: cos^10. */
+  fill(0.0, 1.0, 0.0, 0.0);
+  TIME(t_libm, out_libm[i] = pow(in_a[i], 10));
+  TIME(t_fast, out_fast[i] = fast_powi(in_a[i], 10));
+  report("powi(x, 10)", t_libm, t_fast,
+         max_error(out_fast, out_libm, 1), "relative");
+
+  /* Beer-Lambert attenuation: transparency^distance. */
+  fill(0.0, 1.0, 0.0, 20.0);
+  TIME(t_libm, out_libm[i] = pow(in_a[i], in_b[i]));
+  TIME(t_fast, out_fast[i] = fast_pow(in_a[i], in_b[i]));
+  report("pow(t, d)", t_libm, t_fast,
+         max_error(out_fast, out_libm, 1), "relative");
+
+  fill(-60.0, 60.0, 0.0, 0.0);
+  TIME(t_libm, out_libm[i] = exp2(in_a[i]));
+  TIME(t_fast, out_fast[i] = fast_exp2(in_a[i]));
+  report("exp2", t_libm, t_fast,
+         max_error(out_fast, out_libm, 1), "relative");
+
+  fill(1e-9, 1e9, 0.0, 0.0);
+  TIME(t_libm, out_libm[i] = log2(in_a[i]));
+  TIME(t_fast, out_fast[i] = fast_log2(in_a[i]));
+  report("log2", t_libm, t_fast,
+         max_error(out_fast, out_libm, 0), "absolute");
+
+  /* Box-Muller radius: log of a uniform in (0, 1]. */
+  fill(0.0, 1.0, 0.0, 0.0);
+  TIME(t_libm, out_libm[i] = log(in_a[i]));
+  TIME(t_fast, out_fast[i] = fast_log(in_a[i]));
+  report("log", t_libm, t_fast,
+         max_error(out_fast, out_libm, 0), "absolute");
+
+  /* Box-Muller angle, and colour_phase: both in (0, 2 pi]. */
+  fill(0.0, 2 * M_PI, 0.0, 0.0);
+  TIME(t_libm, out_libm[i] = sin(in_a[i]); out_libm2[i] = cos(in_a[i]));
+  TIME(t_fast, fast_sincos(in_a[i], out_fast + i, out_fast2 + i));
+  double err = max_error(out_fast, out_libm, 0);
+  double err2 = max_error(out_fast2, out_libm2, 0);
+  report("sincos", t_libm, t_fast, err > err2 ? err : err2, "absolute");
+
+  return 0;
+}
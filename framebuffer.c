@@ -0,0 +1,93 @@
+/*
+ * framebuffer.c: Tiled single-precision accumulation buffer.
+ *
+ * (C) Copyright Simon Frankau 1999-2014
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "framebuffer.h"
+
+/* Alignment of the pixel array - a cache line. */
+#define FB_ALIGN 64
+
+framebuffer *framebuffer_create(int width, int height)
+{
+  framebuffer *fb = framebuffer_alloc(width, height);
+  framebuffer_clear(fb);
+  return fb;
+}
+
+framebuffer *framebuffer_alloc(int width, int height)
+{
+  framebuffer *fb = (framebuffer *)malloc(sizeof(framebuffer));
+  fb->width = width;
+  fb->height = height;
+  fb->tiles_across = (width + FB_TILE_SIZE - 1) / FB_TILE_SIZE;
+  fb->tiles_down = (height + FB_TILE_SIZE - 1) / FB_TILE_SIZE;
+
+  size_t size = (size_t)fb->tiles_across * fb->tiles_down *
+    FB_TILE_PIXELS * sizeof(fb_pixel);
+  void *pixels;
+  if (posix_memalign(&pixels, FB_ALIGN, size) != 0) {
+    printf("Couldn't allocate framebuffer.\n");
+    exit(1);
+  }
+  fb->pixels = (fb_pixel *)pixels;
+  return fb;
+}
+
+void framebuffer_destroy(framebuffer *fb)
+{
+  free(fb->pixels);
+  free(fb);
+}
+
+void framebuffer_clear(framebuffer *fb)
+{
+  memset(fb->pixels, 0, (size_t)fb->tiles_across * fb->tiles_down *
+         FB_TILE_PIXELS * sizeof(fb_pixel));
+}
+
+void framebuffer_clear_tiles(framebuffer *fb, int x0, int y0, int x1, int y1)
+{
+  int tx0 = x0 >> FB_TILE_SHIFT;
+  int tx1 = (x1 + FB_TILE_SIZE - 1) >> FB_TILE_SHIFT;
+  int ty;
+  for (ty = y0 >> FB_TILE_SHIFT; ty << FB_TILE_SHIFT < y1; ty++) {
+    memset(fb->pixels + (ty * fb->tiles_across + tx0) * FB_TILE_PIXELS, 0,
+           (size_t)(tx1 - tx0) * FB_TILE_PIXELS * sizeof(fb_pixel));
+  }
+}
+
+void framebuffer_merge(framebuffer *fb, framebuffer const *other)
+{
+  size_t count = (size_t)fb->tiles_across * fb->tiles_down * FB_TILE_PIXELS;
+  size_t i;
+  for (i = 0; i < count; i++) {
+    fb->pixels[i].r += other->pixels[i].r;
+    fb->pixels[i].g += other->pixels[i].g;
+    fb->pixels[i].b += other->pixels[i].b;
+    fb->pixels[i].n += other->pixels[i].n;
+  }
+}
+
+void framebuffer_detile(framebuffer *fb, colour *image, int stride)
+{
+  int x, y;
+  for (y = 0; y < fb->height; y++) {
+    for (x = 0; x < fb->width; x++) {
+      fb_pixel const *p = framebuffer_pixel(fb, x, y);
+      colour *c = image + y * stride + x;
+      if (p->n > 0.0f) {
+        c->r = p->r / p->n;
+        c->g = p->g / p->n;
+        c->b = p->b / p->n;
+      } else {
+        c->r = c->g = c->b = 0.0;
+      }
+    }
+  }
+}
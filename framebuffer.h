@@ -0,0 +1,98 @@
+/*
+ * framebuffer.h: Tiled single-precision accumulation buffer.
+ *
+ * (C) Copyright Simon Frankau 1999-2014
+ */
+
+#ifndef FRAMEBUFFER_H_INCLUDED
+#define FRAMEBUFFER_H_INCLUDED
+
+#include "tracer.h"
+
+/* ------------------------------------------------------------------
+ * Macros
+ */
+
+/* Tiles are FB_TILE_SIZE pixels square. Must be a power of 2. */
+#define FB_TILE_SHIFT 3
+#define FB_TILE_SIZE (1 << FB_TILE_SHIFT)
+#define FB_TILE_PIXELS (FB_TILE_SIZE * FB_TILE_SIZE)
+
+/* ------------------------------------------------------------------
+ * Data types
+ */
+
+/* Sum of the samples so far, and how many there were. */
+typedef struct {
+  float r, g, b;
+  float n;
+} fb_pixel;
+
+/* Pixels are stored tile by tile, rows of tiles at a time, and in
+ * Morton order within each tile. Each tile is 1K and starts on a
+ * cache line, so threads working on different tiles never share a
+ * line, and a tile's pixels are close together however it is walked.
+ */
+typedef struct framebuffer_t {
+  int width;
+  int height;
+  int tiles_across;
+  int tiles_down;
+  fb_pixel *pixels;
+} framebuffer;
+
+/* ------------------------------------------------------------------
+ * Exported functions
+ */
+
+/* Make a cleared framebuffer. */
+framebuffer *framebuffer_create(int width, int height);
+
+/* Make a framebuffer without touching its memory, so that each part
+ * is placed on the NUMA node of whoever clears it first with
+ * framebuffer_clear_tiles.
+ */
+framebuffer *framebuffer_alloc(int width, int height);
+
+void framebuffer_destroy(framebuffer *fb);
+
+/* Zero all the pixels and sample counts. */
+void framebuffer_clear(framebuffer *fb);
+
+/* Zero the tiles covering pixels (x0, y0) up to (x1, y1). */
+void framebuffer_clear_tiles(framebuffer *fb, int x0, int y0, int x1, int y1);
+
+/* Find a pixel. */
+static inline fb_pixel *framebuffer_pixel(framebuffer *fb, int x, int y)
+{
+  int tile = (y >> FB_TILE_SHIFT) * fb->tiles_across + (x >> FB_TILE_SHIFT);
+  /* Interleave the low bits of x and y. */
+  unsigned morton = 0;
+  int i;
+  for (i = 0; i < FB_TILE_SHIFT; i++) {
+    morton |= ((x >> i) & 1) << (2 * i);
+    morton |= ((y >> i) & 1) << (2 * i + 1);
+  }
+  return fb->pixels + tile * FB_TILE_PIXELS + morton;
+}
+
+/* Add 'samples' samples summing to 'sum' to a pixel. */
+static inline void framebuffer_add(framebuffer *fb, int x, int y,
+                                   colour sum, int samples)
+{
+  fb_pixel *p = framebuffer_pixel(fb, x, y);
+  p->r += sum.r;
+  p->g += sum.g;
+  p->b += sum.b;
+  p->n += samples;
+}
+
+/* Add another framebuffer's samples, of the same size, to this one. */
+void framebuffer_merge(framebuffer *fb, framebuffer const *other);
+
+/* Write out the average of each pixel in scanline order, into an image
+ * 'stride' pixels across. Pixels without samples come out black.
+ */
+void framebuffer_detile(framebuffer *fb, colour *image, int stride);
+
+#endif // FRAMEBUFFER_H_INCLUDED
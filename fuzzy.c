@@ -8,8 +8,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#include "arena.h"
 #include "tracer.h"
 #include "png_render.h"
+#include "scene_file.h"
 
 #define WIDTH 256
 #define HEIGHT 256
@@ -49,7 +51,7 @@ static void set_surface(surface *s, double r, double g, double b, double shine)
 }
 
 /* Make a spherical shell filled with spheres. */
-static scene *make_scene(double fuzz_size, fuzz_mode style)
+static scene *make_scene(arena *a, double fuzz_size, fuzz_mode style)
 {
   /* Place the checkerboard */
   checkerboards.normal.x = 0.0;
@@ -62,7 +64,7 @@ static scene *make_scene(double fuzz_size, fuzz_mode style)
 
   /* Place a set of spheres. */
   int num_spheres = 1;
-  sphere *spheres = (sphere *)malloc(num_spheres * sizeof(sphere));
+  sphere *spheres = (sphere *)arena_alloc(a, num_spheres * sizeof(sphere));
 
   vector pos = { 0.0, 0.0, 5.0 };
 
@@ -74,31 +76,51 @@ static scene *make_scene(double fuzz_size, fuzz_mode style)
   spheres->fuzz_size = fuzz_size;
   spheres->fuzz_style = style;
 
-  scene *result = (scene *)malloc(sizeof(scene));
+  scene *result = (scene *)arena_calloc(a, 1, sizeof(scene));
   result->spheres = spheres;
   result->num_spheres = num_spheres;
   result->checkerboards = &checkerboards;
   result->num_checkerboards = num_checkerboards;
   result->lights = lights;
   result->num_lights = num_lights;
+  result->light_samples = 0;
+  result->light_table = NULL;
 
   result->num_samples    = 1000;
+  result->max_depth      = DEPTH_UNSET;
+  result->rr_depth       = DEPTH_UNSET;
   result->blur_size      = 0.0;
   result->antialias_size = 0.5;
   result->focal_depth    = 0.0;
   result->callback       = NULL;
+  result->arena          = a;
 
   return result;
 }
 
-int main(void) {
+/* With a filename argument, save the scenes as <name>-0.scn,
+ * <name>-1.scn, etc. rather than rendering them.
+ */
+int main(int argc, char **argv) {
+  arena *scene_arena = arena_create(0);
   scene scenes[5];
-  scenes[0] = *make_scene(0.00, none);
-  scenes[1] = *make_scene(0.05, both);
-  scenes[2] = *make_scene(0.15, both);
-  scenes[3] = *make_scene(0.15, horizontal);
-  scenes[4] = *make_scene(0.15, vertical);
-  png_render_ex(scenes, sizeof(scenes)/sizeof(scenes[0]), 3,
-		WIDTH, HEIGHT, "fuzzy.png");
-  return 0;
+  scenes[0] = *make_scene(scene_arena, 0.00, none);
+  scenes[1] = *make_scene(scene_arena, 0.05, both);
+  scenes[2] = *make_scene(scene_arena, 0.15, both);
+  scenes[3] = *make_scene(scene_arena, 0.15, horizontal);
+  scenes[4] = *make_scene(scene_arena, 0.15, vertical);
+  int err = 0;
+  if (argc > 1) {
+    int i;
+    for (i = 0; i < sizeof(scenes)/sizeof(scenes[0]) && !err; i++) {
+      char name[1024];
+      snprintf(name, sizeof(name), "%s-%d.scn", argv[1], i);
+      err = scene_file_save(scenes + i, WIDTH, HEIGHT, name) ? 1 : 0;
+    }
+  } else {
+    png_render_ex(scenes, sizeof(scenes)/sizeof(scenes[0]), 3,
+                  WIDTH, HEIGHT, "fuzzy.png");
+  }
+  arena_destroy(scene_arena);
+  return err;
 }
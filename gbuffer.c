@@ -0,0 +1,127 @@
+/*
+ * gbuffer.c: Saved camera ray hits, for re-shading.
+ *
+ * (C) Copyright Simon Frankau 1999-2014
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gbuffer.h"
+
+/* ------------------------------------------------------------------
+ * Macros
+ */
+
+#define GBUFFER_MAGIC "SPHGBUF1"
+#define GBUFFER_BYTE_ORDER 0x01020304
+
+/* ------------------------------------------------------------------
+ * Data types
+ */
+
+typedef struct {
+  char magic[8];
+  uint32_t byte_order;
+  uint32_t sample_size;
+  int32_t width;
+  int32_t height;
+  int32_t samples;
+  int32_t pad;
+} gbuffer_header;
+
+/* ------------------------------------------------------------------
+ * Functions
+ */
+
+gbuffer *gbuffer_create(int width, int height, int samples)
+{
+  gbuffer *gb = (gbuffer *)malloc(sizeof(gbuffer));
+  gb->width = width;
+  gb->height = height;
+  gb->samples = samples;
+  gb->data = (gbuffer_sample *)malloc((size_t)width * height * samples *
+                                      sizeof(gbuffer_sample));
+  if (gb->data == NULL) {
+    printf("Couldn't allocate G-buffer.\n");
+    exit(1);
+  }
+  return gb;
+}
+
+void gbuffer_destroy(gbuffer *gb)
+{
+  free(gb->data);
+  free(gb);
+}
+
+int gbuffer_save(gbuffer const *gb, char const *filename)
+{
+  gbuffer_header h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, GBUFFER_MAGIC, sizeof(h.magic));
+  h.byte_order = GBUFFER_BYTE_ORDER;
+  h.sample_size = sizeof(gbuffer_sample);
+  h.width = gb->width;
+  h.height = gb->height;
+  h.samples = gb->samples;
+
+  FILE *fp = fopen(filename, "wb");
+  if (!fp) {
+    fprintf(stderr, "Couldn't open %s for writing.\n", filename);
+    return -1;
+  }
+  size_t count = (size_t)gb->width * gb->height * gb->samples;
+  int err = fwrite(&h, sizeof(h), 1, fp) == 1 ? 0 : -1;
+  if (!err && count > 0) {
+    err = fwrite(gb->data, sizeof(gbuffer_sample), count, fp) == count
+      ? 0 : -1;
+  }
+  if (fclose(fp) != 0) {
+    err = -1;
+  }
+  if (err) {
+    fprintf(stderr, "Error writing %s.\n", filename);
+  }
+  return err;
+}
+
+gbuffer *gbuffer_load(char const *filename)
+{
+  FILE *fp = fopen(filename, "rb");
+  if (!fp) {
+    fprintf(stderr, "Couldn't open %s.\n", filename);
+    return NULL;
+  }
+  gbuffer_header h;
+  if (fread(&h, sizeof(h), 1, fp) != 1 ||
+      memcmp(h.magic, GBUFFER_MAGIC, sizeof(h.magic)) != 0) {
+    fprintf(stderr, "%s is not a G-buffer.\n", filename);
+    fclose(fp);
+    return NULL;
+  }
+  if (h.byte_order != GBUFFER_BYTE_ORDER ||
+      h.sample_size != sizeof(gbuffer_sample)) {
+    fprintf(stderr, "%s was written on a different kind of machine.\n",
+            filename);
+    fclose(fp);
+    return NULL;
+  }
+  if (h.width <= 0 || h.height <= 0 || h.samples <= 0) {
+    fprintf(stderr, "%s is corrupt.\n", filename);
+    fclose(fp);
+    return NULL;
+  }
+
+  gbuffer *gb = gbuffer_create(h.width, h.height, h.samples);
+  size_t count = (size_t)h.width * h.height * h.samples;
+  if (fread(gb->data, sizeof(gbuffer_sample), count, fp) != count) {
+    fprintf(stderr, "%s is truncated.\n", filename);
+    fclose(fp);
+    gbuffer_destroy(gb);
+    return NULL;
+  }
+  fclose(fp);
+  return gb;
+}
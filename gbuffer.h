@@ -0,0 +1,81 @@
+/*
+ * gbuffer.h: Saved camera ray hits, for re-shading.
+ *
+ * Everything about a camera ray up to its first hit depends only on
+ * the camera, the geometry and the random numbers, so a render can
+ * keep it, and a later render of the same view with different lights
+ * or surface colours can start each sample from there.
+ *
+ * (C) Copyright Simon Frankau 1999-2014
+ */
+
+#ifndef GBUFFER_H_INCLUDED
+#define GBUFFER_H_INCLUDED
+
+#include <stdint.h>
+
+#include "tracer.h"
+
+/* ------------------------------------------------------------------
+ * Data types
+ */
+
+/* A camera ray's first hit, as texture() needs it. */
+typedef struct {
+  /* Where it hit, the normal there, and the ray's direction and
+   * length.
+   */
+  vector w;
+  vector normal;
+  vector dir;
+  double dist;
+  /* Where light passing through comes out, and which way. */
+  vector trans_w;
+  vector trans_dir;
+  double trans_dist;
+  /* The random number state just after the hit, so that the rest of
+   * the sample uses the same numbers as it would have.
+   */
+  uint64_t rand_state;
+  /* The surface hit, or -1 for a miss. Surfaces are numbered through
+   * the spheres, the group spheres, the two of each checkerboard, then
+   * the two of each material, so that the number means the same in an
+   * edited copy of the scene.
+   */
+  int surface;
+} gbuffer_sample;
+
+/* The samples of each pixel are together, in scanline order. */
+typedef struct gbuffer_t {
+  int width;
+  int height;
+  int samples;
+  gbuffer_sample *data;
+} gbuffer;
+
+/* ------------------------------------------------------------------
+ * Exported functions
+ */
+
+/* Make a G-buffer with room for 'samples' samples per pixel. */
+gbuffer *gbuffer_create(int width, int height, int samples);
+
+void gbuffer_destroy(gbuffer *gb);
+
+/* Find the samples of a pixel. */
+static inline gbuffer_sample *gbuffer_pixel(gbuffer *gb, int x, int y)
+{
+  return gb->data + ((size_t)y * gb->width + x) * gb->samples;
+}
+
+/* Write a G-buffer out. Like scene files, these are native-endian.
+ * Returns 0 on success.
+ */
+int gbuffer_save(gbuffer const *gb, char const *filename);
+
+/* Read a G-buffer back in. Returns NULL (having printed why) on
+ * failure.
+ */
+gbuffer *gbuffer_load(char const *filename);
+
+#endif // GBUFFER_H_INCLUDED
@@ -0,0 +1,172 @@
+/*
+ * image_file.c: Read and write images in simple non-PNG formats.
+ *
+ * (C) Copyright Simon Frankau 1999-2014
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "image_file.h"
+#include "png_render.h"
+
+int ppm_save(int width, int height, colour const *image, char const *file)
+{
+  unsigned char *bytes = (unsigned char *)malloc(width * height * 3);
+  convert_image(width, height, image, width, bytes);
+
+  FILE *fp = fopen(file, "wb");
+  if (!fp) {
+    free(bytes);
+    return -1;
+  }
+  fprintf(fp, "P6\n%d %d\n255\n", width, height);
+  size_t size = (size_t)width * height * 3;
+  int err = fwrite(bytes, 1, size, fp) == size ? 0 : -1;
+  if (fclose(fp) != 0) {
+    err = -1;
+  }
+  free(bytes);
+  return err;
+}
+
+static int little_endian(void)
+{
+  unsigned int one = 1;
+  return *(unsigned char *)&one == 1;
+}
+
+int pfm_save(int width, int height, colour const *image, char const *file)
+{
+  FILE *fp = fopen(file, "wb");
+  if (!fp) {
+    return -1;
+  }
+  /* Negative scale means little-endian. PFM stores rows bottom-up. */
+  fprintf(fp, "PF\n%d %d\n%s\n", width, height,
+          little_endian() ? "-1.0" : "1.0");
+
+  float *row = (float *)malloc(width * 3 * sizeof(float));
+  int err = 0;
+  int x, y;
+  for (y = height - 1; y >= 0 && !err; y--) {
+    for (x = 0; x < width; x++) {
+      colour const *c = image + y * width + x;
+      row[x * 3 + 0] = c->r;
+      row[x * 3 + 1] = c->g;
+      row[x * 3 + 2] = c->b;
+    }
+    if (fwrite(row, sizeof(float), width * 3, fp) != (size_t)width * 3) {
+      err = -1;
+    }
+  }
+  free(row);
+  if (fclose(fp) != 0) {
+    err = -1;
+  }
+  return err;
+}
+
+int cost_save(int width, int height, render_cost const *cost,
+              char const *file)
+{
+  float const *buffers[4] = { cost->time, cost->rays, cost->casts,
+                              cost->shades };
+  static char const *const names[4] = { "time", "rays", "casts", "shades" };
+  FILE *fp = fopen(file, "wb");
+  if (!fp) {
+    return -1;
+  }
+  fprintf(fp, "COST\n%d %d\n", width, height);
+  int i, n = 0;
+  for (i = 0; i < 4; i++) {
+    if (buffers[i]) {
+      fprintf(fp, n++ ? " %s" : "%s", names[i]);
+    }
+  }
+  fprintf(fp, "\n");
+
+  float *row = (float *)malloc(width * 4 * sizeof(float));
+  int err = 0;
+  int x, y;
+  for (y = 0; y < height && !err; y++) {
+    float *p = row;
+    for (x = 0; x < width; x++) {
+      for (i = 0; i < 4; i++) {
+        if (buffers[i]) {
+          *p++ = buffers[i][y * width + x];
+        }
+      }
+    }
+    if (fwrite(row, sizeof(float), p - row, fp) != (size_t)(p - row)) {
+      err = -1;
+    }
+  }
+  free(row);
+  if (fclose(fp) != 0) {
+    err = -1;
+  }
+  return err;
+}
+
+colour *pfm_load(char const *file, int *width, int *height)
+{
+  FILE *fp = fopen(file, "rb");
+  if (!fp) {
+    return NULL;
+  }
+  char magic[3];
+  double scale;
+  if (fscanf(fp, "%2s %d %d %lf", magic, width, height, &scale) != 4 ||
+      strcmp(magic, "PF") != 0 || *width <= 0 || *height <= 0 ||
+      (scale < 0.0) != little_endian() || fgetc(fp) == EOF) {
+    fclose(fp);
+    return NULL;
+  }
+
+  colour *image = (colour *)malloc(*width * *height * sizeof(colour));
+  float *row = (float *)malloc(*width * 3 * sizeof(float));
+  int x, y;
+  for (y = *height - 1; y >= 0; y--) {
+    if (fread(row, sizeof(float), *width * 3, fp) != (size_t)*width * 3) {
+      free(image);
+      image = NULL;
+      break;
+    }
+    for (x = 0; x < *width; x++) {
+      colour *c = image + y * *width + x;
+      c->r = row[x * 3 + 0];
+      c->g = row[x * 3 + 1];
+      c->b = row[x * 3 + 2];
+    }
+  }
+  free(row);
+  fclose(fp);
+  return image;
+}
+
+int pfm_merge(char const *file_in, char const *file_out,
+              int x, int y, int crop_width, int crop_height,
+              colour const *crop)
+{
+  int width, height;
+  colour *image = pfm_load(file_in, &width, &height);
+  if (!image) {
+    printf("Couldn't read %s.\n", file_in);
+    return -1;
+  }
+  if (x < 0 || y < 0 || x + crop_width > width || y + crop_height > height) {
+    printf("Crop doesn't fit in %s.\n", file_in);
+    free(image);
+    return -1;
+  }
+  int i;
+  for (i = 0; i < crop_height; i++) {
+    memcpy(image + (y + i) * width + x, crop + i * crop_width,
+           crop_width * sizeof(colour));
+  }
+  int err = pfm_save(width, height, image, file_out);
+  free(image);
+  return err;
+}
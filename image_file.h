@@ -0,0 +1,43 @@
+/*
+ * image_file.h: Read and write images in simple non-PNG formats.
+ *
+ * (C) Copyright Simon Frankau 1999-2014
+ */
+
+#ifndef IMAGE_FILE_H_INCLUDED
+#define IMAGE_FILE_H_INCLUDED
+
+#include "tracer.h"
+
+/* 8-bit binary PPM, scaled like the PNG output. Returns 0 on success. */
+int ppm_save(int width, int height, colour const *image, char const *file);
+
+/* Unscaled floating-point PFM, for further processing. Returns 0 on
+ * success.
+ */
+int pfm_save(int width, int height, colour const *image, char const *file);
+
+/* Per-pixel costs, raw: a text header like PFM's,
+ *
+ *   COST
+ *   width height
+ *   time rays casts shades
+ *
+ * then for each pixel, in scanline order from the top, a native-endian
+ * float for each name on the third line. Buffers that are NULL are
+ * left out. Returns 0 on success.
+ */
+int cost_save(int width, int height, render_cost const *cost,
+              char const *file);
+
+/* Read a PFM written by pfm_save. Returns NULL on failure. */
+colour *pfm_load(char const *file, int *width, int *height);
+
+/* Paste a crop at (x, y) into an existing PFM, which acts as a
+ * checkpoint of the full image. Returns 0 on success.
+ */
+int pfm_merge(char const *file_in, char const *file_out,
+              int x, int y, int crop_width, int crop_height,
+              colour const *crop);
+
+#endif // IMAGE_FILE_H_INCLUDED
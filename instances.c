@@ -0,0 +1,169 @@
+/*
+ * instances.c: Instancing demo
+ *
+ * A field of sphere clusters. Only two clusters are actually stored;
+ * everything else is a scaled and moved copy of one of them.
+ *
+ * (C) Copyright Simon Frankau 1999-2014
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "arena.h"
+#include "tracer.h"
+#include "png_render.h"
+#include "scene_file.h"
+
+#define WIDTH 1024
+#define HEIGHT 512
+
+/* Copies across and into the distance. */
+#define ACROSS 40
+#define DEEP 40
+
+static light lights[] = {
+  {{10.0, 20.0, -5.0}, {1.0, 1.0, 1.0}, {0.0, 0.0, 0.0}, {0.0, 0.0, 0.0}},
+};
+static int num_lights = 1;
+
+static checkerboard checkerboards;
+
+static void set_surface(surface *s, double r, double g, double b, double shine)
+{
+  s->diffuse.r = r;
+  s->diffuse.g = g;
+  s->diffuse.b = b;
+
+  s->specular.r
+    = s->specular.g
+    = s->specular.b
+    = shine;
+
+  s->reflective.r
+    = s->reflective.g
+    = s->reflective.b
+    = shine;
+
+  s->transparency.r
+    = s->transparency.g
+    = s->transparency.b
+    = 0.0;
+
+  s->refractive_index = 1.0;
+}
+
+static void set_sphere(sphere *sp, double x, double y, double z, double radius,
+                       colour c)
+{
+  sp->center.x = x;
+  sp->center.y = y;
+  sp->center.z = z;
+  sp->radius = radius;
+  set_surface(&sp->props, c.r, c.g, c.b, 0.3);
+  sp->fuzz_size = 0.0;
+  sp->fuzz_style = none;
+}
+
+static scene *make_scene(arena *a)
+{
+  /* Place the checkerboard */
+  checkerboards.normal.x = 0.0;
+  checkerboards.normal.y = 1.0;
+  checkerboards.normal.z = 0.0;
+  checkerboards.distance = -2.0;
+  set_surface(&checkerboards.p1, 0.9, 0.9, 0.9, 0.0);
+  set_surface(&checkerboards.p2, 0.1, 0.1, 0.1, 0.0);
+  int num_checkerboards = 1;
+
+  /* Two groups, both sitting on y = -1 and within a unit of the
+   * origin: a bunch of grapes, and a ring of beads.
+   */
+  int num_grapes = 30;
+  int num_beads = 12;
+  int num_group_spheres = num_grapes + num_beads;
+  sphere *group_spheres =
+    (sphere *)arena_alloc(a, num_group_spheres * sizeof(sphere));
+
+  int i, j;
+  for (i = 0; i < num_grapes; i++) {
+    /* A cone of grapes, widest at the top. */
+    double y = -0.8 + 1.6 * i / num_grapes;
+    double r = 0.2 + 0.6 * (y + 0.8) / 1.6;
+    double theta = 2.4 * i;
+    set_sphere(group_spheres + i, r * cos(theta), y, r * sin(theta), 0.2,
+               colour_phase(0.75 + 0.1 * i / num_grapes));
+  }
+  for (i = 0; i < num_beads; i++) {
+    double theta = 2.0 * M_PI * i / num_beads;
+    set_sphere(group_spheres + num_grapes + i,
+               0.8 * cos(theta), -0.8, 0.8 * sin(theta), 0.2,
+               colour_phase((double)i / num_beads));
+  }
+
+  int num_groups = 2;
+  sphere_group *groups =
+    (sphere_group *)arena_alloc(a, num_groups * sizeof(sphere_group));
+  groups[0].first = 0;
+  groups[0].count = num_grapes;
+  groups[1].first = num_grapes;
+  groups[1].count = num_beads;
+
+  /* Lay the copies out in a grid on the checkerboard. */
+  int num_instances = ACROSS * DEEP;
+  instance *instances =
+    (instance *)arena_alloc(a, num_instances * sizeof(instance));
+  for (j = 0; j < DEEP; j++) {
+    for (i = 0; i < ACROSS; i++) {
+      instance *inst = instances + j * ACROSS + i;
+      inst->group = (i + j) % num_groups;
+      inst->scale = 0.5 + 0.5 * rand() / RAND_MAX;
+      inst->offset.x = 2.5 * (i - ACROSS / 2);
+      inst->offset.y = checkerboards.distance + inst->scale;
+      inst->offset.z = 4.0 + 2.5 * j;
+    }
+  }
+
+ scene *result = (scene *)arena_calloc(a, 1, sizeof(scene));
+ result->checkerboards = &checkerboards;
+ result->num_checkerboards = num_checkerboards;
+ result->lights = lights;
+ result->num_lights = num_lights;
+ result->group_spheres = group_spheres;
+ result->num_group_spheres = num_group_spheres;
+ result->groups = groups;
+ result->num_groups = num_groups;
+ result->instances = instances;
+ result->num_instances = num_instances;
+ result->light_samples = 0;
+ result->light_table = NULL;
+ result->instance_accel = NULL;
+
+ result->num_samples    = 4;
+ result->max_depth      = DEPTH_UNSET;
+ result->rr_depth       = DEPTH_UNSET;
+ result->blur_size      = 0.0;
+ result->antialias_size = 0.5;
+ result->focal_depth    = 0.0;
+ result->callback       = NULL;
+ result->arena          = a;
+
+ return result;
+}
+
+/* With a filename argument, save the scene there rather than
+ * rendering it.
+ */
+int main(int argc, char **argv) {
+  arena *scene_arena = arena_create(0);
+  scene *sc = make_scene(scene_arena);
+  int err = 0;
+  if (argc > 1) {
+    err = scene_file_save(sc, WIDTH, HEIGHT, argv[1]) ? 1 : 0;
+  } else {
+    png_render(sc, WIDTH, HEIGHT, "instances.png");
+  }
+  arena_destroy(scene_arena);
+  return err;
+}
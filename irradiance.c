@@ -0,0 +1,223 @@
+/*
+ * irradiance.c: Irradiance caching, for ambient light.
+ *
+ * (C) Copyright Simon Frankau 1999-2014
+ */
+
+#include <math.h>
+#include <stdlib.h>
+
+#include "arena.h"
+#include "irradiance.h"
+
+/* ------------------------------------------------------------------
+ * Macros
+ */
+
+/* Stop splitting nodes this deep, however small the estimates. */
+#define MAX_OCTREE_DEPTH 24
+
+/* An estimate is ignored at points this far in front of it, as a
+ * fraction of its distance, as it can't see what lights them.
+ */
+#define IN_FRONT_LIMIT 0.05
+
+/* ------------------------------------------------------------------
+ * Data types
+ */
+
+/* A cube of space, 'half' from its centre to each face. Estimates are
+ * kept in the smallest node that holds their centre and is at least
+ * as big as the region they cover, so those that cover a point are in
+ * nodes which, grown by their size, hold it.
+ */
+typedef struct octree_node_t {
+  vector centre;
+  double half;
+  struct octree_node_t *children[8];
+  irradiance_record *records;
+} octree_node;
+
+struct irradiance_cache_t {
+  double accuracy;
+  octree_node *root;
+  int size;
+  arena *arena;
+};
+
+/* ------------------------------------------------------------------
+ * Functions
+ */
+
+irradiance_cache *irradiance_cache_create(double accuracy)
+{
+  arena *a = arena_create(0);
+  irradiance_cache *c = (irradiance_cache *)arena_calloc(a, 1,
+                                                         sizeof(*c));
+  c->accuracy = accuracy;
+  c->arena = a;
+  return c;
+}
+
+void irradiance_cache_destroy(irradiance_cache *c)
+{
+  /* The cache lives in its own arena. */
+  arena_destroy(c->arena);
+}
+
+int irradiance_cache_size(irradiance_cache const *c)
+{
+  return c->size;
+}
+
+static octree_node *node_create(irradiance_cache *c, vector centre,
+                                double half)
+{
+  octree_node *node = (octree_node *)arena_calloc(c->arena, 1,
+                                                  sizeof(octree_node));
+  node->centre = centre;
+  node->half = half;
+  return node;
+}
+
+/* Which child of 'node' holds 'w'. */
+static int child_index(octree_node const *node, vector w)
+{
+  return (w.x >= node->centre.x ? 1 : 0) |
+         (w.y >= node->centre.y ? 2 : 0) |
+         (w.z >= node->centre.z ? 4 : 0);
+}
+
+static int node_holds(octree_node const *node, vector w, double margin)
+{
+  double size = node->half + margin;
+  return fabs(w.x - node->centre.x) <= size &&
+         fabs(w.y - node->centre.y) <= size &&
+         fabs(w.z - node->centre.z) <= size;
+}
+
+/* Make the root big enough to hold a region 'radius' around 'w', by
+ * making it the child of a root twice the size until it is.
+ */
+static void grow_root(irradiance_cache *c, vector w, double radius)
+{
+  if (c->root == NULL) {
+    c->root = node_create(c, w, radius);
+    return;
+  }
+  while (!node_holds(c->root, w, 0.0) || c->root->half < radius) {
+    octree_node *old = c->root;
+    vector centre = old->centre;
+    centre.x += w.x >= centre.x ? old->half : -old->half;
+    centre.y += w.y >= centre.y ? old->half : -old->half;
+    centre.z += w.z >= centre.z ? old->half : -old->half;
+    c->root = node_create(c, centre, 2.0 * old->half);
+    c->root->children[child_index(c->root, old->centre)] = old;
+  }
+}
+
+void irradiance_cache_insert(irradiance_cache *c,
+                             irradiance_record const *r)
+{
+  double radius = c->accuracy * r->dist;
+  grow_root(c, r->w, radius);
+
+  octree_node *node = c->root;
+  int depth;
+  for (depth = 0; depth < MAX_OCTREE_DEPTH && node->half * 0.5 >= radius;
+       depth++) {
+    int i = child_index(node, r->w);
+    if (node->children[i] == NULL) {
+      double q = node->half * 0.5;
+      vector centre = node->centre;
+      centre.x += i & 1 ? q : -q;
+      centre.y += i & 2 ? q : -q;
+      centre.z += i & 4 ? q : -q;
+      node->children[i] = node_create(c, centre, q);
+    }
+    node = node->children[i];
+  }
+
+  irradiance_record *copy =
+    (irradiance_record *)arena_alloc(c->arena, sizeof(irradiance_record));
+  *copy = *r;
+  copy->next = node->records;
+  node->records = copy;
+  c->size++;
+}
+
+typedef struct {
+  vector w;
+  vector n;
+  /* Estimates weighted below this are no use. */
+  double min_weight;
+  double slack;
+  colour sum;
+  double total_weight;
+} irradiance_search;
+
+static void search_node(octree_node const *node, irradiance_search *s)
+{
+  irradiance_record const *r;
+  for (r = node->records; r != NULL; r = r->next) {
+    vector d = s->w;
+    SUB(d, r->w);
+    double dist = sqrt(DOT(d, d));
+    double cos_n = DOT(s->n, r->n);
+    double turn = cos_n < 1.0 ? sqrt(1.0 - cos_n) : 0.0;
+    double error = dist / r->dist + turn;
+    if (error * s->min_weight >= 1.0) {
+      continue;
+    }
+    vector mean_n = s->n;
+    ADD(mean_n, r->n);
+    if (DOT(d, mean_n) * 0.5 < -IN_FRONT_LIMIT * r->dist) {
+      continue;
+    }
+    double weight = error > 0.0 ? 1.0 / error : 1.0e10;
+
+    /* Extrapolate to the point, by the gradients. */
+    vector axis;
+    axis.x = r->n.y * s->n.z - r->n.z * s->n.y;
+    axis.y = r->n.z * s->n.x - r->n.x * s->n.z;
+    axis.z = r->n.x * s->n.y - r->n.y * s->n.x;
+    double er = r->e.r + DOT(axis, r->rot_grad[0]) + DOT(d, r->trans_grad[0]);
+    double eg = r->e.g + DOT(axis, r->rot_grad[1]) + DOT(d, r->trans_grad[1]);
+    double eb = r->e.b + DOT(axis, r->rot_grad[2]) + DOT(d, r->trans_grad[2]);
+    s->sum.r += weight * (er > 0.0 ? er : 0.0);
+    s->sum.g += weight * (eg > 0.0 ? eg : 0.0);
+    s->sum.b += weight * (eb > 0.0 ? eb : 0.0);
+    s->total_weight += weight;
+  }
+
+  int i;
+  for (i = 0; i < 8; i++) {
+    octree_node const *child = node->children[i];
+    if (child != NULL && node_holds(child, s->w, s->slack * child->half)) {
+      search_node(child, s);
+    }
+  }
+}
+
+int irradiance_cache_lookup(irradiance_cache const *c, vector w, vector n,
+                            double slack, colour *e)
+{
+  if (c->root == NULL) {
+    return 0;
+  }
+  irradiance_search s;
+  s.w = w;
+  s.n = n;
+  s.min_weight = 1.0 / (c->accuracy * slack);
+  s.slack = slack;
+  s.sum.r = s.sum.g = s.sum.b = 0.0;
+  s.total_weight = 0.0;
+  search_node(c->root, &s);
+  if (s.total_weight <= 0.0) {
+    return 0;
+  }
+  e->r = s.sum.r / s.total_weight;
+  e->g = s.sum.g / s.total_weight;
+  e->b = s.sum.b / s.total_weight;
+  return 1;
+}
@@ -0,0 +1,68 @@
+/*
+ * irradiance.h: Irradiance caching, for ambient light.
+ *
+ * Light bounced in from all around changes slowly over a diffuse
+ * surface, so rather than firing a hemisphere of rays at every point
+ * shaded, estimates are made at scattered points and interpolated
+ * between. Each estimate carries the harmonic mean distance to what
+ * its rays hit, which says how far it can be trusted, and gradients
+ * for how it changes as the point moves and the normal turns (Ward and
+ * Heckbert's). Estimates are found through a loose octree, each in
+ * the smallest node at least as big as the region it covers.
+ *
+ * (C) Copyright Simon Frankau 1999-2014
+ */
+
+#ifndef IRRADIANCE_H_INCLUDED
+#define IRRADIANCE_H_INCLUDED
+
+#include "tracer.h"
+
+/* ------------------------------------------------------------------
+ * Data types
+ */
+
+/* One estimate of the light falling on a surface. */
+typedef struct irradiance_record_t {
+  vector w;
+  vector n;
+  colour e;
+  /* Harmonic mean distance to the surfaces seen from here. */
+  double dist;
+  /* Per channel: how the light changes as the normal rotates, and as
+   * the point moves.
+   */
+  vector rot_grad[3];
+  vector trans_grad[3];
+  struct irradiance_record_t *next;
+} irradiance_record;
+
+typedef struct irradiance_cache_t irradiance_cache;
+
+/* ------------------------------------------------------------------
+ * Exported functions
+ */
+
+/* Make an empty cache. 'accuracy' is the largest error allowed, as a
+ * fraction, before an estimate is no longer used.
+ */
+irradiance_cache *irradiance_cache_create(double accuracy);
+
+void irradiance_cache_destroy(irradiance_cache *c);
+
+/* Estimates in the cache. */
+int irradiance_cache_size(irradiance_cache const *c);
+
+/* Interpolate the light falling on the front of a surface at 'w' with
+ * normal 'n', from estimates valid there, allowing 'slack' times the
+ * cache's accuracy. Returns 0, leaving 'e' alone, if there are none.
+ * Safe to call from many threads, as long as none are inserting.
+ */
+int irradiance_cache_lookup(irradiance_cache const *c, vector w, vector n,
+                            double slack, colour *e);
+
+/* Add a copy of an estimate. */
+void irradiance_cache_insert(irradiance_cache *c,
+                             irradiance_record const *r);
+
+#endif // IRRADIANCE_H_INCLUDED
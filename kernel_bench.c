@@ -0,0 +1,396 @@
+/*
+ * kernel_bench.c: Time the tracer's inner kernels one at a time
+ *
+ * Each kernel is run over an array of inputs made up front from a
+ * scene: camera rays, the spheres and planes they're tested against,
+ * hit points for refraction, and an image to convert. The static
+ * kernels are got at by including tracer.c whole. Runs are repeated,
+ * pinned to one CPU, and the median, best and spread reported, so
+ * that a change to a kernel can be measured against run-to-run noise.
+ *
+ *   kernel_bench [-c cpu] [-r runs] [-k kernel] [scene-file]
+ *
+ * Without a scene file, uses a row of spheres on a plane, like 'dof'.
+ *
+ * (C) Copyright Simon Frankau 1999-2014
+ */
+
+#include "tracer.c"
+
+#include "png_render.h"
+#include "scene_file.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/* ------------------------------------------------------------------
+ * Macros
+ */
+
+/* Inputs per kernel. Small enough to stay in cache, so the kernels
+ * are timed rather than memory.
+ */
+#define BENCH_OPS (1 << 16)
+
+/* Each timed run goes over the inputs enough times to take at least
+ * this long.
+ */
+#define BENCH_MIN_SECONDS 0.01
+
+#define DEFAULT_RUNS 15
+#define MAX_RUNS 1000
+
+/* Width of the image convert_image is timed on. */
+#define BENCH_IMAGE_WIDTH 512
+
+/* ------------------------------------------------------------------
+ * Data types
+ */
+
+typedef struct {
+  /* Camera rays, and the sphere and plane each is tested against. */
+  vector from[BENCH_OPS];
+  vector dir[BENCH_OPS];
+  sphere const *sp[BENCH_OPS];
+  checkerboard const *pl[BENCH_OPS];
+  /* Where rays aimed at spheres enter them, and the inward normal
+   * there.
+   */
+  sphere const *hit_sp[BENCH_OPS];
+  vector hit_w[BENCH_OPS];
+  vector hit_dir[BENCH_OPS];
+  vector hit_n[BENCH_OPS];
+  double phase[BENCH_OPS];
+  colour image[BENCH_OPS];
+  /* Results, so that the work can't be optimised away. */
+  double out_d[BENCH_OPS];
+  vector out_v[BENCH_OPS];
+  vector out_v2[BENCH_OPS];
+  colour out_c[BENCH_OPS];
+  unsigned char out_image[BENCH_OPS * 3];
+  worker_state ws;
+} bench_data;
+
+typedef struct {
+  char const *name;
+  void (*run)(bench_data *b);
+} bench_kernel;
+
+/* ------------------------------------------------------------------
+ * Kernels
+ */
+
+static void bench_sphere_intersect(bench_data *b)
+{
+  int i;
+  for (i = 0; i < BENCH_OPS; i++) {
+    b->out_d[i] = sphere_intersect(b->sp[i], b->from[i], b->dir[i]);
+  }
+}
+
+static void bench_plane_intersect(bench_data *b)
+{
+  int i;
+  for (i = 0; i < BENCH_OPS; i++) {
+    b->out_d[i] = plane_intersect(b->pl[i], b->from[i], b->dir[i]);
+  }
+}
+
+static void bench_refract(bench_data *b)
+{
+  int i;
+  for (i = 0; i < BENCH_OPS; i++) {
+    b->out_v[i] = refract(b->hit_dir[i], b->hit_n[i],
+                          b->hit_sp[i]->props.refractive_index);
+  }
+}
+
+static void bench_sphere_transmit(bench_data *b)
+{
+  int i;
+  for (i = 0; i < BENCH_OPS; i++) {
+    sphere_transmit(b->hit_sp[i], b->hit_w[i], b->hit_dir[i],
+                    b->out_v + i, b->out_v2 + i, b->out_d + i);
+  }
+}
+
+static void bench_random_vector(bench_data *b)
+{
+  int i;
+  for (i = 0; i < BENCH_OPS; i++) {
+    b->out_v[i] = random_vector(&b->ws);
+  }
+}
+
+static void bench_noise_xy(bench_data *b)
+{
+  int i;
+  for (i = 0; i < BENCH_OPS; i++) {
+    b->out_v[i] = noise_xy(&b->ws, 0.5);
+  }
+}
+
+static void bench_colour_phase(bench_data *b)
+{
+  int i;
+  for (i = 0; i < BENCH_OPS; i++) {
+    b->out_c[i] = colour_phase(b->phase[i]);
+  }
+}
+
+/* One op per pixel. */
+static void bench_convert_image(bench_data *b)
+{
+  convert_image(BENCH_IMAGE_WIDTH, BENCH_OPS / BENCH_IMAGE_WIDTH, b->image,
+                BENCH_IMAGE_WIDTH, b->out_image);
+}
+
+static bench_kernel const kernels[] = {
+  { "sphere_intersect", bench_sphere_intersect },
+  { "plane_intersect", bench_plane_intersect },
+  { "refract", bench_refract },
+  { "sphere_transmit", bench_sphere_transmit },
+  { "random_vector", bench_random_vector },
+  { "noise_xy", bench_noise_xy },
+  { "colour_phase", bench_colour_phase },
+  { "convert_image", bench_convert_image },
+};
+
+/* ------------------------------------------------------------------
+ * Inputs
+ */
+
+static double uniform(worker_state *ws, double lo, double hi)
+{
+  return lo + (hi - lo) * tracer_rand(ws) / TRACER_RAND_MAX;
+}
+
+/* Spheres and planes like dof's, for when there's no scene file. */
+static void default_scene(scene *sc)
+{
+  static sphere spheres[5];
+  static checkerboard plane;
+  int i;
+  memset(spheres, 0, sizeof(spheres));
+  for (i = 0; i < 5; i++) {
+    spheres[i].center.x = -3.0 + 1.5 * i;
+    spheres[i].center.y = -1.0;
+    spheres[i].center.z = 5.0 + 3.0 * i;
+    spheres[i].radius = 1.0;
+  }
+  memset(&plane, 0, sizeof(plane));
+  plane.normal.y = 1.0;
+  plane.distance = -2.0;
+  memset(sc, 0, sizeof(*sc));
+  sc->spheres = spheres;
+  sc->num_spheres = 5;
+  sc->checkerboards = &plane;
+  sc->num_checkerboards = 1;
+}
+
+static void make_inputs(bench_data *b, scene const *sc, int width,
+                        int height)
+{
+  worker_state *ws = &b->ws;
+  memset(ws, 0, sizeof(*ws));
+  tracer_srand(ws, 1);
+
+  /* Spheres that refract. Like trans's, their index is the ratio of
+   * sines going in, so below 1.
+   */
+  sphere *glass = (sphere *)malloc(sc->num_spheres * sizeof(sphere));
+  memcpy(glass, sc->spheres, sc->num_spheres * sizeof(sphere));
+  int i;
+  for (i = 0; i < sc->num_spheres; i++) {
+    if (glass[i].props.refractive_index >= 1.0 ||
+        glass[i].props.refractive_index <= 0.0) {
+      glass[i].props.refractive_index = 0.75;
+    }
+  }
+
+  vector origin = { 0.0, 0.0, 0.0 };
+  for (i = 0; i < BENCH_OPS; i++) {
+    /* Camera rays through random points of the image, as render_pixel
+     * makes them.
+     */
+    vector ray;
+    ray.x = uniform(ws, 0.0, width) - width/2;
+    ray.y = height/2 - uniform(ws, 0.0, height);
+    ray.z = width/2;
+    NORMALISE(ray);
+    b->from[i] = origin;
+    b->dir[i] = ray;
+    b->sp[i] = sc->spheres + tracer_rand(ws) % sc->num_spheres;
+    b->pl[i] = sc->checkerboards + tracer_rand(ws) % sc->num_checkerboards;
+
+    /* Rays aimed inside a sphere, which must hit it. */
+    sphere const *sp = glass + tracer_rand(ws) % sc->num_spheres;
+    vector aim = random_vector(ws);
+    MULT(aim, 0.9 * sp->radius);
+    ADD(aim, sp->center);
+    NORMALISE(aim);
+    double dist = sphere_intersect(sp, origin, aim);
+    vector w = aim;
+    MULT(w, dist);
+    vector n = sp->center;
+    SUB(n, w);
+    NORMALISE(n);
+    b->hit_sp[i] = sp;
+    b->hit_w[i] = w;
+    b->hit_dir[i] = aim;
+    b->hit_n[i] = n;
+
+    b->phase[i] = uniform(ws, 0.0, 1.0);
+
+    /* Rendered images are mostly dim, with a few bright highlights. */
+    double level = -log(uniform(ws, 1e-6, 1.0));
+    b->image[i].r = level * uniform(ws, 0.5, 1.0);
+    b->image[i].g = level * uniform(ws, 0.5, 1.0);
+    b->image[i].b = level * uniform(ws, 0.5, 1.0);
+  }
+}
+
+/* ------------------------------------------------------------------
+ * Timing
+ */
+
+static double bench_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Time stamp counter ticks. On current x86s these go at a fixed rate
+ * rather than the core's clock, so turbo makes cycles/op look small.
+ */
+static uint64_t bench_ticks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return 0;
+#endif
+}
+
+static int compare_doubles(void const *a, void const *b)
+{
+  double x = *(double const *)a;
+  double y = *(double const *)b;
+  return x < y ? -1 : x > y;
+}
+
+static void bench_run(bench_kernel const *k, bench_data *b, int runs)
+{
+  /* Warm up, and see how many passes over the inputs make a run long
+   * enough to time.
+   */
+  double t0 = bench_now();
+  k->run(b);
+  double once = bench_now() - t0;
+  int passes = once > 0.0 ? (int)(BENCH_MIN_SECONDS / once) + 1 : 1000;
+
+  double ns[MAX_RUNS];
+  double cycles[MAX_RUNS];
+  int r, p;
+  for (r = 0; r < runs; r++) {
+    double start = bench_now();
+    uint64_t ticks = bench_ticks();
+    for (p = 0; p < passes; p++) {
+      k->run(b);
+    }
+    ticks = bench_ticks() - ticks;
+    double ops = (double)passes * BENCH_OPS;
+    ns[r] = (bench_now() - start) * 1e9 / ops;
+    cycles[r] = ticks / ops;
+  }
+  qsort(ns, runs, sizeof(double), compare_doubles);
+  qsort(cycles, runs, sizeof(double), compare_doubles);
+
+  /* Spread as the median absolute deviation, which one descheduled
+   * run doesn't throw.
+   */
+  double median = ns[runs / 2];
+  double dev[MAX_RUNS];
+  for (r = 0; r < runs; r++) {
+    dev[r] = fabs(ns[r] - median);
+  }
+  qsort(dev, runs, sizeof(double), compare_doubles);
+
+  printf("%-17s %8.2f ns/op  ", k->name, median);
+  if (cycles[runs / 2] > 0.0) {
+    printf("%7.1f cycles/op  ", cycles[runs / 2]);
+  } else {
+    printf("    n/a cycles/op  ");
+  }
+  printf("%8.1f Mops/s  best %8.2f  +/-%5.1f%%\n",
+         1e3 / median, ns[0], 100.0 * dev[runs / 2] / median);
+}
+
+static void usage(char const *prog)
+{
+  fprintf(stderr,
+          "Usage: %s [options] [scene-file]\n"
+          "  -c cpu      Pin to this CPU, or -1 not to (default 0)\n"
+          "  -r runs     Timed runs per kernel (default %d)\n"
+          "  -k kernel   Only time this kernel\n",
+          prog, DEFAULT_RUNS);
+  exit(1);
+}
+
+int main(int argc, char **argv)
+{
+  int cpu = 0;
+  int runs = DEFAULT_RUNS;
+  char const *only = NULL;
+  int c;
+  while ((c = getopt(argc, argv, "c:r:k:")) != -1) {
+    switch (c) {
+    case 'c': cpu = atoi(optarg); break;
+    case 'r': runs = atoi(optarg); break;
+    case 'k': only = optarg; break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (optind < argc - 1 || runs < 1 || runs > MAX_RUNS) {
+    usage(argv[0]);
+  }
+
+  scene sc;
+  int width = 1024;
+  int height = 512;
+  scene_file *sf = NULL;
+  if (optind < argc) {
+    sf = scene_file_load(argv[optind]);
+    if (sf == NULL) {
+      return 1;
+    }
+    sc = sf->sc;
+    width = sf->width;
+    height = sf->height;
+  }
+  if (sf == NULL || sc.num_spheres == 0 || sc.num_checkerboards == 0) {
+    default_scene(&sc);
+  }
+
+  if (cpu >= 0 && numa_pin(cpu) != 0) {
+    fprintf(stderr, "Couldn't pin to CPU %d, timing unpinned.\n", cpu);
+  }
+
+  bench_data *b = (bench_data *)malloc(sizeof(bench_data));
+  make_inputs(b, &sc, width, height);
+  printf("%d ops per pass, median of %d runs\n", BENCH_OPS, runs);
+  int i;
+  for (i = 0; i < (int)(sizeof(kernels) / sizeof(kernels[0])); i++) {
+    if (only == NULL || strcmp(only, kernels[i].name) == 0) {
+      bench_run(kernels + i, b, runs);
+    }
+  }
+  free(b);
+  if (sf != NULL) {
+    scene_file_unload(sf);
+  }
+  return 0;
+}
@@ -0,0 +1,570 @@
+/*
+ * mesh.c: Triangle meshes, and a compact tree to trace them.
+ *
+ * Meshes can have millions of triangles, so the tree is built to be
+ * small: a binary tree is built first and then collapsed into nodes
+ * with up to eight children, and each node stores its children's
+ * boxes as 16-bit fractions of its own box. A node is then a few
+ * cache lines holding eight boxes, rather than eight nodes each
+ * holding a box of doubles.
+ *
+ * The ray/triangle test is the watertight one from Woop, Benthin and
+ * Wald, "Watertight Ray/Triangle Intersection", so rays can't slip
+ * through the cracks between neighbouring triangles.
+ *
+ * (C) Copyright Simon Frankau 1999-2014
+ */
+
+#include <float.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "bvh.h"
+#include "mesh.h"
+
+/* ------------------------------------------------------------------
+ * Macros
+ */
+
+#define WIDE 8
+
+/* Largest quantised coordinate. */
+#define QUANT_MAX 65535
+
+/* Room for seven siblings at each level of a deep tree. */
+#define WIDE_STACK_SIZE 256
+
+/* ------------------------------------------------------------------
+ * Data types
+ */
+
+/* A child's box is origin + [lo, hi] * scale along each axis. */
+typedef struct {
+  float origin[3];
+  float scale[3];
+  uint16_t lo[3][WIDE];
+  uint16_t hi[3][WIDE];
+  /* Inner children: node index. Leaves: first entry in the tree's
+   * triangle list.
+   */
+  int32_t child[WIDE];
+  /* Triangles in a leaf, or zero for an inner node. */
+  uint8_t count[WIDE];
+  uint8_t num_children;
+} wide_node;
+
+typedef struct mesh_accel_t {
+  wide_node *nodes;
+  int num_nodes;
+  /* Triangles in leaf order, as absolute vertex indices, and where
+   * each came from in sc->mesh_triangles.
+   */
+  mesh_triangle *tris;
+  int *tri_index;
+  int num_tris;
+} mesh_accel;
+
+typedef struct {
+  bvh const *tree;
+  mesh_accel *acc;
+} wide_builder;
+
+/* A ray, sheared so that it points along z, for the watertight test. */
+typedef struct {
+  double from[3];
+  int kx, ky, kz;
+  double sx, sy, sz;
+} sheared_ray;
+
+/* ------------------------------------------------------------------
+ * Functions
+ */
+
+/* Grow an array for the loader. */
+static void *grow_array(void *array, int *capacity, int count, size_t size)
+{
+  if (count < *capacity) {
+    return array;
+  }
+  *capacity = *capacity ? *capacity * 2 : 1024;
+  array = realloc(array, *capacity * size);
+  if (!array) {
+    printf("Out of memory loading mesh.\n");
+    exit(1);
+  }
+  return array;
+}
+
+/* Turn an OBJ face corner ("7", "7/1", "-2//3") into a zero-based
+ * index, or -1 if it's no good.
+ */
+static int obj_index(char const *token, int num_vertices)
+{
+  long i = strtol(token, NULL, 10);
+  if (i < 0) {
+    i += num_vertices;
+  } else {
+    i -= 1;
+  }
+  return i >= 0 && i < num_vertices ? (int)i : -1;
+}
+
+int mesh_load(scene *sc, char const *filename, double scale, vector offset,
+              int mat)
+{
+  FILE *fp = fopen(filename, "r");
+  if (!fp) {
+    fprintf(stderr, "Couldn't open %s.\n", filename);
+    return -1;
+  }
+
+  mesh_vertex *verts = NULL;
+  mesh_triangle *tris = NULL;
+  int num_verts = 0, verts_cap = 0;
+  int num_tris = 0, tris_cap = 0;
+  int err = 0;
+  char line[1024];
+  while (!err && fgets(line, sizeof(line), fp)) {
+    if (line[0] == 'v' && line[1] == ' ') {
+      double x, y, z;
+      if (sscanf(line + 2, "%lf %lf %lf", &x, &y, &z) != 3) {
+        err = -1;
+        break;
+      }
+      verts = (mesh_vertex *)grow_array(verts, &verts_cap, num_verts,
+                                        sizeof(mesh_vertex));
+      verts[num_verts].x = x * scale + offset.x;
+      verts[num_verts].y = y * scale + offset.y;
+      verts[num_verts].z = z * scale + offset.z;
+      num_verts++;
+    } else if (line[0] == 'f' && line[1] == ' ') {
+      /* Split polygons into a fan of triangles. */
+      int corners = 0, first = -1, prev = -1;
+      char *save;
+      char *token = strtok_r(line + 2, " \t\r\n", &save);
+      for (; token; token = strtok_r(NULL, " \t\r\n", &save)) {
+        int v = obj_index(token, num_verts);
+        if (v < 0) {
+          err = -1;
+          break;
+        }
+        if (corners >= 2) {
+          tris = (mesh_triangle *)grow_array(tris, &tris_cap, num_tris,
+                                             sizeof(mesh_triangle));
+          tris[num_tris].v[0] = first;
+          tris[num_tris].v[1] = prev;
+          tris[num_tris].v[2] = v;
+          num_tris++;
+        }
+        if (corners == 0) {
+          first = v;
+        }
+        prev = v;
+        corners++;
+      }
+    }
+  }
+  fclose(fp);
+  if (err || num_tris == 0) {
+    fprintf(stderr, "%s is not a usable OBJ file.\n", filename);
+    free(verts);
+    free(tris);
+    return -1;
+  }
+
+  /* Copy everything into bigger arrays in the arena. The old ones may
+   * be mapped from a scene file, so are just left be.
+   */
+  arena *a = sc->arena;
+  mesh_vertex *all_verts = (mesh_vertex *)arena_alloc(a,
+    (sc->num_mesh_vertices + num_verts) * sizeof(mesh_vertex));
+  memcpy(all_verts, sc->mesh_vertices,
+         sc->num_mesh_vertices * sizeof(mesh_vertex));
+  memcpy(all_verts + sc->num_mesh_vertices, verts,
+         num_verts * sizeof(mesh_vertex));
+  mesh_triangle *all_tris = (mesh_triangle *)arena_alloc(a,
+    (sc->num_mesh_triangles + num_tris) * sizeof(mesh_triangle));
+  memcpy(all_tris, sc->mesh_triangles,
+         sc->num_mesh_triangles * sizeof(mesh_triangle));
+  memcpy(all_tris + sc->num_mesh_triangles, tris,
+         num_tris * sizeof(mesh_triangle));
+  mesh *meshes = (mesh *)arena_alloc(a, (sc->num_meshes + 1) * sizeof(mesh));
+  memcpy(meshes, sc->meshes, sc->num_meshes * sizeof(mesh));
+  free(verts);
+  free(tris);
+
+  if (mat < 0) {
+    material *materials = (material *)arena_calloc(a, sc->num_materials + 1,
+                                                   sizeof(material));
+    memcpy(materials, sc->materials, sc->num_materials * sizeof(material));
+    material *m = materials + sc->num_materials;
+    m->type = material_plain;
+    m->s1.diffuse.r = m->s1.diffuse.g = m->s1.diffuse.b = 0.7;
+    m->s1.specular.r = m->s1.specular.g = m->s1.specular.b = 0.2;
+    m->s1.refractive_index = 1.0;
+    mat = sc->num_materials;
+    sc->materials = materials;
+    sc->num_materials++;
+  }
+
+  mesh *m = meshes + sc->num_meshes;
+  m->first_vertex = sc->num_mesh_vertices;
+  m->num_vertices = num_verts;
+  m->first_triangle = sc->num_mesh_triangles;
+  m->num_triangles = num_tris;
+  m->material = mat;
+
+  sc->mesh_vertices = all_verts;
+  sc->num_mesh_vertices += num_verts;
+  sc->mesh_triangles = all_tris;
+  sc->num_mesh_triangles += num_tris;
+  sc->meshes = meshes;
+  sc->num_meshes++;
+  sc->mesh_accel = NULL;
+  return 0;
+}
+
+static double axis_of(vector v, int axis)
+{
+  return axis == 0 ? v.x : axis == 1 ? v.y : v.z;
+}
+
+/* Pick the children of a binary node to put in one wide node, by
+ * repeatedly opening up the biggest inner child.
+ */
+static int gather_children(bvh const *tree, int node, int *kids)
+{
+  if (tree->nodes[node].count > 0) {
+    kids[0] = node;
+    return 1;
+  }
+  int n = 2;
+  kids[0] = node + 1;
+  kids[1] = tree->nodes[node].first;
+  while (n < WIDE) {
+    int i, best = -1;
+    double best_area = -1.0;
+    for (i = 0; i < n; i++) {
+      bvh_node const *k = tree->nodes + kids[i];
+      if (k->count > 0) {
+        continue;
+      }
+      vector e = k->box.hi;
+      SUB(e, k->box.lo);
+      double area = e.x * e.y + e.y * e.z + e.z * e.x;
+      if (area > best_area) {
+        best_area = area;
+        best = i;
+      }
+    }
+    if (best < 0) {
+      break;
+    }
+    int open = kids[best];
+    kids[best] = open + 1;
+    kids[n++] = tree->nodes[open].first;
+  }
+  return n;
+}
+
+static int build_wide(wide_builder *b, int node)
+{
+  mesh_accel *acc = b->acc;
+  int index = acc->num_nodes++;
+  wide_node *w = acc->nodes + index;
+
+  int kids[WIDE];
+  int n = gather_children(b->tree, node, kids);
+  w->num_children = n;
+
+  /* Round the frame outwards, so that float rounding can only grow
+   * the children's boxes.
+   */
+  bbox const *box = &b->tree->nodes[node].box;
+  int axis, i;
+  for (axis = 0; axis < 3; axis++) {
+    double lo = axis_of(box->lo, axis);
+    double hi = axis_of(box->hi, axis);
+    float origin = (float)lo;
+    if (origin > lo) {
+      origin = nextafterf(origin, -INFINITY);
+    }
+    double scale = (hi - origin) / QUANT_MAX;
+    w->origin[axis] = origin;
+    w->scale[axis] = scale > 0.0 ? nextafterf((float)scale, INFINITY)
+                                 : FLT_MIN;
+  }
+
+  for (i = 0; i < n; i++) {
+    bbox const *cbox = &b->tree->nodes[kids[i]].box;
+    for (axis = 0; axis < 3; axis++) {
+      double lo = (axis_of(cbox->lo, axis) - w->origin[axis]) / w->scale[axis];
+      double hi = (axis_of(cbox->hi, axis) - w->origin[axis]) / w->scale[axis];
+      lo = floor(lo) - 1.0;
+      hi = ceil(hi) + 1.0;
+      w->lo[axis][i] = lo < 0.0 ? 0 : lo > QUANT_MAX ? QUANT_MAX : lo;
+      w->hi[axis][i] = hi < 0.0 ? 0 : hi > QUANT_MAX ? QUANT_MAX : hi;
+    }
+  }
+  for (i = 0; i < n; i++) {
+    bvh_node const *k = b->tree->nodes + kids[i];
+    if (k->count > 0) {
+      w->child[i] = k->first;
+      w->count[i] = k->count;
+    } else {
+      /* The node array never moves, so 'w' stays good. */
+      w->child[i] = build_wide(b, kids[i]);
+      w->count[i] = 0;
+    }
+  }
+  return index;
+}
+
+mesh_accel *mesh_accel_build(scene const *sc)
+{
+  arena *a = sc->arena;
+  mesh_accel *acc = (mesh_accel *)arena_alloc(a, sizeof(mesh_accel));
+  int n = sc->num_mesh_triangles;
+  acc->num_tris = n;
+  acc->num_nodes = 0;
+
+  /* Absolute vertex indices, and a box for each triangle. */
+  mesh_triangle *tris = (mesh_triangle *)malloc(n * sizeof(mesh_triangle));
+  bbox *boxes = (bbox *)malloc(n * sizeof(bbox));
+  int i, j, k;
+  for (i = 0; i < sc->num_meshes; i++) {
+    mesh const *m = sc->meshes + i;
+    for (j = 0; j < m->num_triangles; j++) {
+      int t = m->first_triangle + j;
+      for (k = 0; k < 3; k++) {
+        int v = m->first_vertex + sc->mesh_triangles[t].v[k];
+        mesh_vertex const *mv = sc->mesh_vertices + v;
+        vector p = { mv->x, mv->y, mv->z };
+        tris[t].v[k] = v;
+        if (k == 0) {
+          boxes[t].lo = boxes[t].hi = p;
+        } else {
+          bbox pb = { p, p };
+          bbox_union(boxes + t, &pb);
+        }
+      }
+    }
+  }
+
+  /* The binary tree is only needed while building. */
+  arena *tmp = arena_create(0);
+  bvh *tree = bvh_build(boxes, n, tmp);
+  free(boxes);
+
+  acc->tris = (mesh_triangle *)arena_alloc(a, n * sizeof(mesh_triangle));
+  acc->tri_index = (int *)arena_alloc(a, n * sizeof(int));
+  for (i = 0; i < n; i++) {
+    acc->tris[i] = tris[tree->items[i]];
+    acc->tri_index[i] = tree->items[i];
+  }
+  free(tris);
+
+  /* Wide nodes only come from binary inner nodes (or a lone leaf). */
+  int max_nodes = tree->num_nodes / 2 + 1;
+  acc->nodes = (wide_node *)arena_alloc(a, max_nodes * sizeof(wide_node));
+  if (n > 0) {
+    wide_builder b = { tree, acc };
+    build_wide(&b, 0);
+  }
+  arena_destroy(tmp);
+  return acc;
+}
+
+size_t mesh_accel_bytes(mesh_accel const *acc)
+{
+  return acc->num_nodes * sizeof(wide_node) +
+         acc->num_tris * (sizeof(mesh_triangle) + sizeof(int));
+}
+
+static sheared_ray shear_ray(vector from, vector dir)
+{
+  sheared_ray r;
+  double d[3] = { dir.x, dir.y, dir.z };
+  r.from[0] = from.x;
+  r.from[1] = from.y;
+  r.from[2] = from.z;
+  r.kz = 0;
+  if (fabs(d[1]) > fabs(d[r.kz])) r.kz = 1;
+  if (fabs(d[2]) > fabs(d[r.kz])) r.kz = 2;
+  r.kx = (r.kz + 1) % 3;
+  r.ky = (r.kx + 1) % 3;
+  /* Keep the winding the same. */
+  if (d[r.kz] < 0.0) {
+    int t = r.kx;
+    r.kx = r.ky;
+    r.ky = t;
+  }
+  r.sx = d[r.kx] / d[r.kz];
+  r.sy = d[r.ky] / d[r.kz];
+  r.sz = 1.0 / d[r.kz];
+  return r;
+}
+
+/* Test the triangles of a leaf, recording the nearest hit. */
+static void leaf_hits(scene const *sc, mesh_accel const *acc,
+                      sheared_ray const *r, int first, int count,
+                      double *nearest, int *hit)
+{
+  int i;
+  for (i = first; i < first + count; i++) {
+    mesh_triangle const *t = acc->tris + i;
+    mesh_vertex const *va = sc->mesh_vertices + t->v[0];
+    mesh_vertex const *vb = sc->mesh_vertices + t->v[1];
+    mesh_vertex const *vc = sc->mesh_vertices + t->v[2];
+    double a[3] = { va->x - r->from[0], va->y - r->from[1],
+                    va->z - r->from[2] };
+    double b[3] = { vb->x - r->from[0], vb->y - r->from[1],
+                    vb->z - r->from[2] };
+    double c[3] = { vc->x - r->from[0], vc->y - r->from[1],
+                    vc->z - r->from[2] };
+
+    double ax = a[r->kx] - r->sx * a[r->kz];
+    double ay = a[r->ky] - r->sy * a[r->kz];
+    double bx = b[r->kx] - r->sx * b[r->kz];
+    double by = b[r->ky] - r->sy * b[r->kz];
+    double cx = c[r->kx] - r->sx * c[r->kz];
+    double cy = c[r->ky] - r->sy * c[r->kz];
+
+    /* Which side of each edge the ray passes. An edge shared by two
+     * triangles gives exactly opposite answers for each, so one or
+     * the other always gets the hit.
+     */
+    double u = cx * by - cy * bx;
+    double v = ax * cy - ay * cx;
+    double w = bx * ay - by * ax;
+    if ((u < 0.0 || v < 0.0 || w < 0.0) &&
+        (u > 0.0 || v > 0.0 || w > 0.0)) {
+      continue;
+    }
+    double det = u + v + w;
+    if (det == 0.0) {
+      continue;
+    }
+    double dist = (u * r->sz * a[r->kz] + v * r->sz * b[r->kz] +
+                   w * r->sz * c[r->kz]) / det;
+    if (EPSILON < dist && dist < *nearest) {
+      *nearest = dist;
+      *hit = acc->tri_index[i];
+    }
+  }
+}
+
+int mesh_intersect(scene const *sc, vector from, vector dir,
+                   double *nearest_dist)
+{
+  mesh_accel const *acc = sc->mesh_accel;
+  int hit = -1;
+  if (acc->num_nodes == 0) {
+    return hit;
+  }
+  sheared_ray r = shear_ray(from, dir);
+  double o[3] = { from.x, from.y, from.z };
+  double inv[3] = { 1.0 / dir.x, 1.0 / dir.y, 1.0 / dir.z };
+
+  /* Nodes to visit, and how far along the ray they start. */
+  int stack[WIDE_STACK_SIZE];
+  double stack_dist[WIDE_STACK_SIZE];
+  int depth = 0;
+  stack[depth] = 0;
+  stack_dist[depth++] = 0.0;
+  while (depth > 0) {
+    depth--;
+    if (stack_dist[depth] >= *nearest_dist) {
+      continue;
+    }
+    wide_node const *w = acc->nodes + stack[depth];
+
+    int inner[WIDE];
+    double inner_dist[WIDE];
+    int num_inner = 0;
+    int i, axis;
+    for (i = 0; i < w->num_children; i++) {
+      double tmin = 0.0, tmax = *nearest_dist;
+      for (axis = 0; axis < 3; axis++) {
+        double lo = w->origin[axis] + w->lo[axis][i] * (double)w->scale[axis];
+        double hi = w->origin[axis] + w->hi[axis][i] * (double)w->scale[axis];
+        double t0 = (lo - o[axis]) * inv[axis];
+        double t1 = (hi - o[axis]) * inv[axis];
+        if (t0 > t1) {
+          double t = t0;
+          t0 = t1;
+          t1 = t;
+        }
+        if (t0 > tmin) tmin = t0;
+        if (t1 < tmax) tmax = t1;
+      }
+      if (!(tmin <= tmax)) {
+        continue;
+      }
+      if (w->count[i] > 0) {
+        leaf_hits(sc, acc, &r, w->child[i], w->count[i], nearest_dist, &hit);
+      } else {
+        /* Keep the inner children sorted, furthest first. */
+        int j = num_inner++;
+        while (j > 0 && inner_dist[j - 1] < tmin) {
+          inner[j] = inner[j - 1];
+          inner_dist[j] = inner_dist[j - 1];
+          j--;
+        }
+        inner[j] = w->child[i];
+        inner_dist[j] = tmin;
+      }
+    }
+    /* Push the nearest last, so it comes off first. */
+    for (i = 0; i < num_inner; i++) {
+      stack[depth] = inner[i];
+      stack_dist[depth++] = inner_dist[i];
+    }
+  }
+  return hit;
+}
+
+/* Binary search for the mesh a triangle belongs to. */
+static mesh const *find_mesh(scene const *sc, int triangle)
+{
+  int lo = 0, hi = sc->num_meshes - 1;
+  while (lo < hi) {
+    int mid = (lo + hi + 1) / 2;
+    if (sc->meshes[mid].first_triangle <= triangle) {
+      lo = mid;
+    } else {
+      hi = mid - 1;
+    }
+  }
+  return sc->meshes + lo;
+}
+
+vector mesh_normal(scene const *sc, int triangle, vector dir)
+{
+  mesh const *m = find_mesh(sc, triangle);
+  mesh_triangle const *t = sc->mesh_triangles + triangle;
+  mesh_vertex const *va = sc->mesh_vertices + m->first_vertex + t->v[0];
+  mesh_vertex const *vb = sc->mesh_vertices + m->first_vertex + t->v[1];
+  mesh_vertex const *vc = sc->mesh_vertices + m->first_vertex + t->v[2];
+  vector e1 = { vb->x - va->x, vb->y - va->y, vb->z - va->z };
+  vector e2 = { vc->x - va->x, vc->y - va->y, vc->z - va->z };
+  vector n = {
+    e1.y * e2.z - e1.z * e2.y,
+    e1.z * e2.x - e1.x * e2.z,
+    e1.x * e2.y - e1.y * e2.x
+  };
+  NORMALISE(n);
+  if (DOT(n, dir) > 0.0) {
+    MULT(n, -1.0);
+  }
+  return n;
+}
+
+material *mesh_material(scene const *sc, int triangle)
+{
+  return sc->materials + find_mesh(sc, triangle)->material;
+}
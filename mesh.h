@@ -0,0 +1,49 @@
+/*
+ * mesh.h: Triangle meshes, and a compact tree to trace them.
+ *
+ * (C) Copyright Simon Frankau 1999-2014
+ */
+
+#ifndef MESH_H_INCLUDED
+#define MESH_H_INCLUDED
+
+#include <stddef.h>
+
+#include "tracer.h"
+
+/* ------------------------------------------------------------------
+ * Exported functions
+ */
+
+/* Load a mesh from a Wavefront OBJ file (just the 'v' and 'f' lines),
+ * scale it up and move it by 'offset', and add it to the scene,
+ * allocating in the scene's arena. A negative 'mat' gives the
+ * mesh a new plain grey material. Returns 0 on success.
+ *
+ * Save the scene to get a binary version that loads instantly.
+ */
+int mesh_load(scene *sc, char const *filename, double scale, vector offset,
+              int mat);
+
+/* Build the tree over every mesh triangle in the scene, in the
+ * scene's arena.
+ */
+struct mesh_accel_t *mesh_accel_build(scene const *sc);
+
+/* Bytes used by the tree, and the triangle data it keeps. */
+size_t mesh_accel_bytes(struct mesh_accel_t const *acc);
+
+/* Find the nearest mesh triangle hit by a unit ray closer than
+ * '*nearest_dist', updating it. Returns the triangle's index in
+ * sc->mesh_triangles, or -1 if there isn't one.
+ */
+int mesh_intersect(scene const *sc, vector from, vector dir,
+                   double *nearest_dist);
+
+/* Normal of a triangle, facing back along 'dir'. */
+vector mesh_normal(scene const *sc, int triangle, vector dir);
+
+/* The material of a triangle. */
+material *mesh_material(scene const *sc, int triangle);
+
+#endif // MESH_H_INCLUDED
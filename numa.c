@@ -0,0 +1,113 @@
+/*
+ * numa.c: Which CPUs belong to which memory node, and pinning to them.
+ *
+ * (C) Copyright Simon Frankau 1999-2014
+ */
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "numa.h"
+
+#define NODE_DIR "/sys/devices/system/node"
+
+/* Read a list like "0-3,8-11" from a file into 'out'. Returns how
+ * many numbers there were (up to 'max'), or -1 if it can't be read.
+ */
+static int read_list(char const *path, int *out, int max)
+{
+  FILE *fp = fopen(path, "r");
+  if (fp == NULL) {
+    return -1;
+  }
+  char buf[4096];
+  if (fgets(buf, sizeof(buf), fp) == NULL) {
+    fclose(fp);
+    return -1;
+  }
+  fclose(fp);
+
+  int n = 0;
+  char *p = buf;
+  while (*p != '\0' && *p != '\n') {
+    char *end;
+    long lo = strtol(p, &end, 10);
+    if (end == p) {
+      return -1;
+    }
+    long hi = lo;
+    p = end;
+    if (*p == '-') {
+      hi = strtol(p + 1, &end, 10);
+      if (end == p + 1) {
+        return -1;
+      }
+      p = end;
+    }
+    for (; lo <= hi && n < max; lo++) {
+      out[n++] = lo;
+    }
+    if (*p == ',') {
+      p++;
+    }
+  }
+  return n;
+}
+
+void numa_topology_read(numa_topology *t)
+{
+  cpu_set_t allowed;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+    CPU_ZERO(&allowed);
+  }
+
+  t->num_nodes = 0;
+  t->first[0] = 0;
+  int nodes[NUMA_MAX_NODES];
+  int num_nodes = read_list(NODE_DIR "/online", nodes, NUMA_MAX_NODES);
+  int i, j;
+  int cpus[NUMA_MAX_CPUS];
+  for (i = 0; i < num_nodes; i++) {
+    char path[256];
+    snprintf(path, sizeof(path), NODE_DIR "/node%d/cpulist", nodes[i]);
+    int n = read_list(path, cpus, NUMA_MAX_CPUS);
+    int count = t->first[t->num_nodes];
+    for (j = 0; j < n; j++) {
+      if (cpus[j] < CPU_SETSIZE && CPU_ISSET(cpus[j], &allowed) &&
+          count < NUMA_MAX_CPUS) {
+        t->cpus[count++] = cpus[j];
+      }
+    }
+    /* Memory-only nodes are no use to us. */
+    if (count > t->first[t->num_nodes]) {
+      t->first[++t->num_nodes] = count;
+    }
+  }
+
+  if (t->num_nodes == 0) {
+    int count = 0;
+    for (i = 0; i < CPU_SETSIZE && count < NUMA_MAX_CPUS; i++) {
+      if (CPU_ISSET(i, &allowed)) {
+        t->cpus[count++] = i;
+      }
+    }
+    if (count == 0) {
+      t->cpus[count++] = 0;
+    }
+    t->num_nodes = 1;
+    t->first[1] = count;
+  }
+}
+
+int numa_pin(int cpu)
+{
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  return pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
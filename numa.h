@@ -0,0 +1,53 @@
+/*
+ * numa.h: Which CPUs belong to which memory node, and pinning to them.
+ *
+ * Read straight from /sys, so no libnuma needed. Memory placement is
+ * left to the kernel's first-touch policy: a page lands on the node
+ * of the CPU that first writes it, so a pinned thread that allocates
+ * and fills something gets it locally.
+ *
+ * (C) Copyright Simon Frankau 1999-2014
+ */
+
+#ifndef NUMA_H_INCLUDED
+#define NUMA_H_INCLUDED
+
+/* ------------------------------------------------------------------
+ * Macros
+ */
+
+#define NUMA_MAX_NODES 64
+#define NUMA_MAX_CPUS 1024
+
+/* ------------------------------------------------------------------
+ * Data types
+ */
+
+/* CPUs we may run on, grouped by node: node i has cpus[first[i]] up
+ * to cpus[first[i + 1] - 1]. Nodes without such CPUs are left out.
+ */
+typedef struct {
+  int num_nodes;
+  int first[NUMA_MAX_NODES + 1];
+  int cpus[NUMA_MAX_CPUS];
+} numa_topology;
+
+/* ------------------------------------------------------------------
+ * Exported functions
+ */
+
+/* Find the nodes and their CPUs. Without NUMA information, makes one
+ * node of every CPU we may run on.
+ */
+void numa_topology_read(numa_topology *t);
+
+/* CPUs on a node. */
+static inline int numa_node_cpus(numa_topology const *t, int node)
+{
+  return t->first[node + 1] - t->first[node];
+}
+
+/* Pin the calling thread to one CPU. Returns 0 on success. */
+int numa_pin(int cpu);
+
+#endif // NUMA_H_INCLUDED
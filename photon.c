@@ -0,0 +1,271 @@
+/*
+ * photon.c: Photon maps, for caustics.
+ *
+ * (C) Copyright Simon Frankau 1999-2014
+ */
+
+#include <math.h>
+#include <stdlib.h>
+
+#include "arena.h"
+#include "photon.h"
+
+/* ------------------------------------------------------------------
+ * Data types
+ */
+
+/* A photon found by a search. */
+typedef struct {
+  float dist2;
+  int index;
+} photon_near;
+
+/* A k-nearest search in progress. The nearest found so far are kept
+ * in a max-heap, so the farthest is on top to be replaced.
+ */
+typedef struct {
+  photon_map const *m;
+  float w[3];
+  vector n;
+  int k;
+  photon_near heap[PHOTON_MAX_GATHER];
+  int size;
+  /* Only photons nearer than this can get in. */
+  float max_dist2;
+} photon_search;
+
+/* ------------------------------------------------------------------
+ * Functions
+ */
+
+static float photon_coord(photon const *p, int axis)
+{
+  return axis == 0 ? p->x : axis == 1 ? p->y : p->z;
+}
+
+static void photon_swap(photon *a, photon *b)
+{
+  photon tmp = *a;
+  *a = *b;
+  *b = tmp;
+}
+
+/* Partially sort photons lo to hi - 1 on 'axis', so that 'nth' is in
+ * place, with none after it smaller and none before it bigger.
+ */
+static void select_nth(photon *p, int lo, int hi, int nth, int axis)
+{
+  while (hi - lo > 1) {
+    /* Median of three, left at 'lo'. */
+    int mid = lo + (hi - lo) / 2;
+    if (photon_coord(p + mid, axis) < photon_coord(p + lo, axis))
+      photon_swap(p + mid, p + lo);
+    if (photon_coord(p + hi - 1, axis) < photon_coord(p + lo, axis))
+      photon_swap(p + hi - 1, p + lo);
+    if (photon_coord(p + hi - 1, axis) < photon_coord(p + mid, axis))
+      photon_swap(p + hi - 1, p + mid);
+    photon_swap(p + lo, p + mid);
+    float pivot = photon_coord(p + lo, axis);
+
+    int i = lo, j = hi;
+    for (;;) {
+      do i++; while (i < hi && photon_coord(p + i, axis) < pivot);
+      do j--; while (photon_coord(p + j, axis) > pivot);
+      if (i >= j) {
+        break;
+      }
+      photon_swap(p + i, p + j);
+    }
+    photon_swap(p + lo, p + j);
+
+    if (j == nth) {
+      return;
+    } else if (nth < j) {
+      hi = j;
+    } else {
+      lo = j + 1;
+    }
+  }
+}
+
+/* Make photons lo to hi - 1 into a subtree, splitting on the axis
+ * they're most spread out along.
+ */
+static void build_tree(photon_map *m, int lo, int hi)
+{
+  while (hi - lo > 1) {
+    float min[3], max[3];
+    int i, axis;
+    for (axis = 0; axis < 3; axis++) {
+      min[axis] = max[axis] = photon_coord(m->photons + lo, axis);
+    }
+    for (i = lo + 1; i < hi; i++) {
+      for (axis = 0; axis < 3; axis++) {
+        float c = photon_coord(m->photons + i, axis);
+        if (c < min[axis]) min[axis] = c;
+        if (c > max[axis]) max[axis] = c;
+      }
+    }
+    axis = 0;
+    if (max[1] - min[1] > max[axis] - min[axis]) axis = 1;
+    if (max[2] - min[2] > max[axis] - min[axis]) axis = 2;
+
+    int mid = lo + (hi - lo) / 2;
+    select_nth(m->photons, lo, hi, mid, axis);
+    m->axes[mid] = axis;
+    build_tree(m, lo, mid);
+    lo = mid + 1;
+  }
+  if (hi - lo == 1) {
+    m->axes[lo] = 0;
+  }
+}
+
+photon_map *photon_map_build(photon const *photons, int count,
+                             double radius, arena *a)
+{
+  photon_map *m;
+  if (a) {
+    m = (photon_map *)arena_alloc(a, sizeof(photon_map));
+    m->photons = (photon *)arena_alloc(a, count * sizeof(photon));
+    m->axes = (unsigned char *)arena_alloc(a, count);
+  } else {
+    m = (photon_map *)malloc(sizeof(photon_map));
+    m->photons = (photon *)malloc(count * sizeof(photon));
+    m->axes = (unsigned char *)malloc(count);
+  }
+  m->num_photons = count;
+  m->radius = radius;
+
+  int i;
+  for (i = 0; i < count; i++) {
+    m->photons[i] = photons[i];
+  }
+  build_tree(m, 0, count);
+  return m;
+}
+
+/* Put the entry at the top of the heap back in order. */
+static void heap_sift_down(photon_near *heap, int size)
+{
+  int i = 0;
+  for (;;) {
+    int child = 2 * i + 1;
+    if (child >= size) {
+      break;
+    }
+    if (child + 1 < size && heap[child + 1].dist2 > heap[child].dist2) {
+      child++;
+    }
+    if (heap[child].dist2 <= heap[i].dist2) {
+      break;
+    }
+    photon_near tmp = heap[i];
+    heap[i] = heap[child];
+    heap[child] = tmp;
+    i = child;
+  }
+}
+
+static void heap_push(photon_near *heap, int size, photon_near p)
+{
+  int i = size;
+  heap[i] = p;
+  while (i > 0 && heap[(i - 1) / 2].dist2 < heap[i].dist2) {
+    photon_near tmp = heap[i];
+    heap[i] = heap[(i - 1) / 2];
+    heap[(i - 1) / 2] = tmp;
+    i = (i - 1) / 2;
+  }
+}
+
+/* Consider photon 'i' for the search. */
+static void search_add(photon_search *s, int i)
+{
+  photon const *p = s->m->photons + i;
+  float dx = p->x - s->w[0];
+  float dy = p->y - s->w[1];
+  float dz = p->z - s->w[2];
+  float dist2 = dx * dx + dy * dy + dz * dz;
+  if (dist2 >= s->max_dist2) {
+    return;
+  }
+  /* Only photons arriving at the front of the surface. */
+  if (p->dx * s->n.x + p->dy * s->n.y + p->dz * s->n.z >= 0.0f) {
+    return;
+  }
+  photon_near near = { dist2, i };
+  if (s->size < s->k) {
+    heap_push(s->heap, s->size++, near);
+  } else {
+    s->heap[0] = near;
+    heap_sift_down(s->heap, s->size);
+  }
+  if (s->size == s->k) {
+    s->max_dist2 = s->heap[0].dist2;
+  }
+}
+
+/* Search the subtree of photons lo to hi - 1, nearer side first. */
+static void search_tree(photon_search *s, int lo, int hi)
+{
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    int axis = s->m->axes[mid];
+    float d = s->w[axis] - photon_coord(s->m->photons + mid, axis);
+    if (d < 0.0f) {
+      search_tree(s, lo, mid);
+    } else {
+      search_tree(s, mid + 1, hi);
+    }
+    search_add(s, mid);
+    /* The far side is at least 'd' away. */
+    if (d * d >= s->max_dist2) {
+      return;
+    }
+    if (d < 0.0f) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+}
+
+colour photon_map_irradiance(photon_map const *m, vector w, vector n, int k)
+{
+  colour c = { 0.0, 0.0, 0.0 };
+  if (k > PHOTON_MAX_GATHER) {
+    k = PHOTON_MAX_GATHER;
+  }
+  if (m->num_photons == 0 || k <= 0) {
+    return c;
+  }
+
+  photon_search s;
+  s.m = m;
+  s.w[0] = w.x;
+  s.w[1] = w.y;
+  s.w[2] = w.z;
+  s.n = n;
+  s.k = k;
+  s.size = 0;
+  s.max_dist2 = m->radius * m->radius;
+  search_tree(&s, 0, m->num_photons);
+  if (s.size == 0) {
+    return c;
+  }
+
+  /* Spread their power over the disc they were found in. */
+  int i;
+  for (i = 0; i < s.size; i++) {
+    photon const *p = m->photons + s.heap[i].index;
+    c.r += p->r;
+    c.g += p->g;
+    c.b += p->b;
+  }
+  double area = M_PI * s.max_dist2;
+  c.r /= area;
+  c.g /= area;
+  c.b /= area;
+  return c;
+}
@@ -0,0 +1,63 @@
+/*
+ * photon.h: Photon maps, for caustics.
+ *
+ * Photons are kept in a kd-tree, balanced so that it needs no
+ * pointers: each subtree is a range of the photon array, with the
+ * photon it splits at in the middle. Caustics pile photons up very
+ * unevenly, which a tree copes with better than a grid.
+ *
+ * (C) Copyright Simon Frankau 1999-2014
+ */
+
+#ifndef PHOTON_H_INCLUDED
+#define PHOTON_H_INCLUDED
+
+#include "tracer.h"
+
+/* ------------------------------------------------------------------
+ * Macros
+ */
+
+/* Most photons a single estimate may gather. */
+#define PHOTON_MAX_GATHER 256
+
+/* ------------------------------------------------------------------
+ * Data types
+ */
+
+/* Floats, to keep the map small. */
+typedef struct {
+  float x, y, z;
+  /* Direction of travel. */
+  float dx, dy, dz;
+  /* Power. */
+  float r, g, b;
+} photon;
+
+typedef struct photon_map_t {
+  photon *photons;
+  int num_photons;
+  /* Which axis each photon splits its subtree on: 0 for x, 1 for y,
+   * 2 for z.
+   */
+  unsigned char *axes;
+  double radius;
+} photon_map;
+
+/* ------------------------------------------------------------------
+ * Exported functions
+ */
+
+/* Build a map over 'count' photons, for searches out to 'radius', in
+ * the arena if non-NULL. The photons are copied.
+ */
+photon_map *photon_map_build(photon const *photons, int count,
+                             double radius, struct arena_t *a);
+
+/* Estimate the light falling on the front of a surface at 'w' with
+ * normal 'n', from the 'k' nearest photons within the map's radius
+ * (at most PHOTON_MAX_GATHER).
+ */
+colour photon_map_irradiance(photon_map const *m, vector w, vector n, int k);
+
+#endif // PHOTON_H_INCLUDED
@@ -7,15 +7,35 @@
 #include <png.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
+#include "arena.h"
 #include "tracer.h"
+#include "png_render.h"
+#include "png_stream.h"
 
-/* Convert a colour array into an image suitable for saving. */
-static void convert_image(int width, int height, colour const *im_in,
-                          int dest_width, png_bytep im_out)
+/* PNG text key holding the scale used by convert_image. */
+#define SCALE_KEY "tracer-scale"
+
+/* PNG text key holding the value shown as white in a heatmap. */
+#define HEAT_KEY "tracer-heat-max"
+
+/* Heatmap colours, evenly spaced from 0 to the top value. */
+static unsigned char const heat_ramp[][3] = {
+  {   0,   0,   0 },
+  {   0,   0, 160 },
+  { 160,   0, 160 },
+  { 255,   0,   0 },
+  { 255, 160,   0 },
+  { 255, 255,   0 },
+  { 255, 255, 255 },
+};
+#define HEAT_STEPS ((int)(sizeof(heat_ramp) / sizeof(heat_ramp[0])) - 1)
+
+/* Find the scale that maps the brightest component to white. */
+double image_scale(int width, int height, colour const *im_in)
 {
  int x, y;
- int r, g, b;
  double max = 0.0;
 
  for (x = 0; x < width; x++)
@@ -28,7 +48,15 @@ static void convert_image(int width, int height, colour const *im_in,
         max = im_in[y*width+x].b;
    }
 
- max /= 256.0;
+ return max / 256.0;
+}
+
+/* Convert a colour array with a given scale. */
+void convert_image_scaled(int width, int height, colour const *im_in,
+                          double max, int dest_width, unsigned char *im_out)
+{
+ int x, y;
+ int r, g, b;
 
  for (x = 0; x < width; x++)
    for (y = 0; y < height; y++) {
@@ -44,74 +72,217 @@ static void convert_image(int width, int height, colour const *im_in,
    }
 }
 
-/* Write an image from an array of R, G and B png_bytes. */
-static void write_image(int width, int height, png_bytep image,
-                        char const *filename)
+/* Convert a colour array into an image suitable for saving. */
+void convert_image(int width, int height, colour const *im_in,
+                   int dest_width, unsigned char *im_out)
 {
- FILE *fp;
- png_structp png_ptr;
- png_infop info_ptr;
- png_bytep *row_pointers;
- int i;
+ convert_image_scaled(width, height, im_in,
+                      image_scale(width, height, im_in),
+                      dest_width, im_out);
+}
+
+/* Start writing an image from an array of R, G and B png_bytes, to be
+ * compressed on a thread per CPU as its rows are said to be ready. If
+ * 'scale' is positive, it is recorded so that crops can later be
+ * merged in with the same exposure.
+ */
+static png_stream *start_image(int width, int height, png_bytep image,
+                               double scale, char const *filename)
+{
+ int threads = sysconf(_SC_NPROCESSORS_ONLN);
+ png_stream *s = png_stream_open(filename, width, height, image, threads);
+ if (!s) {
+   return NULL;
+ }
+ if (scale > 0.0) {
+   char scale_text[32];
+   snprintf(scale_text, sizeof(scale_text), "%.17g", scale);
+   png_stream_text(s, SCALE_KEY, scale_text);
+ }
+ return s;
+}
+
+/* Finish an image, returning 0 if all of it was written. */
+static int finish_image(png_stream *s)
+{
+ return s && png_stream_close(s) == 0 ? 0 : -1;
+}
+
+/* Write an image from an array of R, G and B png_bytes, as above. */
+static int write_image(int width, int height, png_bytep image,
+                       double scale, char const *filename)
+{
+ return finish_image(start_image(width, height, image, scale, filename));
+}
+
+int png_save(int width, int height, colour const *image, char const *file)
+{
+ double scale = image_scale(width, height, image);
+ png_bytep image2 = (png_bytep)malloc(width*height*3);
+ convert_image_scaled(width, height, image, scale, width, image2);
+ int err = write_image(width, height, image2, scale, file);
+ free(image2);
+ return err;
+}
+
+static int compare_floats(void const *a, void const *b)
+{
+ float x = *(float const *)a;
+ float y = *(float const *)b;
+ return x < y ? -1 : x > y;
+}
+
+int png_save_heatmap(int width, int height, float const *values,
+                     char const *file)
+{
+ int pixels = width * height;
+ float *sorted = (float *)malloc(pixels * sizeof(float));
+ memcpy(sorted, values, pixels * sizeof(float));
+ qsort(sorted, pixels, sizeof(float), compare_floats);
+ double top = sorted[(int)(0.99 * (pixels - 1))];
+ if (top <= 0.0) {
+   top = sorted[pixels - 1];
+ }
+ free(sorted);
+
+ png_bytep image = (png_bytep)malloc(pixels * 3);
+ int i, c;
+ for (i = 0; i < pixels; i++) {
+   double t = top > 0.0 ? values[i] / top * HEAT_STEPS : 0.0;
+   if (t < 0.0) t = 0.0;
+   if (t > HEAT_STEPS) t = HEAT_STEPS;
+   int step = (int)t;
+   if (step == HEAT_STEPS) step--;
+   double f = t - step;
+   for (c = 0; c < 3; c++) {
+     image[i * 3 + c] = heat_ramp[step][c] * (1.0 - f) +
+                        heat_ramp[step + 1][c] * f + 0.5;
+   }
+ }
+
+ png_stream *s = start_image(width, height, image, 0.0, file);
+ if (s) {
+   char top_text[32];
+   snprintf(top_text, sizeof(top_text), "%.9g", top);
+   png_stream_text(s, HEAT_KEY, top_text);
+ }
+ int err = finish_image(s);
+ free(image);
+ return err;
+}
 
- fp = fopen(filename, "wb");
+/* Read an 8-bit RGB image, and the scale it was written with (zero if
+ * not recorded). Returns NULL on failure.
+ */
+static png_bytep read_image(char const *filename, int *width, int *height,
+                            double *scale)
+{
+ FILE *fp = fopen(filename, "rb");
  if (!fp) {
-   return;
+   return NULL;
  }
- png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, (png_voidp)NULL,
-                                   NULL, NULL);
- if (!png_ptr)
-   return;
- info_ptr = png_create_info_struct(png_ptr);
+ png_structp png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING,
+                                              NULL, NULL, NULL);
+ if (!png_ptr) {
+   fclose(fp);
+   return NULL;
+ }
+ png_infop info_ptr = png_create_info_struct(png_ptr);
  if (!info_ptr) {
-   png_destroy_write_struct(&png_ptr,
-                            (png_infopp)NULL);
-   return;
+   png_destroy_read_struct(&png_ptr, NULL, NULL);
+   fclose(fp);
+   return NULL;
  }
+ png_bytep image = NULL;
  if (setjmp(png_jmpbuf(png_ptr))) {
-   png_destroy_write_struct(&png_ptr, &info_ptr);
+   png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
    fclose(fp);
-   return;
+   free(image);
+   return NULL;
  }
  png_init_io(png_ptr, fp);
- png_set_IHDR(png_ptr, info_ptr, width, height,
-             8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE,
-             PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
- png_write_info(png_ptr, info_ptr);
- row_pointers = (png_bytep *)malloc(height * sizeof(png_bytep));
- if (!row_pointers) {
-   png_destroy_write_struct(&png_ptr, &info_ptr);
-   fclose(fp);
-   return;
+ png_read_png(png_ptr, info_ptr,
+              PNG_TRANSFORM_STRIP_16 | PNG_TRANSFORM_STRIP_ALPHA |
+              PNG_TRANSFORM_PACKING | PNG_TRANSFORM_EXPAND |
+              PNG_TRANSFORM_GRAY_TO_RGB,
+              NULL);
+
+ *width = png_get_image_width(png_ptr, info_ptr);
+ *height = png_get_image_height(png_ptr, info_ptr);
+ *scale = 0.0;
+ png_textp text;
+ int num_text = 0;
+ png_get_text(png_ptr, info_ptr, &text, &num_text);
+ int i;
+ for (i = 0; i < num_text; i++) {
+   if (strcmp(text[i].key, SCALE_KEY) == 0) {
+     *scale = atof(text[i].text);
+   }
+ }
+
+ png_bytepp rows = png_get_rows(png_ptr, info_ptr);
+ image = (png_bytep)malloc(*width * *height * 3);
+ for (i = 0; i < *height; i++) {
+   memcpy(image + i * *width * 3, rows[i], *width * 3);
  }
- for (i = 0; i < height; i++)
-   row_pointers[i] = image + (i * width * 3);
- png_write_image(png_ptr, row_pointers);
- png_write_end(png_ptr, info_ptr);
- png_destroy_write_struct(&png_ptr, (png_infopp)NULL);
+
+ png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
  fclose(fp);
- printf("Saved file %s!\n", filename);
+ return image;
 }
 
-void png_render(scene *sc, int width, int height, char const *file)
+int png_merge(char const *file_in, char const *file_out,
+              int x, int y, int crop_width, int crop_height,
+              colour const *crop)
 {
- colour *image = (colour *)malloc(width*height*sizeof(colour));
- png_bytep image2 = (png_bytep)malloc(width*height*3);
+ int width, height;
+ double scale;
+ png_bytep image = read_image(file_in, &width, &height, &scale);
+ if (!image) {
+   printf("Couldn't read %s.\n", file_in);
+   return -1;
+ }
+ if (x < 0 || y < 0 || x + crop_width > width || y + crop_height > height) {
+   printf("Crop doesn't fit in %s.\n", file_in);
+   free(image);
+   return -1;
+ }
+ if (scale <= 0.0) {
+   printf("No scale recorded in %s, using the crop's own.\n", file_in);
+   scale = image_scale(crop_width, crop_height, crop);
+ }
+ convert_image_scaled(crop_width, crop_height, crop, scale,
+                      width, image + 3 * (y * width + x));
+ int err = write_image(width, height, image, scale, file_out);
+ free(image);
+ return err;
+}
+
+void png_render(scene const *sc, int width, int height, char const *file)
+{
+ arena *frame = arena_create(0);
+ colour *image = (colour *)arena_alloc(frame, width*height*sizeof(colour));
  render(sc, width, height, image);
- convert_image(width, height, image, width, image2);
- write_image(width, height, image2, file);
+ if (png_save(width, height, image, file) == 0) {
+   printf("Saved file %s!\n", file);
+ }
+ arena_destroy(frame);
 }
 
 /* Render a set of scenes into a big image. */
-void png_render_ex(scene *sc, int num_scenes, int tiles_across,
+void png_render_ex(scene const *sc, int num_scenes, int tiles_across,
 		   int width, int height, char const *file)
 {
   int tiles_down = (num_scenes - 1) / tiles_across + 1;
-  colour *image = (colour *)malloc(width*height*sizeof(colour));
+  arena *frame = arena_create(0);
+  colour *image = (colour *)arena_alloc(frame, width*height*sizeof(colour));
   int dest_size = width*height*tiles_across*tiles_down*3;
-  png_bytep image2 = (png_bytep)malloc(dest_size);
+  png_bytep image2 = (png_bytep)arena_alloc(frame, dest_size);
   memset(image2, 0, dest_size);
 
+  /* Each row of scenes gets compressed while the next renders. */
+  png_stream *s = start_image(width * tiles_across, height * tiles_down,
+                              image2, 0.0, file);
   int i;
   for (i = 0; i < num_scenes; i++) {
     int tx = i % tiles_across;
@@ -121,7 +292,13 @@ void png_render_ex(scene *sc, int num_scenes, int tiles_across,
 		  width * tiles_across,
 		  image2 + 3 * (ty * height * width * tiles_across
 				+ tx * width));
+    if (s && tx == tiles_across - 1) {
+      png_stream_rows(s, (ty + 1) * height);
+    }
+  }
+  if (finish_image(s) == 0) {
+    printf("Saved file %s!\n", file);
   }
-  write_image(width * tiles_across, height * tiles_down, image2, file);
+  arena_destroy(frame);
 }
 
@@ -9,9 +9,43 @@
 
 #include "tracer.h"
 
-void png_render(scene *sc, int width, int height, char const *file);
+/* Find the scale convert_image uses: the brightest component / 256. */
+double image_scale(int width, int height, colour const *im_in);
 
-void png_render_ex(scene *sc, int num_scenes, int tiles_across,
+/* Convert a colour array to 8-bit RGB, dividing by 'max', into an
+ * image 'dest_width' pixels across.
+ */
+void convert_image_scaled(int width, int height, colour const *im_in,
+                          double max, int dest_width, unsigned char *im_out);
+
+/* Convert a colour array to 8-bit RGB, scaled so the brightest
+ * component is white, into an image 'dest_width' pixels across.
+ */
+void convert_image(int width, int height, colour const *im_in,
+                   int dest_width, unsigned char *im_out);
+
+/* Write an already-rendered image. Returns 0 on success. */
+int png_save(int width, int height, colour const *image, char const *file);
+
+/* Write per-pixel values (costs, say) in false colour, from black
+ * through blue, red and yellow to white. The top 1% of values are all
+ * white, so a few outliers don't leave the rest dark. The value white
+ * stands for is recorded in the PNG. Returns 0 on success.
+ */
+int png_save_heatmap(int width, int height, float const *values,
+                     char const *file);
+
+/* Paste a crop at (x, y) into an existing PNG, converting it with the
+ * scale the PNG was written with so the exposure matches. Returns 0 on
+ * success.
+ */
+int png_merge(char const *file_in, char const *file_out,
+              int x, int y, int crop_width, int crop_height,
+              colour const *crop);
+
+void png_render(scene const *sc, int width, int height, char const *file);
+
+void png_render_ex(scene const *sc, int num_scenes, int tiles_across,
 		   int width, int height, char const *file);
 
 #endif // PNG_RENDER_H_INCLUDED
@@ -0,0 +1,358 @@
+/*
+ * png_stream.c: Writing 8-bit RGB PNGs as their rows become ready.
+ *
+ * Each band is deflated as raw deflate data, flushed to a byte
+ * boundary without ending the stream, except for the last band,
+ * which ends it. Laid end to end after a zlib header they make a
+ * valid stream, and the trailing checksum is put together from the
+ * bands' own with adler32_combine. Bands don't share a dictionary, so
+ * compress a little worse than one long stream would.
+ *
+ * (C) Copyright Simon Frankau 1999-2014
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "png_stream.h"
+
+/* ------------------------------------------------------------------
+ * Macros
+ */
+
+/* Aim for bands of about this much image data. */
+#define PNG_BAND_BYTES (256 * 1024)
+
+/* Room before a band's data for the zlib header, and after it for the
+ * checksum.
+ */
+#define ZLIB_HEADER_SIZE 2
+#define ZLIB_TRAILER_SIZE 4
+
+/* ------------------------------------------------------------------
+ * Data types
+ */
+
+typedef struct {
+  /* Header space, deflate data, then trailer space. */
+  unsigned char *out;
+  size_t out_len;
+  /* Filtered bytes, and their checksum. */
+  size_t raw_len;
+  uLong adler;
+  int done;
+} png_band;
+
+struct png_stream_t {
+  FILE *fp;
+  int width;
+  int height;
+  unsigned char const *image;
+  int rows_per_band;
+  int num_bands;
+  png_band *bands;
+  /* Bands whose rows are all ready, the next to compress, and the
+   * next to write.
+   */
+  int bands_ready;
+  int next_band;
+  int next_write;
+  uLong adler;
+  int error;
+  pthread_t *workers;
+  int num_workers;
+  pthread_mutex_t lock;
+  pthread_cond_t work;
+};
+
+/* ------------------------------------------------------------------
+ * Functions
+ */
+
+static void put_u32(unsigned char *p, uint32_t x)
+{
+  p[0] = x >> 24;
+  p[1] = x >> 16;
+  p[2] = x >> 8;
+  p[3] = x;
+}
+
+static void write_chunk(png_stream *s, char const *type,
+                        unsigned char const *data, size_t len)
+{
+  unsigned char buf[4];
+  put_u32(buf, len);
+  uLong crc = crc32(0L, (Bytef const *)type, 4);
+  if (len > 0) {
+    crc = crc32(crc, data, len);
+  }
+  if (fwrite(buf, 1, 4, s->fp) != 4 ||
+      fwrite(type, 1, 4, s->fp) != 4 ||
+      (len > 0 && fwrite(data, 1, len, s->fp) != len)) {
+    s->error = 1;
+  }
+  put_u32(buf, crc);
+  if (fwrite(buf, 1, 4, s->fp) != 4) {
+    s->error = 1;
+  }
+}
+
+static int paeth(int a, int b, int c)
+{
+  int p = a + b - c;
+  int pa = abs(p - a);
+  int pb = abs(p - b);
+  int pc = abs(p - c);
+  if (pa <= pb && pa <= pc) {
+    return a;
+  }
+  return pb <= pc ? b : c;
+}
+
+/* Filter 'f' of byte 'i' of a row, with 'prev' the row above. */
+static unsigned char filter_byte(int f, unsigned char const *row,
+                                 unsigned char const *prev, int i)
+{
+  int left = i >= 3 ? row[i - 3] : 0;
+  int up = prev[i];
+  int up_left = i >= 3 ? prev[i - 3] : 0;
+  switch (f) {
+  case 1: return row[i] - left;
+  case 2: return row[i] - up;
+  case 3: return row[i] - ((left + up) >> 1);
+  case 4: return row[i] - paeth(left, up, up_left);
+  default: return row[i];
+  }
+}
+
+/* Filter a row into 'out', type byte first. Like libpng, pick the
+ * filter whose output is smallest taken as signed bytes, which tends
+ * to compress best.
+ */
+static void filter_row(unsigned char const *row, unsigned char const *prev,
+                       int bytes, unsigned char *out)
+{
+  int best = 0;
+  long best_sum = -1;
+  int f, i;
+  for (f = 0; f < 5; f++) {
+    long sum = 0;
+    for (i = 0; i < bytes; i++) {
+      sum += abs((signed char)filter_byte(f, row, prev, i));
+    }
+    if (best_sum < 0 || sum < best_sum) {
+      best = f;
+      best_sum = sum;
+    }
+  }
+  out[0] = best;
+  for (i = 0; i < bytes; i++) {
+    out[i + 1] = filter_byte(best, row, prev, i);
+  }
+}
+
+/* Filter and deflate band 'b'. */
+static int compress_band(png_stream *s, int b, unsigned char const *zeros)
+{
+  png_band *band = s->bands + b;
+  int y0 = b * s->rows_per_band;
+  int y1 = y0 + s->rows_per_band;
+  if (y1 > s->height) {
+    y1 = s->height;
+  }
+  int bytes = s->width * 3;
+  band->raw_len = (size_t)(y1 - y0) * (bytes + 1);
+  unsigned char *raw = (unsigned char *)malloc(band->raw_len);
+  int y;
+  for (y = y0; y < y1; y++) {
+    unsigned char const *row = s->image + (size_t)y * bytes;
+    filter_row(row, y > 0 ? row - bytes : zeros, bytes,
+               raw + (size_t)(y - y0) * (bytes + 1));
+  }
+  band->adler = adler32(adler32(0L, NULL, 0), raw, band->raw_len);
+
+  z_stream z;
+  memset(&z, 0, sizeof(z));
+  /* libpng's defaults for filtered images, but raw. */
+  if (deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8,
+                   Z_FILTERED) != Z_OK) {
+    free(raw);
+    band->out = NULL;
+    return -1;
+  }
+  /* The bound is for a finished stream; a flush adds a few bytes. */
+  size_t room = deflateBound(&z, band->raw_len) + 16;
+  band->out = (unsigned char *)malloc(ZLIB_HEADER_SIZE + room +
+                                      ZLIB_TRAILER_SIZE);
+  z.next_in = raw;
+  z.avail_in = band->raw_len;
+  z.next_out = band->out + ZLIB_HEADER_SIZE;
+  z.avail_out = room;
+  int last = b == s->num_bands - 1;
+  int err = deflate(&z, last ? Z_FINISH : Z_SYNC_FLUSH);
+  band->out_len = room - z.avail_out;
+  deflateEnd(&z);
+  free(raw);
+  return err == (last ? Z_STREAM_END : Z_OK) && z.avail_in == 0 ? 0 : -1;
+}
+
+/* Write out every band that's done and has all before it written.
+ * Call with the lock held.
+ */
+static void write_bands(png_stream *s)
+{
+  while (s->next_write < s->num_bands && s->bands[s->next_write].done) {
+    int b = s->next_write++;
+    png_band *band = s->bands + b;
+    if (band->out == NULL) {
+      /* Failed to compress, so the file's no good anyway. */
+      continue;
+    }
+    unsigned char *data = band->out + ZLIB_HEADER_SIZE;
+    size_t len = band->out_len;
+    if (b == 0) {
+      /* Deflate, 32K window, default compression. */
+      data -= ZLIB_HEADER_SIZE;
+      data[0] = 0x78;
+      data[1] = 0x9c;
+      len += ZLIB_HEADER_SIZE;
+      s->adler = band->adler;
+    } else {
+      s->adler = adler32_combine(s->adler, band->adler, band->raw_len);
+    }
+    if (b == s->num_bands - 1) {
+      put_u32(data + len, s->adler);
+      len += ZLIB_TRAILER_SIZE;
+    }
+    write_chunk(s, "IDAT", data, len);
+    free(band->out);
+    band->out = NULL;
+  }
+}
+
+static void *png_worker(void *arg)
+{
+  png_stream *s = (png_stream *)arg;
+  unsigned char *zeros = (unsigned char *)calloc(s->width * 3, 1);
+  pthread_mutex_lock(&s->lock);
+  for (;;) {
+    while (s->next_band >= s->bands_ready && s->next_band < s->num_bands) {
+      pthread_cond_wait(&s->work, &s->lock);
+    }
+    if (s->next_band >= s->num_bands) {
+      break;
+    }
+    int b = s->next_band++;
+    pthread_mutex_unlock(&s->lock);
+    int err = compress_band(s, b, zeros);
+    pthread_mutex_lock(&s->lock);
+    if (err) {
+      s->error = 1;
+    }
+    s->bands[b].done = 1;
+    write_bands(s);
+  }
+  pthread_mutex_unlock(&s->lock);
+  free(zeros);
+  return NULL;
+}
+
+png_stream *png_stream_open(char const *filename, int width, int height,
+                            unsigned char const *image, int threads)
+{
+  FILE *fp = fopen(filename, "wb");
+  if (!fp) {
+    return NULL;
+  }
+  png_stream *s = (png_stream *)calloc(1, sizeof(png_stream));
+  s->fp = fp;
+  s->width = width;
+  s->height = height;
+  s->image = image;
+  s->rows_per_band = PNG_BAND_BYTES / (width * 3 + 1);
+  if (s->rows_per_band < 1) {
+    s->rows_per_band = 1;
+  }
+  s->num_bands = (height - 1) / s->rows_per_band + 1;
+  s->bands = (png_band *)calloc(s->num_bands, sizeof(png_band));
+  pthread_mutex_init(&s->lock, NULL);
+  pthread_cond_init(&s->work, NULL);
+
+  static unsigned char const signature[8] = {
+    0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'
+  };
+  if (fwrite(signature, 1, sizeof(signature), fp) != sizeof(signature)) {
+    s->error = 1;
+  }
+  unsigned char ihdr[13];
+  put_u32(ihdr, width);
+  put_u32(ihdr + 4, height);
+  ihdr[8] = 8;   /* Bits per channel. */
+  ihdr[9] = 2;   /* RGB. */
+  ihdr[10] = 0;  /* Deflate. */
+  ihdr[11] = 0;  /* Adaptive filtering. */
+  ihdr[12] = 0;  /* Not interlaced. */
+  write_chunk(s, "IHDR", ihdr, sizeof(ihdr));
+
+  /* No more workers than bands. */
+  if (threads > s->num_bands) {
+    threads = s->num_bands;
+  }
+  if (threads < 1) {
+    threads = 1;
+  }
+  s->workers = (pthread_t *)malloc(threads * sizeof(pthread_t));
+  for (s->num_workers = 0; s->num_workers < threads; s->num_workers++) {
+    pthread_create(s->workers + s->num_workers, NULL, png_worker, s);
+  }
+  return s;
+}
+
+void png_stream_text(png_stream *s, char const *key, char const *text)
+{
+  size_t key_len = strlen(key);
+  size_t text_len = strlen(text);
+  unsigned char *data = (unsigned char *)malloc(key_len + 1 + text_len);
+  memcpy(data, key, key_len + 1);
+  memcpy(data + key_len + 1, text, text_len);
+  pthread_mutex_lock(&s->lock);
+  write_chunk(s, "tEXt", data, key_len + 1 + text_len);
+  pthread_mutex_unlock(&s->lock);
+  free(data);
+}
+
+void png_stream_rows(png_stream *s, int rows)
+{
+  /* A band is ready once its last row is. */
+  int ready = rows >= s->height ? s->num_bands : rows / s->rows_per_band;
+  pthread_mutex_lock(&s->lock);
+  if (ready > s->bands_ready) {
+    s->bands_ready = ready;
+    pthread_cond_broadcast(&s->work);
+  }
+  pthread_mutex_unlock(&s->lock);
+}
+
+int png_stream_close(png_stream *s)
+{
+  png_stream_rows(s, s->height);
+  int i;
+  for (i = 0; i < s->num_workers; i++) {
+    pthread_join(s->workers[i], NULL);
+  }
+  write_chunk(s, "IEND", NULL, 0);
+  int err = s->error;
+  if (fclose(s->fp) != 0) {
+    err = 1;
+  }
+  pthread_cond_destroy(&s->work);
+  pthread_mutex_destroy(&s->lock);
+  free(s->workers);
+  free(s->bands);
+  free(s);
+  return err ? -1 : 0;
+}
@@ -0,0 +1,45 @@
+/*
+ * png_stream.h: Writing 8-bit RGB PNGs as their rows become ready.
+ *
+ * The rows are split into bands, each filtered and deflated on its own
+ * by a pool of threads, and the pieces joined into the one zlib
+ * stream a PNG needs. Bands are written out as soon as they and all
+ * the bands before them are done, so a caller that hands over rows as
+ * it finishes them has most of the file written by the time it's done.
+ *
+ * (C) Copyright Simon Frankau 1999-2014
+ */
+
+#ifndef PNG_STREAM_H_INCLUDED
+#define PNG_STREAM_H_INCLUDED
+
+/* ------------------------------------------------------------------
+ * Data types
+ */
+
+typedef struct png_stream_t png_stream;
+
+/* ------------------------------------------------------------------
+ * Exported functions
+ */
+
+/* Start writing a PNG 'width' by 'height' pixels, with 'threads'
+ * compressing it. 'image' holds the rows, 'width' * 3 bytes each, and
+ * is only read once png_stream_rows says they're ready. Returns NULL
+ * if the file can't be opened.
+ */
+png_stream *png_stream_open(char const *filename, int width, int height,
+                            unsigned char const *image, int threads);
+
+/* Add a text chunk. Only before any rows are ready. */
+void png_stream_text(png_stream *s, char const *key, char const *text);
+
+/* Say that rows up to 'rows' - 1 are ready, and won't change. */
+void png_stream_rows(png_stream *s, int rows);
+
+/* Finish the file, taking any rows not yet said to be ready as ready
+ * now. Returns 0 on success.
+ */
+int png_stream_close(png_stream *s);
+
+#endif // PNG_STREAM_H_INCLUDED
@@ -0,0 +1,245 @@
+/*
+ * preview.c: Fast, progressively refined previews for scene layout.
+ *
+ * Each preview pass renders at a fraction of the final resolution
+ * with a single noise-free sample, and is scaled up to full size so
+ * the viewer always sees the same frame size. Passes double the
+ * resolution until the image is full size, so a rough frame arrives
+ * almost immediately and sharpens while you look at it.
+ *
+ * (C) Copyright Simon Frankau 1999-2014
+ */
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "png_render.h"
+#include "preview.h"
+#include "scene_file.h"
+
+/* How often to look for scene changes once the preview is complete. */
+#define POLL_MS 100
+
+void preview_scene(scene const *sc, scene *out, light *lights)
+{
+  *out = *sc;
+  out->num_samples = 1;
+  out->blur_size = 0.0;
+  out->antialias_size = 0.0;
+  out->focal_depth = 0.0;
+  out->lights = lights;
+  out->light_table = NULL;
+
+  int i;
+  for (i = 0; i < sc->num_lights; i++) {
+    light l = sc->lights[i];
+    /* Move to the centre of the area light, and stop jittering. */
+    MULT(l.area1, 0.5);
+    MULT(l.area2, 0.5);
+    ADD(l.loc, l.area1);
+    ADD(l.loc, l.area2);
+    l.area1.x = l.area1.y = l.area1.z = 0.0;
+    l.area2 = l.area1;
+    /* Black lights sweep the colour wheel, which averages to grey. */
+    if (IS_BLACK(l.col)) {
+      l.col.r = l.col.g = l.col.b = 0.5;
+    }
+    lights[i] = l;
+  }
+}
+
+/* Write all of a buffer, returning 0 on success. */
+static int write_all(int fd, unsigned char const *buf, size_t len)
+{
+  while (len > 0) {
+    ssize_t n = write(fd, buf, len);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    buf += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/* Scale up a 'scale' times smaller image and write it as a PPM. */
+static int write_frame(int fd, int width, int height,
+                       int small_width, int small_height, int scale,
+                       colour const *small, unsigned char *small_bytes,
+                       unsigned char *frame)
+{
+  convert_image(small_width, small_height, small, small_width, small_bytes);
+
+  int x, y;
+  for (y = 0; y < height; y++) {
+    int sy = y / scale;
+    if (sy >= small_height) sy = small_height - 1;
+    for (x = 0; x < width; x++) {
+      int sx = x / scale;
+      if (sx >= small_width) sx = small_width - 1;
+      memcpy(frame + 3 * (y * width + x),
+             small_bytes + 3 * (sy * small_width + sx), 3);
+    }
+  }
+
+  char header[64];
+  int len = snprintf(header, sizeof(header), "P6\n%d %d\n255\n",
+                     width, height);
+  if (write_all(fd, (unsigned char *)header, len) != 0) {
+    return -1;
+  }
+  return write_all(fd, frame, (size_t)width * height * 3);
+}
+
+/* Has the file changed since we last looked? */
+static int file_changed(char const *path, struct stat *last)
+{
+  struct stat st;
+  if (stat(path, &st) != 0) {
+    return 0;
+  }
+  int changed = st.st_mtim.tv_sec != last->st_mtim.tv_sec ||
+                st.st_mtim.tv_nsec != last->st_mtim.tv_nsec ||
+                st.st_size != last->st_size ||
+                st.st_ino != last->st_ino;
+  *last = st;
+  return changed;
+}
+
+/* Wait for a viewer to connect to the socket. */
+static int accept_viewer(int listen_fd)
+{
+  fprintf(stderr, "Waiting for a viewer...\n");
+  for (;;) {
+    int fd = accept(listen_fd, NULL, NULL);
+    if (fd >= 0 || errno != EINTR) {
+      return fd;
+    }
+  }
+}
+
+static int listen_socket(char const *path)
+{
+  struct sockaddr_un addr;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Socket path too long: %s\n", path);
+    return -1;
+  }
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  unlink(path);
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+      listen(fd, 1) != 0) {
+    fprintf(stderr, "Couldn't listen on %s\n", path);
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+int preview_run(char const *scene_path, int width, int height,
+                int start_scale, render_opts const *opts_in,
+                int fd, char const *socket_path)
+{
+  /* Viewers going away shouldn't kill us. */
+  signal(SIGPIPE, SIG_IGN);
+
+  int listen_fd = -1;
+  if (socket_path != NULL) {
+    listen_fd = listen_socket(socket_path);
+    if (listen_fd < 0) {
+      return -1;
+    }
+    fd = accept_viewer(listen_fd);
+    if (fd < 0) {
+      return -1;
+    }
+  }
+
+  render_opts opts = *opts_in;
+  opts.verbose = 0;
+  opts.region_x = opts.region_y = 0;
+  opts.region_width = opts.region_height = 0;
+
+  struct stat last;
+  memset(&last, 0, sizeof(last));
+  file_changed(scene_path, &last);
+
+  /* Reset for each reload, so a long session doesn't keep going back
+   * to malloc.
+   */
+  arena *frame = arena_create(0);
+
+  for (;;) {
+    scene_file *sf = scene_file_load(scene_path);
+    if (!sf) {
+      /* Probably caught it half-written. Try again shortly. */
+      usleep(POLL_MS * 1000);
+      file_changed(scene_path, &last);
+      continue;
+    }
+
+    int w = width > 0 ? width : sf->width;
+    int h = height > 0 ? height : sf->height;
+    arena_reset(frame);
+    light *lights =
+      (light *)arena_alloc(frame, (sf->sc.num_lights + 1) * sizeof(light));
+    scene sc;
+    preview_scene(&sf->sc, &sc, lights);
+    /* Build once for all the scales. */
+    render_prepare(&sc);
+
+    colour *small = (colour *)arena_alloc(frame, w * h * sizeof(colour));
+    unsigned char *small_bytes = (unsigned char *)arena_alloc(frame, w * h * 3);
+    unsigned char *pixels = (unsigned char *)arena_alloc(frame, w * h * 3);
+
+    int scale = start_scale > 1 ? start_scale : 1;
+    int changed = 0;
+    while (!changed) {
+      int sw = w / scale > 0 ? w / scale : 1;
+      int sh = h / scale > 0 ? h / scale : 1;
+      render_ex(&sc, sw, sh, small, &opts);
+      while (write_frame(fd, w, h, sw, sh, scale,
+                         small, small_bytes, pixels) != 0) {
+        if (listen_fd < 0) {
+          fprintf(stderr, "Viewer went away\n");
+          return -1;
+        }
+        close(fd);
+        fd = accept_viewer(listen_fd);
+        if (fd < 0) {
+          return -1;
+        }
+      }
+
+      if (scale > 1) {
+        scale /= 2;
+        changed = file_changed(scene_path, &last);
+      } else {
+        /* Full size. Wait for something to happen. */
+        while (!(changed = file_changed(scene_path, &last))) {
+          usleep(POLL_MS * 1000);
+        }
+      }
+    }
+
+    scene_file_unload(sf);
+  }
+}
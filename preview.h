@@ -0,0 +1,34 @@
+/*
+ * preview.h: Fast, progressively refined previews for scene layout.
+ *
+ * (C) Copyright Simon Frankau 1999-2014
+ */
+
+#ifndef PREVIEW_H_INCLUDED
+#define PREVIEW_H_INCLUDED
+
+#include "tracer.h"
+
+/* ------------------------------------------------------------------
+ * Exported functions
+ */
+
+/* Make a cheap version of 'sc' in 'out': one sample per pixel, a
+ * pinhole camera, and point lights at the centre of any area lights.
+ * 'lights' must have room for sc->num_lights lights. The geometry is
+ * shared with 'sc'.
+ */
+void preview_scene(scene const *sc, scene *out, light *lights);
+
+/* Preview a scene file, writing binary PPM frames to 'fd' or, if
+ * 'socket_path' is non-NULL, to viewers connecting to a Unix domain
+ * socket there. The image is first rendered at 1/start_scale of full
+ * resolution, then refined by halving the scale until it is full
+ * size. Whenever the scene file changes it is reloaded and the
+ * preview starts again. Only returns on error.
+ */
+int preview_run(char const *scene_path, int width, int height,
+                int start_scale, render_opts const *opts,
+                int fd, char const *socket_path);
+
+#endif // PREVIEW_H_INCLUDED
@@ -0,0 +1,599 @@
+/*
+ * prims.c: Boxes, planes, discs, cylinders and triangles.
+ *
+ * For tracing, the primitives are copied into one structure-of-arrays
+ * per type, in the order the tree's leaves visit them, with each
+ * leaf's primitives grouped by type. A leaf is then a few runs of the
+ * same type, and each run is handed to a loop over that type's arrays
+ * - one switch per run rather than a call through a pointer per
+ * primitive, and loops the compiler can vectorise.
+ *
+ * Planes are unbounded, so are kept out of the tree and always tested.
+ *
+ * (C) Copyright Simon Frankau 1999-2014
+ */
+
+#include <math.h>
+#include <stdlib.h>
+
+#include "arena.h"
+#include "bvh.h"
+#include "prims.h"
+
+/* ------------------------------------------------------------------
+ * Macros
+ */
+
+/* Most numbers any type keeps per primitive. */
+#define PRIM_FIELDS 9
+
+/* ------------------------------------------------------------------
+ * Data types
+ */
+
+/* One type's primitives. The fields are:
+ *   box:      lo x, y, z, hi x, y, z
+ *   plane:    normal x, y, z, distance
+ *   disc:     centre x, y, z, unit normal x, y, z, radius^2
+ *   cylinder: base x, y, z, unit axis x, y, z, height, radius^2
+ *   triangle: corner x, y, z, edge 1 x, y, z, edge 2 x, y, z
+ */
+typedef struct {
+  int count;
+  /* Index of each in the scene's primitives. */
+  int *prim;
+  double *f[PRIM_FIELDS];
+} prim_soa;
+
+typedef struct prim_accel_t {
+  prim_soa soa[num_prim_types];
+  /* Over everything but the planes. */
+  bvh *tree;
+  /* For each entry in the tree's item list, its type and where it is
+   * in that type's arrays.
+   */
+  unsigned char *item_type;
+  int *soa_index;
+} prim_accel;
+
+typedef surface *(*material_fn)(material *m, vector w);
+
+/* ------------------------------------------------------------------
+ * Functions
+ */
+
+/* Allocate from an arena, or malloc if there isn't one. */
+static void *alloc_in(arena *a, size_t size)
+{
+  return a ? arena_alloc(a, size) : malloc(size);
+}
+
+static vector cross(vector a, vector b)
+{
+  vector c = {
+    a.y * b.z - a.z * b.y,
+    a.z * b.x - a.x * b.z,
+    a.x * b.y - a.y * b.x
+  };
+  return c;
+}
+
+static int num_fields(prim_type type)
+{
+  switch (type) {
+  case prim_box: return 6;
+  case prim_plane: return 4;
+  case prim_disc: return 7;
+  case prim_cylinder: return 8;
+  default: return 9;
+  }
+}
+
+/* Fill in the fields for primitive 'p' at 'i' in its type's arrays. */
+static void soa_store(prim_soa *s, int i, primitive const *p)
+{
+  double f[PRIM_FIELDS];
+  vector n;
+  switch (p->type) {
+  case prim_box:
+    f[0] = p->a.x; f[1] = p->a.y; f[2] = p->a.z;
+    f[3] = p->b.x; f[4] = p->b.y; f[5] = p->b.z;
+    break;
+  case prim_plane:
+    f[0] = p->a.x; f[1] = p->a.y; f[2] = p->a.z;
+    f[3] = p->d;
+    break;
+  case prim_disc:
+    n = p->b;
+    NORMALISE(n);
+    f[0] = p->a.x; f[1] = p->a.y; f[2] = p->a.z;
+    f[3] = n.x; f[4] = n.y; f[5] = n.z;
+    f[6] = p->d * p->d;
+    break;
+  case prim_cylinder:
+    n = p->b;
+    NORMALISE(n);
+    f[0] = p->a.x; f[1] = p->a.y; f[2] = p->a.z;
+    f[3] = n.x; f[4] = n.y; f[5] = n.z;
+    f[6] = sqrt(DOT(p->b, p->b));
+    f[7] = p->d * p->d;
+    break;
+  default:
+    f[0] = p->a.x; f[1] = p->a.y; f[2] = p->a.z;
+    f[3] = p->b.x - p->a.x; f[4] = p->b.y - p->a.y; f[5] = p->b.z - p->a.z;
+    f[6] = p->c.x - p->a.x; f[7] = p->c.y - p->a.y; f[8] = p->c.z - p->a.z;
+    break;
+  }
+  int j;
+  for (j = 0; j < num_fields(p->type); j++) {
+    s->f[j][i] = f[j];
+  }
+}
+
+static void grow(bbox *b, vector v, double r)
+{
+  bbox c = { { v.x - r, v.y - r, v.z - r }, { v.x + r, v.y + r, v.z + r } };
+  bbox_union(b, &c);
+}
+
+static bbox prim_bounds(primitive const *p)
+{
+  bbox b = { p->a, p->a };
+  switch (p->type) {
+  case prim_box:
+    b.hi = p->b;
+    break;
+  case prim_disc:
+    grow(&b, p->a, p->d);
+    break;
+  case prim_cylinder: {
+    vector top = p->a;
+    ADD(top, p->b);
+    grow(&b, p->a, p->d);
+    grow(&b, top, p->d);
+    break;
+  }
+  case prim_triangle:
+    grow(&b, p->b, 0.0);
+    grow(&b, p->c, 0.0);
+    break;
+  default:
+    break;
+  }
+  return b;
+}
+
+/* Sort a leaf's entries by type, so that each type is one run. */
+static void sort_leaf(bvh *tree, primitive const *prims, int const *bounded,
+                      bvh_node const *node)
+{
+  int *items = tree->items + node->first;
+  int i, j;
+  for (i = 1; i < node->count; i++) {
+    int item = items[i];
+    prim_type t = prims[bounded[item]].type;
+    for (j = i; j > 0 && prims[bounded[items[j - 1]]].type > t; j--) {
+      items[j] = items[j - 1];
+    }
+    items[j] = item;
+  }
+}
+
+prim_accel *prim_accel_build(scene const *sc)
+{
+  arena *a = sc->arena;
+  prim_accel *acc = (prim_accel *)alloc_in(a, sizeof(prim_accel));
+
+  int counts[num_prim_types] = { 0 };
+  int i, j;
+  for (i = 0; i < sc->num_primitives; i++) {
+    counts[sc->primitives[i].type]++;
+  }
+  for (i = 0; i < num_prim_types; i++) {
+    prim_soa *s = acc->soa + i;
+    s->count = 0;
+    s->prim = (int *)alloc_in(a, counts[i] * sizeof(int));
+    for (j = 0; j < num_fields(i); j++) {
+      s->f[j] = (double *)alloc_in(a, counts[i] * sizeof(double));
+    }
+  }
+
+  /* Build the tree over everything bounded. */
+  int num_bounded = sc->num_primitives - counts[prim_plane];
+  int *bounded = (int *)malloc(num_bounded * sizeof(int));
+  bbox *boxes = (bbox *)malloc(num_bounded * sizeof(bbox));
+  num_bounded = 0;
+  for (i = 0; i < sc->num_primitives; i++) {
+    primitive const *p = sc->primitives + i;
+    if (p->type == prim_plane) {
+      prim_soa *s = acc->soa + prim_plane;
+      s->prim[s->count] = i;
+      soa_store(s, s->count++, p);
+    } else {
+      bounded[num_bounded] = i;
+      boxes[num_bounded++] = prim_bounds(p);
+    }
+  }
+  acc->tree = bvh_build(boxes, num_bounded, a);
+  free(boxes);
+
+  for (i = 0; i < acc->tree->num_nodes; i++) {
+    if (acc->tree->nodes[i].count > 0) {
+      sort_leaf(acc->tree, sc->primitives, bounded, acc->tree->nodes + i);
+    }
+  }
+
+  /* Lay out the arrays in leaf order. */
+  acc->item_type = (unsigned char *)alloc_in(a, num_bounded);
+  acc->soa_index = (int *)alloc_in(a, num_bounded * sizeof(int));
+  for (i = 0; i < num_bounded; i++) {
+    int index = bounded[acc->tree->items[i]];
+    primitive const *p = sc->primitives + index;
+    prim_soa *s = acc->soa + p->type;
+    acc->item_type[i] = p->type;
+    acc->soa_index[i] = s->count;
+    s->prim[s->count] = index;
+    soa_store(s, s->count++, p);
+  }
+  free(bounded);
+  return acc;
+}
+
+/* The intersection loops. Each tests 'count' primitives from 'first'
+ * in its type's arrays, and records the nearest hit.
+ */
+
+static void box_hits(prim_soa const *s, int first, int count,
+                     vector from, vector dir, double *nearest, int *hit)
+{
+  double const *lx = s->f[0], *ly = s->f[1], *lz = s->f[2];
+  double const *hx = s->f[3], *hy = s->f[4], *hz = s->f[5];
+  vector inv_dir = { 1.0 / dir.x, 1.0 / dir.y, 1.0 / dir.z };
+  int i;
+  for (i = first; i < first + count; i++) {
+    double t0 = (lx[i] - from.x) * inv_dir.x;
+    double t1 = (hx[i] - from.x) * inv_dir.x;
+    double tmin = fmin(t0, t1), tmax = fmax(t0, t1);
+    t0 = (ly[i] - from.y) * inv_dir.y;
+    t1 = (hy[i] - from.y) * inv_dir.y;
+    tmin = fmax(tmin, fmin(t0, t1));
+    tmax = fmin(tmax, fmax(t0, t1));
+    t0 = (lz[i] - from.z) * inv_dir.z;
+    t1 = (hz[i] - from.z) * inv_dir.z;
+    tmin = fmax(tmin, fmin(t0, t1));
+    tmax = fmin(tmax, fmax(t0, t1));
+    /* From inside, we hit the far side. */
+    double t = tmin > EPSILON ? tmin : tmax;
+    if (tmin <= tmax && EPSILON < t && t < *nearest) {
+      *nearest = t;
+      *hit = s->prim[i];
+    }
+  }
+}
+
+static void plane_hits(prim_soa const *s, int first, int count,
+                       vector from, vector dir, double *nearest, int *hit)
+{
+  double const *nx = s->f[0], *ny = s->f[1], *nz = s->f[2], *d = s->f[3];
+  int i;
+  for (i = first; i < first + count; i++) {
+    double t = (d[i] - (from.x * nx[i] + from.y * ny[i] + from.z * nz[i])) /
+               (dir.x * nx[i] + dir.y * ny[i] + dir.z * nz[i]);
+    if (EPSILON < t && t < *nearest) {
+      *nearest = t;
+      *hit = s->prim[i];
+    }
+  }
+}
+
+static void disc_hits(prim_soa const *s, int first, int count,
+                      vector from, vector dir, double *nearest, int *hit)
+{
+  double const *cx = s->f[0], *cy = s->f[1], *cz = s->f[2];
+  double const *nx = s->f[3], *ny = s->f[4], *nz = s->f[5];
+  double const *r2 = s->f[6];
+  int i;
+  for (i = first; i < first + count; i++) {
+    double ox = cx[i] - from.x, oy = cy[i] - from.y, oz = cz[i] - from.z;
+    double t = (ox * nx[i] + oy * ny[i] + oz * nz[i]) /
+               (dir.x * nx[i] + dir.y * ny[i] + dir.z * nz[i]);
+    double px = t * dir.x - ox, py = t * dir.y - oy, pz = t * dir.z - oz;
+    if (px * px + py * py + pz * pz <= r2[i] &&
+        EPSILON < t && t < *nearest) {
+      *nearest = t;
+      *hit = s->prim[i];
+    }
+  }
+}
+
+static void cylinder_hits(prim_soa const *s, int first, int count,
+                          vector from, vector dir, double *nearest, int *hit)
+{
+  double const *bx = s->f[0], *by = s->f[1], *bz = s->f[2];
+  double const *ax = s->f[3], *ay = s->f[4], *az = s->f[5];
+  double const *height = s->f[6], *r2 = s->f[7];
+  int i;
+  for (i = first; i < first + count; i++) {
+    /* Work relative to the base, ignoring movement along the axis. */
+    vector o = { from.x - bx[i], from.y - by[i], from.z - bz[i] };
+    double od = o.x * ax[i] + o.y * ay[i] + o.z * az[i];
+    double dd = dir.x * ax[i] + dir.y * ay[i] + dir.z * az[i];
+    vector op = { o.x - od * ax[i], o.y - od * ay[i], o.z - od * az[i] };
+    vector dp = { dir.x - dd * ax[i], dir.y - dd * ay[i], dir.z - dd * az[i] };
+    double qa = DOT(dp, dp);
+    double qb = DOT(dp, op);
+    double qc = DOT(op, op) - r2[i];
+    double disc = qb * qb - qa * qc;
+    if (disc < 0.0 || qa == 0.0) {
+      continue;
+    }
+    disc = sqrt(disc);
+    /* Nearer wall, unless it's behind us or off the end. */
+    double t = (-qb - disc) / qa;
+    double h = od + t * dd;
+    if (t <= EPSILON || h < 0.0 || h > height[i]) {
+      t = (-qb + disc) / qa;
+      h = od + t * dd;
+      if (h < 0.0 || h > height[i]) {
+        continue;
+      }
+    }
+    if (EPSILON < t && t < *nearest) {
+      *nearest = t;
+      *hit = s->prim[i];
+    }
+  }
+}
+
+/* Moller-Trumbore. */
+static void triangle_hits(prim_soa const *s, int first, int count,
+                          vector from, vector dir, double *nearest, int *hit)
+{
+  double const *vx = s->f[0], *vy = s->f[1], *vz = s->f[2];
+  double const *e1x = s->f[3], *e1y = s->f[4], *e1z = s->f[5];
+  double const *e2x = s->f[6], *e2y = s->f[7], *e2z = s->f[8];
+  int i;
+  for (i = first; i < first + count; i++) {
+    vector e1 = { e1x[i], e1y[i], e1z[i] };
+    vector e2 = { e2x[i], e2y[i], e2z[i] };
+    vector p = cross(dir, e2);
+    double det = DOT(e1, p);
+    if (det == 0.0) {
+      continue;
+    }
+    double inv_det = 1.0 / det;
+    vector tv = { from.x - vx[i], from.y - vy[i], from.z - vz[i] };
+    double u = DOT(tv, p) * inv_det;
+    vector q = cross(tv, e1);
+    double v = DOT(dir, q) * inv_det;
+    double t = DOT(e2, q) * inv_det;
+    if (u >= 0.0 && v >= 0.0 && u + v <= 1.0 &&
+        EPSILON < t && t < *nearest) {
+      *nearest = t;
+      *hit = s->prim[i];
+    }
+  }
+}
+
+static void run_hits(prim_accel const *acc, prim_type type, int first,
+                     int count, vector from, vector dir,
+                     double *nearest, int *hit)
+{
+  prim_soa const *s = acc->soa + type;
+  switch (type) {
+  case prim_box:
+    box_hits(s, first, count, from, dir, nearest, hit);
+    break;
+  case prim_plane:
+    plane_hits(s, first, count, from, dir, nearest, hit);
+    break;
+  case prim_disc:
+    disc_hits(s, first, count, from, dir, nearest, hit);
+    break;
+  case prim_cylinder:
+    cylinder_hits(s, first, count, from, dir, nearest, hit);
+    break;
+  default:
+    triangle_hits(s, first, count, from, dir, nearest, hit);
+    break;
+  }
+}
+
+int prim_intersect(scene const *sc, vector from, vector dir,
+                   double *nearest_dist)
+{
+  prim_accel const *acc = sc->prim_accel;
+  int hit = -1;
+
+  run_hits(acc, prim_plane, 0, acc->soa[prim_plane].count, from, dir,
+           nearest_dist, &hit);
+
+  bvh const *tree = acc->tree;
+  if (tree->num_nodes == 0) {
+    return hit;
+  }
+  vector inv_dir = { 1.0 / dir.x, 1.0 / dir.y, 1.0 / dir.z };
+
+  int stack[BVH_STACK_SIZE];
+  int depth = 0;
+  stack[depth++] = 0;
+  while (depth > 0) {
+    bvh_node const *node = tree->nodes + stack[--depth];
+    if (!bbox_hit(&node->box, from, inv_dir, *nearest_dist)) {
+      continue;
+    }
+    if (node->count == 0) {
+      stack[depth++] = node->first;
+      stack[depth++] = node - tree->nodes + 1;
+      continue;
+    }
+    int end = node->first + node->count;
+    int i, j;
+    for (i = node->first; i < end; i = j) {
+      for (j = i + 1; j < end && acc->item_type[j] == acc->item_type[i]; j++)
+        ;
+      run_hits(acc, acc->item_type[i], acc->soa_index[i], j - i,
+               from, dir, nearest_dist, &hit);
+    }
+  }
+  return hit;
+}
+
+vector prim_normal(primitive const *p, vector w, vector dir)
+{
+  vector n = { 0.0, 0.0, 0.0 };
+  switch (p->type) {
+  case prim_box: {
+    /* Whichever face we're nearest. */
+    double d[6] = {
+      fabs(w.x - p->a.x), fabs(w.x - p->b.x),
+      fabs(w.y - p->a.y), fabs(w.y - p->b.y),
+      fabs(w.z - p->a.z), fabs(w.z - p->b.z)
+    };
+    int i, best = 0;
+    for (i = 1; i < 6; i++) {
+      if (d[i] < d[best]) {
+        best = i;
+      }
+    }
+    double sign = best & 1 ? 1.0 : -1.0;
+    switch (best / 2) {
+    case 0: n.x = sign; break;
+    case 1: n.y = sign; break;
+    default: n.z = sign; break;
+    }
+    break;
+  }
+  case prim_plane:
+    n = p->a;
+    break;
+  case prim_disc:
+    n = p->b;
+    break;
+  case prim_cylinder: {
+    vector axis = p->b;
+    NORMALISE(axis);
+    n = w;
+    SUB(n, p->a);
+    vector along = axis;
+    MULT(along, DOT(n, axis));
+    SUB(n, along);
+    break;
+  }
+  default: {
+    vector e1 = p->b;
+    vector e2 = p->c;
+    SUB(e1, p->a);
+    SUB(e2, p->a);
+    n = cross(e1, e2);
+    break;
+  }
+  }
+  NORMALISE(n);
+  /* Flat things have two sides, and we want the one we're looking at. */
+  if (DOT(n, dir) > 0.0) {
+    MULT(n, -1.0);
+  }
+  return n;
+}
+
+int prim_solid(primitive const *p)
+{
+  return p->type == prim_box || p->type == prim_cylinder;
+}
+
+int prim_exit(primitive const *p, vector w, vector dir,
+              double *dist, vector *normal)
+{
+  vector n = { 0.0, 0.0, 0.0 };
+  double t;
+  switch (p->type) {
+  case prim_box: {
+    /* The nearest of the three faces we're heading towards. */
+    double tx = dir.x > 0.0 ? (p->b.x - w.x) / dir.x :
+                dir.x < 0.0 ? (p->a.x - w.x) / dir.x : INFINITY;
+    double ty = dir.y > 0.0 ? (p->b.y - w.y) / dir.y :
+                dir.y < 0.0 ? (p->a.y - w.y) / dir.y : INFINITY;
+    double tz = dir.z > 0.0 ? (p->b.z - w.z) / dir.z :
+                dir.z < 0.0 ? (p->a.z - w.z) / dir.z : INFINITY;
+    if (tx <= ty && tx <= tz) {
+      t = tx;
+      n.x = dir.x > 0.0 ? 1.0 : -1.0;
+    } else if (ty <= tz) {
+      t = ty;
+      n.y = dir.y > 0.0 ? 1.0 : -1.0;
+    } else {
+      t = tz;
+      n.z = dir.z > 0.0 ? 1.0 : -1.0;
+    }
+    break;
+  }
+  case prim_cylinder: {
+    /* The far wall, unless we leave through an end first. */
+    double height = sqrt(DOT(p->b, p->b));
+    vector axis = p->b;
+    MULT(axis, 1.0 / height);
+    vector o = w;
+    SUB(o, p->a);
+    double od = DOT(o, axis);
+    double dd = DOT(dir, axis);
+    vector op = axis;
+    MULT(op, -od);
+    ADD(op, o);
+    vector dp = axis;
+    MULT(dp, -dd);
+    ADD(dp, dir);
+    double qa = DOT(dp, dp);
+    double qb = DOT(dp, op);
+    double qc = DOT(op, op) - p->d * p->d;
+    double disc = qb * qb - qa * qc;
+    t = qa > 0.0 ? (-qb + sqrt(disc > 0.0 ? disc : 0.0)) / qa : INFINITY;
+    double t_end = dd > 0.0 ? (height - od) / dd :
+                   dd < 0.0 ? -od / dd : INFINITY;
+    if (t_end < t) {
+      t = t_end;
+      n = axis;
+      if (dd < 0.0) {
+        MULT(n, -1.0);
+      }
+    } else {
+      n = dp;
+      MULT(n, t);
+      ADD(n, op);
+      NORMALISE(n);
+    }
+    break;
+  }
+  default:
+    return 0;
+  }
+  *dist = t > 0.0 ? t : 0.0;
+  *normal = n;
+  return 1;
+}
+
+static surface *plain_surface(material *m, vector w)
+{
+  return &m->s1;
+}
+
+/* Points exactly half-way between squares may go either way, so keep
+ * flat faces on whole multiples of the size.
+ */
+static surface *checker_surface(material *m, vector w)
+{
+  double inv_size = 1.0 / m->size;
+  long parity = lrint(w.x * inv_size) + lrint(w.y * inv_size) +
+                lrint(w.z * inv_size);
+  return parity & 1 ? &m->s1 : &m->s2;
+}
+
+static material_fn const material_fns[num_material_types] = {
+  plain_surface,
+  checker_surface
+};
+
+surface *material_surface(material *m, vector w)
+{
+  return material_fns[m->type](m, w);
+}
@@ -0,0 +1,49 @@
+/*
+ * prims.h: Boxes, planes, discs, cylinders and triangles.
+ *
+ * (C) Copyright Simon Frankau 1999-2014
+ */
+
+#ifndef PRIMS_H_INCLUDED
+#define PRIMS_H_INCLUDED
+
+#include "tracer.h"
+
+/* ------------------------------------------------------------------
+ * Exported functions
+ */
+
+/* Sort the scene's primitives into per-type arrays and build a tree
+ * over them, allocating in the scene's arena.
+ */
+struct prim_accel_t *prim_accel_build(scene const *sc);
+
+/* Find the nearest primitive hit by a unit ray closer than
+ * '*nearest_dist', updating it. Returns the primitive's index, or -1
+ * if there isn't one.
+ */
+int prim_intersect(scene const *sc, vector from, vector dir,
+                   double *nearest_dist);
+
+/* Normal of a primitive at 'w', facing back along 'dir'. */
+vector prim_normal(primitive const *p, vector w, vector dir);
+
+/* Boxes and cylinders are solid: light refracts into them, travels
+ * through (and is absorbed, going by the surface's transparency), and
+ * refracts out. A cylinder's ends count as flat faces for this, open
+ * or not. The other primitives are thin, and light passes straight
+ * through them unbent.
+ */
+int prim_solid(primitive const *p);
+
+/* For a unit ray from 'w' inside a solid primitive, how far it goes
+ * to get out and the outward normal where it does. Returns 0 for thin
+ * primitives.
+ */
+int prim_exit(primitive const *p, vector w, vector dir,
+              double *dist, vector *normal);
+
+/* The surface a material has at 'w'. */
+surface *material_surface(material *m, vector w);
+
+#endif // PRIMS_H_INCLUDED
@@ -0,0 +1,475 @@
+/*
+ * scene_file.c: Binary scene files, mapped straight into memory.
+ *
+ * The file is a fixed-size header followed by the raw geometry
+ * arrays, each starting on a cache-line boundary. The arrays are
+ * stored exactly as the tracer uses them, so loading is just an mmap
+ * and some pointer arithmetic, however many spheres there are.
+ *
+ * The format is native-endian and tied to the struct layouts of the
+ * machine that wrote it - the header records enough to spot a file
+ * from somewhere else and refuse it, rather than render garbage.
+ *
+ * (C) Copyright Simon Frankau 1999-2014
+ */
+
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "scene_file.h"
+
+/* ------------------------------------------------------------------
+ * Macros
+ */
+
+#define SCENE_FILE_MAGIC "SPHSCENE"
+#define SCENE_FILE_VERSION 1
+#define SCENE_FILE_BYTE_ORDER 0x01020304
+
+/* Alignment of each section, suitable for SIMD loads. */
+#define SCENE_FILE_ALIGN 64
+
+#define SCENE_FILE_MAX_SECTIONS 16
+
+#define ALIGN_UP(x) (((x) + SCENE_FILE_ALIGN - 1) & ~(uint64_t)(SCENE_FILE_ALIGN - 1))
+
+/* ------------------------------------------------------------------
+ * Data types
+ */
+
+typedef enum {
+  section_spheres = 1,
+  section_checkerboards = 2,
+  section_lights = 3,
+  section_group_spheres = 4,
+  section_groups = 5,
+  section_instances = 6,
+  section_primitives = 7,
+  section_materials = 8,
+  section_mesh_vertices = 9,
+  section_mesh_triangles = 10,
+  section_meshes = 11
+} section_type;
+
+typedef struct {
+  uint32_t type;
+  uint32_t elem_size;
+  uint64_t count;
+  uint64_t offset;
+} section;
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  uint32_t header_size;
+  uint32_t num_sections;
+  int32_t width;
+  int32_t height;
+  int32_t num_samples;
+  /* Was padding, so zero (every light) in older files. */
+  int32_t light_samples;
+  double blur_size;
+  double antialias_size;
+  double focal_depth;
+  section sections[SCENE_FILE_MAX_SECTIONS];
+  /* Later additions go here, so that older files' headers are a
+   * prefix of this one. Missing fields load as zero.
+   */
+  int32_t max_depth;
+  int32_t rr_depth;
+  double rr_survival;
+  int32_t num_photons;
+  int32_t photon_gather;
+  double photon_radius;
+  int32_t ambient_samples;
+  int32_t pad;
+  double ambient_accuracy;
+  colour ambient;
+  /* max_depth and rr_depth again, with DEPTH_UNSET for the default so
+   * that 0 can be stored. The fields above keep 0 for the default, for
+   * older readers.
+   */
+  int32_t exact_max_depth;
+  int32_t exact_rr_depth;
+} header;
+
+/* Size of the header before path lengths were added, before photons
+ * were, before ambient light was, and before depths could be 0.
+ */
+#define HEADER_V1_SIZE offsetof(header, max_depth)
+#define HEADER_V2_SIZE offsetof(header, num_photons)
+#define HEADER_V3_SIZE offsetof(header, ambient_samples)
+#define HEADER_V4_SIZE offsetof(header, exact_max_depth)
+
+/* ------------------------------------------------------------------
+ * Functions
+ */
+
+static void add_section(header *h, uint64_t *offset, section_type type,
+                        size_t elem_size, int count)
+{
+  section *s = h->sections + h->num_sections++;
+  s->type = type;
+  s->elem_size = elem_size;
+  s->count = count;
+  s->offset = *offset;
+  *offset = ALIGN_UP(*offset + elem_size * count);
+}
+
+static int write_section(FILE *fp, section const *s, void const *data)
+{
+  if (fseek(fp, s->offset, SEEK_SET) != 0) {
+    return -1;
+  }
+  if (s->count == 0) {
+    return 0;
+  }
+  return fwrite(data, s->elem_size, s->count, fp) == s->count ? 0 : -1;
+}
+
+int scene_file_save(scene const *sc, int width, int height,
+                    char const *filename)
+{
+  header h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, SCENE_FILE_MAGIC, sizeof(h.magic));
+  h.version = SCENE_FILE_VERSION;
+  h.byte_order = SCENE_FILE_BYTE_ORDER;
+  h.header_size = sizeof(header);
+  h.width = width;
+  h.height = height;
+  h.num_samples = sc->num_samples;
+  h.light_samples = sc->light_samples;
+  h.blur_size = sc->blur_size;
+  h.antialias_size = sc->antialias_size;
+  h.focal_depth = sc->focal_depth;
+  h.max_depth = sc->max_depth > 0 ? sc->max_depth : 0;
+  h.rr_depth = sc->rr_depth > 0 ? sc->rr_depth : 0;
+  h.exact_max_depth = sc->max_depth;
+  h.exact_rr_depth = sc->rr_depth;
+  h.rr_survival = sc->rr_survival;
+  h.num_photons = sc->num_photons;
+  h.photon_gather = sc->photon_gather;
+  h.photon_radius = sc->photon_radius;
+  h.ambient_samples = sc->ambient_samples;
+  h.ambient_accuracy = sc->ambient_accuracy;
+  h.ambient = sc->ambient;
+
+  uint64_t offset = ALIGN_UP(sizeof(header));
+  add_section(&h, &offset, section_spheres,
+              sizeof(sphere), sc->num_spheres);
+  add_section(&h, &offset, section_checkerboards,
+              sizeof(checkerboard), sc->num_checkerboards);
+  add_section(&h, &offset, section_lights,
+              sizeof(light), sc->num_lights);
+  add_section(&h, &offset, section_group_spheres,
+              sizeof(sphere), sc->num_group_spheres);
+  add_section(&h, &offset, section_groups,
+              sizeof(sphere_group), sc->num_groups);
+  add_section(&h, &offset, section_instances,
+              sizeof(instance), sc->num_instances);
+  add_section(&h, &offset, section_primitives,
+              sizeof(primitive), sc->num_primitives);
+  add_section(&h, &offset, section_materials,
+              sizeof(material), sc->num_materials);
+  add_section(&h, &offset, section_mesh_vertices,
+              sizeof(mesh_vertex), sc->num_mesh_vertices);
+  add_section(&h, &offset, section_mesh_triangles,
+              sizeof(mesh_triangle), sc->num_mesh_triangles);
+  add_section(&h, &offset, section_meshes,
+              sizeof(mesh), sc->num_meshes);
+
+  if (sc->callback != NULL) {
+    fprintf(stderr, "Warning: scene callback not saved to %s\n", filename);
+  }
+
+  FILE *fp = fopen(filename, "wb");
+  if (!fp) {
+    fprintf(stderr, "Couldn't open %s for writing.\n", filename);
+    return -1;
+  }
+
+  int err = fwrite(&h, sizeof(h), 1, fp) == 1 ? 0 : -1;
+  if (!err) err = write_section(fp, h.sections + 0, sc->spheres);
+  if (!err) err = write_section(fp, h.sections + 1, sc->checkerboards);
+  if (!err) err = write_section(fp, h.sections + 2, sc->lights);
+  if (!err) err = write_section(fp, h.sections + 3, sc->group_spheres);
+  if (!err) err = write_section(fp, h.sections + 4, sc->groups);
+  if (!err) err = write_section(fp, h.sections + 5, sc->instances);
+  if (!err) err = write_section(fp, h.sections + 6, sc->primitives);
+  if (!err) err = write_section(fp, h.sections + 7, sc->materials);
+  if (!err) err = write_section(fp, h.sections + 8, sc->mesh_vertices);
+  if (!err) err = write_section(fp, h.sections + 9, sc->mesh_triangles);
+  if (!err) err = write_section(fp, h.sections + 10, sc->meshes);
+  /* Pad out the final section, so the file size covers it. */
+  if (!err) err = ftruncate(fileno(fp), offset);
+
+  if (fclose(fp) != 0) {
+    err = -1;
+  }
+  if (err) {
+    fprintf(stderr, "Error writing %s.\n", filename);
+  }
+  return err;
+}
+
+/* Check that groups and instances only refer to things that exist. */
+static int check_instances(scene const *sc)
+{
+  int i;
+  for (i = 0; i < sc->num_groups; i++) {
+    sphere_group const *g = sc->groups + i;
+    if (g->first < 0 || g->count < 0 ||
+        g->first > sc->num_group_spheres ||
+        g->count > sc->num_group_spheres - g->first) {
+      return -1;
+    }
+  }
+  for (i = 0; i < sc->num_instances; i++) {
+    instance const *inst = sc->instances + i;
+    if (inst->group < 0 || inst->group >= sc->num_groups ||
+        !(inst->scale > 0.0)) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/* Check that primitives have known types and materials. */
+static int check_primitives(scene const *sc)
+{
+  int i;
+  for (i = 0; i < sc->num_primitives; i++) {
+    primitive const *p = sc->primitives + i;
+    if ((unsigned)p->type >= num_prim_types ||
+        p->material < 0 || p->material >= sc->num_materials) {
+      return -1;
+    }
+  }
+  for (i = 0; i < sc->num_materials; i++) {
+    material const *m = sc->materials + i;
+    if ((unsigned)m->type >= num_material_types ||
+        (m->type == material_checker && !(m->size > 0.0))) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/* Check that meshes cover the triangles in order, and that their
+ * corners are in range. This touches every triangle, but it's far
+ * cheaper than building the tree over them.
+ */
+static int check_meshes(scene const *sc)
+{
+  int i, j, k;
+  int next_triangle = 0;
+  for (i = 0; i < sc->num_meshes; i++) {
+    mesh const *m = sc->meshes + i;
+    if (m->first_triangle != next_triangle || m->num_triangles < 0 ||
+        m->num_triangles > sc->num_mesh_triangles - next_triangle ||
+        m->first_vertex < 0 || m->num_vertices < 0 ||
+        m->first_vertex > sc->num_mesh_vertices ||
+        m->num_vertices > sc->num_mesh_vertices - m->first_vertex ||
+        m->material < 0 || m->material >= sc->num_materials) {
+      return -1;
+    }
+    for (j = 0; j < m->num_triangles; j++) {
+      mesh_triangle const *t = sc->mesh_triangles + m->first_triangle + j;
+      for (k = 0; k < 3; k++) {
+        if (t->v[k] < 0 || t->v[k] >= m->num_vertices) {
+          return -1;
+        }
+      }
+    }
+    next_triangle += m->num_triangles;
+  }
+  return next_triangle == sc->num_mesh_triangles ? 0 : -1;
+}
+
+/* Find a section, checking it lies within the file. */
+static void *find_section(scene_file *sf, header const *h,
+                          section_type type, size_t elem_size, int *count)
+{
+  unsigned i;
+  for (i = 0; i < h->num_sections; i++) {
+    section const *s = h->sections + i;
+    if (s->type != type) {
+      continue;
+    }
+    if (s->elem_size != elem_size ||
+        s->offset % SCENE_FILE_ALIGN != 0 ||
+        s->count > (uint64_t)INT32_MAX ||
+        s->offset > sf->map_size ||
+        s->count * s->elem_size > sf->map_size - s->offset) {
+      return NULL;
+    }
+    *count = s->count;
+    return (char *)sf->map + s->offset;
+  }
+  /* Missing sections are just empty. */
+  *count = 0;
+  return (char *)sf->map;
+}
+
+scene_file *scene_file_load(char const *filename)
+{
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "Couldn't open %s.\n", filename);
+    return NULL;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < (off_t)HEADER_V1_SIZE) {
+    fprintf(stderr, "%s is not a scene file.\n", filename);
+    close(fd);
+    return NULL;
+  }
+
+  /* Private mapping, so that scene callbacks may scribble on the
+   * geometry without touching the file.
+   */
+  void *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                   fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    fprintf(stderr, "Couldn't map %s.\n", filename);
+    return NULL;
+  }
+
+  scene_file *sf = (scene_file *)malloc(sizeof(scene_file));
+  sf->sc.arena = NULL;
+  sf->map = map;
+  sf->map_size = st.st_size;
+
+  header const *h = (header const *)map;
+  if (memcmp(h->magic, SCENE_FILE_MAGIC, sizeof(h->magic)) != 0 ||
+      h->byte_order != SCENE_FILE_BYTE_ORDER ||
+      (h->header_size != sizeof(header) &&
+       h->header_size != HEADER_V4_SIZE &&
+       h->header_size != HEADER_V3_SIZE &&
+       h->header_size != HEADER_V2_SIZE &&
+       h->header_size != HEADER_V1_SIZE) ||
+      st.st_size < (off_t)h->header_size ||
+      h->num_sections > SCENE_FILE_MAX_SECTIONS) {
+    fprintf(stderr, "%s is not a scene file for this machine.\n", filename);
+    scene_file_unload(sf);
+    return NULL;
+  }
+  if (h->version != SCENE_FILE_VERSION) {
+    fprintf(stderr, "%s has version %u, expected %u.\n",
+            filename, h->version, SCENE_FILE_VERSION);
+    scene_file_unload(sf);
+    return NULL;
+  }
+
+  scene *sc = &sf->sc;
+  sc->spheres = (sphere *)find_section(sf, h, section_spheres,
+                                       sizeof(sphere), &sc->num_spheres);
+  sc->checkerboards =
+    (checkerboard *)find_section(sf, h, section_checkerboards,
+                                 sizeof(checkerboard),
+                                 &sc->num_checkerboards);
+  sc->lights = (light *)find_section(sf, h, section_lights,
+                                     sizeof(light), &sc->num_lights);
+  sc->group_spheres =
+    (sphere *)find_section(sf, h, section_group_spheres,
+                           sizeof(sphere), &sc->num_group_spheres);
+  sc->groups = (sphere_group *)find_section(sf, h, section_groups,
+                                            sizeof(sphere_group),
+                                            &sc->num_groups);
+  sc->instances = (instance *)find_section(sf, h, section_instances,
+                                           sizeof(instance),
+                                           &sc->num_instances);
+  sc->primitives = (primitive *)find_section(sf, h, section_primitives,
+                                             sizeof(primitive),
+                                             &sc->num_primitives);
+  sc->materials = (material *)find_section(sf, h, section_materials,
+                                           sizeof(material),
+                                           &sc->num_materials);
+  sc->mesh_vertices =
+    (mesh_vertex *)find_section(sf, h, section_mesh_vertices,
+                                sizeof(mesh_vertex), &sc->num_mesh_vertices);
+  sc->mesh_triangles =
+    (mesh_triangle *)find_section(sf, h, section_mesh_triangles,
+                                  sizeof(mesh_triangle),
+                                  &sc->num_mesh_triangles);
+  sc->meshes = (mesh *)find_section(sf, h, section_meshes,
+                                    sizeof(mesh), &sc->num_meshes);
+  if (!sc->spheres || !sc->checkerboards || !sc->lights ||
+      !sc->group_spheres || !sc->groups || !sc->instances ||
+      !sc->primitives || !sc->materials ||
+      !sc->mesh_vertices || !sc->mesh_triangles || !sc->meshes ||
+      check_instances(sc) != 0 || check_primitives(sc) != 0 ||
+      check_meshes(sc) != 0) {
+    fprintf(stderr, "%s is corrupt.\n", filename);
+    scene_file_unload(sf);
+    return NULL;
+  }
+
+  sc->num_samples = h->num_samples;
+  sc->light_samples = h->light_samples;
+  sc->light_table = NULL;
+  sc->instance_accel = NULL;
+  sc->prim_accel = NULL;
+  sc->mesh_accel = NULL;
+  sc->blur_size = h->blur_size;
+  sc->antialias_size = h->antialias_size;
+  sc->focal_depth = h->focal_depth;
+  if (h->header_size >= sizeof(header)) {
+    sc->max_depth = h->exact_max_depth;
+    sc->rr_depth = h->exact_rr_depth;
+  } else if (h->header_size >= HEADER_V2_SIZE) {
+    sc->max_depth = h->max_depth > 0 ? h->max_depth : DEPTH_UNSET;
+    sc->rr_depth = h->rr_depth > 0 ? h->rr_depth : DEPTH_UNSET;
+  } else {
+    sc->max_depth = DEPTH_UNSET;
+    sc->rr_depth = DEPTH_UNSET;
+  }
+  sc->rr_survival = h->header_size >= HEADER_V2_SIZE ? h->rr_survival : 0.0;
+  if (h->header_size >= HEADER_V3_SIZE) {
+    sc->num_photons = h->num_photons;
+    sc->photon_gather = h->photon_gather;
+    sc->photon_radius = h->photon_radius;
+  } else {
+    sc->num_photons = 0;
+    sc->photon_gather = 0;
+    sc->photon_radius = 0.0;
+  }
+  if (h->header_size >= HEADER_V4_SIZE) {
+    sc->ambient_samples = h->ambient_samples;
+    sc->ambient_accuracy = h->ambient_accuracy;
+    sc->ambient = h->ambient;
+  } else {
+    sc->ambient_samples = 0;
+    sc->ambient_accuracy = 0.0;
+    sc->ambient.r = sc->ambient.g = sc->ambient.b = 0.0;
+  }
+  sc->photon_map = NULL;
+  sc->callback = NULL;
+  /* Just for the odd table render builds - the geometry is mapped. */
+  sc->arena = arena_create(4096);
+  sf->width = h->width;
+  sf->height = h->height;
+
+  return sf;
+}
+
+void scene_file_unload(scene_file *sf)
+{
+  if (sf->sc.arena) {
+    arena_destroy(sf->sc.arena);
+  }
+  munmap(sf->map, sf->map_size);
+  free(sf);
+}
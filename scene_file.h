@@ -0,0 +1,48 @@
+/*
+ * scene_file.h: Binary scene files, mapped straight into memory.
+ *
+ * (C) Copyright Simon Frankau 1999-2014
+ */
+
+#ifndef SCENE_FILE_H_INCLUDED
+#define SCENE_FILE_H_INCLUDED
+
+#include <stddef.h>
+
+#include "tracer.h"
+
+/* ------------------------------------------------------------------
+ * Data types
+ */
+
+/* A scene loaded from a file. The geometry arrays in 'sc' point
+ * directly into the mapped file, so nothing is copied on load.
+ */
+typedef struct {
+  scene sc;
+  /* Image size the scene was set up for. */
+  int width;
+  int height;
+  void *map;
+  size_t map_size;
+} scene_file;
+
+/* ------------------------------------------------------------------
+ * Exported functions
+ */
+
+/* Write a scene out. Callbacks can't be saved, and are dropped.
+ * Returns 0 on success.
+ */
+int scene_file_save(scene const *sc, int width, int height,
+                    char const *filename);
+
+/* Map a scene file into memory. Returns NULL (having printed why) on
+ * failure.
+ */
+scene_file *scene_file_load(char const *filename);
+
+/* Unmap a loaded scene. */
+void scene_file_unload(scene_file *sf);
+
+#endif // SCENE_FILE_H_INCLUDED
@@ -0,0 +1,183 @@
+/*
+ * shapes.c: Things other than spheres
+ *
+ * A box, a capped cylinder, a pyramid and a disc, on a plane with a
+ * checker material, next to a sphere for old times' sake.
+ *
+ * (C) Copyright Simon Frankau 1999-2014
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "arena.h"
+#include "tracer.h"
+#include "png_render.h"
+#include "scene_file.h"
+
+#define WIDTH 1024
+#define HEIGHT 512
+
+static light lights[] = {
+  {{10.0, 10.0, 3.0}, {1.0, 1.0, 1.0}, {0.0, 0.0, 0.0}, {0.0, 0.0, 0.0}},
+};
+static int num_lights = 1;
+
+static void set_surface(surface *s, double r, double g, double b, double shine)
+{
+  s->diffuse.r = r;
+  s->diffuse.g = g;
+  s->diffuse.b = b;
+
+  s->specular.r
+    = s->specular.g
+    = s->specular.b
+    = shine;
+
+  s->reflective.r
+    = s->reflective.g
+    = s->reflective.b
+    = shine;
+
+  s->transparency.r
+    = s->transparency.g
+    = s->transparency.b
+    = 0.0;
+
+  s->refractive_index = 1.0;
+}
+
+static void set_vector(vector *v, double x, double y, double z)
+{
+  v->x = x;
+  v->y = y;
+  v->z = z;
+}
+
+static void set_triangle(primitive *p, int mat, vector a, vector b, vector c)
+{
+  p->type = prim_triangle;
+  p->material = mat;
+  p->a = a;
+  p->b = b;
+  p->c = c;
+}
+
+static scene *make_scene(arena *a)
+{
+  /* Checkered floor, then a material per shape. */
+  int num_materials = 5;
+  material *materials =
+    (material *)arena_calloc(a, num_materials, sizeof(material));
+  materials[0].type = material_checker;
+  materials[0].size = 1.0;
+  set_surface(&materials[0].s1, 0.9, 0.9, 0.9, 0.0);
+  set_surface(&materials[0].s2, 0.1, 0.1, 0.1, 0.0);
+  int i;
+  for (i = 1; i < num_materials; i++) {
+    colour c = colour_phase((double)i / num_materials);
+    materials[i].type = material_plain;
+    set_surface(&materials[i].s1, c.r, c.g, c.b, 0.4);
+  }
+
+  int num_primitives = 9;
+  primitive *prims =
+    (primitive *)arena_calloc(a, num_primitives, sizeof(primitive));
+  primitive *p = prims;
+
+  /* The floor. */
+  p->type = prim_plane;
+  p->material = 0;
+  set_vector(&p->a, 0.0, 1.0, 0.0);
+  p->d = -2.0;
+  p++;
+
+  /* A box. */
+  p->type = prim_box;
+  p->material = 1;
+  set_vector(&p->a, -5.0, -2.0, 5.0);
+  set_vector(&p->b, -3.0, 0.0, 7.0);
+  p++;
+
+  /* A cylinder with a lid. */
+  p->type = prim_cylinder;
+  p->material = 2;
+  set_vector(&p->a, -0.5, -2.0, 8.0);
+  set_vector(&p->b, 0.0, 3.0, 0.0);
+  p->d = 1.0;
+  p++;
+  p->type = prim_disc;
+  p->material = 2;
+  set_vector(&p->a, -0.5, 1.0, 8.0);
+  set_vector(&p->b, 0.0, 1.0, 0.0);
+  p->d = 1.0;
+  p++;
+
+  /* A square-based pyramid, without the base. */
+  vector apex = { 3.0, 0.5, 7.0 };
+  vector base[4] = {
+    { 2.0, -2.0, 6.0 }, { 4.0, -2.0, 6.0 },
+    { 4.0, -2.0, 8.0 }, { 2.0, -2.0, 8.0 }
+  };
+  for (i = 0; i < 4; i++) {
+    set_triangle(p++, 3, base[i], base[(i + 1) % 4], apex);
+  }
+
+  /* A disc standing on its edge. */
+  p->type = prim_disc;
+  p->material = 4;
+  set_vector(&p->a, 6.5, -0.5, 10.0);
+  set_vector(&p->b, -1.0, 0.0, -1.0);
+  p->d = 1.5;
+  p++;
+
+  /* And a sphere, behind it all. */
+  int num_spheres = 1;
+  sphere *spheres = (sphere *)arena_alloc(a, num_spheres * sizeof(sphere));
+  set_vector(&spheres[0].center, 1.0, 0.0, 14.0);
+  spheres[0].radius = 2.0;
+  set_surface(&spheres[0].props, 0.8, 0.8, 0.8, 0.7);
+  spheres[0].fuzz_size = 0.0;
+  spheres[0].fuzz_style = none;
+
+ scene *result = (scene *)arena_calloc(a, 1, sizeof(scene));
+ result->spheres = spheres;
+ result->num_spheres = num_spheres;
+ result->lights = lights;
+ result->num_lights = num_lights;
+ result->primitives = prims;
+ result->num_primitives = p - prims;
+ result->materials = materials;
+ result->num_materials = num_materials;
+ result->light_samples = 0;
+ result->light_table = NULL;
+ result->prim_accel = NULL;
+
+ result->num_samples    = 4;
+ result->max_depth      = DEPTH_UNSET;
+ result->rr_depth       = DEPTH_UNSET;
+ result->blur_size      = 0.0;
+ result->antialias_size = 0.5;
+ result->focal_depth    = 0.0;
+ result->callback       = NULL;
+ result->arena          = a;
+
+ return result;
+}
+
+/* With a filename argument, save the scene there rather than
+ * rendering it.
+ */
+int main(int argc, char **argv) {
+  arena *scene_arena = arena_create(0);
+  scene *sc = make_scene(scene_arena);
+  int err = 0;
+  if (argc > 1) {
+    err = scene_file_save(sc, WIDTH, HEIGHT, argv[1]) ? 1 : 0;
+  } else {
+    png_render(sc, WIDTH, HEIGHT, "shapes.png");
+  }
+  arena_destroy(scene_arena);
+  return err;
+}
@@ -8,8 +8,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#include "arena.h"
 #include "tracer.h"
 #include "png_render.h"
+#include "scene_file.h"
 
 #define WIDTH 512
 #define HEIGHT 512
@@ -49,7 +51,7 @@ static void set_surface(surface *s, double r, double g, double b, double shine)
 }
 
 /* Make a spherical shell filled with spheres. */
-static scene *make_scene()
+static scene *make_scene(arena *a)
 {
   /* Place the checkerboard */
   checkerboards.normal.x = 0.0;
@@ -62,7 +64,7 @@ static scene *make_scene()
 
   /* Place a set of spheres. */
   int num_spheres = 1;
-  sphere *spheres = (sphere *)malloc(num_spheres * sizeof(sphere));
+  sphere *spheres = (sphere *)arena_alloc(a, num_spheres * sizeof(sphere));
 
   vector pos = { 0.0, 0.0, 5.0 };
 
@@ -74,25 +76,40 @@ static scene *make_scene()
   spheres->fuzz_size = 0.0;
   spheres->fuzz_style = none;
 
-  scene *result = (scene *)malloc(sizeof(scene));
+  scene *result = (scene *)arena_calloc(a, 1, sizeof(scene));
   result->spheres = spheres;
   result->num_spheres = num_spheres;
   result->checkerboards = &checkerboards;
   result->num_checkerboards = num_checkerboards;
   result->lights = lights;
   result->num_lights = num_lights;
+  result->light_samples = 0;
+  result->light_table = NULL;
 
   result->num_samples    = 1000;
+  result->max_depth      = DEPTH_UNSET;
+  result->rr_depth       = DEPTH_UNSET;
   result->blur_size      = 0.0;
   result->antialias_size = 0.5;
   result->focal_depth    = 0.0;
   result->callback       = NULL;
+  result->arena          = a;
 
   return result;
 }
 
-int main(void) {
-  scene *sc = make_scene();
-  png_render(sc, WIDTH, HEIGHT, "soft.png");
-  return 0;
+/* With a filename argument, save the scene there rather than
+ * rendering it.
+ */
+int main(int argc, char **argv) {
+  arena *scene_arena = arena_create(0);
+  scene *sc = make_scene(scene_arena);
+  int err = 0;
+  if (argc > 1) {
+    err = scene_file_save(sc, WIDTH, HEIGHT, argv[1]) ? 1 : 0;
+  } else {
+    png_render(sc, WIDTH, HEIGHT, "soft.png");
+  }
+  arena_destroy(scene_arena);
+  return err;
 }
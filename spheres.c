@@ -9,8 +9,10 @@
 #include <stdlib.h>
 #include <time.h>
 
+#include "arena.h"
 #include "tracer.h"
 #include "png_render.h"
+#include "scene_file.h"
 
 #define WIDTH 512
 #define HEIGHT 512
@@ -57,17 +59,13 @@ static void set_surface(surface *s)
 }
 
 /* Make a spherical shell filled with spheres. */
-static scene *make_scene(double min, double max, int count)
+static scene *make_scene(arena *a, double min, double max, int count)
 {
  double radius, theta, phi, cosphi;
  double dist;
  int i, j;
 
- sphere *spheres = (sphere *)malloc(count * sizeof(sphere));
- if (!spheres) {
-   printf("Couldn't allocated spheres storage.\n");
-   exit(1);
- }
+ sphere *spheres = (sphere *)arena_alloc(a, count * sizeof(sphere));
  int num_spheres = count;
 
  printf("Making spheres (%d):\n", count);
@@ -118,30 +116,45 @@ static scene *make_scene(double min, double max, int count)
  set_surface(&checkerboards.p2);
  int num_checkerboards = 1;
 
- scene *result = (scene *)malloc(sizeof(scene));
+ scene *result = (scene *)arena_calloc(a, 1, sizeof(scene));
  result->spheres = spheres;
  result->num_spheres = num_spheres;
  result->checkerboards = &checkerboards;
  result->num_checkerboards = num_checkerboards;
  result->lights = lights;
  result->num_lights = num_lights;
+ result->light_samples = 0;
+ result->light_table = NULL;
  result->num_samples = 1;
+ result->max_depth = DEPTH_UNSET;
+ result->rr_depth = DEPTH_UNSET;
  result->blur_size = 0.0;
  result->antialias_size = 0.0;
  result->focal_depth = 0.0;
  result->callback = NULL;
+ result->arena = a;
 
  return result;
 }
 
-int main(void) {
+/* With a filename argument, save the scene there rather than
+ * rendering it, so it can be reloaded without regenerating.
+ */
+int main(int argc, char **argv) {
 #ifdef DEBUG
  srand(0);
 #else
  srand(time(NULL));
 #endif
 
- scene *sc = make_scene(5, 10, 1000);
- png_render(sc, WIDTH, HEIGHT, "spheres.png");
- return 0;
+ arena *scene_arena = arena_create(0);
+ scene *sc = make_scene(scene_arena, 5, 10, 1000);
+ int err = 0;
+ if (argc > 1) {
+   err = scene_file_save(sc, WIDTH, HEIGHT, argv[1]) ? 1 : 0;
+ } else {
+   png_render(sc, WIDTH, HEIGHT, "spheres.png");
+ }
+ arena_destroy(scene_arena);
+ return err;
 }
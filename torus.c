@@ -0,0 +1,165 @@
+/*
+ * torus.c: Triangle mesh demo
+ *
+ * A finely tessellated twisted torus - a quarter of a million
+ * triangles - on a checkered plane.
+ *
+ * (C) Copyright Simon Frankau 1999-2014
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "arena.h"
+#include "tracer.h"
+#include "png_render.h"
+#include "scene_file.h"
+
+#define WIDTH 1024
+#define HEIGHT 512
+
+/* Segments around the ring, and around the tube. */
+#define RING 512
+#define TUBE 256
+
+static light lights[] = {
+  {{10.0, 10.0, 3.0}, {1.0, 1.0, 1.0}, {0.0, 0.0, 0.0}, {0.0, 0.0, 0.0}},
+};
+static int num_lights = 1;
+
+static void set_surface(surface *s, double r, double g, double b, double shine)
+{
+  s->diffuse.r = r;
+  s->diffuse.g = g;
+  s->diffuse.b = b;
+
+  s->specular.r
+    = s->specular.g
+    = s->specular.b
+    = shine;
+
+  s->reflective.r
+    = s->reflective.g
+    = s->reflective.b
+    = shine;
+
+  s->transparency.r
+    = s->transparency.g
+    = s->transparency.b
+    = 0.0;
+
+  s->refractive_index = 1.0;
+}
+
+static scene *make_scene(arena *a)
+{
+  int num_materials = 2;
+  material *materials =
+    (material *)arena_calloc(a, num_materials, sizeof(material));
+  materials[0].type = material_checker;
+  materials[0].size = 1.0;
+  set_surface(&materials[0].s1, 0.9, 0.9, 0.9, 0.0);
+  set_surface(&materials[0].s2, 0.1, 0.1, 0.1, 0.0);
+  materials[1].type = material_plain;
+  set_surface(&materials[1].s1, 0.8, 0.5, 0.2, 0.3);
+
+  int num_primitives = 1;
+  primitive *prims =
+    (primitive *)arena_calloc(a, num_primitives, sizeof(primitive));
+  prims[0].type = prim_plane;
+  prims[0].material = 0;
+  prims[0].a.y = 1.0;
+  prims[0].d = -2.0;
+
+  /* A torus tilted towards us, whose tube wobbles in and out as it
+   * goes round, so that it isn't all smooth.
+   */
+  int num_vertices = RING * TUBE;
+  int num_triangles = 2 * RING * TUBE;
+  mesh_vertex *vertices =
+    (mesh_vertex *)arena_alloc(a, num_vertices * sizeof(mesh_vertex));
+  mesh_triangle *triangles =
+    (mesh_triangle *)arena_alloc(a, num_triangles * sizeof(mesh_triangle));
+  double tilt = 0.6;
+  int i, j;
+  for (i = 0; i < RING; i++) {
+    double u = 2.0 * M_PI * i / RING;
+    double tube = 0.6 + 0.15 * sin(12.0 * u);
+    for (j = 0; j < TUBE; j++) {
+      double v = 2.0 * M_PI * j / TUBE;
+      double x = (2.0 + tube * cos(v)) * cos(u);
+      double y = tube * sin(v);
+      double z = (2.0 + tube * cos(v)) * sin(u);
+      mesh_vertex *mv = vertices + i * TUBE + j;
+      mv->x = x;
+      mv->y = y * cos(tilt) - z * sin(tilt) + 0.8;
+      mv->z = y * sin(tilt) + z * cos(tilt) + 9.0;
+    }
+  }
+  mesh_triangle *t = triangles;
+  for (i = 0; i < RING; i++) {
+    int i2 = (i + 1) % RING;
+    for (j = 0; j < TUBE; j++) {
+      int j2 = (j + 1) % TUBE;
+      t->v[0] = i * TUBE + j;
+      t->v[1] = i2 * TUBE + j;
+      t->v[2] = i2 * TUBE + j2;
+      t++;
+      t->v[0] = i * TUBE + j;
+      t->v[1] = i2 * TUBE + j2;
+      t->v[2] = i * TUBE + j2;
+      t++;
+    }
+  }
+
+  int num_meshes = 1;
+  mesh *meshes = (mesh *)arena_calloc(a, num_meshes, sizeof(mesh));
+  meshes[0].num_vertices = num_vertices;
+  meshes[0].num_triangles = num_triangles;
+  meshes[0].material = 1;
+
+ scene *result = (scene *)arena_calloc(a, 1, sizeof(scene));
+ result->lights = lights;
+ result->num_lights = num_lights;
+ result->primitives = prims;
+ result->num_primitives = num_primitives;
+ result->materials = materials;
+ result->num_materials = num_materials;
+ result->mesh_vertices = vertices;
+ result->num_mesh_vertices = num_vertices;
+ result->mesh_triangles = triangles;
+ result->num_mesh_triangles = num_triangles;
+ result->meshes = meshes;
+ result->num_meshes = num_meshes;
+ result->light_samples = 0;
+ result->light_table = NULL;
+ result->mesh_accel = NULL;
+
+ result->num_samples    = 4;
+ result->max_depth      = DEPTH_UNSET;
+ result->rr_depth       = DEPTH_UNSET;
+ result->blur_size      = 0.0;
+ result->antialias_size = 0.5;
+ result->focal_depth    = 0.0;
+ result->callback       = NULL;
+ result->arena          = a;
+
+ return result;
+}
+
+/* With a filename argument, save the scene there rather than
+ * rendering it.
+ */
+int main(int argc, char **argv) {
+  arena *scene_arena = arena_create(0);
+  scene *sc = make_scene(scene_arena);
+  int err = 0;
+  if (argc > 1) {
+    err = scene_file_save(sc, WIDTH, HEIGHT, argv[1]) ? 1 : 0;
+  } else {
+    png_render(sc, WIDTH, HEIGHT, "torus.png");
+  }
+  arena_destroy(scene_arena);
+  return err;
+}
@@ -5,11 +5,28 @@
  */
 
 #include <assert.h>
+#include <limits.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
-
+#include <time.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "bvh.h"
+#include "fastmath.h"
+#include "gbuffer.h"
+#include "irradiance.h"
+#include "mesh.h"
+#include "numa.h"
+#include "photon.h"
+#include "prims.h"
 #include "tracer.h"
+#include "framebuffer.h"
 
 /* ------------------------------------------------------------------
  * Macros
@@ -17,14 +34,64 @@
 
 /* #define DEBUG */
 
-#define REFLECTSTOP 0.1
+/* Defaults for the scene's path length settings. */
+#define DEFAULT_MAX_DEPTH 32
+#define DEFAULT_RR_DEPTH 2
+
+/* Default photons gathered per caustic estimate, and default search
+ * radius as a fraction of the largest sphere photons are shot through.
+ */
+#define DEFAULT_PHOTON_GATHER 64
+#define DEFAULT_PHOTON_RADIUS 0.125
+
+/* Photons traced per batch. Batches are seeded by number, so that the
+ * photon map doesn't depend on how many threads trace it.
+ */
+#define PHOTON_BATCH 4096
+
+/* Default largest error of interpolated ambient light. Lookups while
+ * rendering may go this many times over, rather than make a fresh
+ * estimate.
+ */
+#define DEFAULT_AMBIENT_ACCURACY 0.2
+#define AMBIENT_SLACK 2.0
+
+/* Most rays for one ambient estimate. */
+#define AMBIENT_MAX_SAMPLES 1024
+
+/* Smallest and largest regions an ambient estimate may cover, in
+ * pixels across where it's seen.
+ */
+#define AMBIENT_MIN_PIXELS 1.5
+#define AMBIENT_MAX_PIXELS 20.0
+
+/* The pass filling the irradiance cache visits every pixel this many
+ * pixels apart first, then halves the spacing until it has visited
+ * them all, following each pixel's ray for this many surfaces hit.
+ */
+#define AMBIENT_PREPASS_SPACING 16
+#define AMBIENT_PREPASS_DEPTH 3
+
+/* Pixels the pass traces between adding to the cache. */
+#define AMBIENT_PREPASS_CHUNK 4096
+
+/* Times light may be reflected back inside a solid primitive before
+ * it's let out unbent.
+ */
+#define MAX_INTERNAL_REFLECTIONS 8
+
+/* Phong exponent of specular highlights. */
+#define SPECULAR_POWER 10
 
 #ifndef INFINITY
 #define INFINITY (1.0 / 0.0)
 #endif
-#ifndef EPSILON
-#define EPSILON 1.0e-7
-#endif
+
+/* Range of tracer_rand(), like RAND_MAX. */
+#define TRACER_RAND_MAX 0x7fffffff
+
+/* Entries in each thread's shadow cache. Must be a power of 2. */
+#define SHADOW_CACHE_SIZE 1024
 
 #define SHADE(c, i, k, p) { \
     c.r += i.r * k.r * p; \
@@ -33,28 +100,110 @@
   }
 
 /* ------------------------------------------------------------
- * Global variables
+ * Data types
+ */
+
+/* What a primary ray hit, for feature buffers. */
+typedef struct {
+  surface const *surf;
+  vector normal;
+  double dist;
+} hit_info;
+
+/* What a point light looks like through the scene from a grid cell. */
+typedef struct {
+  int64_t x, y, z;
+  int light;
+  /* Only entries from the current pixel count. */
+  unsigned generation;
+  colour transmitted;
+} shadow_entry;
+
+/* Trees over the instances, and over each group's spheres in the
+ * group's own space.
+ */
+typedef struct instance_accel_t {
+  bvh *top;
+  bvh **groups;
+} instance_accel;
+
+/* What a worker keeps to itself while tracing, passed down to
+ * everything that needs it, so that any number of renders can run at
+ * once.
+ */
+typedef struct {
+  /* Random number state, seeded per pixel so that the noise is
+   * reproducible however the image is split into tiles, threads and
+   * regions.
+   */
+  uint64_t rand_state;
+  /* The shadow cache in use (NULL if off), and its grid. */
+  shadow_entry *shadow_cache;
+  double shadow_inv_cell;
+  unsigned shadow_generation;
+  /* The cache's memory, kept between renders by context workers. */
+  shadow_entry *shadow_store;
+  /* Ambient light estimates for the render in hand, or NULL. */
+  irradiance_cache const *irradiance;
+  /* Counts since the worker started. */
+  render_stats stats;
+} worker_state;
+
+/* Work for a context's workers: any number of them may call 'run' at
+ * once, each returning when there's nothing left for it to take.
+ */
+typedef struct context_task_t {
+  void (*run)(void *data, worker_state *ws);
+  void *data;
+  /* The most workers that may share the task, how many are on it,
+   * and whether they're all done. Guarded by the context's lock.
+   */
+  int max_workers;
+  int active;
+  int finished;
+  struct context_task_t *next_queued;
+} context_task;
+
+/* ------------------------------------------------------------
+ * Constants
  */
 
 /* These 2 are for convenience. */
-colour white = {1.0, 1.0, 1.0};
-colour black = {0.0, 0.0, 0.0};
+static colour const white = {1.0, 1.0, 1.0};
+static colour const black = {0.0, 0.0, 0.0};
 
 /* ------------------------------------------------------------
  * Function prototypes.
  */
 
+/* Trace a ray, 'depth' bounces from the camera */
+static colour trace(worker_state *ws, scene const *sc, vector from,
+                    vector dir, colour premul, int depth);
+static colour trace_hit(worker_state *ws, scene const *sc, vector from,
+                        vector dir, colour premul, int depth, hit_info *hit,
+                        gbuffer_sample *save);
+
 /* Trace a unit ray, to find an intersection */
-static surface *intersect(scene const *sc, vector from, vector direction,
+static surface *intersect(worker_state *ws, scene const *sc,
+                          vector from, vector direction,
                           double *dist, vector *normal,
 			  vector *trans_w, vector *trans_dir,
 			  double *trans_dist);
 
 /* Texture a point */
-static void texture(scene const *sc, surface const *surf,
+static void texture(worker_state *ws, scene const *sc, surface const *surf,
                     vector w, vector n, vector dir,
 		    vector trans_w, vector trans_dir, double trans_dist,
-		    colour *colour);
+		    int depth, colour *colour);
+
+/* Number a surface for G-buffers, and find it again */
+static int surface_id(scene const *sc, surface const *s);
+static surface const *surface_from_id(scene const *sc, int id);
+
+/* Run a task on the context's workers, or on the calling thread if
+ * 'ctx' is NULL, and wait for it to finish.
+ */
+static void run_task(render_context *ctx, context_task *task);
 
 /* ------------------------------------------------------------
  * Functions.
@@ -73,8 +222,8 @@ colour colour_phase(double x)
   c2.r = sqrt(1.0 / 6.0); c2.g = c2.r; c2.b = -2.0 * c2.r;
 
   double phase = x * 2 * M_PI;
-  double colour_cos = cos(phase);
-  double colour_sin = sin(phase);
+  double colour_cos, colour_sin;
+  fm_sincos(phase, &colour_sin, &colour_cos);
 
   /* Construct point and normalise back to unit cube. */
   colour c;
@@ -85,21 +234,81 @@ colour colour_phase(double x)
   return c;
 }
 
+/* Seed with a splitmix64 hash, so nearby seeds give unrelated
+ * sequences.
+ */
+static void tracer_srand(worker_state *ws, uint64_t seed)
+{
+  uint64_t z = seed + 0x9e3779b97f4a7c15ULL;
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  z ^= z >> 31;
+  /* xorshift must not start at zero. */
+  ws->rand_state = z ? z : 1;
+}
+
+/* xorshift64*, returning 31 bits like rand(). */
+static int tracer_rand(worker_state *ws)
+{
+  ws->rand_state ^= ws->rand_state >> 12;
+  ws->rand_state ^= ws->rand_state << 25;
+  ws->rand_state ^= ws->rand_state >> 27;
+  return (int)((ws->rand_state * 0x2545f4914f6cdd1dULL) >> 33);
+}
+
+/* Pick a light from the table. */
+static int light_table_pick(worker_state *ws, light_table const *t)
+{
+  double u = tracer_rand(ws) / (TRACER_RAND_MAX + 1.0) * t->num_lights;
+  int i = (int)u;
+  return (u - i) < t->prob[i] ? i : t->alias[i];
+}
+
+/* Should lights be sampled from the table, rather than all shaded?
+ * Not if the samples would cover every light anyway: looping over them
+ * is cheaper, and free of noise.
+ */
+static int sample_lights(scene const *sc)
+{
+  return sc->light_samples > 0 && sc->light_samples < sc->num_lights;
+}
+
 /* Find the colour for a given ray. Rather than post-multiply for
  * absorbtion further down the line, we pre-multiply, allowing us
  * to cut off at an appropriate point.
  */
-static colour trace(scene const *sc, vector from, vector dir, colour premul)
+static colour trace(worker_state *ws, scene const *sc, vector from,
+                    vector dir, colour premul, int depth)
 {
+  return trace_hit(ws, sc, from, dir, premul, depth, NULL, NULL);
+}
+
+/* As trace, but also fill in what the ray hit first (if 'hit' is
+ * non-NULL), and save it for re-shading (if 'save' is). 'hit->surf'
+ * is NULL on a miss.
+ */
+static colour trace_hit(worker_state *ws, scene const *sc, vector from,
+                        vector dir, colour premul, int depth, hit_info *hit,
+                        gbuffer_sample *save)
+{
+  ws->stats.rays++;
   double dist;
   vector normal;
   vector trans_w;
   vector trans_dir;
   double trans_dist;
-  surface *intersecting = intersect(sc, from, dir, &dist, &normal,
+  surface *intersecting = intersect(ws, sc, from, dir, &dist, &normal,
 				    &trans_w, &trans_dir, &trans_dist);
+  if (hit) {
+    hit->surf = intersecting;
+    hit->normal = normal;
+    hit->dist = dist;
+  }
   if (!intersecting) {
     /* Missed! Send ray off to darkest infinity */
+    if (save) {
+      save->surface = -1;
+    }
     return black;
   } else {
     /* Find point of intersection, w */
@@ -107,9 +316,21 @@ static colour trace(scene const *sc, vector from, vector dir, colour premul)
     MULT(w, dist);
     ADD(w, from);
 
+    if (save) {
+      save->w = w;
+      save->normal = normal;
+      save->dir = dir;
+      save->dist = dist;
+      save->trans_w = trans_w;
+      save->trans_dir = trans_dir;
+      save->trans_dist = trans_dist;
+      save->rand_state = ws->rand_state;
+      save->surface = surface_id(sc, intersecting);
+    }
+
     colour result = premul;
-    texture(sc, intersecting, w, normal, dir,
-	    trans_w, trans_dir, trans_dist, &result);
+    texture(ws, sc, intersecting, w, normal, dir,
+	    trans_w, trans_dir, trans_dist, depth, &result);
     return result;
   }
 }
@@ -131,25 +352,25 @@ static double sphere_intersect(sphere const *sp, vector from, vector dir)
 }
 
 /* Creates a random vector within the unit sphere */
-static vector random_vector()
+static vector random_vector(worker_state *ws)
 {
   vector v;
   do {
-    v.x = 2.0 * ((double)rand() / RAND_MAX) - 1.0;
-    v.y = 2.0 * ((double)rand() / RAND_MAX) - 1.0;
-    v.z = 2.0 * ((double)rand() / RAND_MAX) - 1.0;
+    v.x = 2.0 * ((double)tracer_rand(ws) / TRACER_RAND_MAX) - 1.0;
+    v.y = 2.0 * ((double)tracer_rand(ws) / TRACER_RAND_MAX) - 1.0;
+    v.z = 2.0 * ((double)tracer_rand(ws) / TRACER_RAND_MAX) - 1.0;
   } while (DOT(v, v) > 1);
   return v;
 }
 
-static vector sphere_normal(sphere const *sp, vector w)
+static vector sphere_normal(worker_state *ws, sphere const *sp, vector w)
 {
   vector n = w;
   SUB(n, sp->center);
   NORMALISE(n);
 
   if (sp->fuzz_size > 0.0 && sp->fuzz_style != none) {
-    vector r = random_vector();
+    vector r = random_vector(ws);
     switch (sp->fuzz_style) {
     case horizontal:
       r.y = 0.0;
@@ -290,8 +511,141 @@ static void plane_transmit(checkerboard const *pl, vector w, vector dir,
   }
 }
 
+/* Pass through a box or cylinder, refracting in and out, with the
+ * surface 'surf' that was hit and 'normal' facing back along 'dir'.
+ * Light meeting a face too steeply to leave is reflected back in.
+ */
+static void prim_transmit(primitive const *p, surface const *surf,
+                          vector w, vector dir, vector normal,
+                          vector *trans_w, vector *trans_dir,
+                          double *trans_dist)
+{
+  double index = surf->refractive_index > 0.0 ? surf->refractive_index
+                                              : 1.0;
+  MULT(normal, -1.0);
+  double cos_in = DOT(dir, normal);
+  if (index * index * (1.0 - cos_in * cos_in) < 1.0) {
+    dir = refract(dir, normal, index);
+  }
+
+  double total = 0.0;
+  int i;
+  for (i = 0; i <= MAX_INTERNAL_REFLECTIONS; i++) {
+    double dist;
+    vector out;
+    prim_exit(p, w, dir, &dist, &out);
+    vector through = dir;
+    MULT(through, dist);
+    ADD(w, through);
+    total += dist;
+
+    /* Can it get out? (See refract.) */
+    cos_in = DOT(dir, out);
+    int escapes = (1.0 - cos_in * cos_in) < index * index;
+    if (escapes || i == MAX_INTERNAL_REFLECTIONS) {
+      if (escapes) {
+        dir = refract(dir, out, 1.0 / index);
+      }
+      break;
+    }
+    MULT(out, 2.0 * cos_in);
+    SUB(dir, out);
+  }
+
+  if (trans_w) {
+    *trans_w = w;
+  }
+  if (trans_dir) {
+    *trans_dir = dir;
+  }
+  if (trans_dist) {
+    *trans_dist = total;
+  }
+}
+
+/* Find the nearest sphere of a group instance closer than
+ * '*nearest_dist'. The ray is moved into the group's space, where the
+ * distances are smaller by the instance's scale.
+ */
+static void intersect_group(scene const *sc, instance const *inst,
+                            vector from, vector dir,
+                            double *nearest_dist, sphere **nearest_sphere,
+                            instance const **nearest_instance)
+{
+  bvh const *tree = sc->instance_accel->groups[inst->group];
+  if (tree->num_nodes == 0) {
+    return;
+  }
+  sphere *spheres = sc->group_spheres + sc->groups[inst->group].first;
+
+  double inv_scale = 1.0 / inst->scale;
+  SUB(from, inst->offset);
+  MULT(from, inv_scale);
+  vector inv_dir = { 1.0 / dir.x, 1.0 / dir.y, 1.0 / dir.z };
+
+  int stack[BVH_STACK_SIZE];
+  int depth = 0;
+  stack[depth++] = 0;
+  while (depth > 0) {
+    bvh_node const *node = tree->nodes + stack[--depth];
+    if (!bbox_hit(&node->box, from, inv_dir, *nearest_dist * inv_scale)) {
+      continue;
+    }
+    if (node->count == 0) {
+      stack[depth++] = node->first;
+      stack[depth++] = node - tree->nodes + 1;
+      continue;
+    }
+    int i;
+    for (i = 0; i < node->count; i++) {
+      sphere *sp = spheres + tree->items[node->first + i];
+      double this_dist = sphere_intersect(sp, from, dir) * inst->scale;
+      if (EPSILON < this_dist && this_dist < *nearest_dist) {
+        *nearest_dist = this_dist;
+        *nearest_sphere = sp;
+        *nearest_instance = inst;
+      }
+    }
+  }
+}
+
+/* Find the nearest instanced sphere closer than '*nearest_dist'. */
+static void intersect_instances(scene const *sc, vector from, vector dir,
+                                double *nearest_dist,
+                                sphere **nearest_sphere,
+                                instance const **nearest_instance)
+{
+  bvh const *tree = sc->instance_accel->top;
+  if (tree->num_nodes == 0) {
+    return;
+  }
+  vector inv_dir = { 1.0 / dir.x, 1.0 / dir.y, 1.0 / dir.z };
+
+  int stack[BVH_STACK_SIZE];
+  int depth = 0;
+  stack[depth++] = 0;
+  while (depth > 0) {
+    bvh_node const *node = tree->nodes + stack[--depth];
+    if (!bbox_hit(&node->box, from, inv_dir, *nearest_dist)) {
+      continue;
+    }
+    if (node->count == 0) {
+      stack[depth++] = node->first;
+      stack[depth++] = node - tree->nodes + 1;
+      continue;
+    }
+    int i;
+    for (i = 0; i < node->count; i++) {
+      intersect_group(sc, sc->instances + tree->items[node->first + i],
+                      from, dir, nearest_dist, nearest_sphere,
+                      nearest_instance);
+    }
+  }
+}
+
 /* Trace a unit ray, to find an intersection */
-static surface *intersect(scene const *sc,
+static surface *intersect(worker_state *ws,
+                          scene const *sc,
                           vector from,
                           vector direction,
                           double *dist,
@@ -300,8 +654,10 @@ static surface *intersect(scene const *sc,
 			  vector *trans_dir,
 			  double *trans_dist)
 {
+  ws->stats.casts++;
   double nearest_dist = INFINITY;
   sphere *nearest_sphere = NULL;
+  instance const *nearest_instance = NULL;
   checkerboard *nearest_checkerboard = NULL;
   int i;
 
@@ -313,6 +669,11 @@ static surface *intersect(scene const *sc,
     }
   }
 
+  if (sc->instance_accel != NULL) {
+    intersect_instances(sc, from, direction, &nearest_dist,
+                        &nearest_sphere, &nearest_instance);
+  }
+
   for (i = 0; i < sc->num_checkerboards; i++) {
     double this_dist = plane_intersect(sc->checkerboards + i, from, direction);
     if (EPSILON < this_dist && this_dist < nearest_dist) {
@@ -322,6 +683,25 @@ static surface *intersect(scene const *sc,
     }
   }
 
+  int nearest_prim = -1;
+  if (sc->prim_accel != NULL) {
+    nearest_prim = prim_intersect(sc, from, direction, &nearest_dist);
+    if (nearest_prim >= 0) {
+      nearest_sphere = NULL;
+      nearest_checkerboard = NULL;
+    }
+  }
+
+  int nearest_triangle = -1;
+  if (sc->mesh_accel != NULL) {
+    nearest_triangle = mesh_intersect(sc, from, direction, &nearest_dist);
+    if (nearest_triangle >= 0) {
+      nearest_sphere = NULL;
+      nearest_checkerboard = NULL;
+      nearest_prim = -1;
+    }
+  }
+
   vector w = direction;
   MULT(w, nearest_dist);
   ADD(w, from);
@@ -331,10 +711,25 @@ static surface *intersect(scene const *sc,
   }
 
   if (nearest_sphere != NULL) {
-    sphere_transmit(nearest_sphere, w, direction,
+    /* Work on instanced spheres in their group's space. */
+    vector local_w = w;
+    if (nearest_instance != NULL) {
+      SUB(local_w, nearest_instance->offset);
+      MULT(local_w, 1.0 / nearest_instance->scale);
+    }
+    sphere_transmit(nearest_sphere, local_w, direction,
 		    trans_w, trans_dir, trans_dist);
+    if (nearest_instance != NULL) {
+      if (trans_w != NULL) {
+        MULT((*trans_w), nearest_instance->scale);
+        ADD((*trans_w), nearest_instance->offset);
+      }
+      if (trans_dist != NULL) {
+        *trans_dist *= nearest_instance->scale;
+      }
+    }
     if (normal != NULL) {
-      *normal = sphere_normal(nearest_sphere, w);
+      *normal = sphere_normal(ws, nearest_sphere, local_w);
     }
     return &(nearest_sphere->props);
   }
@@ -345,7 +740,9 @@ static surface *intersect(scene const *sc,
     if (normal != NULL) {
       *normal = plane_normal(nearest_checkerboard, w);
     }
-    /* Cheesy checkerboard hardwired... */
+    /* Cheesy checkerboard hardwired... Use a plane primitive with a
+     * checker material for anything new.
+     */
     int parity = (lrint(w.x) + lrint(w.z)) % 2;
 
     surface *surface = parity ?
@@ -355,19 +752,177 @@ static surface *intersect(scene const *sc,
     return surface;
   }
 
+  if (nearest_prim >= 0) {
+    primitive const *p = sc->primitives + nearest_prim;
+    surface *surf = material_surface(sc->materials + p->material, w);
+    if (prim_solid(p) && !IS_BLACK(surf->transparency)) {
+      prim_transmit(p, surf, w, direction, prim_normal(p, w, direction),
+                    trans_w, trans_dir, trans_dist);
+    } else {
+      /* Thin, like the checkerboard: straight through. */
+      plane_transmit(NULL, w, direction, trans_w, trans_dir, trans_dist);
+    }
+    if (normal != NULL) {
+      *normal = prim_normal(p, w, direction);
+    }
+    return surf;
+  }
+
+  if (nearest_triangle >= 0) {
+    plane_transmit(NULL, w, direction, trans_w, trans_dir, trans_dist);
+    if (normal != NULL) {
+      *normal = mesh_normal(sc, nearest_triangle, direction);
+    }
+    return material_surface(mesh_material(sc, nearest_triangle), w);
+  }
+
   return NULL;
 }
 
 static colour apply_transparency(surface const *surf, colour in, double dist)
 {
-  in.r *= pow(surf->transparency.r, dist);
-  in.g *= pow(surf->transparency.g, dist);
-  in.b *= pow(surf->transparency.b, dist);
+  in.r *= fm_pow(surf->transparency.r, dist);
+  in.g *= fm_pow(surf->transparency.g, dist);
+  in.b *= fm_pow(surf->transparency.b, dist);
   return in;
 }
 
-static colour check_visibility(scene const *sc,
-			       vector n, vector l, vector w, vector light_loc)
+/* Find the cache entry for light 'light_index' seen from 'w', and
+ * whether it's already filled in.
+ */
+static int shadow_lookup(worker_state *ws, vector w, int light_index,
+                         shadow_entry **entry)
+{
+  int64_t x = llrint(w.x * ws->shadow_inv_cell);
+  int64_t y = llrint(w.y * ws->shadow_inv_cell);
+  int64_t z = llrint(w.z * ws->shadow_inv_cell);
+  uint64_t h = (uint64_t)x * 73856093 ^ (uint64_t)y * 19349663 ^
+               (uint64_t)z * 83492791 ^ (uint64_t)light_index * 2654435761u;
+  shadow_entry *e = ws->shadow_cache + (h & (SHADOW_CACHE_SIZE - 1));
+  ws->stats.shadow_queries++;
+  if (e->generation == ws->shadow_generation && e->light == light_index &&
+      e->x == x && e->y == y && e->z == z) {
+    ws->stats.shadow_hits++;
+    *entry = e;
+    return 1;
+  }
+  e->generation = ws->shadow_generation;
+  e->light = light_index;
+  e->x = x;
+  e->y = y;
+  e->z = z;
+  *entry = e;
+  return 0;
+}
+
+/* Does light passing through the sphere get bent? */
+static int sphere_refracts(sphere const *sp)
+{
+  double index = sp->props.refractive_index;
+  return !IS_BLACK(sp->props.transparency) && index > 0.0 && index != 1.0;
+}
+
+/* If 's' is the surface 'offset' bytes into one of the 'count'
+ * structs of 'size' bytes at 'base', which one, else -1.
+ */
+static int surface_index(void const *base, int count, size_t size,
+                         size_t offset, surface const *s)
+{
+  if (count == 0) {
+    return -1;
+  }
+  uintptr_t d = (uintptr_t)s - ((uintptr_t)base + offset);
+  if (d % size != 0 || d / size >= (uintptr_t)count) {
+    return -1;
+  }
+  return d / size;
+}
+
+/* If 's' is the surface of one of the scene's own (not instanced)
+ * spheres, and it refracts, the sphere. These are the ones photons
+ * are shot through. NULL otherwise.
+ */
+static sphere const *caustic_sphere(scene const *sc, surface const *s)
+{
+  int i = surface_index(sc->spheres, sc->num_spheres, sizeof(sphere),
+                        offsetof(sphere, props), s);
+  if (i < 0) {
+    return NULL;
+  }
+  return sphere_refracts(sc->spheres + i) ? sc->spheres + i : NULL;
+}
+
+static int surface_id(scene const *sc, surface const *s)
+{
+  int base = 0;
+  int i = surface_index(sc->spheres, sc->num_spheres, sizeof(sphere),
+                        offsetof(sphere, props), s);
+  if (i >= 0) {
+    return base + i;
+  }
+  base += sc->num_spheres;
+  i = surface_index(sc->group_spheres, sc->num_group_spheres, sizeof(sphere),
+                    offsetof(sphere, props), s);
+  if (i >= 0) {
+    return base + i;
+  }
+  base += sc->num_group_spheres;
+  i = surface_index(sc->checkerboards, sc->num_checkerboards,
+                    sizeof(checkerboard), offsetof(checkerboard, p1), s);
+  if (i >= 0) {
+    return base + 2 * i;
+  }
+  i = surface_index(sc->checkerboards, sc->num_checkerboards,
+                    sizeof(checkerboard), offsetof(checkerboard, p2), s);
+  if (i >= 0) {
+    return base + 2 * i + 1;
+  }
+  base += 2 * sc->num_checkerboards;
+  i = surface_index(sc->materials, sc->num_materials, sizeof(material),
+                    offsetof(material, s1), s);
+  if (i >= 0) {
+    return base + 2 * i;
+  }
+  i = surface_index(sc->materials, sc->num_materials, sizeof(material),
+                    offsetof(material, s2), s);
+  if (i >= 0) {
+    return base + 2 * i + 1;
+  }
+  return -1;
+}
+
+/* NULL if the scene has no such surface. */
+static surface const *surface_from_id(scene const *sc, int id)
+{
+  if (id < 0) {
+    return NULL;
+  }
+  if (id < sc->num_spheres) {
+    return &sc->spheres[id].props;
+  }
+  id -= sc->num_spheres;
+  if (id < sc->num_group_spheres) {
+    return &sc->group_spheres[id].props;
+  }
+  id -= sc->num_group_spheres;
+  if (id < 2 * sc->num_checkerboards) {
+    checkerboard const *cb = sc->checkerboards + id / 2;
+    return id % 2 ? &cb->p2 : &cb->p1;
+  }
+  id -= 2 * sc->num_checkerboards;
+  if (id < 2 * sc->num_materials) {
+    material const *m = sc->materials + id / 2;
+    return id % 2 ? &m->s2 : &m->s1;
+  }
+  return NULL;
+}
+
+/* 'cache_light' is the index of a point light, whose visibility can
+ * be cached, or -1.
+ */
+static colour check_visibility(worker_state *ws, scene const *sc,
+			       vector n, vector l, vector w, vector light_loc,
+			       int cache_light)
 {
   colour c = white;
 
@@ -378,6 +933,12 @@ static colour check_visibility(scene const *sc,
   if (diffuse <= 0.0)
     return black;
 
+  shadow_entry *entry = NULL;
+  if (ws->shadow_cache != NULL && cache_light >= 0 &&
+      shadow_lookup(ws, w, cache_light, &entry)) {
+    return entry->transmitted;
+  }
+
   /* Light is on right side - check we can see it. */
 
   vector to_l = w;
@@ -387,10 +948,16 @@ static colour check_visibility(scene const *sc,
   do {
     double dist;
     double trans_dist;
-    surface *s = intersect(sc, w, l, &dist, NULL, NULL, NULL, &trans_dist);
+    surface *s = intersect(ws, sc, w, l, &dist, NULL, NULL, NULL,
+                           &trans_dist);
     if (dist_to_light > dist) {
-      if (IS_BLACK(s->transparency)) {
-	return black;
+      /* With a photon map, light bent by a sphere arrives as caustics
+       * instead.
+       */
+      if (IS_BLACK(s->transparency) ||
+          (sc->photon_map != NULL && caustic_sphere(sc, s) != NULL)) {
+        c = black;
+        break;
       }
       c = apply_transparency(s, c, trans_dist);
     }
@@ -400,11 +967,343 @@ static colour check_visibility(scene const *sc,
     ADD(w, moved);
   } while (dist_to_light > EPSILON);
 
+  if (entry != NULL) {
+    entry->transmitted = c;
+  }
+  return c;
+}
+
+/* Add the diffuse and specular lighting from one light, scaled by
+ * 'weight'.
+ */
+static void shade_light(worker_state *ws, scene const *sc,
+                        surface const *surf, light const *lt, double weight,
+                        vector w, vector n, vector r, colour *c)
+{
+  vector l;
+  double specular;
+
+  vector light_loc = lt->loc;
+  colour light_col = lt->col;
+
+  double y_rand = ((double)tracer_rand(ws))/TRACER_RAND_MAX;
+  double z_rand = ((double)tracer_rand(ws))/TRACER_RAND_MAX;
+
+  vector lr1 = lt->area1;
+  MULT(lr1, z_rand);
+  vector lr2 = lt->area2;
+  MULT(lr2, y_rand);
+  ADD(light_loc, lr1);
+  ADD(light_loc, lr2);
+
+  if (IS_BLACK(light_col)) {
+    light_col = colour_phase(z_rand);
+  }
+
+  /* Normalised vector pointing at the light source. */
+  l = light_loc;
+  SUB(l, w);
+  NORMALISE(l);
+
+  int is_point = IS_ZERO(lt->area1) && IS_ZERO(lt->area2);
+  colour transmitted = check_visibility(ws, sc, n, l, w, light_loc,
+                                        is_point ? lt - sc->lights : -1);
+  if (IS_BLACK(transmitted)) {
+    return;
+  }
+
+  light_col.r *= transmitted.r;
+  light_col.g *= transmitted.g;
+  light_col.b *= transmitted.b;
+
+  /* Diffuse colour */
+  double diffuse = DOT(n, l);
+  SHADE((*c), light_col, surf->diffuse, diffuse * weight);
+
+  /* Specular */
+  specular = DOT(r, l);
+  if (specular >= 0.0) {
+    specular = fm_powi(specular, SPECULAR_POWER);
+    SHADE((*c), light_col, surf->specular, specular * weight);
+  }
+}
+
+/* Make a frame with 'n' as its z axis. */
+static void normal_frame(vector n, vector *u, vector *v)
+{
+  vector a = { 1.0, 0.0, 0.0 };
+  if (fabs(n.x) > 0.5) {
+    a.x = 0.0;
+    a.y = 1.0;
+  }
+  u->x = a.y * n.z - a.z * n.y;
+  u->y = a.z * n.x - a.x * n.z;
+  u->z = a.x * n.y - a.y * n.x;
+  NORMALISE((*u));
+  v->x = n.y * u->z - n.z * u->y;
+  v->y = n.z * u->x - n.x * u->z;
+  v->z = n.x * u->y - n.y * u->x;
+}
+
+/* The direction 'phi' round from 'u' towards 'v'. */
+static vector frame_dir(vector u, vector v, double phi)
+{
+  double s, c;
+  fm_sincos(phi, &s, &c);
+  MULT(u, c);
+  MULT(v, s);
+  ADD(u, v);
+  return u;
+}
+
+/* The light leaving a surface seen by an ambient ray: just the direct
+ * light on its diffuse colour, as following the light round any
+ * further would cost too much for what it adds.
+ */
+static colour ambient_radiance(worker_state *ws, scene const *sc,
+                               surface const *s, vector w, vector n,
+                               vector dir)
+{
+  colour c = black;
+  if (IS_BLACK(s->diffuse)) {
+    return c;
+  }
+  if (DOT(n, dir) > 0.0) {
+    MULT(n, -1.0);
+  }
+  surface diffuse = *s;
+  diffuse.specular = black;
+  int i;
+  if (sc->light_table != NULL && sample_lights(sc)) {
+    for (i = 0; i < sc->light_samples; i++) {
+      int j = light_table_pick(ws, sc->light_table);
+      double weight = 1.0 / (sc->light_samples * sc->light_table->pdf[j]);
+      shade_light(ws, sc, &diffuse, sc->lights + j, weight, w, n, n, &c);
+    }
+  } else {
+    for (i = 0; i < sc->num_lights; i++) {
+      shade_light(ws, sc, &diffuse, sc->lights + i, 1.0, w, n, n, &c);
+    }
+  }
   return c;
 }
 
+/* Estimate the light falling on a surface at 'w', whose normal 'n'
+ * faces the way the light comes from, from 'samples' rays spread over
+ * the hemisphere in proportion to the cosine (in M by N strata). If
+ * 'rec' is non-NULL, fill it in for the irradiance cache, with its
+ * gradients worked out from the same rays as Ward and Heckbert do.
+ */
+static colour ambient_estimate(worker_state *ws, scene const *sc,
+                               vector w, vector n, int samples,
+                               irradiance_record *rec)
+{
+  if (samples > AMBIENT_MAX_SAMPLES) {
+    samples = AMBIENT_MAX_SAMPLES;
+  }
+  int m = (int)(sqrt(samples / M_PI) + 0.5);
+  if (m < 2) {
+    m = 2;
+  }
+  int n_phi = samples / m;
+  if (n_phi < 4) {
+    n_phi = 4;
+  }
+  colour lum[AMBIENT_MAX_SAMPLES];
+  double dist[AMBIENT_MAX_SAMPLES];
+  double tan_theta[AMBIENT_MAX_SAMPLES];
+
+  vector u, v;
+  normal_frame(n, &u, &v);
+  colour e = black;
+  double inv_dist = 0.0;
+  int j, k, c;
+  for (k = 0; k < n_phi; k++) {
+    for (j = 0; j < m; j++) {
+      int i = k * m + j;
+      double sin2 = (j + (double)tracer_rand(ws) / TRACER_RAND_MAX) / m;
+      double phi = 2.0 * M_PI *
+        (k + (double)tracer_rand(ws) / TRACER_RAND_MAX) / n_phi;
+      double sin_theta = sqrt(sin2);
+      double cos_theta = sqrt(1.0 - sin2);
+      tan_theta[i] = sin_theta / (cos_theta > 1.0e-3 ? cos_theta : 1.0e-3);
+      vector dir = frame_dir(u, v, phi);
+      MULT(dir, sin_theta);
+      vector up = n;
+      MULT(up, cos_theta);
+      ADD(dir, up);
+
+      double d;
+      vector hn;
+      vector trans_w;
+      vector trans_dir;
+      double trans_dist;
+      surface *s = intersect(ws, sc, w, dir, &d, &hn,
+                             &trans_w, &trans_dir, &trans_dist);
+      if (s == NULL) {
+        lum[i] = sc->ambient;
+        dist[i] = INFINITY;
+      } else {
+        vector h = dir;
+        MULT(h, d);
+        ADD(h, w);
+        lum[i] = ambient_radiance(ws, sc, s, h, hn, dir);
+        dist[i] = d;
+        inv_dist += 1.0 / d;
+      }
+      e.r += lum[i].r;
+      e.g += lum[i].g;
+      e.b += lum[i].b;
+    }
+  }
+  double scale = M_PI / (m * n_phi);
+  e.r *= scale;
+  e.g *= scale;
+  e.b *= scale;
+  if (rec == NULL) {
+    return e;
+  }
+
+  rec->w = w;
+  rec->n = n;
+  rec->e = e;
+  rec->dist = inv_dist > 0.0 ? m * n_phi / inv_dist : INFINITY;
+  for (c = 0; c < 3; c++) {
+    rec->rot_grad[c].x = rec->rot_grad[c].y = rec->rot_grad[c].z = 0.0;
+    rec->trans_grad[c] = rec->rot_grad[c];
+  }
+  for (k = 0; k < n_phi; k++) {
+    /* Along the middle of the stratum, across it, and across its
+     * near edge.
+     */
+    double phi = 2.0 * M_PI * (k + 0.5) / n_phi;
+    double phi_edge = 2.0 * M_PI * k / n_phi;
+    vector uk = frame_dir(u, v, phi);
+    vector vk = frame_dir(u, v, phi + M_PI / 2);
+    vector vk_edge = frame_dir(u, v, phi_edge + M_PI / 2);
+    int prev_k = (k + n_phi - 1) % n_phi;
+    double rot[3] = { 0.0, 0.0, 0.0 };
+    double along[3] = { 0.0, 0.0, 0.0 };
+    double across[3] = { 0.0, 0.0, 0.0 };
+    for (j = 0; j < m; j++) {
+      int i = k * m + j;
+      double l[3] = { lum[i].r, lum[i].g, lum[i].b };
+      for (c = 0; c < 3; c++) {
+        rot[c] -= tan_theta[i] * l[c];
+      }
+      if (j > 0) {
+        /* Between this stratum and the one below it. */
+        double sin2 = (double)j / m;
+        double r = dist[i] < dist[i - 1] ? dist[i] : dist[i - 1];
+        double f = sqrt(sin2) * (1.0 - sin2) / r;
+        double lb[3] = { lum[i - 1].r, lum[i - 1].g, lum[i - 1].b };
+        for (c = 0; c < 3; c++) {
+          along[c] += f * (l[c] - lb[c]);
+        }
+      }
+      /* Between this stratum and the one round from it. */
+      int side = prev_k * m + j;
+      double r = dist[i] < dist[side] ? dist[i] : dist[side];
+      double f = (sqrt((j + 1.0) / m) - sqrt((double)j / m)) / r;
+      double ls[3] = { lum[side].r, lum[side].g, lum[side].b };
+      for (c = 0; c < 3; c++) {
+        across[c] += f * (l[c] - ls[c]);
+      }
+    }
+    for (c = 0; c < 3; c++) {
+      vector g = vk;
+      MULT(g, rot[c] * scale);
+      ADD(rec->rot_grad[c], g);
+      g = uk;
+      MULT(g, along[c] * 2.0 * M_PI / n_phi);
+      ADD(rec->trans_grad[c], g);
+      g = vk_edge;
+      MULT(g, across[c]);
+      ADD(rec->trans_grad[c], g);
+    }
+  }
+  return e;
+}
+
+/* Fill in an irradiance cache record for a point seen 'path_len'
+ * from the camera, in an image 'width' pixels across, keeping the
+ * region it covers to a sensible number of pixels, and to where its
+ * gradient says it will still be about right.
+ */
+static void ambient_record(worker_state *ws, scene const *sc,
+                           vector w, vector n, double path_len, int width,
+                           double accuracy, irradiance_record *rec)
+{
+  ambient_estimate(ws, sc, w, n, sc->ambient_samples, rec);
+  double e[3] = { rec->e.r, rec->e.g, rec->e.b };
+  int c;
+  for (c = 0; c < 3; c++) {
+    double g = sqrt(DOT(rec->trans_grad[c], rec->trans_grad[c]));
+    if (g * rec->dist > e[c] && g > 0.0) {
+      rec->dist = e[c] / g;
+    }
+  }
+  double pixel = 2.0 * path_len / width;
+  double lo = AMBIENT_MIN_PIXELS * pixel / accuracy;
+  double hi = AMBIENT_MAX_PIXELS * pixel / accuracy;
+  if (rec->dist < lo) rec->dist = lo;
+  if (rec->dist > hi) rec->dist = hi;
+}
+
+/* The ambient light falling on the front of a surface, from the cache
+ * if there's one that covers it, else estimated afresh.
+ */
+static colour ambient_irradiance(worker_state *ws, scene const *sc,
+                                 vector w, vector n, vector dir)
+{
+  if (DOT(n, dir) > 0.0) {
+    MULT(n, -1.0);
+  }
+  colour e;
+  if (ws->irradiance != NULL &&
+      irradiance_cache_lookup(ws->irradiance, w, n, AMBIENT_SLACK, &e)) {
+    ws->stats.ambient_cached++;
+    return e;
+  }
+  ws->stats.ambient_estimates++;
+  return ambient_estimate(ws, sc, w, n, sc->ambient_samples, NULL);
+}
+
+/* Russian roulette: decide whether a ray of the given depth, carrying
+ * 'weight' of the light, is worth tracing. Rather than always dropping
+ * dim rays, let them through at random, scaling up the survivors so
+ * that on average they give the right answer.
+ */
+static int survive(worker_state *ws, scene const *sc, colour *weight,
+                   int depth)
+{
+  int max_depth = sc->max_depth >= 0 ? sc->max_depth : DEFAULT_MAX_DEPTH;
+  int rr_depth = sc->rr_depth >= 0 ? sc->rr_depth : DEFAULT_RR_DEPTH;
+  double most = weight->r;
+  if (weight->g > most) most = weight->g;
+  if (weight->b > most) most = weight->b;
+  if (most <= 0.0 || depth > max_depth) {
+    return 0;
+  }
+  if (depth <= rr_depth) {
+    return 1;
+  }
+  double p = most * (sc->rr_survival > 0.0 ? sc->rr_survival : 1.0);
+  if (p >= 1.0) {
+    return 1;
+  }
+  if (tracer_rand(ws) >= p * ((double)TRACER_RAND_MAX + 1.0)) {
+    return 0;
+  }
+  weight->r /= p;
+  weight->g /= p;
+  weight->b /= p;
+  return 1;
+}
+
 /* Texture a point */
-static void texture(scene const *sc,
+static void texture(worker_state *ws,
+                    scene const *sc,
                     surface const *surf,
                     vector w, /* Point of intersection */
                     vector n, /* Surface normal */
@@ -413,17 +1312,19 @@ static void texture(scene const *sc,
 				       after taking into account refraction */
 		    vector trans_dir, /* Direction after transmission */
 		    double trans_dist, /* Distance to other side */
+                    int depth,
                     colour *col)
 {
   /* Texture by the nearest thing we hit. */
-  vector l, r;
+  vector r;
   double tmp;
   vector tmp2;
-  double specular;
   int i;
 
   colour c;
 
+  ws->stats.shades++;
+
   /* And the normalised reflection vector, r */
   tmp = DOT(n, dir);
   tmp2 = n;
@@ -431,52 +1332,34 @@ static void texture(scene const *sc,
   r = dir;
   SUB(r, tmp2);
 
-  /* FIXME: Ambient lighting? */
   c.r = c.g = c.b = 0.0;
 
-  /* Diffuse and specular lighting. */
-  for (i = 0; i < sc->num_lights; i++) {
-    vector light_loc = sc->lights[i].loc;
-    colour light_col = sc->lights[i].col;
-
-    double y_rand = ((double)rand())/RAND_MAX;
-    double z_rand = ((double)rand())/RAND_MAX;
-
-    vector lr1 = sc->lights[i].area1;
-    MULT(lr1, z_rand);
-    vector lr2 = sc->lights[i].area2;
-    MULT(lr2, y_rand);
-    ADD(light_loc, lr1);
-    ADD(light_loc, lr2);
+  /* Ambient lighting, from the sky and what's lit nearby. */
+  if (sc->ambient_samples > 0 && !IS_BLACK(surf->diffuse)) {
+    colour e = ambient_irradiance(ws, sc, w, n, dir);
+    SHADE(c, e, surf->diffuse, 1.0 / M_PI);
+  }
 
-    if (IS_BLACK(light_col)) {
-      light_col = colour_phase(z_rand);
+  /* Diffuse and specular lighting. */
+  if (sc->light_table != NULL && sample_lights(sc)) {
+    /* Sample a few lights, favouring the bright ones. */
+    for (i = 0; i < sc->light_samples; i++) {
+      int j = light_table_pick(ws, sc->light_table);
+      double weight = 1.0 / (sc->light_samples * sc->light_table->pdf[j]);
+      shade_light(ws, sc, surf, sc->lights + j, weight, w, n, r, &c);
     }
-
-    /* Normalised vector pointing at the light source. */
-    l = light_loc;
-    SUB(l, w);
-    NORMALISE(l);
-
-    colour transmitted = check_visibility(sc, n, l, w, light_loc);
-    if (IS_BLACK(transmitted)) {
-      continue;
+  } else {
+    for (i = 0; i < sc->num_lights; i++) {
+      shade_light(ws, sc, surf, sc->lights + i, 1.0, w, n, r, &c);
     }
+  }
 
-    light_col.r *= transmitted.r;
-    light_col.g *= transmitted.g;
-    light_col.b *= transmitted.b;
-
-    /* Diffuse colour */
-    double diffuse = DOT(n, l);
-    SHADE(c, light_col, surf->diffuse, diffuse);
-
-    /* Specular */
-    specular = DOT(r, l);
-    if (specular >= 0.0) {
-      specular = pow(specular, 10);
-      SHADE(c, light_col, surf->specular, specular);
-    }
+  /* Caustics. */
+  if (sc->photon_map != NULL && !IS_BLACK(surf->diffuse)) {
+    int gather = sc->photon_gather > 0 ? sc->photon_gather
+                                       : DEFAULT_PHOTON_GATHER;
+    colour e = photon_map_irradiance(sc->photon_map, w, n, gather);
+    SHADE(c, e, surf->diffuse, 1.0);
   }
 
   /* Reflection */
@@ -490,11 +1373,9 @@ static void texture(scene const *sc,
   col->g *= surf->reflective.g;
   col->b *= surf->reflective.b;
 
-  if (col->r + col->g + col->b > REFLECTSTOP) {
-    /* Enough light to make it worth tracing further */
-    *col = trace(sc, w, r, *col);
+  if (survive(ws, sc, col, depth + 1)) {
+    *col = trace(ws, sc, w, r, *col, depth + 1);
   } else {
-    /* Not enough light to bother tracing further. */
     *col = black;
   }
 
@@ -505,8 +1386,8 @@ static void texture(scene const *sc,
 
   /* Transparency */
   in = apply_transparency(surf, in, trans_dist);
-  if (in.r + in.g + in.b > REFLECTSTOP) {
-    colour trans = trace(sc, trans_w, trans_dir, in);
+  if (survive(ws, sc, &in, depth + 1)) {
+    colour trans = trace(ws, sc, trans_w, trans_dir, in, depth + 1);
     col->r += trans.r;
     col->g += trans.g;
     col->b += trans.b;
@@ -514,14 +1395,18 @@ static void texture(scene const *sc,
 }
 
 /* Create a normally distributed lump of noise in the X-Z plane */
-static vector noise_xy(double std_var) {
+static vector noise_xy(worker_state *ws, double std_var) {
   /* Box-Muller */
-  double u1 = ((double)rand() + 1.0) / ((double)RAND_MAX + 1.0);
-  double u2 = ((double)rand() + 1.0) / ((double)RAND_MAX + 1.0);
-  double r  = sqrt(-2.0 * log(u1));
+  double u1 = ((double)tracer_rand(ws) + 1.0) /
+    ((double)TRACER_RAND_MAX + 1.0);
+  double u2 = ((double)tracer_rand(ws) + 1.0) /
+    ((double)TRACER_RAND_MAX + 1.0);
+  double r  = sqrt(-2.0 * fm_log(u1));
   double th = 2 * M_PI * u2;
-  double z0 = r * cos(th);
-  double z1 = r * sin(th);
+  double z0, z1;
+  fm_sincos(th, &z1, &z0);
+  z0 *= r;
+  z1 *= r;
   vector v;
   v.x = std_var * z0;
   v.y = std_var * z1;
@@ -529,58 +1414,1546 @@ static vector noise_xy(double std_var) {
   return v;
 }
 
-/* Render a picture */
-void render(scene *sc, int width, int height, colour *image)
+/* Allocate from an arena, or malloc if there isn't one. */
+static void *alloc_in(arena *a, size_t size)
 {
-  /* Make sure the noise we apply is reproduceable. */
-  srand(42);
+  return a ? arena_alloc(a, size) : malloc(size);
+}
+
+/* Build an alias table (Vose's method), weighting each light by its
+ * total power.
+ */
+light_table *light_table_build(light const *lights, int num_lights,
+                               arena *a)
+{
+  light_table *t = (light_table *)alloc_in(a, sizeof(light_table));
+  t->num_lights = num_lights;
+  t->prob = (double *)alloc_in(a, num_lights * sizeof(double));
+  t->alias = (int *)alloc_in(a, num_lights * sizeof(int));
+  t->pdf = (double *)alloc_in(a, num_lights * sizeof(double));
+
+  int i;
+  double total = 0.0;
+  for (i = 0; i < num_lights; i++) {
+    colour c = lights[i].col;
+    /* Black lights cycle through the colour wheel, averaging grey. */
+    t->pdf[i] = IS_BLACK(c) ? 1.5 : c.r + c.g + c.b;
+    total += t->pdf[i];
+  }
+  for (i = 0; i < num_lights; i++) {
+    t->pdf[i] = total > 0.0 ? t->pdf[i] / total : 1.0 / num_lights;
+  }
+
+  /* Split into slots below and above the average, and pair them up. */
+  int *small = (int *)malloc(num_lights * sizeof(int));
+  int *large = (int *)malloc(num_lights * sizeof(int));
+  int num_small = 0, num_large = 0;
+  for (i = 0; i < num_lights; i++) {
+    t->prob[i] = t->pdf[i] * num_lights;
+    t->alias[i] = i;
+    if (t->prob[i] < 1.0) {
+      small[num_small++] = i;
+    } else {
+      large[num_large++] = i;
+    }
+  }
+  while (num_small > 0 && num_large > 0) {
+    int s = small[--num_small];
+    int l = large[--num_large];
+    t->alias[s] = l;
+    t->prob[l] -= 1.0 - t->prob[s];
+    if (t->prob[l] < 1.0) {
+      small[num_small++] = l;
+    } else {
+      large[num_large++] = l;
+    }
+  }
+  /* Anything left over is 1 give or take rounding. */
+  while (num_large > 0) t->prob[large[--num_large]] = 1.0;
+  while (num_small > 0) t->prob[small[--num_small]] = 1.0;
+
+  free(small);
+  free(large);
+  return t;
+}
 
+static bbox sphere_bounds(sphere const *sp)
+{
+  bbox b = { sp->center, sp->center };
+  b.lo.x -= sp->radius; b.lo.y -= sp->radius; b.lo.z -= sp->radius;
+  b.hi.x += sp->radius; b.hi.y += sp->radius; b.hi.z += sp->radius;
+  return b;
+}
+
+/* Build a tree for each group, and one over the instances, bounding
+ * each by its group's bounds scaled and moved into place.
+ */
+static instance_accel *instance_accel_build(scene const *sc)
+{
+  instance_accel *acc = (instance_accel *)alloc_in(sc->arena,
+                                                   sizeof(instance_accel));
+  acc->groups = (bvh **)alloc_in(sc->arena, sc->num_groups * sizeof(bvh *));
+
+  bbox *group_bounds = (bbox *)malloc(sc->num_groups * sizeof(bbox));
+  int i, j;
+  for (i = 0; i < sc->num_groups; i++) {
+    sphere_group const *g = sc->groups + i;
+    bbox *boxes = (bbox *)malloc(g->count * sizeof(bbox));
+    /* Empty groups never get hit, so any bounds will do. */
+    memset(group_bounds + i, 0, sizeof(bbox));
+    for (j = 0; j < g->count; j++) {
+      boxes[j] = sphere_bounds(sc->group_spheres + g->first + j);
+      if (j == 0) {
+        group_bounds[i] = boxes[j];
+      } else {
+        bbox_union(group_bounds + i, boxes + j);
+      }
+    }
+    acc->groups[i] = bvh_build(boxes, g->count, sc->arena);
+    free(boxes);
+  }
+
+  bbox *boxes = (bbox *)malloc(sc->num_instances * sizeof(bbox));
+  for (i = 0; i < sc->num_instances; i++) {
+    instance const *inst = sc->instances + i;
+    boxes[i] = group_bounds[inst->group];
+    MULT(boxes[i].lo, inst->scale);
+    MULT(boxes[i].hi, inst->scale);
+    ADD(boxes[i].lo, inst->offset);
+    ADD(boxes[i].hi, inst->offset);
+  }
+  acc->top = bvh_build(boxes, sc->num_instances, sc->arena);
+  free(boxes);
+  free(group_bounds);
+  return acc;
+}
+
+/* Photon tracing, split into batches that workers take in turn. */
+typedef struct {
+  scene const *sc;
+  /* Spheres to shoot photons through, from every light. */
+  sphere const **casters;
+  int num_casters;
+  int per_target;
+  int num_photons;
+  int num_batches;
+  int next_batch;
+  /* Each batch's photons, put together in order at the end. */
+  photon **batch_photons;
+  int *batch_counts;
+} photon_job;
+
+/* Shoot photon 'i' from its light through its sphere, and keep it
+ * where it lands on diffuse surfaces after being bent.
+ */
+static void photon_shoot(worker_state *ws, photon_job const *job, int i,
+                         photon **out, int *count, int *capacity)
+{
+  scene const *sc = job->sc;
+  int target = i % (sc->num_lights * job->num_casters);
+  light const *lt = sc->lights + target / job->num_casters;
+  sphere const *sp = job->casters[target % job->num_casters];
+
+  /* A point on the light, picked as shade_light does. */
+  double y_rand = ((double)tracer_rand(ws))/TRACER_RAND_MAX;
+  double z_rand = ((double)tracer_rand(ws))/TRACER_RAND_MAX;
+  vector from = lt->loc;
+  vector lr1 = lt->area1;
+  MULT(lr1, z_rand);
+  vector lr2 = lt->area2;
+  MULT(lr2, y_rand);
+  ADD(from, lr1);
+  ADD(from, lr2);
+  colour power = IS_BLACK(lt->col) ? colour_phase(z_rand) : lt->col;
+
+  /* Aim at a disc through the sphere's centre, facing the light, that
+   * just covers the sphere as the light sees it.
+   */
+  vector axis = sp->center;
+  SUB(axis, from);
+  double d2 = DOT(axis, axis);
+  double r2 = sp->radius * sp->radius;
+  if (d2 <= r2) {
+    return;
+  }
+  double disc_r = sqrt(r2 * d2 / (d2 - r2));
+  NORMALISE(axis);
+  vector u = { 0.0, 0.0, 0.0 };
+  if (fabs(axis.x) < 0.9) {
+    u.x = 1.0;
+  } else {
+    u.y = 1.0;
+  }
+  vector along = axis;
+  MULT(along, DOT(u, axis));
+  SUB(u, along);
+  NORMALISE(u);
+  vector v = { axis.y * u.z - axis.z * u.y,
+               axis.z * u.x - axis.x * u.z,
+               axis.x * u.y - axis.y * u.x };
+  double a, b;
+  do {
+    a = 2.0 * ((double)tracer_rand(ws) / TRACER_RAND_MAX) - 1.0;
+    b = 2.0 * ((double)tracer_rand(ws) / TRACER_RAND_MAX) - 1.0;
+  } while (a * a + b * b > 1.0);
+  MULT(u, a * disc_r);
+  MULT(v, b * disc_r);
+  vector dir = sp->center;
+  ADD(dir, u);
+  ADD(dir, v);
+  SUB(dir, from);
+  NORMALISE(dir);
+
+  /* Lights shine with their colour on each unit of area facing them,
+   * so the photons share out what falls on the disc.
+   */
+  double share = M_PI * disc_r * disc_r / job->per_target;
+  power.r *= share;
+  power.g *= share;
+  power.b *= share;
+
+  int max_depth = sc->max_depth >= 0 ? sc->max_depth : DEFAULT_MAX_DEPTH;
+  int bent = 0;
+  int depth;
+  for (depth = 0; depth < max_depth && !IS_BLACK(power); depth++) {
+    double dist;
+    vector trans_w;
+    vector trans_dir;
+    double trans_dist;
+    surface *s = intersect(ws, sc, from, dir, &dist, NULL,
+                           &trans_w, &trans_dir, &trans_dist);
+    if (s == NULL) {
+      break;
+    }
+    if (bent && !IS_BLACK(s->diffuse)) {
+      if (*count == *capacity) {
+        *capacity = *capacity ? 2 * *capacity : 1024;
+        *out = (photon *)realloc(*out, *capacity * sizeof(photon));
+      }
+      photon *p = *out + (*count)++;
+      p->x = from.x + dir.x * dist;
+      p->y = from.y + dir.y * dist;
+      p->z = from.z + dir.z * dist;
+      p->dx = dir.x;
+      p->dy = dir.y;
+      p->dz = dir.z;
+      p->r = power.r;
+      p->g = power.g;
+      p->b = power.b;
+    }
+    if (IS_BLACK(s->transparency)) {
+      break;
+    }
+    if (caustic_sphere(sc, s) != NULL) {
+      bent = 1;
+    }
+    power = apply_transparency(s, power, trans_dist);
+    from = trans_w;
+    dir = trans_dir;
+  }
+}
+
+static void photon_worker(void *data, worker_state *ws)
+{
+  photon_job *job = (photon_job *)data;
+  ws->shadow_cache = NULL;
+  ws->irradiance = NULL;
+  int batch;
+  while ((batch = __atomic_fetch_add(&job->next_batch, 1,
+                                     __ATOMIC_RELAXED)) < job->num_batches) {
+    /* Pixels seed from 42 up, so count down to stay clear of them. */
+    tracer_srand(ws, ~(uint64_t)batch);
+    photon *out = NULL;
+    int count = 0;
+    int capacity = 0;
+    int end = (batch + 1) * PHOTON_BATCH;
+    int i;
+    if (end > job->num_photons) {
+      end = job->num_photons;
+    }
+    for (i = batch * PHOTON_BATCH; i < end; i++) {
+      photon_shoot(ws, job, i, &out, &count, &capacity);
+    }
+    job->batch_photons[batch] = out;
+    job->batch_counts[batch] = count;
+  }
+}
+
+/* Trace the scene's photons, on the context's workers if non-NULL,
+ * and map them.
+ */
+static photon_map *photon_map_trace(scene const *sc, render_context *ctx)
+{
+  photon_job job;
+  job.sc = sc;
+  job.casters = (sphere const **)malloc((sc->num_spheres + 1) *
+                                        sizeof(sphere const *));
+  job.num_casters = 0;
+  double largest = 0.0;
+  int i;
+  for (i = 0; i < sc->num_spheres; i++) {
+    if (sphere_refracts(sc->spheres + i)) {
+      job.casters[job.num_casters++] = sc->spheres + i;
+      if (sc->spheres[i].radius > largest) {
+        largest = sc->spheres[i].radius;
+      }
+    }
+  }
+  double radius = sc->photon_radius > 0.0 ? sc->photon_radius
+                                          : largest * DEFAULT_PHOTON_RADIUS;
+  int targets = sc->num_lights * job.num_casters;
+  if (targets == 0 || radius <= 0.0) {
+    free(job.casters);
+    return photon_map_build(NULL, 0, 1.0, sc->arena);
+  }
+  job.per_target = sc->num_photons / targets;
+  if (job.per_target < 1) {
+    job.per_target = 1;
+  }
+  job.num_photons = job.per_target * targets;
+  job.num_batches = (job.num_photons - 1) / PHOTON_BATCH + 1;
+  job.next_batch = 0;
+  job.batch_photons = (photon **)malloc(job.num_batches * sizeof(photon *));
+  job.batch_counts = (int *)malloc(job.num_batches * sizeof(int));
+
+  context_task task;
+  task.run = photon_worker;
+  task.data = &job;
+  task.max_workers = job.num_batches;
+  run_task(ctx, &task);
+
+  int total = 0;
+  for (i = 0; i < job.num_batches; i++) {
+    total += job.batch_counts[i];
+  }
+  photon *all = (photon *)malloc((total + 1) * sizeof(photon));
+  total = 0;
+  for (i = 0; i < job.num_batches; i++) {
+    if (job.batch_counts[i] > 0) {
+      memcpy(all + total, job.batch_photons[i],
+             job.batch_counts[i] * sizeof(photon));
+      total += job.batch_counts[i];
+    }
+    free(job.batch_photons[i]);
+  }
+  photon_map *m = photon_map_build(all, total, radius, sc->arena);
+  free(all);
+  free(job.batch_photons);
+  free(job.batch_counts);
+  free(job.casters);
+  return m;
+}
+
+/* Filling an irradiance cache, a chunk of pixels at a time. Each
+ * chunk's pixels are traced in parallel against the cache as it was
+ * before the chunk, then what they found is added in pixel order, so
+ * the cache doesn't depend on how many threads filled it.
+ */
+typedef struct {
+  scene const *sc;
+  irradiance_cache const *cache;
+  double accuracy;
+  int width;
+  int height;
+  /* The chunk's pixels, as y * width + x. */
+  int const *pixels;
+  int num_pixels;
+  int next_pixel;
+  /* AMBIENT_PREPASS_DEPTH slots per pixel for records found. */
+  irradiance_record *found;
+  int *num_found;
+} ambient_job;
+
+/* Follow a ray from the camera, 'path_len' travelled so far, finding
+ * the diffuse surfaces it reaches that need a new estimate.
+ */
+static void ambient_prepass_ray(worker_state *ws, ambient_job *job,
+                                int slot, vector from, vector dir,
+                                double path_len, int depth)
+{
+  scene const *sc = job->sc;
+  double dist;
+  vector n;
+  vector trans_w;
+  vector trans_dir;
+  double trans_dist;
+  surface *s = intersect(ws, sc, from, dir, &dist, &n,
+                         &trans_w, &trans_dir, &trans_dist);
+  if (s == NULL) {
+    return;
+  }
+  vector w = dir;
+  MULT(w, dist);
+  ADD(w, from);
+  path_len += dist;
+
+  int *count = job->num_found + slot;
+  if (!IS_BLACK(s->diffuse) && *count < AMBIENT_PREPASS_DEPTH) {
+    vector front = n;
+    if (DOT(front, dir) > 0.0) {
+      MULT(front, -1.0);
+    }
+    colour e;
+    if (!irradiance_cache_lookup(job->cache, w, front, 1.0, &e)) {
+      irradiance_record *rec = job->found +
+        slot * AMBIENT_PREPASS_DEPTH + (*count)++;
+      ambient_record(ws, sc, w, front, path_len, job->width, job->accuracy,
+                     rec);
+    }
+  }
+
+  if (++depth >= AMBIENT_PREPASS_DEPTH) {
+    return;
+  }
+  if (!IS_BLACK(s->reflective)) {
+    vector r = n;
+    MULT(r, 2.0 * DOT(n, dir));
+    vector refl = dir;
+    SUB(refl, r);
+    ambient_prepass_ray(ws, job, slot, w, refl, path_len, depth);
+  }
+  if (!IS_BLACK(s->transparency)) {
+    ambient_prepass_ray(ws, job, slot, trans_w, trans_dir,
+                        path_len + trans_dist, depth);
+  }
+}
+
+static void ambient_worker(void *data, worker_state *ws)
+{
+  ambient_job *job = (ambient_job *)data;
+  ws->shadow_cache = NULL;
+  ws->irradiance = NULL;
+  int i;
+  while ((i = __atomic_fetch_add(&job->next_pixel, 1,
+                                 __ATOMIC_RELAXED)) < job->num_pixels) {
+    int index = job->pixels[i];
+    int x = index % job->width;
+    int y = index / job->width;
+    /* Clear of the pixels' seeds, and the photons'. */
+    tracer_srand(ws, (1ULL << 62) + index);
+    /* Through the middle of the pixel, as render_pixel would without
+     * noise.
+     */
+    vector origin = { 0.0, 0.0, 0.0 };
+    vector ray;
+    ray.x = x - job->width/2;
+    ray.y = job->height/2 - y;
+    ray.z = job->width/2;
+    NORMALISE(ray);
+    job->num_found[i] = 0;
+    ambient_prepass_ray(ws, job, i, origin, ray, 0.0, 0);
+  }
+}
+
+/* Fill an irradiance cache for the pixels of a region, coarsest
+ * spacing first, so that later pixels mostly find estimates already
+ * there. Each chunk runs on the context's workers if non-NULL.
+ */
+static irradiance_cache *ambient_prepass(scene const *sc,
+                                         render_context *ctx, int width,
+                                         int height, int x0, int y0,
+                                         int x1, int y1)
+{
+  ambient_job job;
+  job.sc = sc;
+  job.accuracy = sc->ambient_accuracy > 0.0 ? sc->ambient_accuracy
+                                            : DEFAULT_AMBIENT_ACCURACY;
+  irradiance_cache *cache = irradiance_cache_create(job.accuracy);
+  job.cache = cache;
+  job.width = width;
+  job.height = height;
+  int *pixels = (int *)malloc(AMBIENT_PREPASS_CHUNK * sizeof(int));
+  job.pixels = pixels;
+  job.found = (irradiance_record *)malloc(AMBIENT_PREPASS_CHUNK *
+                                          AMBIENT_PREPASS_DEPTH *
+                                          sizeof(irradiance_record));
+  job.num_found = (int *)malloc(AMBIENT_PREPASS_CHUNK * sizeof(int));
+
+  context_task task;
+  task.run = ambient_worker;
+  task.data = &job;
+  int spacing;
+  for (spacing = AMBIENT_PREPASS_SPACING; spacing >= 1; spacing /= 2) {
+    int across = (x1 - x0 - 1) / spacing + 1;
+    int down = (y1 - y0 - 1) / spacing + 1;
+    long total = (long)across * down;
+    long next = 0;
+    while (next < total) {
+      /* Gather a chunk of the pixels new at this spacing. */
+      job.num_pixels = 0;
+      for (; next < total && job.num_pixels < AMBIENT_PREPASS_CHUNK; next++) {
+        int col = next % across;
+        int row = next / across;
+        if (spacing < AMBIENT_PREPASS_SPACING && col % 2 == 0 &&
+            row % 2 == 0) {
+          /* Done at the coarser spacing. */
+          continue;
+        }
+        pixels[job.num_pixels++] = (y0 + row * spacing) * width +
+          x0 + col * spacing;
+      }
+      if (job.num_pixels == 0) {
+        continue;
+      }
+      job.next_pixel = 0;
+      task.max_workers = job.num_pixels;
+      run_task(ctx, &task);
+
+      /* Earlier pixels' estimates may cover later ones'. */
+      int i, j;
+      for (i = 0; i < job.num_pixels; i++) {
+        for (j = 0; j < job.num_found[i]; j++) {
+          irradiance_record const *rec =
+            job.found + i * AMBIENT_PREPASS_DEPTH + j;
+          colour e;
+          if (!irradiance_cache_lookup(cache, rec->w, rec->n, 1.0, &e)) {
+            irradiance_cache_insert(cache, rec);
+          }
+        }
+      }
+    }
+  }
+  free(job.num_found);
+  free(job.found);
+  free(pixels);
+  return cache;
+}
+
+/* Features for a single pixel. */
+typedef struct {
+  colour albedo;
+  vector normal;
+  double depth;
+} hit_features;
+
+/* As trace_hit for a camera ray, but starting from its saved first
+ * hit rather than tracing it.
+ */
+static colour trace_saved(worker_state *ws, scene const *sc,
+                          gbuffer_sample const *g, hit_info *hit)
+{
+  surface const *surf = surface_from_id(sc, g->surface);
+  if (hit) {
+    hit->surf = surf;
+    hit->normal = g->normal;
+    hit->dist = g->dist;
+  }
+  if (!surf) {
+    return black;
+  }
+  ws->rand_state = g->rand_state;
+  colour result = white;
+  texture(ws, sc, surf, g->w, g->normal, g->dir,
+          g->trans_w, g->trans_dir, g->trans_dist, 0, &result);
+  return result;
+}
+
+/* Trace 'samples' samples for one pixel, returning their sum. If
+ * 'features' is non-NULL, the features of the first surfaces hit are
+ * averaged into it. If 'saved' is non-NULL, each sample's first hit is
+ * saved there, or with 'reshade', read back from there instead of
+ * being traced.
+ */
+static colour render_pixel(worker_state *ws, scene const *sc,
+                           int width, int height, int x, int y,
+                           int samples, hit_features *features,
+                           gbuffer_sample *saved, int reshade)
+{
   vector origin;
   vector ray;
+  colour c = { 0.0, 0.0, 0.0 };
+  hit_info hit;
+  int i = 0;
+  for (i = 0; i < samples; i++) {
+    colour c2;
+    if (reshade) {
+      c2 = trace_saved(ws, sc, saved + i, features ? &hit : NULL);
+    } else {
+      if (sc->callback != NULL) {
+        /* Perform callback allowing the scene to be updated for e.g.
+         * motion blur. Downside is that we can't share the structure
+         * between threads. Such scenes are rendered from a copy of
+         * their own (see render_job_run), so it's ours to change.
+         */
+        sc->callback((scene *)sc);
+      }
+
+      ray.x = x - width/2;
+      ray.y = height/2 - y;
+      ray.z = width/2;
+
+      /* Add noise to the ray. */
+      vector noise = noise_xy(ws, sc->blur_size);
+      ADD(ray, noise);
+
+      /* And remove the noise at the focal distance. */
+      origin.x = - sc->focal_depth * noise.x / ray.z;
+      origin.y = - sc->focal_depth * noise.y / ray.z;
+      origin.z = 0.0;
+
+      /* And more noise to do antialiasing. */
+      vector aa_noise = noise_xy(ws, sc->antialias_size);
+      ADD(ray, aa_noise);
+
+      NORMALISE(ray);
+      c2 = trace_hit(ws, sc, origin, ray, white, 0,
+                     features ? &hit : NULL, saved ? saved + i : NULL);
+    }
+    c.r += c2.r; c.g += c2.g; c.b += c2.b;
+
+    if (features && hit.surf) {
+      features->albedo.r += hit.surf->diffuse.r;
+      features->albedo.g += hit.surf->diffuse.g;
+      features->albedo.b += hit.surf->diffuse.b;
+      ADD(features->normal, hit.normal);
+      features->depth += hit.dist;
+    }
+  }
+  if (features) {
+    features->albedo.r /= samples;
+    features->albedo.g /= samples;
+    features->albedo.b /= samples;
+    MULT(features->normal, 1.0 / samples);
+    features->depth /= samples;
+  }
+  return c;
+}
+
+/* What the workers on one NUMA node share. */
+typedef struct {
+  /* The node's copy of the scene, and where it lives. NULL until the
+   * first worker on the node has made it.
+   */
+  scene const *sc;
+  arena *arena;
+  int started;
+  /* The node's band of tiles still to do. */
+  int next_tile;
+  int end_tile;
+} render_node;
+
+/* Shared state for the workers rendering one image. */
+typedef struct render_job_t {
+  /* The scene as given, or a copy of it made ready to trace. */
+  scene const *sc;
+  int width;
+  int height;
+  /* Covers the region, which starts at (x0, y0). */
+  framebuffer *fb;
+  int x0, y0, x1, y1;
+  int pass;
+  int tile_width;
+  int tile_height;
+  int tiles_across;
+  int num_tiles;
+  int next_tile;
+  /* Progress reporting. 'next_report' is in nanoseconds, and claimed
+   * by whichever worker sees it pass first.
+   */
+  render_counters *counters;
+  int verbose;
+  render_progress_fn progress;
+  void *progress_data;
+  int progress_fd;
+  int64_t report_interval;
+  int64_t next_report;
+  /* Laid out like an image 'feature_stride' pixels across, starting at
+   * the region's top-left pixel.
+   */
+  render_features const *features;
+  render_cost const *cost;
+  int feature_stride;
+  double shadow_cell;
+  render_stats *stats;
+  int const *tile_samples;
+  /* Covers the region, or NULL. */
+  gbuffer *gbuffer;
+  int reshade;
+  /* Ambient light estimates, or NULL. */
+  irradiance_cache const *irradiance;
+  /* The framebuffer came from framebuffer_alloc, so workers clear
+   * each tile before drawing into it.
+   */
+  int first_touch;
+  /* For NUMA renders, the nodes and their state, else NULL. */
+  numa_topology const *topo;
+  render_node *nodes;
+  int next_worker;
+  pthread_cond_t node_ready;
+  pthread_mutex_t lock;
+  /* For renders on a context. */
+  context_task task;
+} render_job;
+
+/* A context's worker thread, and what it keeps between renders. */
+typedef struct {
+  struct render_context_t *ctx;
+  pthread_t thread;
+  worker_state ws;
+} context_worker;
+
+struct render_context_t {
+  context_worker *workers;
+  int num_workers;
+  /* Tasks with work still to hand out, oldest first. */
+  context_task *queue;
+  int stopping;
+  /* Counts from the renders finished so far. */
+  render_stats stats;
+  pthread_mutex_t lock;
+  /* Signalled when there's a new job, or it's time to stop. */
+  pthread_cond_t work;
+  /* Signalled when a job finishes. */
+  pthread_cond_t done;
+};
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Render a tile, returning the samples traced. */
+static long render_tile(render_job *job, worker_state *ws, scene const *sc,
+                        int tile)
+{
+  int x0 = job->x0 + (tile % job->tiles_across) * job->tile_width;
+  int y0 = job->y0 + (tile / job->tiles_across) * job->tile_height;
+  int x1 = x0 + job->tile_width;
+  int y1 = y0 + job->tile_height;
+  if (x1 > job->x1) x1 = job->x1;
+  if (y1 > job->y1) y1 = job->y1;
+  if (job->first_touch) {
+    framebuffer_clear_tiles(job->fb, x0 - job->x0, y0 - job->y0,
+                            x1 - job->x0, y1 - job->y0);
+  }
+  int samples = job->tile_samples ? job->tile_samples[tile] : sc->num_samples;
+  if (job->gbuffer != NULL) {
+    samples = job->gbuffer->samples;
+  }
+  if (samples <= 0) {
+    return 0;
+  }
+
+  render_features const *f = job->features;
+  render_cost const *cost = job->cost;
   int x, y;
-  for (y = 0; y < height; y++)
-    for (x = 0; x < width; x++)
-      image[y*width+x] = white;
-
-  printf("Ray Tracing (%d):\n", height);
-  for (y = 0; y < height; y++) {
-    printf("%d\n", y);
-    for (x = 0; x < width; x++) {
-      colour c = { 0.0, 0.0, 0.0 };
-      int i = 0;
-      for (i = 0; i < sc->num_samples; i++) {
-	if (sc->callback != NULL) {
-	  /* Perform callback allowing the scene to be updated for e.g.
-	   * motion blur. Downside is that the scene is no longer 'const'
-	   * and we can't share the structure if we ever wanted to
-	   * parallelise.
-	   */
-	  sc->callback(sc);
-	}
-
-	ray.x = x - width/2;
-	ray.y = height/2 - y;
-	ray.z = width/2;
-
-	/* Add noise to the ray. */
-	vector noise = noise_xy(sc->blur_size);
-	ADD(ray, noise);
-
-	/* And remove the noise at the focal distance. */
-	origin.x = - sc->focal_depth * noise.x / ray.z;
-	origin.y = - sc->focal_depth * noise.y / ray.z;
-	origin.z = 0.0;
-
-	/* And more noise to do antialiasing. */
-	vector aa_noise = noise_xy(sc->antialias_size);
-	ADD(ray, aa_noise);
-
-	NORMALISE(ray);
-	colour c2 = trace(sc, origin, ray, white);
-	c.r += c2.r; c.g += c2.g; c.b += c2.b;
+  for (y = y0; y < y1; y++) {
+    for (x = x0; x < x1; x++) {
+      tracer_srand(ws, 42 + ((uint64_t)job->pass * job->height + y) *
+                   job->width + x);
+      ws->shadow_generation++;
+      gbuffer_sample *saved = job->gbuffer
+        ? gbuffer_pixel(job->gbuffer, x - job->x0, y - job->y0) : NULL;
+      hit_features hf;
+      memset(&hf, 0, sizeof(hf));
+      render_stats before = ws->stats;
+      double start = cost != NULL ? now() : 0.0;
+      framebuffer_add(job->fb, x - job->x0, y - job->y0,
+                      render_pixel(ws, sc, job->width, job->height,
+                                   x, y, samples, f ? &hf : NULL,
+                                   saved, job->reshade),
+                      samples);
+      int i = (y - job->y0) * job->feature_stride + (x - job->x0);
+      if (cost != NULL) {
+        if (cost->time) cost->time[i] += now() - start;
+        if (cost->rays) cost->rays[i] += ws->stats.rays - before.rays;
+        if (cost->casts) cost->casts[i] += ws->stats.casts - before.casts;
+        if (cost->shades) cost->shades[i] += ws->stats.shades - before.shades;
+      }
+      if (f == NULL) {
+        continue;
+      }
+      if (f->albedo) f->albedo[i] = hf.albedo;
+      if (f->normal) f->normal[i] = hf.normal;
+      if (f->depth) f->depth[i] = hf.depth;
+    }
+  }
+  return (long)samples * (x1 - x0) * (y1 - y0);
+}
+
+/* Copy 'size' bytes into the arena. */
+static void *copy_in(arena *a, void const *src, size_t size)
+{
+  if (size == 0) {
+    return (void *)src;
+  }
+  void *dst = arena_alloc(a, size);
+  memcpy(dst, src, size);
+  return dst;
+}
+
+/* Copy the scene's geometry into 'a', and build fresh acceleration
+ * structures for it there. Run by a pinned thread, this puts the lot
+ * on the thread's NUMA node.
+ */
+static scene *scene_replicate(scene const *src, arena *a)
+{
+  scene *sc = (scene *)arena_alloc(a, sizeof(scene));
+  *sc = *src;
+#define COPY_ARRAY(field, count) \
+  sc->field = copy_in(a, src->field, src->count * sizeof(*src->field))
+  COPY_ARRAY(spheres, num_spheres);
+  COPY_ARRAY(checkerboards, num_checkerboards);
+  COPY_ARRAY(lights, num_lights);
+  COPY_ARRAY(group_spheres, num_group_spheres);
+  COPY_ARRAY(groups, num_groups);
+  COPY_ARRAY(instances, num_instances);
+  COPY_ARRAY(primitives, num_primitives);
+  COPY_ARRAY(materials, num_materials);
+  COPY_ARRAY(mesh_vertices, num_mesh_vertices);
+  COPY_ARRAY(mesh_triangles, num_mesh_triangles);
+  COPY_ARRAY(meshes, num_meshes);
+#undef COPY_ARRAY
+  sc->light_table = NULL;
+  sc->instance_accel = NULL;
+  sc->prim_accel = NULL;
+  sc->mesh_accel = NULL;
+  /* The photon map is only read, so is shared. Scenes copied for
+   * NUMA nodes are prepared first, so that it's only traced once.
+   */
+  sc->arena = a;
+  render_prepare(sc);
+  return sc;
+}
+
+/* The scene as seen from a node. The first worker there makes the
+ * node's copy, and the rest wait for it.
+ */
+static scene const *node_scene(render_job *job, int node)
+{
+  if (job->topo->num_nodes == 1) {
+    return job->sc;
+  }
+  render_node *n = job->nodes + node;
+  pthread_mutex_lock(&job->lock);
+  int mine = !n->started;
+  n->started = 1;
+  pthread_mutex_unlock(&job->lock);
+
+  if (mine) {
+    arena *a = arena_create(0);
+    scene *sc = scene_replicate(job->sc, a);
+    pthread_mutex_lock(&job->lock);
+    n->arena = a;
+    n->sc = sc;
+    pthread_cond_broadcast(&job->node_ready);
+    pthread_mutex_unlock(&job->lock);
+  } else {
+    pthread_mutex_lock(&job->lock);
+    while (n->sc == NULL) {
+      pthread_cond_wait(&job->node_ready, &job->lock);
+    }
+    pthread_mutex_unlock(&job->lock);
+  }
+  return n->sc;
+}
+
+/* Next tile for a worker on a NUMA node. Call with the lock held. */
+static int take_node_tile(render_job *job, int node)
+{
+  render_node *n = job->nodes + node;
+  if (n->next_tile < n->end_tile) {
+    return n->next_tile++;
+  }
+  /* Out of our own, so help the node with most left, from the far end
+   * of its band.
+   */
+  int i;
+  int best = -1;
+  int most = 0;
+  for (i = 0; i < job->topo->num_nodes; i++) {
+    int left = job->nodes[i].end_tile - job->nodes[i].next_tile;
+    if (left > most) {
+      most = left;
+      best = i;
+    }
+  }
+  return best < 0 ? -1 : --job->nodes[best].end_tile;
+}
+
+/* Next tile for a worker on 'node', or -1 if there are none left. */
+static int take_tile(render_job *job, int node)
+{
+  if (job->nodes == NULL) {
+    int tile = __atomic_fetch_add(&job->next_tile, 1, __ATOMIC_RELAXED);
+    return tile < job->num_tiles ? tile : -1;
+  }
+  pthread_mutex_lock(&job->lock);
+  int tile = take_node_tile(job, node);
+  pthread_mutex_unlock(&job->lock);
+  return tile;
+}
+
+void render_progress_read(render_counters const *counters,
+                          render_progress *progress)
+{
+  progress->tiles_done = __atomic_load_n(&counters->tiles_done,
+                                         __ATOMIC_RELAXED);
+  progress->num_tiles = __atomic_load_n(&counters->num_tiles,
+                                        __ATOMIC_RELAXED);
+  progress->samples = __atomic_load_n(&counters->samples, __ATOMIC_RELAXED);
+  progress->rays = __atomic_load_n(&counters->rays, __ATOMIC_RELAXED);
+  progress->elapsed = now() - counters->start;
+  progress->eta = progress->tiles_done > 0
+    ? progress->elapsed * (progress->num_tiles - progress->tiles_done) /
+      progress->tiles_done
+    : -1.0;
+  progress->rays_per_second = progress->elapsed > 0.0
+    ? progress->rays / progress->elapsed : 0.0;
+}
+
+/* Tell everyone who asked how the render is going. */
+static void report_progress(render_job *job)
+{
+  render_progress p;
+  render_progress_read(job->counters, &p);
+  if (job->progress != NULL) {
+    job->progress(&p, job->progress_data);
+  }
+  int fd = __atomic_load_n(&job->progress_fd, __ATOMIC_RELAXED);
+  if (fd != -1) {
+    char line[256];
+    int len = snprintf(line, sizeof(line),
+                       "{\"tiles_done\":%ld,\"tiles\":%ld,"
+                       "\"samples\":%ld,\"rays\":%ld,"
+                       "\"elapsed\":%.3f,\"eta\":%.3f,"
+                       "\"rays_per_second\":%.0f}\n",
+                       p.tiles_done, p.num_tiles, p.samples, p.rays,
+                       p.elapsed, p.eta, p.rays_per_second);
+    /* Best effort: if the reader goes away, stop writing. Other
+     * workers may be reading the fd as we give up on it.
+     */
+    if (write(fd, line, len) < 0) {
+      __atomic_store_n(&job->progress_fd, -1, __ATOMIC_RELAXED);
+    }
+  }
+  if (job->verbose) {
+    printf("%ld/%ld tiles, %.1f s to go, %.2f Mrays/s\n",
+           p.tiles_done, p.num_tiles, p.eta > 0.0 ? p.eta : 0.0,
+           p.rays_per_second * 1e-6);
+  }
+}
+
+/* Count a finished tile, and report if it's time. */
+static void tile_done(render_job *job, worker_state const *ws, long samples,
+                      long *rays_counted)
+{
+  render_counters *c = job->counters;
+  __atomic_fetch_add(&c->rays, ws->stats.rays - *rays_counted,
+                     __ATOMIC_RELAXED);
+  *rays_counted = ws->stats.rays;
+  __atomic_fetch_add(&c->samples, samples, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&c->tiles_done, 1, __ATOMIC_RELAXED);
+
+  if (job->report_interval < 0) {
+    return;
+  }
+  int64_t t = (int64_t)(now() * 1e9);
+  int64_t due = __atomic_load_n(&job->next_report, __ATOMIC_RELAXED);
+  if (t >= due &&
+      __atomic_compare_exchange_n(&job->next_report, &due,
+                                  t + job->report_interval, 0,
+                                  __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    report_progress(job);
+  }
+}
+
+/* Add 'after' - 'before' to 'to'. */
+static void stats_add(render_stats *to, render_stats const *after,
+                      render_stats const *before)
+{
+  to->shadow_queries += after->shadow_queries - before->shadow_queries;
+  to->shadow_hits += after->shadow_hits - before->shadow_hits;
+  to->rays += after->rays - before->rays;
+  to->ambient_records += after->ambient_records - before->ambient_records;
+  to->ambient_cached += after->ambient_cached - before->ambient_cached;
+  to->ambient_estimates += after->ambient_estimates -
+    before->ambient_estimates;
+  to->casts += after->casts - before->casts;
+  to->shades += after->shades - before->shades;
+}
+
+/* Grab tiles until there are none left, and add what was counted
+ * doing them to the job's stats.
+ */
+static void render_tiles(render_job *job, worker_state *ws,
+                         scene const *sc, int node)
+{
+  render_stats before = ws->stats;
+  ws->shadow_cache = NULL;
+  if (job->shadow_cell > 0.0 && sc->callback == NULL) {
+    if (ws->shadow_store == NULL) {
+      /* Entries start at generation 0, so are all stale. */
+      ws->shadow_store = (shadow_entry *)calloc(SHADOW_CACHE_SIZE,
+                                                sizeof(shadow_entry));
+    }
+    ws->shadow_cache = ws->shadow_store;
+    ws->shadow_inv_cell = 1.0 / job->shadow_cell;
+  }
+  ws->irradiance = job->irradiance;
+  long rays_counted = ws->stats.rays;
+  int tile;
+  while ((tile = take_tile(job, node)) >= 0) {
+    tile_done(job, ws, render_tile(job, ws, sc, tile), &rays_counted);
+  }
+  if (job->stats) {
+    pthread_mutex_lock(&job->lock);
+    stats_add(job->stats, &ws->stats, &before);
+    pthread_mutex_unlock(&job->lock);
+  }
+}
+
+/* A thread started for just the one render. */
+static void *render_worker(void *arg)
+{
+  render_job *job = (render_job *)arg;
+  scene const *sc = job->sc;
+  int node = 0;
+  if (job->nodes != NULL) {
+    /* Deal workers out to the nodes in turn, then to CPUs within. */
+    numa_topology const *t = job->topo;
+    pthread_mutex_lock(&job->lock);
+    int worker = job->next_worker++;
+    pthread_mutex_unlock(&job->lock);
+    node = worker % t->num_nodes;
+    int cpu = (worker / t->num_nodes) % numa_node_cpus(t, node);
+    numa_pin(t->cpus[t->first[node] + cpu]);
+    sc = node_scene(job, node);
+  }
+
+  worker_state ws;
+  memset(&ws, 0, sizeof(ws));
+  render_tiles(job, &ws, sc, node);
+  free(ws.shadow_store);
+  return NULL;
+}
+
+/* Take the task off the context's queue, if it's still there. Call
+ * with the context's lock held.
+ */
+static void context_dequeue(render_context *ctx, context_task *task)
+{
+  context_task **p;
+  for (p = &ctx->queue; *p != NULL; p = &(*p)->next_queued) {
+    if (*p == task) {
+      *p = task->next_queued;
+      return;
+    }
+  }
+}
+
+/* A context's thread: join in with the oldest task that has room,
+ * until told to stop.
+ */
+static void *context_worker_run(void *arg)
+{
+  context_worker *w = (context_worker *)arg;
+  render_context *ctx = w->ctx;
+  pthread_mutex_lock(&ctx->lock);
+  for (;;) {
+    context_task *task = ctx->queue;
+    while (task != NULL && task->active >= task->max_workers) {
+      task = task->next_queued;
+    }
+    if (task == NULL) {
+      if (ctx->stopping) {
+        break;
       }
-      c.r /= sc->num_samples; c.g /= sc->num_samples; c.b /= sc->num_samples;
-      image[y * width + x] = c;
+      pthread_cond_wait(&ctx->work, &ctx->lock);
+      continue;
+    }
+    task->active++;
+    pthread_mutex_unlock(&ctx->lock);
+
+    render_stats before = w->ws.stats;
+    task->run(task->data, &w->ws);
+
+    pthread_mutex_lock(&ctx->lock);
+    stats_add(&ctx->stats, &w->ws.stats, &before);
+    /* Out of work, so no-one else need join in. */
+    context_dequeue(ctx, task);
+    if (--task->active == 0) {
+      task->finished = 1;
+      pthread_cond_broadcast(&ctx->done);
     }
   }
+  pthread_mutex_unlock(&ctx->lock);
+  return NULL;
+}
+
+render_context *render_context_create(int threads)
+{
+  render_context *ctx = (render_context *)calloc(1, sizeof(render_context));
+  if (threads < 1) {
+    threads = 1;
+  }
+  pthread_mutex_init(&ctx->lock, NULL);
+  pthread_cond_init(&ctx->work, NULL);
+  pthread_cond_init(&ctx->done, NULL);
+  ctx->workers = (context_worker *)calloc(threads, sizeof(context_worker));
+  for (ctx->num_workers = 0; ctx->num_workers < threads; ctx->num_workers++) {
+    context_worker *w = ctx->workers + ctx->num_workers;
+    w->ctx = ctx;
+    pthread_create(&w->thread, NULL, context_worker_run, w);
+  }
+  return ctx;
+}
+
+void render_context_destroy(render_context *ctx)
+{
+  pthread_mutex_lock(&ctx->lock);
+  ctx->stopping = 1;
+  pthread_cond_broadcast(&ctx->work);
+  pthread_mutex_unlock(&ctx->lock);
+  int i;
+  for (i = 0; i < ctx->num_workers; i++) {
+    pthread_join(ctx->workers[i].thread, NULL);
+    free(ctx->workers[i].ws.shadow_store);
+  }
+  pthread_cond_destroy(&ctx->done);
+  pthread_cond_destroy(&ctx->work);
+  pthread_mutex_destroy(&ctx->lock);
+  free(ctx->workers);
+  free(ctx);
+}
+
+void render_context_stats(render_context *ctx, render_stats *stats)
+{
+  pthread_mutex_lock(&ctx->lock);
+  *stats = ctx->stats;
+  pthread_mutex_unlock(&ctx->lock);
+}
+
+static void run_task(render_context *ctx, context_task *task)
+{
+  if (ctx == NULL) {
+    worker_state ws;
+    memset(&ws, 0, sizeof(ws));
+    task->run(task->data, &ws);
+    free(ws.shadow_store);
+    return;
+  }
+  task->active = 0;
+  task->finished = 0;
+  task->next_queued = NULL;
+  pthread_mutex_lock(&ctx->lock);
+  context_task **p = &ctx->queue;
+  while (*p != NULL) {
+    p = &(*p)->next_queued;
+  }
+  *p = task;
+  pthread_cond_broadcast(&ctx->work);
+  while (!task->finished) {
+    pthread_cond_wait(&ctx->done, &ctx->lock);
+  }
+  pthread_mutex_unlock(&ctx->lock);
+}
+
+/* A render's tiles, as a context's task. */
+static void render_task(void *data, worker_state *ws)
+{
+  render_job *job = (render_job *)data;
+  render_tiles(job, ws, job->sc, 0);
+}
+
+/* Workers for what's done before a render: the caller's context,
+ * else one of our own for 'threads' > 1, returned in '*own' for the
+ * caller to destroy, else NULL to work on the calling thread.
+ */
+static render_context *prepass_context(render_opts const *opts,
+                                       int threads, render_context **own)
+{
+  *own = NULL;
+  if (opts->context != NULL) {
+    return opts->context;
+  }
+  if (threads > 1) {
+    *own = render_context_create(threads);
+  }
+  return *own;
+}
+
+void render_opts_init(render_opts *opts)
+{
+  opts->threads = 1;
+  opts->tile_width = 0;
+  opts->tile_height = 1;
+  opts->region_x = 0;
+  opts->region_y = 0;
+  opts->region_width = 0;
+  opts->region_height = 0;
+  opts->verbose = 1;
+  opts->features = NULL;
+  opts->cost = NULL;
+  opts->pass = 0;
+  opts->shadow_cell = 0.0;
+  opts->stats = NULL;
+  opts->numa = 0;
+  opts->tile_samples = NULL;
+  opts->counters = NULL;
+  opts->progress = NULL;
+  opts->progress_data = NULL;
+  opts->progress_interval = 1.0;
+  opts->progress_fd = -1;
+  opts->context = NULL;
+  opts->gbuffer = NULL;
+  opts->reshade = 0;
+}
+
+/* Render a picture */
+void render(scene const *sc, int width, int height, colour *image)
+{
+  render_opts opts;
+  render_opts_init(&opts);
+  render_ex(sc, width, height, image, &opts);
+}
+
+int render_clip_region(int width, int height, render_opts const *opts,
+                       int *x0, int *y0, int *x1, int *y1)
+{
+  *x0 = opts->region_x;
+  *y0 = opts->region_y;
+  *x1 = opts->region_width > 0 ? *x0 + opts->region_width : width;
+  *y1 = opts->region_height > 0 ? *y0 + opts->region_height : height;
+  if (*x0 < 0) *x0 = 0;
+  if (*y0 < 0) *y0 = 0;
+  if (*x1 > width) *x1 = width;
+  if (*y1 > height) *y1 = height;
+  return *x0 < *x1 && *y0 < *y1;
+}
+
+/* Is there nothing left for render_prepare to build? */
+static int scene_prepared(scene const *sc)
+{
+  return !(sample_lights(sc) && sc->light_table == NULL) &&
+         !(sc->num_instances > 0 && sc->instance_accel == NULL) &&
+         !(sc->num_primitives > 0 && sc->prim_accel == NULL) &&
+         !(sc->num_mesh_triangles > 0 && sc->mesh_accel == NULL) &&
+         !(sc->num_photons > 0 && sc->photon_map == NULL);
+}
+
+/* As render_prepare, tracing photons on 'ctx', or on the calling
+ * thread if NULL.
+ */
+static void scene_prepare(scene *sc, render_context *ctx)
+{
+  if (sample_lights(sc) && sc->light_table == NULL) {
+    sc->light_table = light_table_build(sc->lights, sc->num_lights,
+                                        sc->arena);
+  }
+  if (sc->num_instances > 0 && sc->instance_accel == NULL) {
+    sc->instance_accel = instance_accel_build(sc);
+  }
+  if (sc->num_primitives > 0 && sc->prim_accel == NULL) {
+    sc->prim_accel = prim_accel_build(sc);
+  }
+  if (sc->num_mesh_triangles > 0 && sc->mesh_accel == NULL) {
+    sc->mesh_accel = mesh_accel_build(sc);
+  }
+  /* Last, as it traces through everything above. */
+  if (sc->num_photons > 0 && sc->photon_map == NULL) {
+    sc->photon_map = photon_map_trace(sc, ctx);
+  }
+}
+
+void render_prepare(scene *sc)
+{
+  scene_prepare(sc, NULL);
+}
+
+void render_prepare_ex(scene *sc, render_opts const *opts)
+{
+  render_context *own_ctx = NULL;
+  render_context *ctx = NULL;
+  if (sc->num_photons > 0 && sc->photon_map == NULL) {
+    ctx = prepass_context(opts, opts->threads, &own_ctx);
+  }
+  scene_prepare(sc, ctx);
+  if (own_ctx != NULL) {
+    render_context_destroy(own_ctx);
+  }
+}
+
+/* As render_prepare_copy, preparing on 'ctx' (see scene_prepare). */
+static scene const *prepare_copy(scene const *sc, render_context *ctx,
+                                 arena **own)
+{
+  *own = NULL;
+  if (sc->callback != NULL || scene_prepared(sc)) {
+    return sc;
+  }
+  *own = arena_create(0);
+  scene *copy = (scene *)arena_alloc(*own, sizeof(scene));
+  *copy = *sc;
+  copy->arena = *own;
+  scene_prepare(copy, ctx);
+  return copy;
+}
+
+scene const *render_prepare_copy(scene const *sc, render_opts const *opts,
+                                 struct arena_t **own)
+{
+  render_context *own_ctx = NULL;
+  render_context *ctx = NULL;
+  if (sc->num_photons > 0 && sc->photon_map == NULL) {
+    ctx = prepass_context(opts, opts->threads, &own_ctx);
+  }
+  scene const *result = prepare_copy(sc, ctx, own);
+  if (own_ctx != NULL) {
+    render_context_destroy(own_ctx);
+  }
+  return result;
+}
+
+/* Render the region into a framebuffer covering it, with feature
+ * buffers 'feature_stride' pixels across, starting at the region.
+ * 'first_touch' says the framebuffer is uncleared. Returns -1, having
+ * rendered nothing, if the G-buffer doesn't fit the render.
+ */
+static int render_job_run(scene const *sc, int width, int height,
+                          framebuffer *fb, int feature_stride,
+                          int first_touch, render_opts const *opts)
+{
+  render_job job;
+  job.sc = sc;
+  job.width = width;
+  job.height = height;
+  job.fb = fb;
+  job.pass = opts->pass;
+
+  if (!render_clip_region(width, height, opts,
+                          &job.x0, &job.y0, &job.x1, &job.y1)) {
+    return 0;
+  }
+  job.gbuffer = opts->gbuffer;
+  job.reshade = opts->reshade;
+  if (job.gbuffer != NULL &&
+      (job.gbuffer->width != job.x1 - job.x0 ||
+       job.gbuffer->height != job.y1 - job.y0 ||
+       (!job.reshade && job.gbuffer->samples != sc->num_samples) ||
+       opts->tile_samples != NULL || sc->callback != NULL)) {
+    return -1;
+  }
+
+  /* Keep tiles to whole framebuffer tiles, so that no two workers
+   * write to the same one.
+   */
+  int tile_width = opts->tile_width > 0 ? opts->tile_width : job.x1 - job.x0;
+  int tile_height = opts->tile_height > 0 ? opts->tile_height : job.y1 - job.y0;
+  job.tile_width = (tile_width + FB_TILE_SIZE - 1) & ~(FB_TILE_SIZE - 1);
+  job.tile_height = (tile_height + FB_TILE_SIZE - 1) & ~(FB_TILE_SIZE - 1);
+  job.tiles_across = (job.x1 - job.x0 - 1) / job.tile_width + 1;
+  int tiles_down = (job.y1 - job.y0 - 1) / job.tile_height + 1;
+  job.num_tiles = job.tiles_across * tiles_down;
+  job.next_tile = 0;
+  render_counters own_counters;
+  memset(&own_counters, 0, sizeof(own_counters));
+  job.counters = opts->counters ? opts->counters : &own_counters;
+  if (job.counters->start == 0.0) {
+    job.counters->start = now();
+  }
+  __atomic_fetch_add(&job.counters->num_tiles, job.num_tiles,
+                     __ATOMIC_RELAXED);
+  job.verbose = opts->verbose;
+  job.progress = opts->progress;
+  job.progress_data = opts->progress_data;
+  job.progress_fd = opts->progress_fd;
+  int reporting = job.verbose || job.progress || job.progress_fd != -1;
+  job.report_interval = reporting ? (int64_t)(opts->progress_interval * 1e9)
+                                  : -1;
+  job.next_report = (int64_t)(now() * 1e9) + job.report_interval;
+  job.features = opts->features;
+  job.cost = opts->cost;
+  job.feature_stride = feature_stride;
+  job.shadow_cell = opts->shadow_cell;
+  job.stats = opts->stats;
+  job.tile_samples = opts->tile_samples;
+  job.first_touch = first_touch;
+  job.topo = NULL;
+  job.nodes = NULL;
+  job.next_worker = 0;
+  pthread_mutex_init(&job.lock, NULL);
+  pthread_cond_init(&job.node_ready, NULL);
+
+  int threads = opts->threads;
+  if (sc->callback != NULL && threads > 1 && opts->context == NULL) {
+    printf("Scene has a callback, rendering single-threaded.\n");
+    threads = 1;
+  }
+  job.task.run = render_task;
+  job.task.data = &job;
+  job.task.max_workers = sc->callback != NULL ? 1 : INT_MAX;
+
+  /* Split the tiles into a band per node. */
+  numa_topology topo;
+  if (opts->numa && threads > 1 && opts->context == NULL) {
+    numa_topology_read(&topo);
+    job.topo = &topo;
+    job.nodes = (render_node *)calloc(topo.num_nodes, sizeof(render_node));
+    int i;
+    for (i = 0; i < topo.num_nodes; i++) {
+      job.nodes[i].next_tile = (long)job.num_tiles * i / topo.num_nodes;
+      job.nodes[i].end_tile = (long)job.num_tiles * (i + 1) / topo.num_nodes;
+    }
+  }
+
+  /* Photons and ambient light are worked out before the render
+   * starts, on the same workers as it, or as many threads.
+   */
+  render_context *own_ctx = NULL;
+  render_context *prep_ctx = NULL;
+  if (sc->callback == NULL &&
+      (sc->ambient_samples > 0 ||
+       (sc->num_photons > 0 && sc->photon_map == NULL))) {
+    prep_ctx = prepass_context(opts, threads, &own_ctx);
+  }
+
+  /* The scene is only read, so that other renders can share it.
+   * Anything it still needs building is built in a copy of our own,
+   * unless each node is making its own copy anyway (and there's no
+   * photon map to trace or irradiance cache to fill first, which the
+   * nodes share). Scenes with callbacks change as they go, so get a
+   * copy of everything.
+   */
+  arena *own_arena = NULL;
+  if (sc->callback != NULL) {
+    own_arena = arena_create(0);
+    job.sc = scene_replicate(sc, own_arena);
+  } else if (job.nodes == NULL || topo.num_nodes == 1 ||
+             (sc->num_photons > 0 && sc->photon_map == NULL) ||
+             sc->ambient_samples > 0) {
+    job.sc = prepare_copy(sc, prep_ctx, &own_arena);
+  }
+
+  /* Ambient light is estimated up front, where the camera sees, and
+   * only interpolated while rendering. Scenes with callbacks move, so
+   * get no cache.
+   */
+  irradiance_cache *irradiance = NULL;
+  if (sc->ambient_samples > 0 && sc->callback == NULL) {
+    irradiance = ambient_prepass(job.sc, prep_ctx, width, height,
+                                 job.x0, job.y0, job.x1, job.y1);
+    if (job.stats) {
+      job.stats->ambient_records += irradiance_cache_size(irradiance);
+    }
+  }
+  job.irradiance = irradiance;
+  if (own_ctx != NULL) {
+    render_context_destroy(own_ctx);
+  }
+
+  if (opts->context != NULL) {
+    run_task(opts->context, &job.task);
+  } else if (threads <= 1) {
+    render_worker(&job);
+  } else {
+    pthread_t *workers = (pthread_t *)malloc(threads * sizeof(pthread_t));
+    int i;
+    for (i = 0; i < threads; i++) {
+      pthread_create(workers + i, NULL, render_worker, &job);
+    }
+    for (i = 0; i < threads; i++) {
+      pthread_join(workers[i], NULL);
+    }
+    free(workers);
+  }
+  if (reporting) {
+    report_progress(&job);
+  }
+  if (job.nodes != NULL) {
+    int i;
+    for (i = 0; i < topo.num_nodes; i++) {
+      if (job.nodes[i].arena != NULL) {
+        arena_destroy(job.nodes[i].arena);
+      }
+    }
+    free(job.nodes);
+  }
+  if (irradiance != NULL) {
+    irradiance_cache_destroy(irradiance);
+  }
+  if (own_arena != NULL) {
+    arena_destroy(own_arena);
+  }
+  pthread_cond_destroy(&job.node_ready);
+  pthread_mutex_destroy(&job.lock);
+  return 0;
+}
+
+/* Render the region into a fresh framebuffer, and write it out into
+ * 'image', 'stride' pixels across and starting at the region.
+ */
+static int render_to_image(scene const *sc, int width, int height,
+                           colour *image, int stride,
+                           render_opts const *opts)
+{
+  int x0, y0, x1, y1;
+  if (!render_clip_region(width, height, opts, &x0, &y0, &x1, &y1)) {
+    return 0;
+  }
+  /* For NUMA renders, leave each tile's memory for the node that
+   * renders it to touch first.
+   */
+  int first_touch = opts->numa && opts->threads > 1;
+  framebuffer *fb = first_touch ? framebuffer_alloc(x1 - x0, y1 - y0)
+                                : framebuffer_create(x1 - x0, y1 - y0);
+  int result = render_job_run(sc, width, height, fb, stride, first_touch,
+                              opts);
+  if (result == 0) {
+    framebuffer_detile(fb, image, stride);
+  }
+  framebuffer_destroy(fb);
+  return result;
+}
+
+/* Render a picture, or part of one, in tiles. */
+int render_ex(scene const *sc, int width, int height, colour *image,
+              render_opts const *opts)
+{
+  int x0 = opts->region_x > 0 ? opts->region_x : 0;
+  int y0 = opts->region_y > 0 ? opts->region_y : 0;
+  int offset = y0 * width + x0;
+
+  /* Feature and cost buffers are laid out like the image. */
+  render_opts job_opts = *opts;
+  render_features features;
+  if (opts->features) {
+    features = *opts->features;
+    if (features.albedo) features.albedo += offset;
+    if (features.normal) features.normal += offset;
+    if (features.depth) features.depth += offset;
+    job_opts.features = &features;
+  }
+  render_cost cost;
+  if (opts->cost) {
+    cost = *opts->cost;
+    if (cost.time) cost.time += offset;
+    if (cost.rays) cost.rays += offset;
+    if (cost.casts) cost.casts += offset;
+    if (cost.shades) cost.shades += offset;
+    job_opts.cost = &cost;
+  }
+  return render_to_image(sc, width, height, image + offset, width,
+                         &job_opts);
+}
+
+/* Render just the region, into an image the size of the region. */
+int render_crop(scene const *sc, int width, int height, colour *image,
+                render_opts const *opts)
+{
+  int region_width = opts->region_width > 0 ? opts->region_width : width;
+  return render_to_image(sc, width, height, image, region_width, opts);
+}
+
+/* Add samples for the region to a framebuffer covering it. */
+int render_fb(scene const *sc, int width, int height, framebuffer *fb,
+              render_opts const *opts)
+{
+  int x0, y0, x1, y1;
+  if (!render_clip_region(width, height, opts, &x0, &y0, &x1, &y1)) {
+    return 0;
+  }
+  return render_job_run(sc, width, height, fb, x1 - x0, 0, opts);
 }
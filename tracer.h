@@ -57,7 +57,103 @@ typedef struct {
   vector area2;
 } light;
 
+/* A cluster of spheres, stored once and placed by instances. The
+ * spheres are group_spheres[first, first + count).
+ */
+typedef struct {
+  int first;
+  int count;
+} sphere_group;
+
+/* A copy of a group, scaled up by 'scale' then moved by 'offset'. */
+typedef struct {
+  int group;
+  vector offset;
+  double scale;
+} instance;
+
+/* Other shapes. Each has a material rather than a surface. */
+typedef enum {
+  prim_box,
+  prim_plane,
+  prim_disc,
+  prim_cylinder,
+  prim_triangle,
+  num_prim_types
+} prim_type;
+
+typedef struct {
+  prim_type type;
+  int material;
+  /* What these mean depends on the type:
+   *   box:      a, b = min and max corners
+   *   plane:    a = normal, d = distance (like checkerboard)
+   *   disc:     a = centre, b = normal, d = radius
+   *   cylinder: a = centre of the base, b = axis (its length being the
+   *             height), d = radius. The ends are open - add discs to
+   *             close them.
+   *   triangle: a, b, c = corners
+   */
+  vector a, b, c;
+  double d;
+} primitive;
+
+/* How a material picks the surface at a point. */
+typedef enum {
+  /* Always s1. */
+  material_plain,
+  /* Alternates between s1 and s2 in cubes of side 'size'. */
+  material_checker,
+  num_material_types
+} material_type;
+
+typedef struct {
+  material_type type;
+  surface s1;
+  surface s2;
+  double size;
+} material;
+
+/* Triangle meshes. All meshes share one vertex array and one triangle
+ * array, each mesh being a range of both, with corners numbered from
+ * the mesh's first vertex. The meshes cover the triangle array in
+ * order, without gaps. Vertices are floats to keep big meshes small.
+ */
+typedef struct {
+  float x, y, z;
+} mesh_vertex;
+
+typedef struct {
+  int v[3];
+} mesh_triangle;
+
+typedef struct {
+  int first_vertex;
+  int num_vertices;
+  int first_triangle;
+  int num_triangles;
+  int material;
+} mesh;
+
+/* Alias table for picking lights in proportion to their power, in
+ * constant time.
+ */
+typedef struct {
+  int num_lights;
+  /* Chance of keeping slot i, rather than taking alias[i]. */
+  double *prob;
+  int *alias;
+  /* Overall chance of picking each light. */
+  double *pdf;
+} light_table;
+
 struct scene_t;
+struct arena_t;
+struct instance_accel_t;
+struct prim_accel_t;
+struct mesh_accel_t;
+struct photon_map_t;
+struct gbuffer_t;
 
 typedef void (* scene_callback)(struct scene_t *);
 
@@ -68,19 +164,263 @@ typedef struct scene_t {
   int num_checkerboards;
   light *lights;
   int num_lights;
+  /* Instanced spheres, on top of the plain ones above. */
+  sphere *group_spheres;
+  int num_group_spheres;
+  sphere_group *groups;
+  int num_groups;
+  instance *instances;
+  int num_instances;
+  /* Built by render when needed. Reset to NULL if the instances or
+   * groups change.
+   */
+  struct instance_accel_t *instance_accel;
+  primitive *primitives;
+  int num_primitives;
+  material *materials;
+  int num_materials;
+  /* Built by render when needed. Reset to NULL if the primitives
+   * change.
+   */
+  struct prim_accel_t *prim_accel;
+  /* Meshes use the materials above. */
+  mesh_vertex *mesh_vertices;
+  int num_mesh_vertices;
+  mesh_triangle *mesh_triangles;
+  int num_mesh_triangles;
+  mesh *meshes;
+  int num_meshes;
+  /* Built by render when needed. Reset to NULL if the meshes change. */
+  struct mesh_accel_t *mesh_accel;
+  /* Lights sampled per shading point. Zero (or at least num_lights)
+   * means shade from every light.
+   */
+  int light_samples;
+  /* Built by render when needed. Reset to NULL if the lights change. */
+  light_table *light_table;
   int num_samples;
+  /* Most bounces a path may take. DEPTH_UNSET for the default, 32. */
+  int max_depth;
+  /* Bounces always traced before Russian roulette may end a path.
+   * DEPTH_UNSET for the default, 2.
+   */
+  int rr_depth;
+  /* After that, the chance at each bounce that a path carrying full
+   * weight goes on. Dimmer paths survive in proportion to their
+   * weight, and survivors are scaled up to keep the image unbiased.
+   * 0 for the default, 1.
+   */
+  double rr_survival;
+  /* Photons shot from the lights through the refracting transparent
+   * spheres (not instanced ones), to light the caustics they focus.
+   * 0 for none. With them, light no longer passes straight through
+   * those spheres to reach a surface.
+   */
+  int num_photons;
+  /* Photons gathered for each caustic estimate, and the farthest to
+   * look for them. 0 for the defaults, 64 and an eighth of the
+   * largest such sphere's radius.
+   */
+  int photon_gather;
+  double photon_radius;
+  /* Built by render when needed. Reset to NULL if the lights, spheres
+   * or settings above change.
+   */
+  struct photon_map_t *photon_map;
+  /* Hemisphere rays per estimate of the light falling on diffuse
+   * surfaces from the sky, whose colour is 'ambient', and bounced off
+   * directly lit surfaces nearby. 0 for none, leaving what lights
+   * don't reach black. Estimates are cached and interpolated, with
+   * an error of about 'ambient_accuracy' (0 for the default, 0.2).
+   */
+  int ambient_samples;
+  double ambient_accuracy;
+  colour ambient;
   double blur_size;
   double antialias_size;
   double focal_depth;
   scene_callback callback;
+  /* Where to allocate things that live as long as the scene, such as
+   * the light table. NULL to use malloc (and never free them).
+   */
+  struct arena_t *arena;
 } scene;
 
+/* Per-pixel features of the surfaces first hit, averaged over the
+ * samples, for guiding a denoiser. Laid out like the image. Any of the
+ * buffers may be NULL. Pixels where nothing was hit are all zero.
+ */
+typedef struct {
+  colour *albedo;
+  vector *normal;
+  double *depth;
+} render_features;
+
+/* What each pixel cost to render, laid out like render_features: the
+ * seconds spent on it, the rays traced for it (as in render_stats),
+ * the rays and shadow rays cast through the scene, and the shading
+ * calls. Any of the buffers may be NULL. Costs are added to what's
+ * there, so that passes accumulate; start them zeroed.
+ */
+typedef struct {
+  float *time;
+  float *rays;
+  float *casts;
+  float *shades;
+} render_cost;
+
+/* Counts from rendering. */
+typedef struct {
+  /* Point light shadow queries made with the shadow cache on, and how
+   * many were answered from it.
+   */
+  long shadow_queries;
+  long shadow_hits;
+  /* Camera, reflected and transmitted rays traced. */
+  long rays;
+  /* Ambient light estimates made before rendering to cache, those
+   * interpolated from the cache while rendering, and those the cache
+   * had nothing near enough for, so were made afresh.
+   */
+  long ambient_records;
+  long ambient_cached;
+  long ambient_estimates;
+  /* Rays of any kind (shadow and ambient rays too) cast through the
+   * scene, and points shaded.
+   */
+  long casts;
+  long shades;
+} render_stats;
+
+/* How a render is getting on. */
+typedef struct {
+  long tiles_done;
+  long num_tiles;
+  /* Pixel samples and rays traced so far. */
+  long samples;
+  long rays;
+  double elapsed;
+  /* Seconds left, going by the tiles done so far, or -1 before any
+   * are.
+   */
+  double eta;
+  double rays_per_second;
+} render_progress;
+
+typedef void (* render_progress_fn)(render_progress const *progress,
+                                    void *data);
+
+/* Counts that workers add to as they finish tiles, without taking any
+ * locks, and that any thread may read with render_progress_read while
+ * the render runs. Start them zeroed; renders sharing them (passes,
+ * say) add up.
+ */
+typedef struct {
+  long tiles_done;
+  long num_tiles;
+  long samples;
+  long rays;
+  /* When the first render using them started. */
+  double start;
+} render_counters;
+
+/* Worker threads, and what they keep to themselves, shared by any
+ * number of renders. Renders started from several threads at once
+ * each get their tiles done by whichever workers are free, oldest
+ * render first.
+ */
+typedef struct render_context_t render_context;
+
+/* How to split up a render. */
+typedef struct {
+  /* Worker threads; 1 renders on the calling thread. */
+  int threads;
+  /* Tile size handed to each worker. Zero means the full width or
+   * height of the region. Rounded up to whole framebuffer tiles.
+   */
+  int tile_width;
+  int tile_height;
+  /* Part of the image to trace. Zero width or height means all of
+   * it. The camera still covers the whole image.
+   */
+  int region_x;
+  int region_y;
+  int region_width;
+  int region_height;
+  /* Print progress to stdout every 'progress_interval' seconds. */
+  int verbose;
+  /* Where to write feature buffers, or NULL. */
+  render_features const *features;
+  /* Where to add up what each pixel cost, or NULL. */
+  render_cost const *cost;
+  /* Renders with different pass numbers use different random
+   * numbers, so their samples can be accumulated.
+   */
+  int pass;
+  /* If positive, remember whether point lights are visible from hit
+   * points snapped to a grid this size, and reuse the answer for the
+   * other samples of the same pixel. Shadow edges are then only
+   * antialiased down to the grid size. Ignored for scenes with a
+   * callback.
+   */
+  double shadow_cell;
+  /* If non-NULL, counts from the render are added here. */
+  render_stats *stats;
+  /* Pin worker threads to CPUs spread over the NUMA nodes, give each
+   * node its own copy of the scene, and hand each node's workers
+   * tiles from its own band of the image. Needs threads > 1.
+   */
+  int numa;
+  /* If non-NULL, samples per pixel for each tile, in place of the
+   * scene's num_samples. Tiles run row by row from the region's top
+   * left, their size rounded up as above; 0 skips a tile.
+   */
+  int const *tile_samples;
+  /* Where workers count progress. NULL for counts private to the
+   * render.
+   */
+  render_counters *counters;
+  /* If non-NULL, called every 'progress_interval' seconds from
+   * whichever worker notices it's due, and once at the end.
+   */
+  render_progress_fn progress;
+  void *progress_data;
+  double progress_interval;
+  /* If not -1, each report is also written here as a line of JSON. */
+  int progress_fd;
+  /* If non-NULL, render on the context's workers, waiting for them to
+   * finish. 'threads' and 'numa' are then ignored.
+   */
+  render_context *context;
+  /* If non-NULL, the first hit of each camera ray is saved here (see
+   * gbuffer.h). It must be the size of the region, with room for the
+   * scene's samples per pixel, and can't be used with 'tile_samples'
+   * or scenes with callbacks: renders it doesn't fit return -1 and
+   * render nothing.
+   */
+  struct gbuffer_t *gbuffer;
+  /* Rather than tracing camera rays, shade the hits saved in
+   * 'gbuffer', taking its samples per pixel. Lights, surfaces and the
+   * settings that don't move the camera may have changed since it was
+   * saved, but not the camera or the geometry.
+   */
+  int reshade;
+} render_opts;
+
+struct framebuffer_t;
+
 /* ------------------------------------------------------------------
  * Macros
  */
 
+#ifdef TRACER_FAST_MATH
+/* One divide rather than three, for a last-bit difference. */
+#define NORMALISE(v) { double _inv = 1.0 / sqrt(v.x*v.x + v.y*v.y + v.z*v.z); \
+                      v.x *= _inv; v.y *= _inv; v.z *= _inv; }
+#else
 #define NORMALISE(v) { double _len = sqrt(v.x*v.x + v.y*v.y + v.z*v.z); \
                       v.x /= _len; v.y /= _len; v.z /= _len; }
+#endif
 
 #define DOT(v1, v2) (v1.x*v2.x + v1.y*v2.y + v1.z*v2.z)
 
@@ -90,7 +430,17 @@ typedef struct scene_t {
 
 #define MULT(v, m) {v.x *= m; v.y *= m; v.z *= m;}
 
+#ifndef EPSILON
+#define EPSILON 1.0e-7
+#endif
+
 #define IS_BLACK(c) ((c).r < EPSILON && (c).g < EPSILON && (c).b < EPSILON)
+#define IS_ZERO(v) ((v).x == 0.0 && (v).y == 0.0 && (v).z == 0.0)
+
+/* A scene's max_depth or rr_depth left to the default. Zero is a
+ * depth like any other.
+ */
+#define DEPTH_UNSET (-1)
 
 /* ------------------------------------------------------------------
  * Exported functions
@@ -99,7 +449,80 @@ typedef struct scene_t {
 /* Find a colour x in [0, 1] of the way around the colour wheel. */
 colour colour_phase(double x);
 
-/* Render a picture */
-void render(scene *scene_in, int width, int height, colour *image);
+/* Build an alias table over some lights, in the arena if non-NULL. */
+light_table *light_table_build(light const *lights, int num_lights,
+                               struct arena_t *a);
+
+/* Build the light tables, acceleration structures and photon map a
+ * scene needs, so that it can be timed separately, and so that renders
+ * of it can share them. Renders of a scene that isn't prepared build
+ * their own. Not to be called while the scene is being rendered.
+ */
+void render_prepare(scene *sc);
+
+/* As render_prepare, which traces photons on the calling thread, but
+ * tracing them on the workers 'opts' would render with.
+ */
+void render_prepare_ex(scene *sc, render_opts const *opts);
+
+/* The scene, if render_prepare has nothing left to build (or it has a
+ * callback, so renders copy it anyway), else a prepared copy in a new
+ * arena, returned in '*own' for the caller to destroy when done.
+ * '*own' is NULL if no copy was made. Photons are traced on the
+ * workers 'opts' would render with.
+ */
+scene const *render_prepare_copy(scene const *sc, render_opts const *opts,
+                                 struct arena_t **own);
+
+/* Start 'threads' workers for renders to share. */
+render_context *render_context_create(int threads);
+
+/* Stop the workers. Not to be called with renders still running. */
+void render_context_destroy(render_context *ctx);
+
+/* Counts from the renders on the context so far. */
+void render_context_stats(render_context *ctx, render_stats *stats);
+
+/* Default options: single-threaded, a row at a time, whole image,
+ * with progress.
+ */
+void render_opts_init(render_opts *opts);
+
+/* Render a picture. All the render functions only read the scene, and
+ * may be called from several threads at once.
+ */
+void render(scene const *scene_in, int width, int height, colour *image);
+
+/* Render a picture, or the region of it given in the options. Pixels
+ * outside the region are left untouched. Returns 0, or -1 if the
+ * G-buffer doesn't fit the render (see render_opts).
+ */
+int render_ex(scene const *scene_in, int width, int height, colour *image,
+              render_opts const *opts);
+
+/* Render just the region given in the options into 'image', which is
+ * region_width x region_height. The camera still covers the whole
+ * width x height frame, so the crop lines up with a full render. The
+ * region must lie within the frame. Returns as render_ex.
+ */
+int render_crop(scene const *scene_in, int width, int height, colour *image,
+                render_opts const *opts);
+
+/* Add sc->num_samples samples for each pixel of the region to a
+ * framebuffer the size of the region (see framebuffer.h). Tiles are
+ * rounded up to whole framebuffer tiles. Returns as render_ex.
+ */
+int render_fb(scene const *scene_in, int width, int height,
+              struct framebuffer_t *fb, render_opts const *opts);
+
+/* Read a render's progress so far. */
+void render_progress_read(render_counters const *counters,
+                          render_progress *progress);
+
+/* Find the part of the image the options ask for, (x0, y0) up to
+ * (x1, y1). Returns 0 if it's empty.
+ */
+int render_clip_region(int width, int height, render_opts const *opts,
+                       int *x0, int *y0, int *x1, int *y1);
 
 #endif // TRACER_H_INCLUDED
@@ -0,0 +1,568 @@
+/*
+ * tracer_cli.c: Render a scene file from the command line.
+ *
+ * (C) Copyright Simon Frankau 1999-2014
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "budget.h"
+#include "denoise.h"
+#include "framebuffer.h"
+#include "gbuffer.h"
+#include "image_file.h"
+#include "mesh.h"
+#include "numa.h"
+#include "photon.h"
+#include "png_render.h"
+#include "preview.h"
+#include "scene_file.h"
+#include "tracer.h"
+
+/* Most -M options. */
+#define MAX_MESHES 16
+
+typedef enum {
+  format_png,
+  format_ppm,
+  format_pfm
+} output_format;
+
+static void usage(char const *prog)
+{
+  fprintf(stderr,
+          "Usage: %s [options] scene-file\n"
+          "  -o file     Output file (default out.png)\n"
+          "  -f format   png, ppm or pfm (default from the file name)\n"
+          "  -w width    Image width (default from the scene)\n"
+          "  -h height   Image height (default from the scene)\n"
+          "  -s samples  Samples per pixel (default from the scene)\n"
+          "  -l lights   Lights sampled per shading point, 0 for all\n"
+          "              (default from the scene)\n"
+          "  -t threads  Worker threads (default: one per CPU)\n"
+          "  -T size     Tile size in pixels (default 32)\n"
+          "  -r x,y,w,h  Only trace this region of the image\n"
+          "  -c          Write just the region, not the full frame\n"
+          "  -m file     Merge the region into this existing png or pfm\n"
+          "  -d          Denoise the result, guided by feature buffers\n"
+          "  -p scale    Preview: stream PPM frames to stdout, starting at\n"
+          "              1/scale resolution, re-rendering on scene changes\n"
+          "  -P path     Preview to viewers on a Unix domain socket instead\n"
+          "  -M file[:scale,x,y,z]\n"
+          "              Add an OBJ mesh, scaled and moved (may be repeated)\n"
+          "  -S file     Save the scene, with any meshes, instead of rendering\n"
+          "  -C size     Reuse point light shadows within each pixel, for hit\n"
+          "              points within this grid size\n"
+          "  -D depth    Most bounces per path (default from the scene)\n"
+          "  -R depth[,survival]\n"
+          "              Bounces before Russian roulette, and the survival\n"
+          "              chance of a full-weight path (default from the scene)\n"
+          "  -N          Pin threads across NUMA nodes, with a copy of the\n"
+          "              scene on each\n"
+          "  -B seconds  Render for this long rather than a fixed number of\n"
+          "              samples, sampling the noisiest tiles most\n"
+          "  -j file     Append progress to this file as JSON lines\n"
+          "  -q          Don't print progress or the files written\n"
+          "  -k photons[,gather[,radius]]\n"
+          "              Light caustics through refracting spheres with a\n"
+          "              photon map, gathering this many photons within\n"
+          "              this radius (default from the scene; 0 photons\n"
+          "              for none)\n"
+          "  -A samples[,accuracy]\n"
+          "              Light diffuse surfaces from the sky and what's lit\n"
+          "              nearby, with this many rays per cached estimate and\n"
+          "              this largest interpolation error (default from the\n"
+          "              scene; 0 samples for none)\n"
+          "  -a r,g,b    Sky colour for -A (default from the scene)\n"
+          "  -H name[,measure]\n"
+          "              Write what each pixel cost to name.png, in false\n"
+          "              colour, and all measures raw to name.cost. The\n"
+          "              measure is time (default), rays, casts or shades\n"
+          "  -G file     Save the camera rays' first hits to this file\n"
+          "  -g file     Re-shade the hits saved with -G instead of tracing\n"
+          "              camera rays; only lights and surfaces may change\n",
+          prog);
+  exit(1);
+}
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Say a file was written, unless asked to be quiet. */
+static void saved(render_opts const *opts, char const *file)
+{
+  if (opts->verbose) {
+    printf("Saved file %s!\n", file);
+  }
+}
+
+/* Add a mesh given as "file[:scale,x,y,z]". */
+static int add_mesh(scene *sc, char const *arg)
+{
+  char path[1024];
+  double scale = 1.0;
+  vector offset = { 0.0, 0.0, 0.0 };
+  char const *colon = strrchr(arg, ':');
+  size_t len = colon ? (size_t)(colon - arg) : strlen(arg);
+  if (len >= sizeof(path)) {
+    return -1;
+  }
+  memcpy(path, arg, len);
+  path[len] = '\0';
+  if (colon && sscanf(colon + 1, "%lf,%lf,%lf,%lf",
+                      &scale, &offset.x, &offset.y, &offset.z) != 4) {
+    fprintf(stderr, "Bad mesh placement '%s'\n", colon + 1);
+    return -1;
+  }
+  return mesh_load(sc, path, scale, offset, -1);
+}
+
+static int parse_format(char const *s, output_format *format)
+{
+  if (strcmp(s, "png") == 0) {
+    *format = format_png;
+  } else if (strcmp(s, "ppm") == 0) {
+    *format = format_ppm;
+  } else if (strcmp(s, "pfm") == 0) {
+    *format = format_pfm;
+  } else {
+    return -1;
+  }
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  char const *output = "out.png";
+  char const *format_name = NULL;
+  int width = 0;
+  int height = 0;
+  int samples = 0;
+  int light_samples = -1;
+  int max_depth = DEPTH_UNSET;
+  int rr_depth = DEPTH_UNSET;
+  double rr_survival = 0.0;
+  int num_photons = -1;
+  int photon_gather = 0;
+  double photon_radius = 0.0;
+  int ambient_samples = -1;
+  double ambient_accuracy = 0.0;
+  colour ambient;
+  int set_ambient = 0;
+  double budget_seconds = 0.0;
+  budget_result budget;
+  int crop = 0;
+  int denoising = 0;
+  char const *merge = NULL;
+  int preview_scale = 0;
+  char const *preview_socket = NULL;
+  char const *meshes[MAX_MESHES];
+  int num_meshes = 0;
+  char const *save_scene = NULL;
+  char const *progress_file = NULL;
+  char const *gbuffer_out = NULL;
+  char const *gbuffer_in = NULL;
+  char heatmap[256] = "";
+  char heat_measure[16] = "time";
+  render_stats stats;
+  memset(&stats, 0, sizeof(stats));
+  render_opts opts;
+  render_opts_init(&opts);
+  opts.stats = &stats;
+  opts.threads = sysconf(_SC_NPROCESSORS_ONLN);
+  opts.tile_width = opts.tile_height = 32;
+
+  int c;
+  while ((c = getopt(argc, argv, "o:f:w:h:s:l:t:T:r:cm:dp:P:M:S:C:D:R:NB:j:qk:A:a:G:g:H:")) != -1) {
+    switch (c) {
+    case 'o': output = optarg; break;
+    case 'f': format_name = optarg; break;
+    case 'w': width = atoi(optarg); break;
+    case 'h': height = atoi(optarg); break;
+    case 's': samples = atoi(optarg); break;
+    case 'l': light_samples = atoi(optarg); break;
+    case 't': opts.threads = atoi(optarg); break;
+    case 'T': opts.tile_width = opts.tile_height = atoi(optarg); break;
+    case 'r':
+      if (sscanf(optarg, "%d,%d,%d,%d",
+                 &opts.region_x, &opts.region_y,
+                 &opts.region_width, &opts.region_height) != 4) {
+        usage(argv[0]);
+      }
+      break;
+    case 'c': crop = 1; break;
+    case 'm': merge = optarg; break;
+    case 'd': denoising = 1; break;
+    case 'p': preview_scale = atoi(optarg); break;
+    case 'P': preview_socket = optarg; break;
+    case 'M':
+      if (num_meshes == MAX_MESHES) {
+        usage(argv[0]);
+      }
+      meshes[num_meshes++] = optarg;
+      break;
+    case 'S': save_scene = optarg; break;
+    case 'C': opts.shadow_cell = atof(optarg); break;
+    case 'N': opts.numa = 1; break;
+    case 'B': budget_seconds = atof(optarg); break;
+    case 'j': progress_file = optarg; break;
+    case 'q': opts.verbose = 0; break;
+    case 'G': gbuffer_out = optarg; break;
+    case 'g': gbuffer_in = optarg; break;
+    case 'H':
+      if (sscanf(optarg, "%200[^,],%15s", heatmap, heat_measure) < 1) {
+        usage(argv[0]);
+      }
+      break;
+    case 'k':
+      if (sscanf(optarg, "%d,%d,%lf", &num_photons, &photon_gather,
+                 &photon_radius) < 1) {
+        usage(argv[0]);
+      }
+      break;
+    case 'A':
+      if (sscanf(optarg, "%d,%lf", &ambient_samples, &ambient_accuracy) < 1) {
+        usage(argv[0]);
+      }
+      break;
+    case 'a':
+      if (sscanf(optarg, "%lf,%lf,%lf", &ambient.r, &ambient.g,
+                 &ambient.b) != 3) {
+        usage(argv[0]);
+      }
+      set_ambient = 1;
+      break;
+    case 'D': max_depth = atoi(optarg); break;
+    case 'R':
+      if (sscanf(optarg, "%d,%lf", &rr_depth, &rr_survival) < 1) {
+        usage(argv[0]);
+      }
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (optind != argc - 1) {
+    usage(argv[0]);
+  }
+
+  if (opts.threads < 1) opts.threads = 1;
+  if (preview_scale > 0 || preview_socket != NULL) {
+    return preview_run(argv[optind], width, height,
+                       preview_scale > 0 ? preview_scale : 8, &opts,
+                       STDOUT_FILENO, preview_socket) ? 1 : 0;
+  }
+
+  /* Pick the format from the extension if not given. */
+  if (format_name == NULL) {
+    char const *dot = strrchr(output, '.');
+    format_name = dot ? dot + 1 : "png";
+  }
+  output_format format;
+  if (parse_format(format_name, &format) != 0) {
+    fprintf(stderr, "Unknown output format '%s'\n", format_name);
+    return 1;
+  }
+  if ((crop || merge) && (opts.region_width <= 0 || opts.region_height <= 0)) {
+    fprintf(stderr, "Cropping and merging need a region\n");
+    return 1;
+  }
+  if (budget_seconds > 0.0 && opts.region_width > 0 && !crop && !merge) {
+    fprintf(stderr, "Budgeted renders of a region need -c or -m\n");
+    return 1;
+  }
+  if (budget_seconds > 0.0 && (gbuffer_out || gbuffer_in)) {
+    fprintf(stderr, "Budgeted renders can't use G-buffers\n");
+    return 1;
+  }
+  if (merge && format == format_ppm) {
+    fprintf(stderr, "Can only merge into png or pfm\n");
+    return 1;
+  }
+
+  if (progress_file != NULL) {
+    opts.progress_fd = open(progress_file, O_WRONLY | O_CREAT | O_APPEND,
+                            0644);
+    if (opts.progress_fd < 0) {
+      fprintf(stderr, "Couldn't open %s\n", progress_file);
+      return 1;
+    }
+  }
+
+  double t0 = now();
+  scene_file *sf = scene_file_load(argv[optind]);
+  if (!sf) {
+    return 1;
+  }
+  double t1 = now();
+
+  scene *sc = &sf->sc;
+  if (width <= 0) width = sf->width;
+  if (height <= 0) height = sf->height;
+  if (samples > 0) sc->num_samples = samples;
+  if (light_samples >= 0) sc->light_samples = light_samples;
+  if (max_depth >= 0) sc->max_depth = max_depth;
+  if (rr_depth >= 0) sc->rr_depth = rr_depth;
+  if (rr_survival > 0.0) sc->rr_survival = rr_survival;
+  if (num_photons >= 0) sc->num_photons = num_photons;
+  if (photon_gather > 0) sc->photon_gather = photon_gather;
+  if (photon_radius > 0.0) sc->photon_radius = photon_radius;
+  if (ambient_samples >= 0) sc->ambient_samples = ambient_samples;
+  if (ambient_accuracy > 0.0) sc->ambient_accuracy = ambient_accuracy;
+  if (set_ambient) sc->ambient = ambient;
+  int i;
+  for (i = 0; i < num_meshes; i++) {
+    if (add_mesh(sc, meshes[i]) != 0) {
+      return 1;
+    }
+  }
+  double t_meshes = now();
+  if (save_scene) {
+    return scene_file_save(sc, width, height, save_scene) ? 1 : 0;
+  }
+  if ((crop || merge) &&
+      (opts.region_x < 0 || opts.region_y < 0 ||
+       opts.region_x + opts.region_width > width ||
+       opts.region_y + opts.region_height > height)) {
+    fprintf(stderr, "Region must lie within the image\n");
+    return 1;
+  }
+
+  /* Cropped and merged renders only need a buffer for the region. */
+  int out_width = width;
+  int out_height = height;
+  if (crop || merge) {
+    out_width = opts.region_width;
+    out_height = opts.region_height;
+  }
+  /* Everything that only lasts for this frame. */
+  arena *frame = arena_create(0);
+  int out_pixels = out_width * out_height;
+  colour *image = (colour *)arena_calloc(frame, out_pixels, sizeof(colour));
+  render_features features;
+  if (denoising) {
+    features.albedo = (colour *)arena_calloc(frame, out_pixels, sizeof(colour));
+    features.normal = (vector *)arena_calloc(frame, out_pixels, sizeof(vector));
+    features.depth = (double *)arena_calloc(frame, out_pixels, sizeof(double));
+    opts.features = &features;
+  }
+  render_cost cost;
+  float *heat = NULL;
+  if (heatmap[0]) {
+    cost.time = (float *)arena_calloc(frame, out_pixels, sizeof(float));
+    cost.rays = (float *)arena_calloc(frame, out_pixels, sizeof(float));
+    cost.casts = (float *)arena_calloc(frame, out_pixels, sizeof(float));
+    cost.shades = (float *)arena_calloc(frame, out_pixels, sizeof(float));
+    opts.cost = &cost;
+    if (strcmp(heat_measure, "time") == 0) {
+      heat = cost.time;
+    } else if (strcmp(heat_measure, "rays") == 0) {
+      heat = cost.rays;
+    } else if (strcmp(heat_measure, "casts") == 0) {
+      heat = cost.casts;
+    } else if (strcmp(heat_measure, "shades") == 0) {
+      heat = cost.shades;
+    } else {
+      usage(argv[0]);
+    }
+  }
+  /* G-buffers cover the region traced. */
+  gbuffer *gb = NULL;
+  if (gbuffer_in || gbuffer_out) {
+    int x0, y0, x1, y1;
+    if (!render_clip_region(width, height, &opts, &x0, &y0, &x1, &y1)) {
+      fprintf(stderr, "Nothing to render\n");
+      return 1;
+    }
+    if (gbuffer_in) {
+      gb = gbuffer_load(gbuffer_in);
+      if (!gb) {
+        return 1;
+      }
+      if (gb->width != x1 - x0 || gb->height != y1 - y0) {
+        fprintf(stderr, "%s is %dx%d, not %dx%d\n", gbuffer_in,
+                gb->width, gb->height, x1 - x0, y1 - y0);
+        return 1;
+      }
+      sc->num_samples = gb->samples;
+      opts.reshade = 1;
+    } else {
+      gb = gbuffer_create(x1 - x0, y1 - y0, sc->num_samples);
+    }
+    opts.gbuffer = gb;
+  }
+  double t_prep = now();
+  render_prepare_ex(sc, &opts);
+  double t_build = now();
+  if (budget_seconds > 0.0) {
+    /* Without a region, the image is the region. */
+    framebuffer *fb = framebuffer_create(out_width, out_height);
+    render_budget(sc, width, height, fb, budget_seconds, &opts, &budget);
+    framebuffer_detile(fb, image, out_width);
+    framebuffer_destroy(fb);
+  } else {
+    int fits = crop || merge ? render_crop(sc, width, height, image, &opts)
+                             : render_ex(sc, width, height, image, &opts);
+    if (fits != 0) {
+      fprintf(stderr, "G-buffer %s doesn't fit the render\n",
+              gbuffer_in ? gbuffer_in : gbuffer_out);
+      return 1;
+    }
+  }
+  double t_render = now();
+  if (denoising) {
+    denoise_opts dopts;
+    denoise_opts_init(&dopts);
+    dopts.threads = opts.threads;
+    denoise(out_width, out_height, image, &features, &dopts);
+  }
+  double t2 = now();
+
+  int err = 0;
+  if (merge) {
+    if (format == format_png) {
+      err = png_merge(merge, output, opts.region_x, opts.region_y,
+                      out_width, out_height, image);
+    } else {
+      err = pfm_merge(merge, output, opts.region_x, opts.region_y,
+                      out_width, out_height, image);
+    }
+  } else {
+    switch (format) {
+    case format_png: err = png_save(out_width, out_height, image, output); break;
+    case format_ppm: err = ppm_save(out_width, out_height, image, output); break;
+    case format_pfm: err = pfm_save(out_width, out_height, image, output); break;
+    }
+  }
+  if (err) {
+    fprintf(stderr, "Couldn't write %s\n", output);
+  } else {
+    saved(&opts, output);
+  }
+  if (gbuffer_out) {
+    if (gbuffer_save(gb, gbuffer_out) != 0) {
+      err = 1;
+    } else {
+      saved(&opts, gbuffer_out);
+    }
+  }
+  if (heat != NULL) {
+    char name[256 + 8];
+    snprintf(name, sizeof(name), "%s.png", heatmap);
+    if (png_save_heatmap(out_width, out_height, heat, name) != 0) {
+      fprintf(stderr, "Couldn't write %s\n", name);
+    } else {
+      saved(&opts, name);
+    }
+    snprintf(name, sizeof(name), "%s.cost", heatmap);
+    if (cost_save(out_width, out_height, &cost, name) != 0) {
+      fprintf(stderr, "Couldn't write %s\n", name);
+    } else {
+      saved(&opts, name);
+    }
+  }
+  double t3 = now();
+
+  int traced_width = opts.region_width > 0 ? opts.region_width : width;
+  int traced_height = opts.region_height > 0 ? opts.region_height : height;
+  double pixels = (double)traced_width * traced_height;
+  double render_time = t_render - t_build;
+
+  printf("Scene:    %d spheres, %d checkerboards, %d lights\n",
+         sc->num_spheres, sc->num_checkerboards, sc->num_lights);
+  if (sc->num_primitives > 0) {
+    printf("          %d other primitives, %d materials\n",
+           sc->num_primitives, sc->num_materials);
+  }
+  if (sc->num_instances > 0) {
+    printf("          %d instances of %d groups (%d spheres)\n",
+           sc->num_instances, sc->num_groups, sc->num_group_spheres);
+  }
+  if (sc->num_meshes > 0) {
+    printf("          %d meshes, %d triangles\n",
+           sc->num_meshes, sc->num_mesh_triangles);
+  }
+  printf("Image:    %dx%d, %d spp, %d threads, %dx%d tiles\n",
+         width, height, sc->num_samples, opts.threads,
+         opts.tile_width, opts.tile_height);
+  if (opts.numa && opts.threads > 1) {
+    numa_topology topo;
+    numa_topology_read(&topo);
+    printf("NUMA:     %d nodes, %d CPUs\n",
+           topo.num_nodes, topo.first[topo.num_nodes]);
+  }
+  printf("Load:     %.3f ms", (t1 - t0) * 1e3);
+  if (num_meshes > 0) {
+    printf(" (+%.3f ms for meshes)", (t_meshes - t1) * 1e3);
+  }
+  printf("\n");
+  printf("Build:    %.3f ms\n", (t_build - t_prep) * 1e3);
+  if (sc->photon_map != NULL) {
+    printf("Photons:  %d stored from %d shot, radius %.3g\n",
+           sc->photon_map->num_photons, sc->num_photons,
+           sc->photon_map->radius);
+  }
+  if (sc->mesh_accel != NULL) {
+    double tree = mesh_accel_bytes(sc->mesh_accel);
+    double verts = (double)sc->num_mesh_vertices * sizeof(mesh_vertex);
+    printf("Mesh BVH: %.1f bytes/triangle (%.1f with vertices)\n",
+           tree / sc->num_mesh_triangles,
+           (tree + verts) / sc->num_mesh_triangles);
+  }
+  double spp = budget_seconds > 0.0 ? budget.spp : sc->num_samples;
+  printf("Render:   %.3f s (%.0f pixels/s, %.0f samples/s)\n",
+         render_time, pixels / render_time, pixels * spp / render_time);
+  if (budget_seconds > 0.0) {
+    printf("Budget:   %.3f s, %d passes, %.1f spp (%d-%d per tile), "
+           "noise %.2g\n", budget_seconds, budget.passes, budget.spp,
+           budget.min_spp, budget.max_spp, budget.noise);
+  }
+  printf("Rays:     %ld (%.2f per sample, %.0f/s)\n",
+         stats.rays, stats.rays / (pixels * spp), stats.rays / render_time);
+  printf("Casts:    %ld through the scene, %ld points shaded\n",
+         stats.casts, stats.shades);
+  if (stats.shadow_queries > 0) {
+    printf("Shadows:  %ld cacheable queries, %.1f%% cache hits\n",
+           stats.shadow_queries,
+           100.0 * stats.shadow_hits / stats.shadow_queries);
+  }
+  if (stats.ambient_records > 0) {
+    long lookups = stats.ambient_cached + stats.ambient_estimates;
+    printf("Ambient:  %ld estimates cached, %.1f%% of %ld lookups "
+           "estimated afresh\n", stats.ambient_records,
+           lookups > 0 ? 100.0 * stats.ambient_estimates / lookups : 0.0,
+           lookups);
+  }
+  if (gb != NULL) {
+    printf("G-buffer: %.1f MB %s\n",
+           (double)gb->width * gb->height * gb->samples *
+           sizeof(gbuffer_sample) / (1024 * 1024),
+           opts.reshade ? "re-shaded" : "saved");
+  }
+  if (denoising) {
+    printf("Denoise:  %.3f ms\n", (t2 - t_render) * 1e3);
+  }
+  printf("Save:     %.3f ms\n", (t3 - t2) * 1e3);
+  printf("Memory:   %zu KB scene, %zu KB frame\n",
+         arena_peak(sc->arena) / 1024, arena_peak(frame) / 1024);
+
+  if (gb != NULL) {
+    gbuffer_destroy(gb);
+  }
+  arena_destroy(frame);
+  scene_file_unload(sf);
+  if (opts.progress_fd >= 0) {
+    close(opts.progress_fd);
+  }
+  return err ? 1 : 0;
+}
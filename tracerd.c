@@ -0,0 +1,54 @@
+/*
+ * tracerd.c: Serve render jobs on a Unix domain socket (see daemon.h).
+ *
+ * (C) Copyright Simon Frankau 1999-2014
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "daemon.h"
+#include "tracer.h"
+
+/* Scenes kept loaded by default. */
+#define DEFAULT_CACHE_SCENES 8
+
+static void usage(char const *prog)
+{
+  fprintf(stderr,
+          "Usage: %s [options] socket-path\n"
+          "  -t threads  Worker threads, shared by all jobs (default: one\n"
+          "              per CPU)\n"
+          "  -n scenes   Scenes to keep loaded between jobs (default %d)\n"
+          "  -C size     Reuse point light shadows within each pixel, for hit\n"
+          "              points within this grid size\n"
+          "  -q          Don't log each job\n",
+          prog, DEFAULT_CACHE_SCENES);
+  exit(1);
+}
+
+int main(int argc, char **argv)
+{
+  int threads = sysconf(_SC_NPROCESSORS_ONLN);
+  int cache_scenes = DEFAULT_CACHE_SCENES;
+  render_opts opts;
+  render_opts_init(&opts);
+
+  int c;
+  while ((c = getopt(argc, argv, "t:n:C:q")) != -1) {
+    switch (c) {
+    case 't': threads = atoi(optarg); break;
+    case 'n': cache_scenes = atoi(optarg); break;
+    case 'C': opts.shadow_cell = atof(optarg); break;
+    case 'q': opts.verbose = 0; break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (optind != argc - 1 || threads < 1 || cache_scenes < 1) {
+    usage(argv[0]);
+  }
+
+  return daemon_run(argv[optind], threads, cache_scenes, &opts) == 0 ? 0 : 1;
+}
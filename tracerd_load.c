@@ -0,0 +1,389 @@
+/*
+ * tracerd_load.c: Load-test a render daemon. Several clients each
+ * submit a run of jobs at random priorities, cancel some of them,
+ * check the rest come back whole, and the timings are summed up.
+ *
+ * (C) Copyright Simon Frankau 1999-2014
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "daemon.h"
+#include "png_render.h"
+#include "tracer.h"
+
+/* ------------------------------------------------------------------
+ * Data types
+ */
+
+typedef struct {
+  char const *scene;
+  int priority;
+  /* 0: let it run, 1: cancel once accepted, 2: cancel after a tile. */
+  int cancel;
+  /* Keep the image, to save. */
+  int save;
+  uint64_t id;
+  int width;
+  int height;
+  long pixels;
+  int status;
+  int cached;
+  int done;
+  double submitted;
+  double first_tile;
+  double finished;
+  colour *image;
+} load_job;
+
+typedef struct {
+  char const *socket;
+  int fd;
+  /* Cancels come from the receiving thread. */
+  pthread_mutex_t write_lock;
+  load_job *jobs;
+  int num_jobs;
+  int num_accepted;
+  int ok;
+} load_client;
+
+typedef struct {
+  char const *socket;
+  char const **scenes;
+  int num_scenes;
+  int width;
+  int height;
+  int samples;
+  int tile_size;
+  int jobs;
+  double cancel_fraction;
+  int max_priority;
+  char const *output;
+} load_settings;
+
+static load_settings settings;
+
+/* ------------------------------------------------------------------
+ * Functions
+ */
+
+static void usage(char const *prog)
+{
+  fprintf(stderr,
+          "Usage: %s [options] socket-path scene-file...\n"
+          "  -c clients  Clients connecting at once (default 4)\n"
+          "  -n jobs     Jobs each client submits (default 8)\n"
+          "  -w width    Image width (default from the scene)\n"
+          "  -h height   Image height (default from the scene)\n"
+          "  -s samples  Samples per pixel (default from the scene)\n"
+          "  -T size     Tile size (default from the daemon)\n"
+          "  -x fraction Fraction of jobs to cancel (default 0.25)\n"
+          "  -p max      Priorities run from 0 to this (default 3)\n"
+          "  -o file     Save the first client's first image as a PNG\n",
+          prog);
+  exit(1);
+}
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int client_send(load_client *c, daemon_message const *m,
+                       void const *payload)
+{
+  pthread_mutex_lock(&c->write_lock);
+  int result = daemon_send(c->fd, m, payload);
+  pthread_mutex_unlock(&c->write_lock);
+  return result;
+}
+
+static void send_cancel(load_client *c, load_job *job)
+{
+  daemon_message m;
+  memset(&m, 0, sizeof(m));
+  m.magic = DAEMON_MAGIC;
+  m.type = DAEMON_CANCEL;
+  m.job_id = job->id;
+  client_send(c, &m, NULL);
+}
+
+static load_job *find_job(load_client *c, uint64_t id)
+{
+  int i;
+  for (i = 0; i < c->num_accepted; i++) {
+    if (c->jobs[i].id == id) {
+      return c->jobs + i;
+    }
+  }
+  return NULL;
+}
+
+/* Submit the jobs, while another thread takes in the replies. */
+static void *sender_run(void *arg)
+{
+  load_client *c = (load_client *)arg;
+  int i;
+  for (i = 0; i < c->num_jobs; i++) {
+    load_job *job = c->jobs + i;
+    daemon_message m;
+    memset(&m, 0, sizeof(m));
+    m.magic = DAEMON_MAGIC;
+    m.type = DAEMON_RENDER;
+    m.priority = job->priority;
+    m.width = settings.width;
+    m.height = settings.height;
+    m.samples = settings.samples;
+    m.tile_size = settings.tile_size;
+    m.payload_size = strlen(job->scene);
+    job->submitted = now();
+    if (client_send(c, &m, job->scene) != 0) {
+      break;
+    }
+  }
+  return NULL;
+}
+
+static void *client_run(void *arg)
+{
+  load_client *c = (load_client *)arg;
+  c->fd = daemon_connect(c->socket);
+  if (c->fd < 0) {
+    fprintf(stderr, "Couldn't connect to %s\n", c->socket);
+    return NULL;
+  }
+  pthread_t sender;
+  pthread_create(&sender, NULL, sender_run, c);
+
+  /* Grown to fit the largest tile size accepted. */
+  size_t capacity = 0;
+  float *payload = NULL;
+  int finished = 0;
+  daemon_message m;
+  while (finished < c->num_jobs) {
+    if (daemon_receive(c->fd, &m, payload, capacity) != 0) {
+      fprintf(stderr, "Lost the daemon\n");
+      break;
+    }
+    load_job *job;
+    if (m.type == DAEMON_ACCEPTED) {
+      /* Jobs are accepted in the order they were sent. */
+      job = c->jobs + c->num_accepted++;
+      job->id = m.job_id;
+      job->width = m.width;
+      job->height = m.height;
+      size_t tile_bytes = (size_t)m.tile_size * m.tile_size * 3 *
+        sizeof(float);
+      if (tile_bytes > capacity) {
+        capacity = tile_bytes;
+        payload = (float *)realloc(payload, capacity);
+      }
+      if (job->save) {
+        job->image = (colour *)calloc((size_t)m.width * m.height,
+                                      sizeof(colour));
+      }
+      if (job->cancel == 1) {
+        send_cancel(c, job);
+      }
+      continue;
+    }
+    job = find_job(c, m.job_id);
+    if (job == NULL) {
+      fprintf(stderr, "Reply for unknown job %llu\n",
+              (unsigned long long)m.job_id);
+      continue;
+    }
+    if (m.type == DAEMON_TILE) {
+      if (job->pixels == 0) {
+        job->first_tile = now();
+        if (job->cancel == 2) {
+          send_cancel(c, job);
+        }
+      }
+      job->pixels += (long)m.width * m.height;
+      if (job->image != NULL) {
+        int x, y;
+        for (y = 0; y < m.height; y++) {
+          for (x = 0; x < m.width; x++) {
+            float const *p = payload + (y * m.width + x) * 3;
+            colour *out = job->image + (m.y + y) * job->width + m.x + x;
+            out->r = p[0];
+            out->g = p[1];
+            out->b = p[2];
+          }
+        }
+      }
+    } else if (m.type == DAEMON_DONE) {
+      job->done = 1;
+      job->status = m.status;
+      job->cached = m.cached;
+      job->finished = now();
+      finished++;
+      if (m.status == DAEMON_OK &&
+          job->pixels != (long)job->width * job->height) {
+        fprintf(stderr, "Job %llu finished with %ld of %d pixels\n",
+                (unsigned long long)job->id, job->pixels,
+                job->width * job->height);
+        job->status = DAEMON_FAILED;
+      }
+    }
+  }
+  c->ok = finished == c->num_jobs;
+
+  free(payload);
+  pthread_join(sender, NULL);
+  close(c->fd);
+  return NULL;
+}
+
+static int compare_doubles(void const *a, void const *b)
+{
+  double x = *(double const *)a;
+  double y = *(double const *)b;
+  return x < y ? -1 : x > y ? 1 : 0;
+}
+
+static double percentile(double *values, int n, double p)
+{
+  if (n == 0) {
+    return 0.0;
+  }
+  int i = (int)(p * (n - 1) + 0.5);
+  return values[i];
+}
+
+int main(int argc, char **argv)
+{
+  int num_clients = 4;
+  settings.jobs = 8;
+  settings.cancel_fraction = 0.25;
+  settings.max_priority = 3;
+
+  int c;
+  while ((c = getopt(argc, argv, "c:n:w:h:s:T:x:p:o:")) != -1) {
+    switch (c) {
+    case 'c': num_clients = atoi(optarg); break;
+    case 'n': settings.jobs = atoi(optarg); break;
+    case 'w': settings.width = atoi(optarg); break;
+    case 'h': settings.height = atoi(optarg); break;
+    case 's': settings.samples = atoi(optarg); break;
+    case 'T': settings.tile_size = atoi(optarg); break;
+    case 'x': settings.cancel_fraction = atof(optarg); break;
+    case 'p': settings.max_priority = atoi(optarg); break;
+    case 'o': settings.output = optarg; break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (argc - optind < 2 || num_clients < 1 || settings.jobs < 1 ||
+      settings.max_priority < 0) {
+    usage(argv[0]);
+  }
+  settings.socket = argv[optind];
+  settings.scenes = (char const **)(argv + optind + 1);
+  settings.num_scenes = argc - optind - 1;
+
+  /* The same mix of jobs each run. */
+  srand(42);
+  load_client *clients = (load_client *)calloc(num_clients,
+                                               sizeof(load_client));
+  int i, j;
+  for (i = 0; i < num_clients; i++) {
+    load_client *cl = clients + i;
+    cl->socket = settings.socket;
+    pthread_mutex_init(&cl->write_lock, NULL);
+    cl->num_jobs = settings.jobs;
+    cl->jobs = (load_job *)calloc(cl->num_jobs, sizeof(load_job));
+    for (j = 0; j < cl->num_jobs; j++) {
+      load_job *job = cl->jobs + j;
+      int n = i * settings.jobs + j;
+      job->scene = settings.scenes[n % settings.num_scenes];
+      job->priority = rand() % (settings.max_priority + 1);
+      job->cancel = 0;
+      if (rand() < settings.cancel_fraction * RAND_MAX) {
+        job->cancel = 1 + rand() % 2;
+      }
+    }
+    if (i == 0 && settings.output != NULL) {
+      cl->jobs[0].cancel = 0;
+      cl->jobs[0].save = 1;
+    }
+  }
+
+  double start = now();
+  pthread_t *threads = (pthread_t *)malloc(num_clients * sizeof(pthread_t));
+  for (i = 0; i < num_clients; i++) {
+    pthread_create(threads + i, NULL, client_run, clients + i);
+  }
+  for (i = 0; i < num_clients; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  double elapsed = now() - start;
+
+  int total = num_clients * settings.jobs;
+  double *latency = (double *)malloc(total * sizeof(double));
+  double *first_tile = (double *)malloc(total * sizeof(double));
+  int num_ok = 0, num_cancelled = 0, num_failed = 0, num_cached = 0;
+  int num_first = 0;
+  double pixels = 0.0;
+  int all_ok = 1;
+  for (i = 0; i < num_clients; i++) {
+    all_ok &= clients[i].ok;
+    for (j = 0; j < clients[i].num_jobs; j++) {
+      load_job const *job = clients[i].jobs + j;
+      pixels += job->pixels;
+      num_cached += job->cached;
+      if (job->pixels > 0) {
+        first_tile[num_first++] = job->first_tile - job->submitted;
+      }
+      if (!job->done) {
+        continue;
+      }
+      if (job->status == DAEMON_OK) {
+        latency[num_ok++] = job->finished - job->submitted;
+      } else if (job->status == DAEMON_CANCELLED) {
+        num_cancelled++;
+      } else {
+        num_failed++;
+      }
+    }
+  }
+  qsort(latency, num_ok, sizeof(double), compare_doubles);
+  qsort(first_tile, num_first, sizeof(double), compare_doubles);
+
+  printf("Jobs: %d done, %d cancelled, %d failed, of %d, in %.3f s\n",
+         num_ok, num_cancelled, num_failed, total, elapsed);
+  printf("Throughput: %.2f jobs/s, %.3f Mpixels/s\n",
+         num_ok / elapsed, pixels / elapsed * 1e-6);
+  printf("Latency: %.3f s median, %.3f s 95th percentile, %.3f s max\n",
+         percentile(latency, num_ok, 0.5), percentile(latency, num_ok, 0.95),
+         num_ok > 0 ? latency[num_ok - 1] : 0.0);
+  printf("First tile: %.3f s median\n",
+         percentile(first_tile, num_first, 0.5));
+  printf("Scene cache: %d of %d jobs hit\n", num_cached, total);
+
+  load_job const *saved = clients[0].jobs;
+  if (settings.output != NULL) {
+    if (saved->done && saved->status == DAEMON_OK) {
+      if (png_save(saved->width, saved->height, saved->image,
+                   settings.output) == 0) {
+        printf("Saved file %s!\n", settings.output);
+      } else {
+        fprintf(stderr, "Couldn't write %s\n", settings.output);
+        all_ok = 0;
+      }
+    } else {
+      fprintf(stderr, "No image to save\n");
+      all_ok = 0;
+    }
+  }
+
+  return all_ok && num_failed == 0 ? 0 : 1;
+}